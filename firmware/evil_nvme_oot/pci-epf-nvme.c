@@ -15,9 +15,25 @@
 
 #define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
 
+#include <crypto/hash.h>
+#include <crypto/skcipher.h>
+#include <linux/blkdev.h>
+#include <linux/bpf.h>
+#include <linux/btf.h>
+#include <linux/btf_ids.h>
+#include <linux/crc-t10dif.h>
+#include <linux/crc32c.h>
+#include <linux/crc64.h>
+#include <linux/crypto.h>
 #include <linux/delay.h>
 #include <linux/dmaengine.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <linux/hash.h>
+#include <linux/hrtimer.h>
 #include <linux/io.h>
+#include <linux/jump_label.h>
+#include <linux/kfifo.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/nvme.h>
@@ -25,7 +41,21 @@
 #include <linux/pci-epc.h>
 #include <linux/pci-epf.h>
 #include <linux/pci_regs.h>
+#include <linux/poll.h>
+#include <linux/random.h>
+#include <linux/rculist.h>
+#include <linux/rwsem.h>
+#include <linux/scatterlist.h>
+#include <linux/sched.h>
+#include <linux/semaphore.h>
 #include <linux/slab.h>
+#include <linux/t10-pi.h>
+#include <linux/unaligned.h>
+#include <linux/uuid.h>
+#include <linux/vmalloc.h>
+#include <linux/xarray.h>
+#include <linux/xxhash.h>
+#include <uapi/linux/sched/types.h>
 
 /* Relative to linux include directory, for OoT build */
 #include <../drivers/nvme/host/nvme.h>
@@ -65,6 +95,12 @@ static bool evil_activated = false;
  */
 #define PCI_EPF_NVME_MAX_NR_QUEUES	16
 
+/*
+ * Delay between attempts to recreate the fabrics controllers after they
+ * could not be created with either the new or the previous options.
+ */
+#define PCI_EPF_NVME_CTRL_RETRY_MS	1000
+
 /*
  * Default maximum data transfer size: limit to 128 KB to avoid
  * excessive local memory use for buffers.
@@ -77,6 +113,45 @@ static bool evil_activated = false;
  */
 #define PCI_EPF_NVME_QUEUE_IS_SQ	(1U << 0)
 #define PCI_EPF_NVME_QUEUE_LIVE		(1U << 1)
+#define PCI_EPF_NVME_QUEUE_MAPPED	(1U << 2)
+
+/*
+ * Default maximum number of queue rings kept mapped for the lifetime of
+ * their queue. Rings beyond this limit are mapped on each use.
+ */
+#define PCI_EPF_NVME_RING_MAPS		8
+
+/*
+ * TLP attributes of the payload writes to the host, and size of the read
+ * back used to order them before the command completion.
+ */
+#define PCI_EPF_NVME_PAYLOAD_RO		(1U << 0)
+#define PCI_EPF_NVME_PAYLOAD_NS		(1U << 1)
+#define PCI_EPF_NVME_PAYLOAD_FENCE_SIZE	16
+
+/*
+ * Default minimum size of the local memory copies offloaded to a DMA
+ * memcpy channel.
+ */
+#define PCI_EPF_NVME_COPY_OFFLOAD_KB	64
+
+/*
+ * Data path scheduling: transfers are split into chunks of xfer_chunk_kb
+ * (default), and waiting transfers get the data path by increasing size,
+ * each KB remaining adding AGING_NS_PER_KB to their arrival time.
+ */
+#define PCI_EPF_NVME_XFER_CHUNK_KB	64
+#define PCI_EPF_NVME_XFER_AGING_NS_PER_KB 1000
+
+/*
+ * I/O SQ polling: default idle time after which the SQ poller stops spinning
+ * between doorbell checks, number of commands being executed for which
+ * the poller gets the full utilization clamp boost, and number of steps
+ * of the boost below that.
+ */
+#define PCI_EPF_NVME_POLL_IDLE_MS	100
+#define PCI_EPF_NVME_UCLAMP_QD		32
+#define PCI_EPF_NVME_UCLAMP_STEPS	4
 
 /* PRP manipulation macros */
 #define pci_epf_nvme_prp_addr(ctrl, prp)	((prp) & ~(ctrl)->mps_mask)
@@ -84,6 +159,139 @@ static bool evil_activated = false;
 #define pci_epf_nvme_prp_size(ctrl, prp)	\
 	((size_t)((ctrl)->mps - pci_epf_nvme_prp_ofst(ctrl, prp)))
 
+/*
+ * Deferred inspection hooks: maximum number of workers of the hook pool and
+ * maximum number of hook executions pending in the pool. When this limit is
+ * reached, deferred hook executions are dropped.
+ */
+#define PCI_EPF_NVME_HOOK_MAX_WORKERS	4
+#define PCI_EPF_NVME_HOOK_MAX_PENDING	128
+
+/* BPF dispatch policies: maximum delay of a command */
+#define PCI_EPF_NVME_BPF_MAX_DELAY_US	USEC_PER_SEC
+
+/*
+ * LBA range operations of vendor specific commands: the range is read from
+ * the backend in chunks of at most PCI_EPF_NVME_RANGE_CHUNK_SIZE, processed in
+ * parallel on all CPUs. To bound memory use, at most
+ * PCI_EPF_NVME_RANGE_MAX_OPS range operations are executed at a time.
+ */
+#define PCI_EPF_NVME_RANGE_CHUNK_SIZE	SZ_1M
+#define PCI_EPF_NVME_RANGE_MAX_OPS	2
+
+/*
+ * Vendor specific I/O commands.
+ */
+#define PCI_EPF_NVME_CMD_SCAN		0x82
+#define PCI_EPF_NVME_CMD_HASH		0x86
+
+/*
+ * Hash algorithms of the hash command.
+ */
+enum pci_epf_nvme_hash_algo {
+	PCI_EPF_NVME_HASH_CRC32C = 0,
+	PCI_EPF_NVME_HASH_XXHASH64,
+	PCI_EPF_NVME_HASH_SHA256,
+	PCI_EPF_NVME_HASH_NR_ALGOS,
+};
+
+/* Block shift value of the hash command to hash the entire range at once */
+#define PCI_EPF_NVME_HASH_RANGE		0xff
+
+/*
+ * Compressed namespaces: default and maximum size of compression clusters
+ * and number of locks used to serialize accesses to clusters.
+ */
+#define PCI_EPF_NVME_COMP_CLUSTER_KB	16
+#define PCI_EPF_NVME_COMP_MAX_CLUSTER_KB	128
+#define PCI_EPF_NVME_COMP_LOCK_BITS	8
+#define PCI_EPF_NVME_COMP_MAGIC		0x5a564e45	/* "ENVZ" */
+
+/*
+ * Encrypted namespaces: buffers larger than the work size are encrypted and
+ * decrypted in parallel by up to PCI_EPF_NVME_CRYPT_MAX_WORKS contexts.
+ */
+#define PCI_EPF_NVME_CRYPT_ALGO		"xts(aes)"
+#define PCI_EPF_NVME_CRYPT_MAX_KEY_SIZE	64
+#define PCI_EPF_NVME_CRYPT_WORK_SIZE	SZ_32K
+#define PCI_EPF_NVME_CRYPT_MAX_WORKS	8
+
+/*
+ * Mirrored namespaces: reads still outstanding after the hedge percentile
+ * of the read latency are hedged to the other backend, once enough read
+ * latency samples (log2 microseconds histogram) are collected.
+ */
+#define PCI_EPF_NVME_MIRROR_HEDGE_PCT	99
+#define PCI_EPF_NVME_MIRROR_LAT_BUCKETS	32
+#define PCI_EPF_NVME_MIRROR_MIN_SAMPLES	1024
+#define PCI_EPF_NVME_MIRROR_UPDATE_MASK	255
+
+/*
+ * Verification of transfers to the host: transfer size classes of the
+ * statistics.
+ */
+enum pci_epf_nvme_verify_size {
+	PCI_EPF_NVME_VERIFY_CQE = 0,
+	PCI_EPF_NVME_VERIFY_4K,
+	PCI_EPF_NVME_VERIFY_64K,
+	PCI_EPF_NVME_VERIFY_LARGE,
+	PCI_EPF_NVME_VERIFY_NR_SIZES,
+};
+
+/* Maximum number of concurrent Abort commands reported to the host */
+#define PCI_EPF_NVME_ABORT_LIMIT	4
+
+/*
+ * Backends of the namespaces defined through configfs.
+ */
+enum pci_epf_nvme_backend_type {
+	PCI_EPF_NVME_BACKEND_FABRICS = 0,
+	PCI_EPF_NVME_BACKEND_BDEV,
+	PCI_EPF_NVME_BACKEND_FILE,
+	PCI_EPF_NVME_BACKEND_RAM,
+	PCI_EPF_NVME_BACKEND_NULL,
+	PCI_EPF_NVME_NR_BACKENDS,
+};
+
+static const char * const pci_epf_nvme_backend_name[] = {
+	[PCI_EPF_NVME_BACKEND_FABRICS]	= "fabrics",
+	[PCI_EPF_NVME_BACKEND_BDEV]	= "bdev",
+	[PCI_EPF_NVME_BACKEND_FILE]	= "file",
+	[PCI_EPF_NVME_BACKEND_RAM]	= "ram",
+	[PCI_EPF_NVME_BACKEND_NULL]	= "null",
+};
+
+#define PCI_EPF_NVME_MAX_NSID		1024
+/* Namespaces with a lower NSID are found with a direct table lookup */
+#define PCI_EPF_NVME_NS_TABLE_SIZE	64
+
+/* Namespace read cache */
+#define PCI_EPF_NVME_CACHE_LINE_SHIFT	12
+#define PCI_EPF_NVME_CACHE_LOCK_BITS	8
+
+/* RAM backend block store */
+#define PCI_EPF_NVME_RAM_HASH_BITS	16
+#define PCI_EPF_NVME_RAM_LOCK_BITS	8
+
+/* Namespace write overlay */
+#define PCI_EPF_NVME_OVERLAY_LOCK_BITS	8
+
+/*
+ * Namespace prefetcher: confidence counters saturate at PREFETCH_CONF_MAX
+ * and reads are prefetched from the threshold confidence, up to MAX_LINES
+ * cache lines. Every WINDOW lines prefetched, the threshold is raised if
+ * less than a quarter of them were read by the host, until prefetching
+ * stops for RETRY_READS host reads, and lowered if more than half were.
+ */
+#define PCI_EPF_NVME_PREFETCH_CONF_MAX	3
+#define PCI_EPF_NVME_PREFETCH_MAX_LINES	32
+#define PCI_EPF_NVME_PREFETCH_WINDOW	256
+#define PCI_EPF_NVME_PREFETCH_RETRY_READS 4096
+#define PCI_EPF_NVME_PREFETCH_MAX_ENTRIES (1U << 20)
+
+/* Namespace QoS: credit accumulated while idle */
+#define PCI_EPF_NVME_QOS_BURST_NS	(10 * NSEC_PER_MSEC)
+
 static struct kmem_cache *epf_nvme_cmd_cache;
 
 struct pci_epf_nvme;
@@ -96,6 +304,15 @@ struct pci_epf_nvme_segment {
 	size_t		size;
 };
 
+/*
+ * Transfer chunk waiting for the data path.
+ */
+struct pci_epf_nvme_xfer {
+	struct list_head	link;
+	u64			key;
+	struct completion	granted;
+};
+
 /*
  * Queue definition and mapping for the local PCI controller.
  */
@@ -127,6 +344,13 @@ struct pci_epf_nvme_queue {
 	spinlock_t		lock;
 	struct list_head	list;
 
+	/* Commands of an SQ being executed, for Abort */
+	spinlock_t		inflight_lock;
+	struct list_head	inflight;
+
+	/* Last time (jiffies) commands were fetched from an SQ */
+	unsigned long		last_fetch;
+
 	struct pci_epf_nvme_queue *sq;
 };
 
@@ -159,23 +383,442 @@ struct pci_epf_nvme_ctrl {
 	size_t				mdts;
 
 	unsigned int			nr_queues;
+	/* I/O queues the host can create, set when enabling */
+	unsigned int			nr_io_queues;
 	struct pci_epf_nvme_queue	*sq;
 	struct pci_epf_nvme_queue	*cq;
 
 	struct workqueue_struct		*wq;
 };
 
+/*
+ * Header of the backend slots of compressed clusters.
+ */
+#define PCI_EPF_NVME_COMP_RAW		(1U << 0)
+#define PCI_EPF_NVME_COMP_ZERO		(1U << 1)
+
+struct pci_epf_nvme_comp_hdr {
+	__le32				magic;
+	__le16				flags;
+	__le16				rsvd;
+	__le32				len;
+	__le32				rsvd2;
+};
+
+/*
+ * Compression stream: a compression transform and its buffers, used by one
+ * context at a time.
+ */
+struct pci_epf_nvme_comp_stream {
+	struct mutex			lock;
+	struct crypto_comp		*tfm;
+	/* Backend slot data */
+	void				*slot;
+	/* Uncompressed cluster data for read-modify-write */
+	void				*data;
+};
+
+/*
+ * Compressed namespace.
+ *
+ * The namespace LBAs are grouped in clusters which are compressed as a unit.
+ * Each cluster is stored in a backend slot of one LBA more than the cluster
+ * size, starting with a header. Compressed clusters only use the backend
+ * LBAs needed for the header and the compressed data, incompressible
+ * clusters are stored raw after the header LBA and zero clusters only use
+ * the header. The cluster map caches the number of backend LBAs used by
+ * clusters, 0 indicating a zero cluster.
+ *
+ * Slots are fixed, so compression only reduces the backend bandwidth: the
+ * space left unused in the slots is not available to other clusters, and
+ * the namespace is smaller than its backend.
+ */
+struct pci_epf_nvme_comp {
+	char				algo[CRYPTO_MAX_ALG_NAME];
+	size_t				cluster_size;
+	unsigned int			cluster_lbas;
+	unsigned int			slot_lbas;
+	u64				nr_clusters;
+	/* Capacity exposed to the host */
+	u64				nr_lbas;
+
+	struct xarray			map;
+	struct mutex			locks[1 << PCI_EPF_NVME_COMP_LOCK_BITS];
+
+	unsigned int			nr_streams;
+	struct pci_epf_nvme_comp_stream	*streams;
+
+	atomic64_t			host_bytes_written;
+	atomic64_t			backend_bytes_written;
+	atomic64_t			host_bytes_read;
+	atomic64_t			backend_bytes_read;
+	atomic64_t			nr_compressed;
+	atomic64_t			nr_raw;
+	atomic64_t			nr_zero;
+};
+
+/*
+ * End-to-end data protection. The metadata of LBAs only holds protection
+ * information (PI) and is stored in a region at the end of the backend
+ * namespace, after the host LBAs.
+ */
+struct pci_epf_nvme_pi {
+	/* NVME_NS_DPS_PI_TYPE1 to NVME_NS_DPS_PI_TYPE3 */
+	unsigned int			type;
+	/* NVME_NVM_NS_16B_GUARD or NVME_NVM_NS_64B_GUARD */
+	unsigned int			guard;
+	/* Metadata size (PI tuple size) */
+	unsigned int			ms;
+	bool				extended;
+
+	/* Capacity exposed to the host and start of the metadata region */
+	u64				nr_lbas;
+	u64				meta_slba;
+
+	/* Serializes metadata LBAs read-modify-write */
+	struct mutex			meta_lock;
+};
+
+/*
+ * Mirrored namespace: the namespace with the same NSID on the mirror
+ * controller (leg 1) holds the same data as the namespace of the main
+ * controller (leg 0).
+ */
+struct pci_epf_nvme_mirror {
+	struct nvme_ns			*ns;
+	atomic_t			inflight[2];
+
+	/* Read latency histogram and hedge threshold */
+	atomic64_t			lat_hist[PCI_EPF_NVME_MIRROR_LAT_BUCKETS];
+	atomic64_t			nr_samples;
+	u64				hedge_ns;
+
+	atomic64_t			nr_reads[2];
+	atomic64_t			nr_hedged;
+	atomic64_t			nr_hedge_wins;
+	atomic64_t			nr_failovers;
+};
+
+/*
+ * Mirrored I/O: requests sent to the backends for a single read or write.
+ * The buffer of a request still in flight when the I/O completes is
+ * orphaned and freed when the request completes.
+ */
+struct pci_epf_nvme_mirror_io;
+
+struct pci_epf_nvme_mirror_leg {
+	struct pci_epf_nvme_mirror_io	*io;
+	unsigned int			idx;
+	void				*buf;
+	bool				issued;
+	bool				pending;
+	bool				orphan;
+	int				ret;
+	u64				start;
+};
+
+struct pci_epf_nvme_mirror_io {
+	struct pci_epf_nvme_ns		*epns;
+	u8				opcode;
+	refcount_t			ref;
+	spinlock_t			lock;
+	wait_queue_head_t		wait;
+	unsigned int			nr_pending;
+	bool				done;
+	int				winner;
+	struct pci_epf_nvme_mirror_leg	legs[2];
+};
+
+/*
+ * Protection information tuple fields, for both tuple formats.
+ */
+struct pci_epf_nvme_pi_tuple {
+	u64				guard;
+	u16				app_tag;
+	u64				ref_tag;
+};
+
+/*
+ * Group commit of flush commands: host flushes wait for the completion of
+ * a backend flush started after they were received. Flush generations are
+ * numbered from 1, started and completed give the last generation started
+ * and completed.
+ */
+struct pci_epf_nvme_flush {
+	spinlock_t			lock;
+	wait_queue_head_t		wait;
+	bool				running;
+	u64				started;
+	u64				completed;
+	int				ret;
+
+	atomic64_t			nr_host_flushes;
+	atomic64_t			nr_backend_flushes;
+};
+
+/*
+ * Performance profile emulation.
+ *
+ * A profile models the behavior of an SSD class: the completion of I/O
+ * commands is delayed to follow per opcode latency distributions, scaled
+ * with the namespace queue depth, read and write bandwidth caps, a lower
+ * write bandwidth after a number of bytes written (write cliff), and
+ * garbage collection pauses every given number of bytes written.
+ */
+#define PCI_EPF_NVME_PERF_MAX_PROFILES	16
+#define PCI_EPF_NVME_PERF_QD_POINTS	8
+#define PCI_EPF_NVME_PERF_MAX_QD_PCT	10000
+
+enum pci_epf_nvme_perf_op {
+	PCI_EPF_NVME_PERF_READ,
+	PCI_EPF_NVME_PERF_WRITE,
+	PCI_EPF_NVME_PERF_FLUSH,
+	PCI_EPF_NVME_PERF_NR_OPS,
+};
+
+/*
+ * Latency distribution, in microseconds: the minimum, median, 99th
+ * percentile and maximum latencies. Latencies are interpolated linearly
+ * between these percentiles.
+ */
+#define PCI_EPF_NVME_PERF_LAT_POINTS	4
+#define PCI_EPF_NVME_PERF_MAX_LAT_US	(10 * USEC_PER_SEC)
+
+struct pci_epf_nvme_perf_profile {
+	/* Namespace of the profile, 0 for the default profile */
+	u32				nsid;
+	u32				lat_us[PCI_EPF_NVME_PERF_NR_OPS]
+					      [PCI_EPF_NVME_PERF_LAT_POINTS];
+	/* Bandwidth caps in MB/s, 0 for no cap */
+	u32				mbps[2];
+	u64				cliff_bytes;
+	u32				cliff_mbps;
+	u64				gc_bytes;
+	u32				gc_pause_us;
+	/* Latency scaling in percent for queue depths */
+	unsigned int			nr_qd_points;
+	u32				qd[PCI_EPF_NVME_PERF_QD_POINTS];
+	u32				qd_pct[PCI_EPF_NVME_PERF_QD_POINTS];
+};
+
+struct pci_epf_nvme_perf {
+	struct rcu_head			rcu;
+	/* Load generation, to reset the namespace states */
+	unsigned int			gen;
+	char				*text;
+	unsigned int			nr_profiles;
+	struct pci_epf_nvme_perf_profile profiles[PCI_EPF_NVME_PERF_MAX_PROFILES];
+};
+
+/*
+ * Per namespace performance emulation state: bandwidth virtual clocks of
+ * reads and writes, bytes written and end of the current GC pause since
+ * the profile generation gen was loaded.
+ */
+struct pci_epf_nvme_perf_state {
+	spinlock_t			lock;
+	unsigned int			gen;
+	u64				bw_next[2];
+	u64				written;
+	u64				gc_until;
+	atomic_t			inflight;
+};
+
+/*
+ * Read cache of a namespace: direct mapped lines of host LBAs, filled by
+ * reads and invalidated by writes. Lines are only filled if no write was
+ * done while they were read from the backend (seq unchanged).
+ */
+struct pci_epf_nvme_cache {
+	unsigned int			line_shift;
+	unsigned int			line_lbas_shift;
+	unsigned long			nr_lines;
+	/* Line number + 1 of the LBAs held, 0 if invalid */
+	u64				*tags;
+	void				*data;
+	atomic64_t			seq;
+	spinlock_t			locks[1 << PCI_EPF_NVME_CACHE_LOCK_BITS];
+
+	atomic64_t			nr_hits;
+	atomic64_t			nr_misses;
+	atomic64_t			nr_fills;
+};
+
+/*
+ * Block of RAM backends, shared by all the pages with the same data.
+ */
+struct pci_epf_nvme_ram_block {
+	struct hlist_node		node;
+	struct rcu_head			rcu;
+	u64				hash;
+	unsigned long			refs;
+	void				*data;
+};
+
+/*
+ * Content addressed store of the blocks of all RAM backends: blocks are
+ * indexed by the xxhash64 of their data, confirmed by comparing the data,
+ * and copied when written. Zeroed pages are not stored. Pages are written
+ * with their page lock held, and read under RCU.
+ */
+struct pci_epf_nvme_ram_store {
+	spinlock_t			lock;
+	struct hlist_head		*buckets;
+	unsigned long			nr_blocks;
+	unsigned long			nr_refs;
+	struct mutex			locks[1 << PCI_EPF_NVME_RAM_LOCK_BITS];
+};
+
+/*
+ * Copy-on-write overlay of a namespace: the backend is only read, and
+ * written blocks of a page are kept in memory, up to max_pages, or in
+ * slots of a scratch file. Block entries are page pointers or value
+ * entries: 0 for zeroed blocks, slot + 1 for blocks in the scratch file.
+ * Discarding the overlay takes lock for writing, I/Os take it for reading.
+ */
+struct pci_epf_nvme_overlay {
+	struct rw_semaphore		lock;
+	struct xarray			blocks;
+	unsigned int			block_lbas_shift;
+	struct mutex			locks[1 << PCI_EPF_NVME_OVERLAY_LOCK_BITS];
+
+	unsigned long			max_pages;
+	atomic_long_t			nr_pages;
+	struct file			*scratch;
+	atomic_long_t			nr_slots;
+};
+
+/*
+ * Correlation of the read of a cache line with the next read.
+ */
+struct pci_epf_nvme_prefetch_entry {
+	/* Cache line number + 1 of the read, 0 if unused */
+	u64				tag;
+	u64				next;
+	u16				nr_lines;
+	u8				conf;
+};
+
+/*
+ * History based prefetcher of a namespace: learns which read follows the
+ * read of a cache line, and reads the cache lines of the next read into
+ * the read cache when confident, one prefetch at a time. Prefetched lines
+ * are marked in lines until the host reads them.
+ */
+struct pci_epf_nvme_prefetch {
+	struct pci_epf_nvme_ns		*epns;
+	spinlock_t			lock;
+	struct pci_epf_nvme_prefetch_entry *table;
+	unsigned int			table_bits;
+	u64				last;
+	unsigned int			threshold;
+	unsigned int			window;
+	unsigned int			idle_reads;
+	atomic_t			window_useful;
+	unsigned long			*lines;
+
+	struct work_struct		work;
+	bool				busy;
+	u64				line;
+	unsigned int			nr_lines;
+	void				*buf;
+
+	atomic64_t			nr_prefetched;
+	atomic64_t			nr_useful;
+};
+
+/*
+ * Namespace QoS: IOPS and bandwidth limits, enforced by delaying commands
+ * using a virtual clock.
+ */
+struct pci_epf_nvme_qos {
+	unsigned int			iops;
+	unsigned int			mbps;
+	spinlock_t			lock;
+	u64				next;
+	atomic64_t			nr_delayed;
+};
+
+/*
+ * Configuration of a namespace defined through configfs. The namespaces
+ * are created from their configuration when the controller is created.
+ */
+struct pci_epf_nvme_ns_cfg {
+	struct config_group		group;
+	struct list_head		link;
+	struct pci_epf_nvme		*epf_nvme;
+	u32				nsid;
+	uuid_t				uuid;
+
+	enum pci_epf_nvme_backend_type	backend;
+	/* Block device or file path, NSID of a fabrics namespace */
+	char				*path;
+	u32				backend_nsid;
+	u64				size_mb;
+	unsigned int			lba_shift;
+
+	unsigned int			cache_mb;
+	/* Prefetcher correlation table entries, no prefetcher if 0 */
+	unsigned int			prefetch_entries;
+	unsigned int			qos_iops;
+	unsigned int			qos_mbps;
+
+	/* Write overlay memory and scratch file, no overlay if 0 */
+	unsigned int			overlay_mb;
+	char				*overlay_path;
+};
+
+/*
+ * Namespace of the local PCI controller: state of a fabrics controller
+ * namespace, created on first use, or of a namespace defined through
+ * configfs.
+ */
+struct pci_epf_nvme_ns {
+	struct pci_epf_nvme		*epf_nvme;
+	u32				nsid;
+
+	/* Backend namespace, NULL for local backends */
+	struct nvme_ns			*ns;
+	unsigned int			lba_shift;
+	u64				nr_lbas;
+
+	/* Namespace defined through configfs */
+	bool				local;
+	uuid_t				uuid;
+	enum pci_epf_nvme_backend_type	backend;
+	struct file			*file;
+	/* Blocks of RAM backends, indexed by page offset */
+	struct xarray			ram;
+
+	struct pci_epf_nvme_overlay	*overlay;
+	struct pci_epf_nvme_cache	*cache;
+	struct pci_epf_nvme_prefetch	*prefetch;
+	struct pci_epf_nvme_qos		qos;
+
+	struct pci_epf_nvme_comp	*comp;
+	struct crypto_sync_skcipher	*crypt;
+	struct pci_epf_nvme_pi		*pi;
+	struct pci_epf_nvme_mirror	*mirror;
+
+	struct pci_epf_nvme_flush	flush;
+	struct pci_epf_nvme_perf_state	perf;
+};
+
 /*
  * Descriptor of commands sent by the host.
  */
 struct pci_epf_nvme_cmd {
 	struct list_head		link;
+	struct list_head		inflight_link;
+	bool				aborted;
 	struct pci_epf_nvme		*epf_nvme;
 
 	int				sqid;
 	int				cqid;
 	unsigned int			status;
+	/* Fabrics namespace, referenced by epns */
 	struct nvme_ns			*ns;
+	struct pci_epf_nvme_ns		*epns;
 	struct nvme_command		cmd;
 	struct nvme_completion		cqe;
 
@@ -184,6 +827,10 @@ struct pci_epf_nvme_cmd {
 	void				*buffer;
 	enum dma_data_direction		dma_dir;
 
+	/* Separate metadata buffer */
+	size_t				meta_size;
+	void				*meta;
+
 	/*
 	 * Host PCI address segments: if nr_segs is 1, we use only "seg",
 	 * otherwise, the segs array is allocated and used to store
@@ -194,9 +841,216 @@ struct pci_epf_nvme_cmd {
 	struct pci_epf_nvme_segment	*segs;
 
 	struct work_struct		work;
-	struct work_struct		evil_work;
 };
 
+/*
+ * Data inspection hooks.
+ *
+ * Hooks are called for every I/O write command with the data received from
+ * the host, before the command is executed. Inline hooks are called directly
+ * from the command execution context on the command buffer, under RCU read
+ * lock, so they must not sleep. Deferred hooks (PCI_EPF_NVME_HOOK_DEFERRED)
+ * are executed by a bounded worker pool on a copy of at most max_bytes of the
+ * command data. If the pool is overloaded, deferred executions are dropped
+ * rather than queued.
+ */
+#define PCI_EPF_NVME_HOOK_DEFERRED	(1U << 0)
+
+struct pci_epf_nvme_hook_data {
+	struct pci_epf_nvme		*epf_nvme;
+	const struct nvme_command	*cmd;
+	const void			*buf;
+	/* Size of buf, limited to the hook max_bytes */
+	size_t				len;
+	/* Total data size of the command */
+	size_t				size;
+};
+
+struct pci_epf_nvme_hook {
+	struct list_head	link;
+	bool			registered;
+
+	const char		*name;
+	unsigned int		flags;
+	size_t			max_bytes;
+	void			(*inspect)(const struct pci_epf_nvme_hook *hook,
+					const struct pci_epf_nvme_hook_data *data);
+
+	atomic64_t		nr_calls;
+	atomic64_t		nr_dropped;
+};
+
+struct pci_epf_nvme_hook_work {
+	struct work_struct		work;
+	struct pci_epf_nvme_hook	*hook;
+	struct pci_epf_nvme_hook_data	data;
+	struct nvme_command		cmd;
+	u8				buf[];
+};
+
+/*
+ * BPF dispatch policy: a struct_ops program called for each I/O command
+ * before it is executed, with a read-only view of the command and of the
+ * data written by the host. The program returns a verdict, sets the
+ * verdict parameters with the bpf_epf_nvme_*() kfuncs, and may use maps.
+ */
+enum pci_epf_nvme_bpf_verdict {
+	PCI_EPF_NVME_BPF_PASS		= 0,
+	/* Fail with the status set with bpf_epf_nvme_set_status() */
+	PCI_EPF_NVME_BPF_FAIL,
+	/* Execute on the namespace set with bpf_epf_nvme_redirect() */
+	PCI_EPF_NVME_BPF_REDIRECT,
+	/* Delay execution by the time set with bpf_epf_nvme_delay() */
+	PCI_EPF_NVME_BPF_DELAY,
+};
+
+struct pci_epf_nvme_bpf_ctx {
+	const struct nvme_command	*cmd;
+	u16				qid;
+	u32				nsid;
+	/* Size of the data written by the host, 0 for other commands */
+	u32				data_len;
+
+	const void			*data;
+	u16				status;
+	u32				redirect_nsid;
+	u32				delay_us;
+};
+
+struct pci_epf_nvme_bpf_ops {
+	int				(*dispatch)(struct pci_epf_nvme_bpf_ctx *ctx);
+	char				name[16];
+};
+
+/*
+ * Scan command: search the LBA range [slba, slba + nlb] for a pattern of plen
+ * bytes and return the offsets of the matches, in bytes from the start of the
+ * range, in a struct pci_epf_nvme_scan_result. The data buffer size is given
+ * in dwords with ndt. The total number of matches is returned in the
+ * completion dword 0, even if the data buffer is too small to hold all of
+ * them.
+ */
+struct pci_epf_nvme_scan_cmd {
+	__u8			opcode;
+	__u8			flags;
+	__u16			command_id;
+	__le32			nsid;
+	__le64			slba;
+	__le64			rsvd4;
+	union nvme_data_ptr	dptr;
+	__le32			ndt;
+	__le32			nlb;
+	__u8			plen;
+	__u8			rsvd12[7];
+	__u8			pattern[8];
+};
+static_assert(sizeof(struct pci_epf_nvme_scan_cmd) ==
+	      sizeof(struct nvme_command));
+
+struct pci_epf_nvme_scan_result {
+	__le32			nr_matches;
+	__le32			rsvd;
+	__le64			ofst[];
+};
+
+/*
+ * Hash command: hash the LBA range [slba, slba + nlb] per block of
+ * (1 << bshift) LBAs, or as a whole if bshift is PCI_EPF_NVME_HASH_RANGE, with
+ * the hash algorithm algo. The digests are returned packed in the data
+ * buffer of ndt dwords and their number in the completion dword 0.
+ */
+struct pci_epf_nvme_hash_cmd {
+	__u8			opcode;
+	__u8			flags;
+	__u16			command_id;
+	__le32			nsid;
+	__le64			slba;
+	__le64			rsvd4;
+	union nvme_data_ptr	dptr;
+	__le32			ndt;
+	__le32			nlb;
+	__u8			algo;
+	__u8			bshift;
+	__u8			rsvd12[14];
+};
+static_assert(sizeof(struct pci_epf_nvme_hash_cmd) ==
+	      sizeof(struct nvme_command));
+
+struct pci_epf_nvme_range_op;
+
+struct pci_epf_nvme_range_chunk {
+	struct work_struct		work;
+	struct pci_epf_nvme_range_op	*op;
+	u64				slba;
+	unsigned int			nlb;
+	/* LBAs read past the end of the chunk, for data crossing chunks */
+	unsigned int			nlb_extra;
+	void				*buf;
+	void				*priv;
+	int				ret;
+};
+
+struct pci_epf_nvme_range_op {
+	struct pci_epf_nvme_cmd		*epcmd;
+	u64				slba;
+	u64				nlb;
+	unsigned int			lookahead;
+	/* If not 0, chunks start on a multiple of align LBAs from slba */
+	unsigned int			align;
+
+	/* Called concurrently for each chunk once its data is read */
+	void				(*process)(struct pci_epf_nvme_range_op *op,
+					struct pci_epf_nvme_range_chunk *chunk);
+	/* Called in LBA order for processed chunks */
+	int				(*merge)(struct pci_epf_nvme_range_op *op,
+					struct pci_epf_nvme_range_chunk *chunk);
+	size_t				chunk_priv_size;
+	void				*priv;
+};
+
+/*
+ * Hot path mode switches: DMA channels are used by at least one function,
+ * transfer verification is enabled for at least one bound function, a
+ * performance profile is loaded for at least one bound function.
+ */
+static DEFINE_STATIC_KEY_FALSE(pci_epf_nvme_dma_used);
+static DEFINE_STATIC_KEY_FALSE(pci_epf_nvme_verify_enabled);
+static DEFINE_STATIC_KEY_FALSE(pci_epf_nvme_perf_enabled);
+
+static DEFINE_STATIC_KEY_FALSE(pci_epf_nvme_bpf_enabled);
+
+static DEFINE_STATIC_KEY_FALSE(pci_epf_nvme_hooks_enabled);
+static LIST_HEAD(pci_epf_nvme_hooks);
+static DEFINE_MUTEX(pci_epf_nvme_hooks_lock);
+static struct workqueue_struct *pci_epf_nvme_hook_wq;
+static atomic_t pci_epf_nvme_hook_pending = ATOMIC_INIT(0);
+
+static struct workqueue_struct *pci_epf_nvme_range_wq;
+static struct workqueue_struct *pci_epf_nvme_prefetch_wq;
+static DEFINE_SEMAPHORE(pci_epf_nvme_range_sem, PCI_EPF_NVME_RANGE_MAX_OPS);
+
+/*
+ * Parallel encryption and decryption of a part of a buffer.
+ */
+struct pci_epf_nvme_crypt_work {
+	struct work_struct		work;
+	struct pci_epf_nvme_ns		*epns;
+	u64				lba;
+	unsigned int			nlb;
+	void				*buf;
+	bool				encrypt;
+	int				ret;
+};
+
+static struct workqueue_struct *pci_epf_nvme_crypt_wq;
+
+static const char *pci_epf_nvme_hash_algo_name[PCI_EPF_NVME_HASH_NR_ALGOS] = {
+	[PCI_EPF_NVME_HASH_CRC32C]	= "crc32c",
+	[PCI_EPF_NVME_HASH_XXHASH64]	= "xxhash64",
+	[PCI_EPF_NVME_HASH_SHA256]	= "sha256",
+};
+static struct crypto_shash *pci_epf_nvme_hash_tfm[PCI_EPF_NVME_HASH_NR_ALGOS];
+
 /*
  * Structure for PCI character device
  */
@@ -205,6 +1059,48 @@ struct pci_epf_nvme_cdev_data {
 	struct cdev			cdev;
 };
 
+/*
+ * Events read by user space from the events character device, as an array
+ * of struct pci_epf_nvme_event. Events are posted from any context and
+ * never block: if the user space daemon does not keep up, new events are
+ * dropped and counted.
+ */
+enum pci_epf_nvme_event_type {
+	PCI_EPF_NVME_EVENT_CTRL_ENABLE = 1,	/* arg0: CC */
+	PCI_EPF_NVME_EVENT_CTRL_DISABLE,	/* arg0: CC */
+	PCI_EPF_NVME_EVENT_CTRL_SHUTDOWN,	/* arg0: CC */
+	PCI_EPF_NVME_EVENT_LINK_UP,		/* arg0: link epoch */
+	PCI_EPF_NVME_EVENT_LINK_DOWN,		/* arg0: link epoch */
+	PCI_EPF_NVME_EVENT_HOOK_MATCH,		/* arg0: NSID, arg1: SLBA */
+	PCI_EPF_NVME_EVENT_CTRL_FAILURE,	/* arg0: errno */
+};
+
+struct pci_epf_nvme_event {
+	__u32				type;
+	__u32				seq;
+	__u64				time_ns;
+	__u64				arg[2];
+};
+
+#define PCI_EPF_NVME_EVENTS_SIZE	256
+
+struct pci_epf_nvme_events {
+	spinlock_t			lock;
+	struct mutex			read_lock;
+	wait_queue_head_t		wait;
+	u32				seq;
+	atomic64_t			nr_dropped;
+	DECLARE_KFIFO(fifo, struct pci_epf_nvme_event,
+		      PCI_EPF_NVME_EVENTS_SIZE);
+};
+
+/*
+ * Transfer verification counters.
+ */
+struct pci_epf_nvme_verify_stats {
+	atomic64_t			nr_verified[PCI_EPF_NVME_VERIFY_NR_SIZES];
+	atomic64_t			nr_mismatch[PCI_EPF_NVME_VERIFY_NR_SIZES];
+};
 
 /*
  * EPF function private data representing our NVMe subsystem.
@@ -224,28 +1120,117 @@ struct pci_epf_nvme {
 	struct pci_epf_nvme_ctrl	ctrl;
 	bool				ctrl_enabled;
 
+	/* Fabrics controller of mirrored namespaces */
+	struct nvme_ctrl		*mirror_ctrl;
+
 	__le64				*prp_list_buf;
 
 	struct dma_chan			*dma_chan_tx;
 	struct dma_chan			*dma_chan_rx;
-	struct mutex			xfer_lock;
+	/* Private (slave) channels or generic memcpy channel transfer */
+	ssize_t				(*dma_xfer)(struct pci_epf_nvme *epf_nvme,
+					    struct pci_epf_nvme_segment *seg,
+					    enum dma_data_direction dir,
+					    void *buf, phys_addr_t dma_addr);
+	/* Data path owner and transfer chunks waiting for it */
+	spinlock_t			xfer_lock;
+	bool				xfer_busy;
+	struct list_head		xfer_queue;
+	atomic64_t			nr_xfer_waits;
+
+	/* Local memory copies offload */
+	struct dma_chan			*copy_chan;
+	atomic64_t			nr_copies_offloaded;
+	atomic64_t			nr_copies_cpu;
+
+	/* Number of queue rings currently using a persistent mapping */
+	atomic_t			nr_ring_maps;
 
 	struct mutex			irq_lock;
 
 	struct delayed_work		reg_poll;
-
-	struct workqueue_struct		*evil_wq;
+	/* Next attempt to recreate the fabrics controllers after a failure */
+	unsigned long			ctrl_retry;
 
 	/* Function configfs attributes */
 	struct config_group		group;
+	struct mutex			config_lock;
 	char				*ctrl_opts_buf;
+	char				*mirror_opts_buf;
+	/* Options of the fabrics controllers in use */
+	char				*ctrl_opts_active;
+	char				*mirror_opts_active;
+	unsigned int			max_io_queues;
+	unsigned int			mirror_hedge_pct;
+	unsigned int			flush_window_us;
+	unsigned int			ring_maps;
+	unsigned int			copy_offload_kb;
+	unsigned int			xfer_chunk_kb;
+	unsigned int			poll_idle_ms;
+	unsigned int			uclamp_boost;
 	bool				dma_enable;
 	size_t				mdts_kb;
+	char				comp_algo[CRYPTO_MAX_ALG_NAME];
+	size_t				comp_cluster_kb;
+	u8				crypt_key[PCI_EPF_NVME_CRYPT_MAX_KEY_SIZE];
+	unsigned int			crypt_key_size;
+	unsigned int			pi_type;
+	unsigned int			pi_guard;
+	bool				pi_extended;
+	unsigned int			verify_rate;
+	/* Set between bind and unbind */
+	bool				bound;
+	/* Holds a reference on pci_epf_nvme_verify_enabled */
+	bool				verify_key;
+	unsigned int			payload_attrs;
+
+	/* Performance profile, NULL when not emulating */
+	struct pci_epf_nvme_perf __rcu	*perf;
+	struct mutex			perf_lock;
+	unsigned int			perf_gen;
+	/* Holds a reference on pci_epf_nvme_perf_enabled */
+	bool				perf_key;
+
+	/*
+	 * Transfer verification: sampling sequence and counters for the
+	 * current link up (epoch) and since the function was bound.
+	 */
+	atomic_t			verify_seq;
+	unsigned int			link_epoch;
+	struct pci_epf_nvme_verify_stats verify_link;
+	struct pci_epf_nvme_verify_stats verify_total;
+
+	/* Payload ordering fences and fences that read back stale data */
+	atomic64_t			nr_fences;
+	atomic64_t			nr_fence_errors;
+
+	/* I/O commands being executed, for the poller utilization clamp */
+	atomic_t			nr_io_cmds;
+
+	/* Namespaces, indexed by NSID */
+	struct xarray			ns_xa;
+	struct pci_epf_nvme_ns		*ns_table[PCI_EPF_NVME_NS_TABLE_SIZE];
+	struct mutex			ns_lock;
+	struct pci_epf_nvme_ram_store	ram_store;
+
+	/* Namespaces defined through configfs */
+	struct config_group		ns_group;
+	struct list_head		ns_cfgs;
+	u32				max_local_nsid;
 
 	bool				link_up;
 
 	struct class			*char_class;
 	struct pci_epf_nvme_cdev_data	chardev_data;
+	struct pci_epf_nvme_cdev_data	events_cdev_data;
+	struct pci_epf_nvme_events	events;
+};
+
+static const char * const pci_epf_nvme_verify_size_name[] = {
+	[PCI_EPF_NVME_VERIFY_CQE]	= "cqe",
+	[PCI_EPF_NVME_VERIFY_4K]	= "<=4K",
+	[PCI_EPF_NVME_VERIFY_64K]	= "<=64K",
+	[PCI_EPF_NVME_VERIFY_LARGE]	= ">64K",
 };
 
 /*
@@ -316,6 +1301,15 @@ static bool pci_epf_nvme_dma_filter(struct dma_chan *chan, void *arg)
 		(filter->dma_mask & caps.directions);
 }
 
+static ssize_t pci_epf_nvme_dma_memcpy_transfer(struct pci_epf_nvme *epf_nvme,
+					struct pci_epf_nvme_segment *seg,
+					enum dma_data_direction dir, void *buf,
+					phys_addr_t dma_addr);
+static ssize_t pci_epf_nvme_dma_private_transfer(struct pci_epf_nvme *epf_nvme,
+					struct pci_epf_nvme_segment *seg,
+					enum dma_data_direction dir, void *buf,
+					phys_addr_t dma_addr);
+
 static bool pci_epf_nvme_init_dma(struct pci_epf_nvme *epf_nvme)
 {
 	struct pci_epf *epf = epf_nvme->epf;
@@ -324,9 +1318,6 @@ static bool pci_epf_nvme_init_dma(struct pci_epf_nvme *epf_nvme)
 	struct dma_chan *chan;
 	dma_cap_mask_t mask;
 
-	mutex_init(&epf_nvme->xfer_lock);
-	mutex_init(&epf_nvme->irq_lock);
-
 	dma_cap_zero(mask);
 	dma_cap_set(DMA_SLAVE, mask);
 
@@ -356,6 +1347,9 @@ static bool pci_epf_nvme_init_dma(struct pci_epf_nvme *epf_nvme)
 		 dma_chan_name(epf_nvme->dma_chan_tx),
 		 dma_get_max_seg_size(epf_nvme->dma_chan_tx->device->dev));
 
+	epf_nvme->dma_xfer = pci_epf_nvme_dma_private_transfer;
+	static_branch_inc(&pci_epf_nvme_dma_used);
+
 	return true;
 
 generic:
@@ -376,13 +1370,52 @@ generic:
 	epf_nvme->dma_chan_tx = chan;
 	epf_nvme->dma_chan_rx = chan;
 
+	epf_nvme->dma_xfer = pci_epf_nvme_dma_memcpy_transfer;
+	static_branch_inc(&pci_epf_nvme_dma_used);
+
 	return true;
 }
 
-static void pci_epf_nvme_clean_dma(struct pci_epf *epf)
-{
+/*
+ * Get a DMA memcpy channel for large local memory copies (cache, overlay
+ * and compression buffers), so that they do not use CPU cycles needed for
+ * processing commands. The generic transfer channel is not shared: copies
+ * would then run unserialized against host transfers, and terminating a
+ * timed out copy would abort them. Without a channel of their own, copies
+ * are done by the CPU.
+ */
+static void pci_epf_nvme_init_copy(struct pci_epf_nvme *epf_nvme)
+{
+	struct device *dev = &epf_nvme->epf->dev;
+	struct dma_chan *chan;
+	dma_cap_mask_t mask;
+
+	dma_cap_zero(mask);
+	dma_cap_set(DMA_MEMCPY, mask);
+	chan = dma_request_chan_by_mask(&mask);
+	if (IS_ERR(chan)) {
+		dev_info(dev, "No DMA channel for local copies\n");
+		return;
+	}
+
+	dev_info(dev, "Local copies DMA channel %s\n", dma_chan_name(chan));
+
+	epf_nvme->copy_chan = chan;
+}
+
+static void pci_epf_nvme_clean_dma(struct pci_epf *epf)
+{
 	struct pci_epf_nvme *epf_nvme = epf_get_drvdata(epf);
 
+	if (epf_nvme->dma_xfer) {
+		static_branch_dec(&pci_epf_nvme_dma_used);
+		epf_nvme->dma_xfer = NULL;
+	}
+
+	if (epf_nvme->copy_chan)
+		dma_release_channel(epf_nvme->copy_chan);
+	epf_nvme->copy_chan = NULL;
+
 	if (epf_nvme->dma_chan_tx)
 		dma_release_channel(epf_nvme->dma_chan_tx);
 
@@ -540,18 +1573,209 @@ static ssize_t pci_epf_nvme_dma_transfer(struct pci_epf_nvme *epf_nvme,
 	if (ret)
 		return ret;
 
-	if (epf_nvme->dma_chan_tx != epf_nvme->dma_chan_rx)
-		ret = pci_epf_nvme_dma_private_transfer(epf_nvme, seg, dir,
-							buf, dma_addr);
-	else
-		ret = pci_epf_nvme_dma_memcpy_transfer(epf_nvme, seg, dir,
-						       buf, dma_addr);
+	ret = epf_nvme->dma_xfer(epf_nvme, seg, dir, buf, dma_addr);
 
 	dma_unmap_single(dma_dev, dma_addr, seg->size, dir);
 
 	return ret;
 }
 
+#ifdef CONFIG_ARM64
+/*
+ * memcpy_fromio() and memcpy_toio() use 8 B accesses, and single bytes for
+ * unaligned heads and tails, so copies through an outbound window generate
+ * many small TLPs. Use 16 B LDP/STP accesses for the 16 B aligned part of
+ * the window instead, unrolled by 64 B, and the generic helpers for the
+ * unaligned edges. The host side of the buffer can be at any alignment.
+ * The order of the two halves of a pair is not defined, so these are only
+ * used for payloads and command fetches, not for completion entries.
+ */
+static inline void pci_epf_nvme_read_pair(const volatile void __iomem *addr,
+					  void *buf)
+{
+	u64 lo, hi;
+
+	asm volatile("ldp %0, %1, [%2]"
+		     : "=&r" (lo), "=r" (hi)
+		     : "r" (addr)
+		     : "memory");
+
+	put_unaligned(lo, (u64 *)buf);
+	put_unaligned(hi, (u64 *)buf + 1);
+}
+
+static inline void pci_epf_nvme_write_pair(volatile void __iomem *addr,
+					   const void *buf)
+{
+	u64 lo = get_unaligned((const u64 *)buf);
+	u64 hi = get_unaligned((const u64 *)buf + 1);
+
+	asm volatile("stp %x0, %x1, [%2]"
+		     :
+		     : "rZ" (lo), "rZ" (hi), "r" (addr)
+		     : "memory");
+}
+
+static void pci_epf_nvme_memcpy_fromio(void *buf,
+				       const volatile void __iomem *addr,
+				       size_t len)
+{
+	size_t head = min_t(size_t, len,
+			    -(unsigned long)addr & (SZ_16 - 1));
+
+	if (head) {
+		memcpy_fromio(buf, addr, head);
+		buf += head;
+		addr += head;
+		len -= head;
+	}
+
+	while (len >= SZ_64) {
+		pci_epf_nvme_read_pair(addr, buf);
+		pci_epf_nvme_read_pair(addr + 16, buf + 16);
+		pci_epf_nvme_read_pair(addr + 32, buf + 32);
+		pci_epf_nvme_read_pair(addr + 48, buf + 48);
+		buf += SZ_64;
+		addr += SZ_64;
+		len -= SZ_64;
+	}
+
+	while (len >= SZ_16) {
+		pci_epf_nvme_read_pair(addr, buf);
+		buf += SZ_16;
+		addr += SZ_16;
+		len -= SZ_16;
+	}
+
+	if (len)
+		memcpy_fromio(buf, addr, len);
+}
+
+static void pci_epf_nvme_memcpy_toio(volatile void __iomem *addr,
+				     const void *buf, size_t len)
+{
+	size_t head = min_t(size_t, len,
+			    -(unsigned long)addr & (SZ_16 - 1));
+
+	if (head) {
+		memcpy_toio(addr, buf, head);
+		buf += head;
+		addr += head;
+		len -= head;
+	}
+
+	while (len >= SZ_64) {
+		pci_epf_nvme_write_pair(addr, buf);
+		pci_epf_nvme_write_pair(addr + 16, buf + 16);
+		pci_epf_nvme_write_pair(addr + 32, buf + 32);
+		pci_epf_nvme_write_pair(addr + 48, buf + 48);
+		buf += SZ_64;
+		addr += SZ_64;
+		len -= SZ_64;
+	}
+
+	while (len >= SZ_16) {
+		pci_epf_nvme_write_pair(addr, buf);
+		buf += SZ_16;
+		addr += SZ_16;
+		len -= SZ_16;
+	}
+
+	if (len)
+		memcpy_toio(addr, buf, len);
+}
+#else
+#define pci_epf_nvme_memcpy_fromio	memcpy_fromio
+#define pci_epf_nvme_memcpy_toio	memcpy_toio
+#endif
+
+static int pci_epf_nvme_dma_copy(struct pci_epf_nvme *epf_nvme, void *dst,
+				 const void *src, size_t len)
+{
+	struct dma_chan *chan = epf_nvme->copy_chan;
+	struct device *dma_dev = chan->device->dev;
+	struct dma_async_tx_descriptor *desc;
+	DECLARE_COMPLETION_ONSTACK(complete);
+	dma_addr_t dma_dst, dma_src;
+	dma_cookie_t cookie;
+	int ret;
+
+	dma_src = dma_map_single(dma_dev, (void *)src, len, DMA_TO_DEVICE);
+	ret = dma_mapping_error(dma_dev, dma_src);
+	if (ret)
+		return ret;
+
+	dma_dst = dma_map_single(dma_dev, dst, len, DMA_FROM_DEVICE);
+	ret = dma_mapping_error(dma_dev, dma_dst);
+	if (ret)
+		goto unmap_src;
+
+	desc = dmaengine_prep_dma_memcpy(chan, dma_dst, dma_src, len,
+					 DMA_CTRL_ACK | DMA_PREP_INTERRUPT);
+	if (!desc) {
+		ret = -EIO;
+		goto unmap_dst;
+	}
+
+	desc->callback = pci_epf_nvme_dma_callback;
+	desc->callback_param = &complete;
+
+	cookie = dmaengine_submit(desc);
+	ret = dma_submit_error(cookie);
+	if (ret)
+		goto unmap_dst;
+
+	dma_async_issue_pending(chan);
+	if (!wait_for_completion_timeout(&complete, msecs_to_jiffies(1000))) {
+		dev_err(&epf_nvme->epf->dev, "DMA copy timeout\n");
+		dmaengine_terminate_sync(chan);
+		ret = -ETIMEDOUT;
+	}
+
+unmap_dst:
+	dma_unmap_single(dma_dev, dma_dst, len, DMA_FROM_DEVICE);
+unmap_src:
+	dma_unmap_single(dma_dev, dma_src, len, DMA_TO_DEVICE);
+
+	return ret;
+}
+
+/*
+ * Copy local memory. Copies of at least copy_offload_kb between physically
+ * contiguous buffers are done by the DMA memcpy channel, if we have one
+ * and DMA is enabled, and the calling context sleeps until the copy
+ * completes, leaving the CPU to other commands. Smaller copies, which
+ * would not amortize the DMA setup, and failed DMA copies are done by the
+ * CPU. Callers must be allowed to sleep: copies done under a spinlock or
+ * in an RCU read-side section (cache hits, RAM backend reads) use memcpy.
+ */
+static void pci_epf_nvme_copy(struct pci_epf_nvme *epf_nvme, void *dst,
+			      const void *src, size_t len)
+{
+	unsigned int offload_kb = READ_ONCE(epf_nvme->copy_offload_kb);
+
+	if (epf_nvme->copy_chan && READ_ONCE(epf_nvme->dma_enable) &&
+	    offload_kb && len >= (size_t)offload_kb * SZ_1K &&
+	    !is_vmalloc_addr(dst) && !is_vmalloc_addr(src) &&
+	    !pci_epf_nvme_dma_copy(epf_nvme, dst, src, len)) {
+		atomic64_inc(&epf_nvme->nr_copies_offloaded);
+		return;
+	}
+
+	atomic64_inc(&epf_nvme->nr_copies_cpu);
+	memcpy(dst, src, len);
+}
+
+/*
+ * Allocate a buffer used for local copies physically contiguous if
+ * possible, so that its copies can be offloaded. Free with kvfree().
+ */
+static void *pci_epf_nvme_copy_alloc(size_t size)
+{
+	return kmalloc(size, GFP_KERNEL | __GFP_NOWARN) ?:
+		kvmalloc(size, GFP_KERNEL);
+}
+
 static ssize_t pci_epf_nvme_mmio_transfer(struct pci_epf_nvme *epf_nvme,
 					  struct pci_epf_nvme_segment *seg,
 					  enum dma_data_direction dir,
@@ -569,11 +1793,11 @@ static ssize_t pci_epf_nvme_mmio_transfer(struct pci_epf_nvme *epf_nvme,
 
 	switch (dir) {
 	case DMA_FROM_DEVICE:
-		memcpy_fromio(buf, map.virt_addr, map.pci_size);
+		pci_epf_nvme_memcpy_fromio(buf, map.virt_addr, map.pci_size);
 		ret = map.pci_size;
 		break;
 	case DMA_TO_DEVICE:
-		memcpy_toio(map.virt_addr, buf, map.pci_size);
+		pci_epf_nvme_memcpy_toio(map.virt_addr, buf, map.pci_size);
 		ret = map.pci_size;
 		break;
 	default:
@@ -586,29 +1810,87 @@ static ssize_t pci_epf_nvme_mmio_transfer(struct pci_epf_nvme *epf_nvme,
 	return ret;
 }
 
-static int pci_epf_nvme_transfer(struct pci_epf_nvme *epf_nvme,
-				 struct pci_epf_nvme_segment *seg,
-				 enum dma_data_direction dir, void *buf)
+/*
+ * Get the data path for a chunk of a transfer with size bytes remaining.
+ * Waiting chunks get the data path by increasing size aged by the arrival
+ * time of their transfer, sampled in arrival the first time one waits, so
+ * that small transfers do not wait for large ones and are not starved.
+ */
+static void pci_epf_nvme_xfer_get(struct pci_epf_nvme *epf_nvme, size_t size,
+				  u64 *arrival)
+{
+	struct pci_epf_nvme_xfer xfer;
+
+	spin_lock(&epf_nvme->xfer_lock);
+	if (!epf_nvme->xfer_busy) {
+		epf_nvme->xfer_busy = true;
+		spin_unlock(&epf_nvme->xfer_lock);
+		return;
+	}
+
+	if (!*arrival)
+		*arrival = ktime_get_ns();
+	xfer.key = *arrival + (size >> 10) * PCI_EPF_NVME_XFER_AGING_NS_PER_KB;
+	init_completion(&xfer.granted);
+	list_add_tail(&xfer.link, &epf_nvme->xfer_queue);
+	spin_unlock(&epf_nvme->xfer_lock);
+
+	atomic64_inc(&epf_nvme->nr_xfer_waits);
+	wait_for_completion(&xfer.granted);
+}
+
+/*
+ * Hand the data path over to the waiting chunk with the lowest key.
+ */
+static void pci_epf_nvme_xfer_put(struct pci_epf_nvme *epf_nvme)
+{
+	struct pci_epf_nvme_xfer *xfer, *next = NULL;
+
+	spin_lock(&epf_nvme->xfer_lock);
+	list_for_each_entry(xfer, &epf_nvme->xfer_queue, link) {
+		if (!next || xfer->key < next->key)
+			next = xfer;
+	}
+	if (next) {
+		list_del(&next->link);
+		complete(&next->granted);
+	} else {
+		epf_nvme->xfer_busy = false;
+	}
+	spin_unlock(&epf_nvme->xfer_lock);
+}
+
+static int __pci_epf_nvme_transfer(struct pci_epf_nvme *epf_nvme,
+				   struct pci_epf_nvme_segment *seg,
+				   enum dma_data_direction dir, void *buf)
 {
+	size_t chunk_size = (size_t)READ_ONCE(epf_nvme->xfer_chunk_kb) * SZ_1K;
+	struct pci_epf_nvme_segment chunk = *seg;
 	size_t size = seg->size;
+	u64 arrival = 0;
 	ssize_t ret;
 
 	while (size) {
+		chunk.size = chunk_size ? min(size, chunk_size) : size;
+
 		/*
 		 * Note: mmio transfers do not need serialization but this is a
 		 * nice way to avoid using too many mapping windows.
 		 */
-		mutex_lock(&epf_nvme->xfer_lock);
-		if (epf_nvme->dma_enable && size > SZ_4K)
-			ret = pci_epf_nvme_dma_transfer(epf_nvme, seg,
+		pci_epf_nvme_xfer_get(epf_nvme, size, &arrival);
+		if (static_branch_likely(&pci_epf_nvme_dma_used) &&
+		    READ_ONCE(epf_nvme->dma_enable) && epf_nvme->dma_xfer &&
+		    chunk.size > SZ_4K)
+			ret = pci_epf_nvme_dma_transfer(epf_nvme, &chunk,
 							dir, buf);
 		else
-			ret = pci_epf_nvme_mmio_transfer(epf_nvme, seg,
+			ret = pci_epf_nvme_mmio_transfer(epf_nvme, &chunk,
 							 dir, buf);
-		mutex_unlock(&epf_nvme->xfer_lock);
+		pci_epf_nvme_xfer_put(epf_nvme);
 		if (ret < 0)
 			return ret;
 
+		chunk.pci_addr += ret;
 		size -= ret;
 		buf += ret;
 	}
@@ -616,6 +1898,170 @@ static int pci_epf_nvme_transfer(struct pci_epf_nvme *epf_nvme,
 	return 0;
 }
 
+/*
+ * Hold a reference on the performance static key while the function is
+ * bound with a profile loaded. Called with perf_lock held.
+ */
+static void pci_epf_nvme_perf_update_key(struct pci_epf_nvme *epf_nvme)
+{
+	bool enable = epf_nvme->bound && rcu_access_pointer(epf_nvme->perf);
+
+	if (enable == epf_nvme->perf_key)
+		return;
+
+	epf_nvme->perf_key = enable;
+	if (enable)
+		static_branch_inc(&pci_epf_nvme_perf_enabled);
+	else
+		static_branch_dec(&pci_epf_nvme_perf_enabled);
+}
+
+/* Free the profile left loaded when the function is destroyed */
+static void pci_epf_nvme_perf_release(void *data)
+{
+	struct pci_epf_nvme *epf_nvme = data;
+	struct pci_epf_nvme_perf *perf;
+
+	perf = rcu_dereference_protected(epf_nvme->perf, true);
+	if (perf) {
+		kfree(perf->text);
+		kfree(perf);
+	}
+}
+
+/*
+ * Transfer verification is sampled: return true for 1 in verify_rate
+ * transfers.
+ */
+static inline bool pci_epf_nvme_verify_sample(struct pci_epf_nvme *epf_nvme)
+{
+	unsigned int rate;
+
+	if (!static_branch_unlikely(&pci_epf_nvme_verify_enabled))
+		return false;
+
+	rate = READ_ONCE(epf_nvme->verify_rate);
+
+	return rate && !(atomic_inc_return(&epf_nvme->verify_seq) % rate);
+}
+
+/*
+ * Hold a reference on the verification static key while the function is
+ * bound with a verification rate set. Called with config_lock held.
+ */
+static void pci_epf_nvme_verify_update_key(struct pci_epf_nvme *epf_nvme)
+{
+	bool enable = epf_nvme->bound && epf_nvme->verify_rate;
+
+	if (enable == epf_nvme->verify_key)
+		return;
+
+	epf_nvme->verify_key = enable;
+	if (enable)
+		static_branch_inc(&pci_epf_nvme_verify_enabled);
+	else
+		static_branch_dec(&pci_epf_nvme_verify_enabled);
+}
+
+static void pci_epf_nvme_verify_account(struct pci_epf_nvme *epf_nvme,
+					size_t size, const void *buf,
+					const void *rbuf)
+{
+	enum pci_epf_nvme_verify_size vs;
+	u32 crc, rcrc;
+
+	if (size <= sizeof(struct nvme_completion))
+		vs = PCI_EPF_NVME_VERIFY_CQE;
+	else if (size <= SZ_4K)
+		vs = PCI_EPF_NVME_VERIFY_4K;
+	else if (size <= SZ_64K)
+		vs = PCI_EPF_NVME_VERIFY_64K;
+	else
+		vs = PCI_EPF_NVME_VERIFY_LARGE;
+
+	atomic64_inc(&epf_nvme->verify_link.nr_verified[vs]);
+	atomic64_inc(&epf_nvme->verify_total.nr_verified[vs]);
+
+	crc = crc32c(~0, buf, size);
+	rcrc = crc32c(~0, rbuf, size);
+	if (crc == rcrc)
+		return;
+
+	atomic64_inc(&epf_nvme->verify_link.nr_mismatch[vs]);
+	atomic64_inc(&epf_nvme->verify_total.nr_mismatch[vs]);
+
+	dev_err_ratelimited(&epf_nvme->epf->dev,
+			    "Link %u: %zu B transfer mismatch, crc 0x%08x, read back 0x%08x\n",
+			    epf_nvme->link_epoch, size, crc, rcrc);
+}
+
+/*
+ * Read back data written to the host and check it with crc32c (using the
+ * ARMv8 CRC32 instructions when available). Mismatches are only counted.
+ */
+static void pci_epf_nvme_verify_transfer(struct pci_epf_nvme *epf_nvme,
+					 struct pci_epf_nvme_segment *seg,
+					 void *buf)
+{
+	void *rbuf;
+
+	rbuf = kmalloc(seg->size, GFP_KERNEL);
+	if (!rbuf)
+		return;
+
+	if (!__pci_epf_nvme_transfer(epf_nvme, seg, DMA_FROM_DEVICE, rbuf))
+		pci_epf_nvme_verify_account(epf_nvme, seg->size, buf, rbuf);
+
+	kfree(rbuf);
+}
+
+/*
+ * With relaxed ordering, the payload written to the host may be passed by
+ * later writes, including the completion entry. A read is never reordered
+ * before earlier writes, so read back the last bytes of the payload before
+ * the completion is posted: once the read completes, all the payload is
+ * visible to the host. The read back data is also compared to the payload,
+ * as a self-test of the ordering: a mismatch means that the completion
+ * could have been seen by the host before its data.
+ */
+static void pci_epf_nvme_fence_payload(struct pci_epf_nvme *epf_nvme,
+				       struct pci_epf_nvme_segment *seg,
+				       void *buf)
+{
+	u8 rbuf[PCI_EPF_NVME_PAYLOAD_FENCE_SIZE];
+	struct pci_epf_nvme_segment tail;
+
+	tail.size = min_t(size_t, seg->size, sizeof(rbuf));
+	tail.pci_addr = seg->pci_addr + seg->size - tail.size;
+	buf += seg->size - tail.size;
+
+	atomic64_inc(&epf_nvme->nr_fences);
+
+	if (__pci_epf_nvme_transfer(epf_nvme, &tail, DMA_FROM_DEVICE, rbuf) ||
+	    memcmp(buf, rbuf, tail.size)) {
+		atomic64_inc(&epf_nvme->nr_fence_errors);
+		dev_err_ratelimited(&epf_nvme->epf->dev,
+				    "Payload at 0x%llx not ordered before completion\n",
+				    (u64)tail.pci_addr);
+	}
+}
+
+static int pci_epf_nvme_transfer(struct pci_epf_nvme *epf_nvme,
+				 struct pci_epf_nvme_segment *seg,
+				 enum dma_data_direction dir, void *buf)
+{
+	int ret;
+
+	ret = __pci_epf_nvme_transfer(epf_nvme, seg, dir, buf);
+	if (ret)
+		return ret;
+
+	if (dir == DMA_TO_DEVICE && pci_epf_nvme_verify_sample(epf_nvme))
+		pci_epf_nvme_verify_transfer(epf_nvme, seg, buf);
+
+	return 0;
+}
+
 static const char *pci_epf_nvme_cmd_name(struct pci_epf_nvme_cmd *epcmd)
 {
 	u8 opcode = epcmd->cmd.common.opcode;
@@ -632,7 +2078,6 @@ pci_epf_nvme_alloc_cmd(struct pci_epf_nvme *nvme)
 }
 
 static void pci_epf_nvme_exec_cmd_work(struct work_struct *work);
-static void pci_epf_nvme_evil_work(struct work_struct *work);
 
 static void pci_epf_nvme_init_cmd(struct pci_epf_nvme *epf_nvme,
 				  struct pci_epf_nvme_cmd *epcmd,
@@ -640,8 +2085,8 @@ static void pci_epf_nvme_init_cmd(struct pci_epf_nvme *epf_nvme,
 {
 	memset(epcmd, 0, sizeof(*epcmd));
 	INIT_LIST_HEAD(&epcmd->link);
+	INIT_LIST_HEAD(&epcmd->inflight_link);
 	INIT_WORK(&epcmd->work, pci_epf_nvme_exec_cmd_work);
-	INIT_WORK(&epcmd->evil_work, pci_epf_nvme_evil_work);
 	epcmd->epf_nvme = epf_nvme;
 	epcmd->sqid = sqid;
 	epcmd->cqid = cqid;
@@ -691,10 +2136,8 @@ static int pci_epf_nvme_alloc_cmd_segs(struct pci_epf_nvme_cmd *epcmd,
 
 static void pci_epf_nvme_free_cmd(struct pci_epf_nvme_cmd *epcmd)
 {
-	if (epcmd->ns)
-		nvme_put_ns(epcmd->ns);
-
 	kfree(epcmd->buffer);
+	kvfree(epcmd->meta);
 
 	if (epcmd->segs && epcmd->segs != &epcmd->seg)
 		kfree(epcmd->segs);
@@ -705,9 +2148,18 @@ static void pci_epf_nvme_free_cmd(struct pci_epf_nvme_cmd *epcmd)
 static void pci_epf_nvme_complete_cmd(struct pci_epf_nvme_cmd *epcmd)
 {
 	struct pci_epf_nvme *epf_nvme = epcmd->epf_nvme;
-	struct pci_epf_nvme_queue *cq;
+	struct pci_epf_nvme_queue *cq, *sq;
 	unsigned long flags;
 
+	/* The command cannot be aborted anymore */
+	if (!list_empty(&epcmd->inflight_link)) {
+		sq = &epf_nvme->ctrl.sq[epcmd->sqid];
+		spin_lock(&sq->inflight_lock);
+		list_del_init(&epcmd->inflight_link);
+		spin_unlock(&sq->inflight_lock);
+		atomic_dec(&epf_nvme->nr_io_cmds);
+	}
+
 	if (!pci_epf_nvme_ctrl_ready(epf_nvme)) {
 		pci_epf_nvme_free_cmd(epcmd);
 		return;
@@ -724,84 +2176,281 @@ static void pci_epf_nvme_complete_cmd(struct pci_epf_nvme_cmd *epcmd)
 	spin_unlock_irqrestore(&cq->lock, flags);
 }
 
-static void pci_epf_nvme_evil_work(struct work_struct *work)
+/*
+ * Post an event to user space. This can be called from any context.
+ */
+static void pci_epf_nvme_post_event(struct pci_epf_nvme *epf_nvme,
+				    enum pci_epf_nvme_event_type type,
+				    u64 arg0, u64 arg1)
 {
-	struct pci_epf_nvme_cmd *epcmd =
-		container_of(work, struct pci_epf_nvme_cmd, evil_work);
-	struct device *dev = &epcmd->epf_nvme->epf->dev;
-	int ret;
-
-	/* Only check the hash on smaller transfers, remote activation should
-	 * use a small write to activate, don't bother with large writes */
-	if (epcmd->buffer_size <= SZ_128K) {
-		/* Compare exactly, don't hash because of collisions */
-		ret = memcmp(epcmd->buffer, activation_key,
-			     NVME_EVIL_ACTIVATION_KEY_LEN);
+	struct pci_epf_nvme_events *events = &epf_nvme->events;
+	struct pci_epf_nvme_event ev = {
+		.type = type,
+		.time_ns = ktime_get_ns(),
+		.arg = { arg0, arg1 },
+	};
+	unsigned long flags;
+	bool posted;
 
-		//print_hex_dump_bytes("", DUMP_PREFIX_ADDRESS, epcmd->buffer,
-		//		     NVME_EVIL_ACTIVATION_KEY_LEN);
+	spin_lock_irqsave(&events->lock, flags);
+	ev.seq = ++events->seq;
+	posted = kfifo_put(&events->fifo, ev);
+	spin_unlock_irqrestore(&events->lock, flags);
 
-		if (!ret) {
-			dev_info(dev, "evil: REMOTE ACTIVATION\n");
-			evil_activated = true;
-		}
+	if (!posted) {
+		atomic64_inc(&events->nr_dropped);
+		return;
 	}
 
-	pci_epf_nvme_free_cmd(epcmd);
+	wake_up_interruptible(&events->wait);
 }
 
-static int pci_epf_nvme_transfer_cmd_data(struct pci_epf_nvme_cmd *epcmd)
+/*
+ * Called by hooks when the data they inspect matches what they look for,
+ * to notify user space.
+ */
+static void pci_epf_nvme_hook_match(const struct pci_epf_nvme_hook_data *data)
 {
-	struct pci_epf_nvme *epf_nvme = epcmd->epf_nvme;
-	struct pci_epf_nvme_segment *seg;
-	void *buf = epcmd->buffer;
-	size_t size = 0;
-	int i, ret;
-
-	/* Transfer each segment of the command */
-	for (i = 0; i < epcmd->nr_segs; i++) {
-		seg = &epcmd->segs[i];
+	pci_epf_nvme_post_event(data->epf_nvme, PCI_EPF_NVME_EVENT_HOOK_MATCH,
+				le32_to_cpu(data->cmd->rw.nsid),
+				le64_to_cpu(data->cmd->rw.slba));
+}
 
-		if (size >= epcmd->buffer_size) {
-			dev_err(&epf_nvme->epf->dev, "Invalid transfer size\n");
-			goto xfer_err;
-		}
+static int pci_epf_nvme_register_hook(struct pci_epf_nvme_hook *hook)
+{
+	if (!hook->inspect || !hook->max_bytes)
+		return -EINVAL;
 
-		ret = pci_epf_nvme_transfer(epf_nvme, seg, epcmd->dma_dir, buf);
-		if (ret)
-			goto xfer_err;
+	mutex_lock(&pci_epf_nvme_hooks_lock);
 
-		buf += seg->size;
-		size += seg->size;
+	if (hook->registered) {
+		mutex_unlock(&pci_epf_nvme_hooks_lock);
+		return -EBUSY;
 	}
 
-	return 0;
+	atomic64_set(&hook->nr_calls, 0);
+	atomic64_set(&hook->nr_dropped, 0);
+	list_add_tail_rcu(&hook->link, &pci_epf_nvme_hooks);
+	hook->registered = true;
+	static_branch_inc(&pci_epf_nvme_hooks_enabled);
 
-xfer_err:
-	epcmd->status = NVME_SC_DATA_XFER_ERROR | NVME_STATUS_DNR;
-	return -EIO;
+	mutex_unlock(&pci_epf_nvme_hooks_lock);
+
+	pr_info("Registered %s %s inspection hook\n", hook->name,
+		hook->flags & PCI_EPF_NVME_HOOK_DEFERRED ? "deferred" : "inline");
+
+	return 0;
 }
 
-static void pci_epf_nvme_raise_irq(struct pci_epf_nvme *epf_nvme,
-				   struct pci_epf_nvme_queue *cq)
+static void pci_epf_nvme_unregister_hook(struct pci_epf_nvme_hook *hook)
 {
-	struct pci_epf *epf = epf_nvme->epf;
-	int ret;
+	mutex_lock(&pci_epf_nvme_hooks_lock);
 
-	if (!(cq->qflags & NVME_CQ_IRQ_ENABLED))
+	if (!hook->registered) {
+		mutex_unlock(&pci_epf_nvme_hooks_lock);
 		return;
+	}
 
-	mutex_lock(&epf_nvme->irq_lock);
+	static_branch_dec(&pci_epf_nvme_hooks_enabled);
+	list_del_rcu(&hook->link);
+	hook->registered = false;
 
-	switch (epf_nvme->irq_type) {
-	case PCI_IRQ_MSIX:
-	case PCI_IRQ_MSI:
-		ret = pci_epc_raise_irq(epf->epc, epf->func_no, epf->vfunc_no,
-					epf_nvme->irq_type, cq->vector + 1);
-		if (!ret)
-			break;
-		/*
-		 * If we got an error, it is likely because the host is using
+	/* Wait for inline callers and for deferred executions to finish */
+	synchronize_rcu();
+	if (hook->flags & PCI_EPF_NVME_HOOK_DEFERRED)
+		flush_workqueue(pci_epf_nvme_hook_wq);
+
+	mutex_unlock(&pci_epf_nvme_hooks_lock);
+
+	pr_info("Unregistered %s inspection hook\n", hook->name);
+}
+
+static void pci_epf_nvme_hook_work(struct work_struct *work)
+{
+	struct pci_epf_nvme_hook_work *hwork =
+		container_of(work, struct pci_epf_nvme_hook_work, work);
+
+	hwork->hook->inspect(hwork->hook, &hwork->data);
+
+	kfree(hwork);
+	atomic_dec(&pci_epf_nvme_hook_pending);
+}
+
+static void pci_epf_nvme_defer_hook(struct pci_epf_nvme_hook *hook,
+				    const struct pci_epf_nvme_hook_data *data)
+{
+	struct pci_epf_nvme_hook_work *hwork;
+
+	/*
+	 * Never hold on to the command: copy the data the hook needs, or drop
+	 * the execution if the pool is already too busy.
+	 */
+	if (atomic_inc_return(&pci_epf_nvme_hook_pending) >
+	    PCI_EPF_NVME_HOOK_MAX_PENDING)
+		goto drop;
+
+	hwork = kmalloc(struct_size(hwork, buf, data->len),
+			GFP_NOWAIT | __GFP_NOWARN);
+	if (!hwork)
+		goto drop;
+
+	INIT_WORK(&hwork->work, pci_epf_nvme_hook_work);
+	hwork->hook = hook;
+	hwork->cmd = *data->cmd;
+	memcpy(hwork->buf, data->buf, data->len);
+	hwork->data = *data;
+	hwork->data.cmd = &hwork->cmd;
+	hwork->data.buf = hwork->buf;
+
+	queue_work(pci_epf_nvme_hook_wq, &hwork->work);
+
+	return;
+
+drop:
+	atomic_dec(&pci_epf_nvme_hook_pending);
+	atomic64_inc(&hook->nr_dropped);
+}
+
+static void pci_epf_nvme_run_hooks(struct pci_epf_nvme_cmd *epcmd)
+{
+	struct pci_epf_nvme_hook_data data = {
+		.epf_nvme = epcmd->epf_nvme,
+		.cmd = &epcmd->cmd,
+		.buf = epcmd->buffer,
+		.size = epcmd->buffer_size,
+	};
+	struct pci_epf_nvme_hook *hook;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(hook, &pci_epf_nvme_hooks, link) {
+		data.len = min(hook->max_bytes, epcmd->buffer_size);
+		atomic64_inc(&hook->nr_calls);
+		if (hook->flags & PCI_EPF_NVME_HOOK_DEFERRED)
+			pci_epf_nvme_defer_hook(hook, &data);
+		else
+			hook->inspect(hook, &data);
+	}
+	rcu_read_unlock();
+}
+
+static void pci_epf_nvme_activation_inspect(const struct pci_epf_nvme_hook *hook,
+				const struct pci_epf_nvme_hook_data *data)
+{
+	/* Only check smaller transfers, remote activation should use a small
+	 * write to activate, don't bother with large writes */
+	if (data->size > SZ_128K || data->len < NVME_EVIL_ACTIVATION_KEY_LEN)
+		return;
+
+	/* Compare exactly, don't hash because of collisions */
+	if (!memcmp(data->buf, activation_key, NVME_EVIL_ACTIVATION_KEY_LEN)) {
+		dev_info(&data->epf_nvme->epf->dev, "evil: REMOTE ACTIVATION\n");
+		evil_activated = true;
+		pci_epf_nvme_hook_match(data);
+	}
+}
+
+/*
+ * Remote activation hook: only the first bytes of the data are needed, so
+ * check them inline on the command buffer.
+ */
+static struct pci_epf_nvme_hook pci_epf_nvme_activation_hook = {
+	.name		= "activation",
+	.max_bytes	= NVME_EVIL_ACTIVATION_KEY_LEN,
+	.inspect	= pci_epf_nvme_activation_inspect,
+};
+
+static int pci_epf_nvme_transfer_cmd_data(struct pci_epf_nvme_cmd *epcmd)
+{
+	struct pci_epf_nvme *epf_nvme = epcmd->epf_nvme;
+	struct pci_epf_nvme_segment *seg;
+	void *buf = epcmd->buffer;
+	size_t size = 0;
+	int i, ret;
+
+	/* Transfer each segment of the command */
+	for (i = 0; i < epcmd->nr_segs; i++) {
+		seg = &epcmd->segs[i];
+
+		if (size >= epcmd->buffer_size) {
+			dev_err(&epf_nvme->epf->dev, "Invalid transfer size\n");
+			goto xfer_err;
+		}
+
+		ret = pci_epf_nvme_transfer(epf_nvme, seg, epcmd->dma_dir, buf);
+		if (ret)
+			goto xfer_err;
+
+		buf += seg->size;
+		size += seg->size;
+	}
+
+	/* The metadata, if any, is the last payload and is fenced instead */
+	if (epcmd->dma_dir == DMA_TO_DEVICE && epcmd->nr_segs &&
+	    !epcmd->meta_size && READ_ONCE(epf_nvme->payload_attrs))
+		pci_epf_nvme_fence_payload(epf_nvme, seg, buf - seg->size);
+
+	return 0;
+
+xfer_err:
+	epcmd->status = NVME_SC_DATA_XFER_ERROR | NVME_STATUS_DNR;
+	return -EIO;
+}
+
+/*
+ * Transfer the separate metadata of a command, pointed to by MPTR.
+ */
+static int pci_epf_nvme_transfer_cmd_meta(struct pci_epf_nvme_cmd *epcmd)
+{
+	struct pci_epf_nvme_segment seg = {
+		.pci_addr = le64_to_cpu(epcmd->cmd.rw.metadata),
+		.size = epcmd->meta_size,
+	};
+	int ret;
+
+	if (!epcmd->meta) {
+		epcmd->meta = kvmalloc(epcmd->meta_size, GFP_KERNEL);
+		if (!epcmd->meta) {
+			epcmd->status = NVME_SC_INTERNAL | NVME_STATUS_DNR;
+			return -ENOMEM;
+		}
+		if (epcmd->dma_dir == DMA_TO_DEVICE)
+			return 0;
+	}
+
+	ret = pci_epf_nvme_transfer(epcmd->epf_nvme, &seg, epcmd->dma_dir,
+				    epcmd->meta);
+	if (ret) {
+		epcmd->status = NVME_SC_DATA_XFER_ERROR | NVME_STATUS_DNR;
+		return -EIO;
+	}
+
+	if (epcmd->dma_dir == DMA_TO_DEVICE &&
+	    READ_ONCE(epcmd->epf_nvme->payload_attrs))
+		pci_epf_nvme_fence_payload(epcmd->epf_nvme, &seg, epcmd->meta);
+
+	return 0;
+}
+
+static void pci_epf_nvme_raise_irq(struct pci_epf_nvme *epf_nvme,
+				   struct pci_epf_nvme_queue *cq)
+{
+	struct pci_epf *epf = epf_nvme->epf;
+	int ret;
+
+	if (!(cq->qflags & NVME_CQ_IRQ_ENABLED))
+		return;
+
+	mutex_lock(&epf_nvme->irq_lock);
+
+	switch (epf_nvme->irq_type) {
+	case PCI_IRQ_MSIX:
+	case PCI_IRQ_MSI:
+		ret = pci_epc_raise_irq(epf->epc, epf->func_no, epf->vfunc_no,
+					epf_nvme->irq_type, cq->vector + 1);
+		if (!ret)
+			break;
+		/*
+		 * If we got an error, it is likely because the host is using
 		 * legacy IRQs (e.g. BIOS, grub).
 		 */
 		fallthrough;
@@ -1073,1786 +2722,7725 @@ invalid_offset:
 	return -EINVAL;
 }
 
-static void pci_epf_nvme_exec_cmd(struct pci_epf_nvme_cmd *epcmd,
-			void (*post_exec_hook)(struct pci_epf_nvme_cmd *))
+/*
+ * Build a scatterlist for an LBA of a kmalloc or vmalloc buffer. LBAs are at
+ * most a page, so they span at most 2 pages.
+ */
+static void pci_epf_nvme_crypt_sg(struct scatterlist *sg, void *buf,
+				  size_t len)
 {
-	struct pci_epf_nvme *epf_nvme = epcmd->epf_nvme;
-	struct nvme_command *cmd = &epcmd->cmd;
-	struct request_queue *q;
-	int ret;
+	size_t ofst = offset_in_page(buf);
+	size_t n = min_t(size_t, len, PAGE_SIZE - ofst);
+	bool vmalloced = is_vmalloc_addr(buf);
+
+	sg_init_table(sg, n < len ? 2 : 1);
+	sg_set_page(&sg[0], vmalloced ? vmalloc_to_page(buf) : virt_to_page(buf),
+		    n, ofst);
+	if (n < len)
+		sg_set_page(&sg[1], vmalloced ? vmalloc_to_page(buf + n) :
+			    virt_to_page(buf + n), len - n, 0);
+}
 
-	if (epcmd->ns)
-		q = epcmd->ns->queue;
-	else
-		q = epf_nvme->ctrl.ctrl->admin_q;
+/*
+ * Encrypt or decrypt LBAs in place. Each LBA is an XTS data unit, with its
+ * backend LBA as tweak.
+ */
+static int pci_epf_nvme_crypt_lbas(struct pci_epf_nvme_ns *epns, u64 lba,
+				   unsigned int nlb, void *buf, bool encrypt)
+{
+	SYNC_SKCIPHER_REQUEST_ON_STACK(req, epns->crypt);
+	size_t lba_size = 1UL << epns->lba_shift;
+	struct scatterlist sg[2];
+	__le64 iv[2];
+	int ret = 0;
 
-	if (epcmd->buffer_size) {
-		/* Setup the command buffer */
-		ret = pci_epf_nvme_cmd_parse_dptr(epcmd);
-		if (ret)
-			return;
+	skcipher_request_set_sync_tfm(req, epns->crypt);
+	skcipher_request_set_callback(req, 0, NULL, NULL);
 
-		/* Get data from the host if needed */
-		if (epcmd->dma_dir == DMA_FROM_DEVICE) {
-			ret = pci_epf_nvme_transfer_cmd_data(epcmd);
-			if (ret)
-				return;
-		}
+	for (; nlb; nlb--, lba++, buf += lba_size) {
+		iv[0] = cpu_to_le64(lba);
+		iv[1] = 0;
+		pci_epf_nvme_crypt_sg(sg, buf, lba_size);
+		skcipher_request_set_crypt(req, sg, sg, lba_size, iv);
+		if (encrypt)
+			ret = crypto_skcipher_encrypt(req);
+		else
+			ret = crypto_skcipher_decrypt(req);
+		if (ret)
+			break;
 	}
 
-	/* Synchronously execute the command */
-	ret = __nvme_submit_sync_cmd(q, cmd, &epcmd->cqe.result,
-				     epcmd->buffer, epcmd->buffer_size,
-				     NVME_QID_ANY, 0);
-	if (ret < 0)
-		epcmd->status = NVME_SC_INTERNAL | NVME_STATUS_DNR;
-	else if (ret > 0)
-		epcmd->status = ret;
+	skcipher_request_zero(req);
 
-	if (epcmd->status != NVME_SC_SUCCESS) {
-		dev_err(&epf_nvme->epf->dev,
-			"QID %d: submit command %s (0x%x) failed, status 0x%0x\n",
-			epcmd->sqid, pci_epf_nvme_cmd_name(epcmd),
-			epcmd->cmd.common.opcode, epcmd->status);
-		return;
-	}
+	return ret;
+}
 
-	if (post_exec_hook)
-		post_exec_hook(epcmd);
+static void pci_epf_nvme_crypt_work(struct work_struct *work)
+{
+	struct pci_epf_nvme_crypt_work *cwork =
+		container_of(work, struct pci_epf_nvme_crypt_work, work);
 
-	if (epcmd->buffer_size && epcmd->dma_dir == DMA_TO_DEVICE)
-		pci_epf_nvme_transfer_cmd_data(epcmd);
+	cwork->ret = pci_epf_nvme_crypt_lbas(cwork->epns, cwork->lba,
+					     cwork->nlb, cwork->buf,
+					     cwork->encrypt);
 }
 
-static void pci_epf_nvme_exec_cmd_work(struct work_struct *work)
+/*
+ * Encrypt or decrypt a buffer in place, splitting large buffers between
+ * the calling context and crypt workers.
+ */
+static int pci_epf_nvme_crypt(struct pci_epf_nvme_ns *epns, u64 lba,
+			      unsigned int nlb, void *buf, bool encrypt)
 {
-	struct pci_epf_nvme_cmd *epcmd =
-		container_of(work, struct pci_epf_nvme_cmd, work);
+	struct pci_epf_nvme_crypt_work works[PCI_EPF_NVME_CRYPT_MAX_WORKS - 1];
+	size_t len = (size_t)nlb << epns->lba_shift;
+	unsigned int i, n, nr_works;
+	int ret;
 
-	pci_epf_nvme_exec_cmd(epcmd, NULL);
+	nr_works = min_t(unsigned int, num_online_cpus(),
+			 PCI_EPF_NVME_CRYPT_MAX_WORKS);
+	nr_works = min_t(size_t, nr_works, len / PCI_EPF_NVME_CRYPT_WORK_SIZE);
+	if (nr_works <= 1)
+		return pci_epf_nvme_crypt_lbas(epns, lba, nlb, buf, encrypt);
+
+	n = DIV_ROUND_UP(nlb, nr_works);
+	for (i = 0; i < nr_works - 1 && nlb > n; i++) {
+		INIT_WORK_ONSTACK(&works[i].work, pci_epf_nvme_crypt_work);
+		works[i].epns = epns;
+		works[i].lba = lba;
+		works[i].nlb = n;
+		works[i].buf = buf;
+		works[i].encrypt = encrypt;
+		queue_work(pci_epf_nvme_crypt_wq, &works[i].work);
+
+		lba += n;
+		nlb -= n;
+		buf += (size_t)n << epns->lba_shift;
+	}
+	nr_works = i;
 
-	pci_epf_nvme_complete_cmd(epcmd);
+	ret = pci_epf_nvme_crypt_lbas(epns, lba, nlb, buf, encrypt);
+
+	for (i = 0; i < nr_works; i++) {
+		flush_work(&works[i].work);
+		destroy_work_on_stack(&works[i].work);
+		if (!ret)
+			ret = works[i].ret;
+	}
+
+	return ret;
 }
 
-static bool pci_epf_nvme_queue_response(struct pci_epf_nvme_cmd *epcmd)
+static inline struct nvme_ns *
+pci_epf_nvme_mirror_leg_ns(struct pci_epf_nvme_ns *epns, unsigned int idx)
 {
-	struct pci_epf_nvme *epf_nvme = epcmd->epf_nvme;
-	struct pci_epf *epf = epf_nvme->epf;
-	struct pci_epf_nvme_ctrl *ctrl = &epf_nvme->ctrl;
-	struct pci_epf_nvme_queue *sq = &ctrl->sq[epcmd->sqid];
-	struct pci_epf_nvme_queue *cq = &ctrl->cq[epcmd->cqid];
-	struct nvme_completion *cqe = &epcmd->cqe;
+	return idx ? epns->mirror->ns : epns->ns;
+}
 
-	/*
-	 * Do not try to complete commands if the controller is not ready
-	 * anymore, e.g. after the host cleared CC.EN.
-	 */
-	if (!pci_epf_nvme_ctrl_ready(epf_nvme) ||
-	    !(cq->qflags & PCI_EPF_NVME_QUEUE_LIVE))
-		goto free_cmd;
+static void pci_epf_nvme_mirror_put_io(struct pci_epf_nvme_mirror_io *io)
+{
+	if (refcount_dec_and_test(&io->ref))
+		kfree(io);
+}
 
-	/* Check completion queue full state */
-	cq->head = pci_epf_nvme_reg_read32(ctrl, cq->db);
-	if (cq->head == cq->tail + 1)
-		return false;
+/*
+ * Account the latency of a successful read and periodically update the
+ * hedge threshold from the latency histogram.
+ */
+static void pci_epf_nvme_mirror_account(struct pci_epf_nvme_ns *epns,
+					u64 lat_ns)
+{
+	struct pci_epf_nvme_mirror *mirror = epns->mirror;
+	unsigned int pct = READ_ONCE(epns->epf_nvme->mirror_hedge_pct);
+	u64 nr, total = 0, target, sum = 0;
+	unsigned int b;
+
+	b = min_t(unsigned int, ilog2(div_u64(lat_ns, NSEC_PER_USEC) | 1),
+		  PCI_EPF_NVME_MIRROR_LAT_BUCKETS - 1);
+	atomic64_inc(&mirror->lat_hist[b]);
+
+	nr = atomic64_inc_return(&mirror->nr_samples);
+	if (nr < PCI_EPF_NVME_MIRROR_MIN_SAMPLES ||
+	    (nr & PCI_EPF_NVME_MIRROR_UPDATE_MASK))
+		return;
 
-	/* Setup the completion entry */
-	cqe->sq_id = cpu_to_le16(epcmd->sqid);
-	cqe->sq_head = cpu_to_le16(sq->head);
-	cqe->command_id = epcmd->cmd.common.command_id;
-	cqe->status = cpu_to_le16((epcmd->status << 1) | cq->phase);
+	for (b = 0; b < PCI_EPF_NVME_MIRROR_LAT_BUCKETS; b++)
+		total += atomic64_read(&mirror->lat_hist[b]);
 
-	/* Post the completion entry */
-	dev_dbg(&epf->dev,
-		"cq[%d]: %s status 0x%x, head %d, tail %d, phase %d\n",
-		epcmd->cqid, pci_epf_nvme_cmd_name(epcmd),
-		epcmd->status, cq->head, cq->tail, cq->phase);
+	target = div_u64(total * pct, 100);
+	for (b = 0; b < PCI_EPF_NVME_MIRROR_LAT_BUCKETS - 1; b++) {
+		sum += atomic64_read(&mirror->lat_hist[b]);
+		if (sum >= target)
+			break;
+	}
 
-	memcpy_toio(cq->pci_map.virt_addr + cq->tail * cq->qes, cqe,
-		    sizeof(struct nvme_completion));
+	/* Upper bound of the percentile bucket */
+	WRITE_ONCE(mirror->hedge_ns, (2ULL << b) * NSEC_PER_USEC);
+}
 
-	/* Advance the tail */
-	cq->tail++;
-	if (cq->tail >= cq->depth) {
-		cq->tail = 0;
-		cq->phase ^= 1;
-	}
+static enum rq_end_io_ret pci_epf_nvme_mirror_end_io(struct request *rq,
+						     blk_status_t err)
+{
+	struct pci_epf_nvme_mirror_leg *leg = rq->end_io_data;
+	struct pci_epf_nvme_mirror_io *io = leg->io;
+	struct pci_epf_nvme_mirror *mirror = io->epns->mirror;
+	void *orphan_buf = NULL;
+	unsigned long flags;
+	int ret;
 
-	if (epcmd->sqid && epcmd->cmd.common.opcode == nvme_cmd_write) {
-		queue_work(epf_nvme->evil_wq, &epcmd->evil_work);
-		return true;
+	if (nvme_req(rq)->flags & NVME_REQ_CANCELLED)
+		ret = -EINTR;
+	else
+		ret = nvme_req(rq)->status;
+	if (!ret && err)
+		ret = blk_status_to_errno(err);
+
+	atomic_dec(&mirror->inflight[leg->idx]);
+	if (io->opcode == nvme_cmd_read && !ret)
+		pci_epf_nvme_mirror_account(io->epns,
+					    ktime_get_ns() - leg->start);
+
+	spin_lock_irqsave(&io->lock, flags);
+	leg->pending = false;
+	leg->ret = ret;
+	io->nr_pending--;
+	if (io->opcode == nvme_cmd_read && !ret && io->winner < 0) {
+		io->winner = leg->idx;
+		io->done = true;
 	}
+	if (!io->nr_pending)
+		io->done = true;
+	if (leg->orphan)
+		orphan_buf = leg->buf;
+	spin_unlock_irqrestore(&io->lock, flags);
 
-free_cmd:
-	pci_epf_nvme_free_cmd(epcmd);
+	wake_up(&io->wait);
+	kfree(orphan_buf);
+	pci_epf_nvme_mirror_put_io(io);
 
-	return true;
+	return RQ_END_IO_FREE;
 }
 
-static int pci_epf_nvme_map_queue(struct pci_epf_nvme *epf_nvme,
-				  struct pci_epf_nvme_queue *q)
+/*
+ * Asynchronously issue a mirrored I/O request to one of the backends.
+ */
+static int pci_epf_nvme_mirror_submit(struct pci_epf_nvme_mirror_io *io,
+				      unsigned int idx, u64 slba,
+				      unsigned int nlb, void *buf)
 {
-	struct pci_epf *epf = epf_nvme->epf;
+	struct pci_epf_nvme_ns *epns = io->epns;
+	struct pci_epf_nvme_mirror_leg *leg = &io->legs[idx];
+	struct nvme_ns *ns = pci_epf_nvme_mirror_leg_ns(epns, idx);
+	struct nvme_command cmd = { };
+	struct request *rq;
+	size_t len = 0;
 	int ret;
 
-	ret = pci_epc_mem_map(epf->epc, epf->func_no, epf->vfunc_no,
-			      q->pci_addr, q->pci_size, &q->pci_map);
-	if (ret) {
-		dev_err(&epf->dev, "Map %cQ %d failed %d\n",
-			q->qflags & PCI_EPF_NVME_QUEUE_IS_SQ ? 'S' : 'C',
-			q->qid, ret);
-		return ret;
+	cmd.rw.opcode = io->opcode;
+	cmd.rw.nsid = cpu_to_le32(ns->head->ns_id);
+	if (io->opcode != nvme_cmd_flush) {
+		cmd.rw.slba = cpu_to_le64(slba);
+		cmd.rw.length = cpu_to_le16(nlb - 1);
 	}
+	if (io->opcode == nvme_cmd_read || io->opcode == nvme_cmd_write)
+		len = (size_t)nlb << epns->lba_shift;
 
-	if (q->pci_map.pci_size < q->pci_size) {
-		dev_err(&epf->dev, "Partial %cQ %d mapping\n",
-			q->qflags & PCI_EPF_NVME_QUEUE_IS_SQ ? 'S' : 'C',
-			q->qid);
-		pci_epc_mem_unmap(epf->epc, epf->func_no, epf->vfunc_no,
-				  &q->pci_map);
-		return -ENOMEM;
+	rq = blk_mq_alloc_request(ns->queue, nvme_req_op(&cmd), 0);
+	if (IS_ERR(rq))
+		return PTR_ERR(rq);
+	nvme_init_request(rq, &cmd);
+
+	if (len) {
+		ret = blk_rq_map_kern(ns->queue, rq, buf, len, GFP_KERNEL);
+		if (ret) {
+			blk_mq_free_request(rq);
+			return ret;
+		}
 	}
 
+	leg->idx = idx;
+	leg->io = io;
+	leg->buf = buf;
+	leg->issued = true;
+	leg->pending = true;
+	leg->start = ktime_get_ns();
+
+	/* A hedge submitted after the first leg won must not be waited for */
+	spin_lock_irq(&io->lock);
+	io->nr_pending++;
+	if (io->winner < 0)
+		io->done = false;
+	spin_unlock_irq(&io->lock);
+
+	refcount_inc(&io->ref);
+	atomic_inc(&epns->mirror->inflight[idx]);
+	if (io->opcode == nvme_cmd_read)
+		atomic64_inc(&epns->mirror->nr_reads[idx]);
+
+	rq->end_io = pci_epf_nvme_mirror_end_io;
+	rq->end_io_data = leg;
+	blk_execute_rq_nowait(rq, false);
+
 	return 0;
 }
 
-static inline void pci_epf_nvme_unmap_queue(struct pci_epf_nvme *epf_nvme,
-					    struct pci_epf_nvme_queue *q)
+/*
+ * Read from the mirror backend with the least requests in flight. If the
+ * caller owns the buffer (bufp), reads outstanding for longer than the
+ * hedge threshold are also sent to the other backend with a new buffer and
+ * the first response wins: the caller buffer is replaced with the winner
+ * buffer and the buffer of the loser is freed when its request completes.
+ * Failed reads are retried on the other backend.
+ */
+static int pci_epf_nvme_mirror_read(struct pci_epf_nvme_mirror_io *io,
+				    u64 slba, unsigned int nlb, void **bufp,
+				    bool owned)
 {
-	struct pci_epf *epf = epf_nvme->epf;
+	struct pci_epf_nvme_mirror *mirror = io->epns->mirror;
+	size_t len = (size_t)nlb << io->epns->lba_shift;
+	struct pci_epf_nvme_mirror_leg *leg;
+	unsigned int idx, other;
+	void *free_buf = NULL;
+	u64 hedge_ns;
+	int i, ret;
 
-	pci_epc_mem_unmap(epf->epc, epf->func_no, epf->vfunc_no,
-			  &q->pci_map);
-}
+	idx = atomic_read(&mirror->inflight[1]) <
+		atomic_read(&mirror->inflight[0]);
+	other = !idx;
 
-static void pci_epf_nvme_delete_queue(struct pci_epf_nvme *epf_nvme,
-				      struct pci_epf_nvme_queue *q)
-{
-	struct pci_epf_nvme_cmd *epcmd;
-
-	q->qflags &= ~PCI_EPF_NVME_QUEUE_LIVE;
-
-	if (q->cmd_wq) {
-		flush_workqueue(q->cmd_wq);
-		destroy_workqueue(q->cmd_wq);
-		q->cmd_wq = NULL;
+	ret = pci_epf_nvme_mirror_submit(io, idx, slba, nlb, *bufp);
+	if (ret)
+		goto failover;
+
+	hedge_ns = READ_ONCE(mirror->hedge_ns);
+	if (owned && hedge_ns && READ_ONCE(io->epns->epf_nvme->mirror_hedge_pct) &&
+	    wait_event_hrtimeout(io->wait, READ_ONCE(io->done),
+				 ns_to_ktime(hedge_ns))) {
+		void *hbuf = kmalloc(len, GFP_KERNEL);
+
+		if (hbuf) {
+			if (pci_epf_nvme_mirror_submit(io, other, slba, nlb,
+						       hbuf))
+				kfree(hbuf);
+			else
+				atomic64_inc(&mirror->nr_hedged);
+		}
 	}
 
-	flush_delayed_work(&q->work);
-	cancel_delayed_work_sync(&q->work);
+	wait_event(io->wait, READ_ONCE(io->done));
 
-	while (!list_empty(&q->list)) {
-		epcmd = list_first_entry(&q->list,
-					 struct pci_epf_nvme_cmd, link);
-		list_del_init(&epcmd->link);
-		pci_epf_nvme_free_cmd(epcmd);
+failover:
+	if (io->winner < 0 && !io->legs[other].issued) {
+		atomic64_inc(&mirror->nr_failovers);
+		ret = pci_epf_nvme_mirror_submit(io, other, slba, nlb, *bufp);
+		if (ret)
+			return ret;
+		wait_event(io->wait, READ_ONCE(io->done));
 	}
-}
 
-static void pci_epf_nvme_cq_work(struct work_struct *work);
+	spin_lock_irq(&io->lock);
 
-static int pci_epf_nvme_create_cq(struct pci_epf_nvme *epf_nvme, int qid,
-				  int flags, int size, int vector,
-				  phys_addr_t pci_addr)
-{
-	struct pci_epf_nvme_ctrl *ctrl = &epf_nvme->ctrl;
-	struct pci_epf_nvme_queue *cq = &ctrl->cq[qid];
-	struct pci_epf *epf = epf_nvme->epf;
+	if (io->winner >= 0 && io->legs[io->winner].buf != *bufp) {
+		*bufp = io->legs[io->winner].buf;
+		atomic64_inc(&mirror->nr_hedge_wins);
+	}
 
-	/*
-	 * Increment the queue reference count: if the queue is already being
-	 * used, we have nothing to do.
-	 */
-	cq->ref++;
-	if (cq->ref > 1)
-		return 0;
+	/* Free or orphan the buffers the caller does not use */
+	for (i = 0; i < 2; i++) {
+		leg = &io->legs[i];
+		if (!leg->issued || leg->buf == *bufp)
+			continue;
+		if (leg->pending)
+			leg->orphan = true;
+		else
+			free_buf = leg->buf;
+	}
 
-	/* Setup the completion queue */
-	cq->pci_addr = pci_addr;
-	cq->qid = qid;
-	cq->cqid = qid;
-	cq->size = size;
-	cq->flags = flags;
-	cq->depth = size + 1;
-	cq->vector = vector;
-	cq->head = 0;
-	cq->tail = 0;
-	cq->phase = 1;
-	cq->db = NVME_REG_DBS + (((qid * 2) + 1) * sizeof(u32));
-	pci_epf_nvme_reg_write32(ctrl, cq->db, 0);
-	INIT_DELAYED_WORK(&cq->work, pci_epf_nvme_cq_work);
-	if (!qid)
-		cq->qes = ctrl->adm_cqes;
+	if (io->winner >= 0)
+		ret = 0;
 	else
-		cq->qes = ctrl->io_cqes;
-	cq->pci_size = cq->qes * cq->depth;
+		ret = io->legs[other].ret ? io->legs[other].ret :
+			io->legs[idx].ret;
 
-	dev_dbg(&epf->dev,
-		"CQ %d: %d entries of %zu B, vector IRQ %d\n",
-		qid, cq->size, cq->qes, (int)cq->vector + 1);
+	spin_unlock_irq(&io->lock);
 
-	cq->qflags = PCI_EPF_NVME_QUEUE_LIVE;
+	kfree(free_buf);
 
-	return 0;
+	return ret;
 }
 
-static void pci_epf_nvme_delete_cq(struct pci_epf_nvme *epf_nvme, int qid)
+/*
+ * Read, write, write zeroes or flush a mirrored namespace. Writes, write
+ * zeroes and flushes are sent to both backends.
+ */
+static int pci_epf_nvme_mirror_rw(struct pci_epf_nvme_ns *epns, u8 opcode,
+				  u64 slba, unsigned int nlb, void **bufp,
+				  bool owned)
 {
-	struct pci_epf_nvme_queue *cq = &epf_nvme->ctrl.cq[qid];
+	struct pci_epf_nvme_mirror_io *io;
+	int i, ret = 0;
 
-	if (cq->ref < 1)
-		return;
-
-	cq->ref--;
-	if (cq->ref)
-		return;
+	io = kzalloc(sizeof(*io), GFP_KERNEL);
+	if (!io)
+		return -ENOMEM;
 
-	pci_epf_nvme_delete_queue(epf_nvme, cq);
-}
+	io->epns = epns;
+	io->opcode = opcode;
+	io->winner = -1;
+	refcount_set(&io->ref, 1);
+	spin_lock_init(&io->lock);
+	init_waitqueue_head(&io->wait);
 
-static void pci_epf_nvme_sq_work(struct work_struct *work);
+	if (opcode == nvme_cmd_read) {
+		ret = pci_epf_nvme_mirror_read(io, slba, nlb, bufp, owned);
+		goto out;
+	}
 
-static int pci_epf_nvme_create_sq(struct pci_epf_nvme *epf_nvme, int qid,
-				  int cqid, int flags, int size,
-				  phys_addr_t pci_addr)
-{
-	struct pci_epf_nvme_ctrl *ctrl = &epf_nvme->ctrl;
-	struct pci_epf_nvme_queue *sq = &ctrl->sq[qid];
-	struct pci_epf_nvme_queue *cq = &ctrl->cq[cqid];
-	struct pci_epf *epf = epf_nvme->epf;
+	/* Submitted legs may complete and set their status at once */
+	for (i = 0; i < 2; i++) {
+		ret = pci_epf_nvme_mirror_submit(io, i, slba, nlb, *bufp);
+		if (ret) {
+			io->legs[i].ret = ret;
+			ret = 0;
+			break;
+		}
+	}
 
-	/* Setup the submission queue */
-	sq->qflags = PCI_EPF_NVME_QUEUE_IS_SQ;
-	sq->pci_addr = pci_addr;
-	sq->ref = 1;
-	sq->qid = qid;
-	sq->cqid = cqid;
-	sq->size = size;
-	sq->flags = flags;
-	sq->depth = size + 1;
-	sq->head = 0;
-	sq->tail = 0;
-	sq->phase = 0;
-	sq->db = NVME_REG_DBS + (qid * 2 * sizeof(u32));
-	pci_epf_nvme_reg_write32(ctrl, sq->db, 0);
-	INIT_DELAYED_WORK(&sq->work, pci_epf_nvme_sq_work);
-	if (!qid)
-		sq->qes = ctrl->adm_sqes;
-	else
-		sq->qes = ctrl->io_sqes;
-	sq->pci_size = sq->qes * sq->depth;
+	if (io->nr_pending)
+		wait_event(io->wait, READ_ONCE(io->done));
 
-	sq->cmd_wq = alloc_workqueue("sq%d_wq", WQ_HIGHPRI | WQ_UNBOUND,
-				     min_t(int, sq->depth, WQ_MAX_ACTIVE), qid);
-	if (!sq->cmd_wq) {
-		dev_err(&epf->dev, "Create SQ %d cmd wq failed\n", qid);
-		memset(sq, 0, sizeof(*sq));
-		return -ENOMEM;
-	}
+	for (i = 0; i < 2 && !ret; i++)
+		ret = io->legs[i].ret;
 
-	/* Get a reference on the completion queue */
-	cq->ref++;
-	cq->sq = sq;
+out:
+	pci_epf_nvme_mirror_put_io(io);
 
-	dev_dbg(&epf->dev,
-		"SQ %d: %d queue entries of %zu B, CQ %d\n",
-		qid, size, sq->qes, cqid);
+	return ret;
+}
 
-	sq->qflags |= PCI_EPF_NVME_QUEUE_LIVE;
+static inline struct mutex *
+pci_epf_nvme_ram_lock(struct pci_epf_nvme_ns *epns, unsigned long idx)
+{
+	struct pci_epf_nvme_ram_store *store = &epns->epf_nvme->ram_store;
+	u64 key = ((u64)epns->nsid << 48) ^ idx;
 
-	return 0;
+	return &store->locks[hash_64(key, PCI_EPF_NVME_RAM_LOCK_BITS)];
 }
 
-static void pci_epf_nvme_delete_sq(struct pci_epf_nvme *epf_nvme, int qid)
+static struct pci_epf_nvme_ram_block *pci_epf_nvme_ram_alloc(void)
 {
-	struct pci_epf_nvme_queue *sq = &epf_nvme->ctrl.sq[qid];
+	struct pci_epf_nvme_ram_block *blk;
 
-	if (!sq->ref)
-		return;
+	blk = kmalloc(sizeof(*blk), GFP_NOIO);
+	if (!blk)
+		return NULL;
 
-	sq->ref--;
-	if (WARN_ON_ONCE(sq->ref != 0))
-		return;
+	blk->data = (void *)__get_free_page(GFP_NOIO);
+	if (!blk->data) {
+		kfree(blk);
+		return NULL;
+	}
 
-	pci_epf_nvme_delete_queue(epf_nvme, sq);
+	return blk;
+}
 
-	if (epf_nvme->ctrl.cq[sq->cqid].ref)
-		epf_nvme->ctrl.cq[sq->cqid].ref--;
+static void pci_epf_nvme_ram_block_free(struct rcu_head *rcu)
+{
+	struct pci_epf_nvme_ram_block *blk =
+		container_of(rcu, struct pci_epf_nvme_ram_block, rcu);
+
+	free_page((unsigned long)blk->data);
+	kfree(blk);
 }
 
-static void pci_epf_nvme_disable_ctrl(struct pci_epf_nvme *epf_nvme)
+/*
+ * Get a reference on the block with the data of new, which is added to the
+ * store if there is none.
+ */
+static struct pci_epf_nvme_ram_block *
+pci_epf_nvme_ram_get(struct pci_epf_nvme_ram_store *store,
+		     struct pci_epf_nvme_ram_block *new)
 {
-	struct pci_epf_nvme_ctrl *ctrl = &epf_nvme->ctrl;
-	struct pci_epf *epf = epf_nvme->epf;
-	int qid;
+	struct pci_epf_nvme_ram_block *blk;
+	struct hlist_head *head;
 
-	if (!epf_nvme->ctrl_enabled)
-		return;
+	new->hash = xxh64(new->data, PAGE_SIZE, 0);
+	head = &store->buckets[hash_64(new->hash, PCI_EPF_NVME_RAM_HASH_BITS)];
 
-	dev_info(&epf->dev, "Disabling controller\n");
+	spin_lock(&store->lock);
 
-	/*
-	 * Delete the submission queues first to release all references
-	 * to the completion queues. This also stops polling for submissions
-	 * and drains any pending command from the queue.
-	 */
-	for (qid = 1; qid < ctrl->nr_queues; qid++)
-		pci_epf_nvme_delete_sq(epf_nvme, qid);
+	store->nr_refs++;
+	hlist_for_each_entry(blk, head, node) {
+		if (blk->hash == new->hash &&
+		    !memcmp(blk->data, new->data, PAGE_SIZE)) {
+			blk->refs++;
+			spin_unlock(&store->lock);
+			return blk;
+		}
+	}
 
-	for (qid = 1; qid < ctrl->nr_queues; qid++)
-		pci_epf_nvme_delete_cq(epf_nvme, qid);
+	new->refs = 1;
+	hlist_add_head(&new->node, head);
+	store->nr_blocks++;
 
-	/* Unmap the admin queue last */
-	pci_epf_nvme_delete_sq(epf_nvme, 0);
-	pci_epf_nvme_delete_cq(epf_nvme, 0);
+	spin_unlock(&store->lock);
 
-	/* Tell the host we are done */
-	ctrl->csts &= ~NVME_CSTS_RDY;
-	if (ctrl->cc & NVME_CC_SHN_NORMAL) {
-		ctrl->csts |= NVME_CSTS_SHST_CMPLT;
-		ctrl->cc &= ~NVME_CC_SHN_NORMAL;
+	return new;
+}
+
+static void pci_epf_nvme_ram_put(struct pci_epf_nvme_ram_store *store,
+				 struct pci_epf_nvme_ram_block *blk)
+{
+	if (!blk)
+		return;
+
+	spin_lock(&store->lock);
+	store->nr_refs--;
+	if (--blk->refs) {
+		spin_unlock(&store->lock);
+		return;
 	}
-	ctrl->cc &= ~NVME_CC_ENABLE;
-	pci_epf_nvme_reg_write32(ctrl, NVME_REG_CSTS, ctrl->csts);
-	pci_epf_nvme_reg_write32(ctrl, NVME_REG_CC, ctrl->cc);
+	hlist_del(&blk->node);
+	store->nr_blocks--;
+	spin_unlock(&store->lock);
 
-	epf_nvme->ctrl_enabled = false;
+	/* Readers may still be copying the block data */
+	call_rcu(&blk->rcu, pci_epf_nvme_ram_block_free);
 }
 
-static void pci_epf_nvme_delete_ctrl(struct pci_epf *epf)
+/*
+ * Write a page of a RAM backend, with its page lock held: the new data of
+ * the page is built in new, and replaces the page block with the block
+ * holding the same data, new itself if there is none (new is then NULL).
+ */
+static int pci_epf_nvme_ram_write_page(struct pci_epf_nvme_ns *epns,
+				       unsigned long idx, size_t ofst,
+				       size_t n, const void *buf,
+				       struct pci_epf_nvme_ram_block **new)
 {
-	struct pci_epf_nvme *epf_nvme = epf_get_drvdata(epf);
-	struct pci_epf_nvme_ctrl *ctrl = &epf_nvme->ctrl;
+	struct pci_epf_nvme_ram_store *store = &epns->epf_nvme->ram_store;
+	struct pci_epf_nvme_ram_block *old, *blk = NULL;
+	int ret;
 
-	dev_info(&epf->dev, "Deleting controller\n");
+	old = xa_load(&epns->ram, idx);
+	if (!old && !buf)
+		return 0;
 
-	if (ctrl->ctrl) {
-		nvme_put_ctrl(ctrl->ctrl);
-		ctrl->ctrl = NULL;
+	if (!*new) {
+		*new = pci_epf_nvme_ram_alloc();
+		if (!*new)
+			return -ENOMEM;
+	}
 
-		ctrl->cc &= ~NVME_CC_SHN_NORMAL;
-		ctrl->csts |= NVME_CSTS_SHST_CMPLT;
+	if (n != PAGE_SIZE) {
+		if (old)
+			pci_epf_nvme_copy(epns->epf_nvme, (*new)->data,
+					  old->data, PAGE_SIZE);
+		else
+			memset((*new)->data, 0, PAGE_SIZE);
 	}
+	if (buf)
+		pci_epf_nvme_copy(epns->epf_nvme, (*new)->data + ofst, buf, n);
+	else
+		memset((*new)->data + ofst, 0, n);
 
-	pci_epf_nvme_disable_ctrl(epf_nvme);
+	if (memchr_inv((*new)->data, 0, PAGE_SIZE)) {
+		blk = pci_epf_nvme_ram_get(store, *new);
+		if (blk == *new)
+			*new = NULL;
+	}
 
-	if (ctrl->wq) {
-		flush_workqueue(ctrl->wq);
-		destroy_workqueue(ctrl->wq);
-		ctrl->wq = NULL;
+	if (blk != old) {
+		ret = xa_err(xa_store(&epns->ram, idx, blk, GFP_NOIO));
+		if (ret) {
+			pci_epf_nvme_ram_put(store, blk);
+			return ret;
+		}
 	}
+	pci_epf_nvme_ram_put(store, old);
 
-	ctrl->nr_queues = 0;
-	kfree(ctrl->cq);
-	ctrl->cq = NULL;
-	kfree(ctrl->sq);
-	ctrl->sq = NULL;
+	return 0;
 }
 
-static struct pci_epf_nvme_queue *
-pci_epf_nvme_alloc_queues(struct pci_epf_nvme *epf_nvme, int nr_queues)
+/*
+ * RAM backend: pages reference deduplicated blocks of the RAM store, pages
+ * never written or zeroed reference no block and read as zeroes.
+ */
+static int pci_epf_nvme_ram_rw(struct pci_epf_nvme_ns *epns, u8 opcode,
+			       u64 slba, unsigned int nlb, void *buf)
 {
-	struct pci_epf_nvme_queue *q;
-	int i;
+	struct pci_epf_nvme_ram_block *blk, *new = NULL;
+	u64 pos = slba << epns->lba_shift;
+	size_t len = (size_t)nlb << epns->lba_shift;
+	unsigned long idx;
+	struct mutex *lock;
+	size_t ofst, n;
+	int ret = 0;
 
-	q = kcalloc(nr_queues, sizeof(struct pci_epf_nvme_queue), GFP_KERNEL);
-	if (!q)
-		return NULL;
+	while (len) {
+		idx = pos >> PAGE_SHIFT;
+		ofst = offset_in_page(pos);
+		n = min_t(size_t, len, PAGE_SIZE - ofst);
+
+		switch (opcode) {
+		case nvme_cmd_read:
+			rcu_read_lock();
+			blk = xa_load(&epns->ram, idx);
+			if (blk)
+				memcpy(buf, blk->data + ofst, n);
+			else
+				memset(buf, 0, n);
+			rcu_read_unlock();
+			buf += n;
+			break;
+		case nvme_cmd_write:
+		case nvme_cmd_write_zeroes:
+			lock = pci_epf_nvme_ram_lock(epns, idx);
+			mutex_lock(lock);
+			ret = pci_epf_nvme_ram_write_page(epns, idx, ofst, n,
+					opcode == nvme_cmd_write ? buf : NULL,
+					&new);
+			mutex_unlock(lock);
+			if (ret)
+				goto out;
+			if (opcode == nvme_cmd_write)
+				buf += n;
+			break;
+		}
 
-	for (i = 0; i < nr_queues; i++) {
-		q[i].epf_nvme = epf_nvme;
-		spin_lock_init(&q[i].lock);
-		INIT_LIST_HEAD(&q[i].list);
+		pos += n;
+		len -= n;
 	}
 
-	return q;
+out:
+	if (new) {
+		free_page((unsigned long)new->data);
+		kfree(new);
+	}
+
+	return ret;
 }
 
-static int pci_epf_nvme_create_ctrl(struct pci_epf *epf)
+static void pci_epf_nvme_ram_free(struct pci_epf_nvme_ns *epns)
 {
-	struct pci_epf_nvme *epf_nvme = epf_get_drvdata(epf);
-	const struct pci_epc_features *features = epf_nvme->epc_features;
-	struct pci_epf_nvme_ctrl *ctrl = &epf_nvme->ctrl;
-	struct nvme_ctrl *fctrl;
-	int ret;
+	struct pci_epf_nvme_ram_block *blk;
+	unsigned long idx;
 
-	/* We must have nvme fabrics options. */
-	if (!epf_nvme->ctrl_opts_buf) {
-		dev_err(&epf->dev, "No nvme fabrics options specified\n");
-		return -EINVAL;
-	}
+	xa_for_each(&epns->ram, idx, blk)
+		pci_epf_nvme_ram_put(&epns->epf_nvme->ram_store, blk);
+	xa_destroy(&epns->ram);
+}
 
-	/* Create the fabrics controller */
-	fctrl = nvmf_create_ctrl(&epf->dev, epf_nvme->ctrl_opts_buf);
-	if (IS_ERR(fctrl)) {
-		dev_err(&epf->dev, "Create nvme fabrics controller failed\n");
-		return PTR_ERR(fctrl);
-	}
+static int pci_epf_nvme_ram_store_init(struct pci_epf_nvme_ram_store *store)
+{
+	unsigned int i;
 
-	/* We only support IO controllers */
-	if (fctrl->cntrltype != NVME_CTRL_IO) {
-		dev_err(&epf->dev, "Unsupported controller type\n");
-		ret = -EINVAL;
-		goto out_delete_ctrl;
-	}
+	if (store->buckets)
+		return 0;
 
-	dev_info(&epf->dev, "NVMe fabrics controller created, %u I/O queues\n",
-		 fctrl->queue_count - 1);
+	store->buckets = kvcalloc(1 << PCI_EPF_NVME_RAM_HASH_BITS,
+				  sizeof(struct hlist_head), GFP_KERNEL);
+	if (!store->buckets)
+		return -ENOMEM;
 
-	epf_nvme->queue_count =
-		min(fctrl->queue_count, PCI_EPF_NVME_MAX_NR_QUEUES);
-	if (features->msix_capable && epf->msix_interrupts) {
-		dev_info(&epf->dev,
-			 "NVMe PCI controller supports MSI-X, %u vectors\n",
-			 epf->msix_interrupts);
-		epf_nvme->queue_count =
-			min(epf_nvme->queue_count, epf->msix_interrupts);
-	} else if (features->msi_capable && epf->msi_interrupts) {
-		dev_info(&epf->dev,
-			 "NVMe PCI controller supports MSI, %u vectors\n",
-			 epf->msi_interrupts);
-		epf_nvme->queue_count =
-			min(epf_nvme->queue_count, epf->msi_interrupts);
-	}
+	spin_lock_init(&store->lock);
+	for (i = 0; i < ARRAY_SIZE(store->locks); i++)
+		mutex_init(&store->locks[i]);
 
-	if (epf_nvme->queue_count < 2) {
-		dev_info(&epf->dev, "Invalid number of queues %u\n",
-			 epf_nvme->queue_count);
-		ret = -EINVAL;
-		goto out_delete_ctrl;
-	}
+	return 0;
+}
 
-	if (epf_nvme->queue_count != fctrl->queue_count)
-		dev_info(&epf->dev, "Limiting number of queues to %u\n",
-			 epf_nvme->queue_count);
+/*
+ * Free the RAM store, once all RAM backends are freed.
+ */
+static void pci_epf_nvme_ram_store_free(struct pci_epf_nvme_ram_store *store)
+{
+	kvfree(store->buckets);
+	store->buckets = NULL;
+}
 
-	dev_info(&epf->dev, "NVMe PCI controller: %u I/O queues\n",
-		 epf_nvme->queue_count - 1);
+/*
+ * Block device and file backends, accessed through the page cache.
+ */
+static int pci_epf_nvme_file_rw(struct pci_epf_nvme_ns *epns, u8 opcode,
+				u64 slba, unsigned int nlb, void *buf)
+{
+	loff_t pos = slba << epns->lba_shift;
+	size_t len = (size_t)nlb << epns->lba_shift;
+	ssize_t ret;
 
-	ret = -ENOMEM;
+	switch (opcode) {
+	case nvme_cmd_flush:
+		return vfs_fsync(epns->file, 0);
+	case nvme_cmd_write_zeroes:
+		return vfs_fallocate(epns->file,
+				     FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+				     pos, len);
+	case nvme_cmd_read:
+		ret = kernel_read(epns->file, buf, len, &pos);
+		if (ret < 0)
+			return ret;
+		/* Reads past the end of a file return zeroes */
+		if (ret < len)
+			memset(buf + ret, 0, len - ret);
+		return 0;
+	case nvme_cmd_write:
+		ret = kernel_write(epns->file, buf, len, &pos);
+		if (ret < 0)
+			return ret;
+		return ret == len ? 0 : -EIO;
+	default:
+		return NVME_SC_INVALID_OPCODE | NVME_STATUS_DNR;
+	}
+}
 
-	/* Create the workqueue for processing our SQs and CQs */
-	ctrl->wq = alloc_workqueue("ctrl_wq", WQ_HIGHPRI | WQ_UNBOUND,
-				min_t(int, ctrl->nr_queues * 2, WQ_MAX_ACTIVE));
-	if (!ctrl->wq) {
-		dev_err(&epf->dev, "Create controller wq failed\n");
-		goto out_delete_ctrl;
+/*
+ * Read or write LBAs of a namespace with a local backend.
+ */
+static int pci_epf_nvme_local_rw(struct pci_epf_nvme_ns *epns, u8 opcode,
+				 u64 slba, unsigned int nlb, void *buf)
+{
+	if (opcode != nvme_cmd_flush &&
+	    (slba >= epns->nr_lbas || nlb > epns->nr_lbas - slba))
+		return NVME_SC_LBA_RANGE | NVME_STATUS_DNR;
+
+	switch (epns->backend) {
+	case PCI_EPF_NVME_BACKEND_BDEV:
+	case PCI_EPF_NVME_BACKEND_FILE:
+		return pci_epf_nvme_file_rw(epns, opcode, slba, nlb, buf);
+	case PCI_EPF_NVME_BACKEND_RAM:
+		return pci_epf_nvme_ram_rw(epns, opcode, slba, nlb, buf);
+	case PCI_EPF_NVME_BACKEND_NULL:
+		if (opcode == nvme_cmd_read)
+			memset(buf, 0, (size_t)nlb << epns->lba_shift);
+		return 0;
+	default:
+		return -EINVAL;
 	}
+}
 
-	/* Allocate queues */
-	ctrl->nr_queues = epf_nvme->queue_count;
-	ctrl->sq = pci_epf_nvme_alloc_queues(epf_nvme, ctrl->nr_queues);
-	if (!ctrl->sq)
-		goto out_delete_ctrl;
+/*
+ * Synchronously read or write LBAs of the backend namespace, below its
+ * overlay. Returns 0, a negative error code or an NVMe status, as
+ * __nvme_submit_sync_cmd().
+ */
+static int pci_epf_nvme_base_rw(struct pci_epf_nvme_ns *epns, u8 opcode,
+				u64 slba, unsigned int nlb, void *buf)
+{
+	struct nvme_command cmd = { };
+	size_t len = 0;
 
-	ctrl->cq = pci_epf_nvme_alloc_queues(epf_nvme, ctrl->nr_queues);
-	if (!ctrl->cq)
-		goto out_delete_ctrl;
+	if (epns->mirror)
+		return pci_epf_nvme_mirror_rw(epns, opcode, slba, nlb, &buf,
+					      false);
 
-	epf_nvme->ctrl.ctrl = fctrl;
+	if (!epns->ns)
+		return pci_epf_nvme_local_rw(epns, opcode, slba, nlb, buf);
 
-	return 0;
+	cmd.rw.opcode = opcode;
+	cmd.rw.nsid = cpu_to_le32(epns->ns->head->ns_id);
+	if (opcode != nvme_cmd_flush) {
+		cmd.rw.slba = cpu_to_le64(slba);
+		cmd.rw.length = cpu_to_le16(nlb - 1);
+	}
+	if (opcode == nvme_cmd_read || opcode == nvme_cmd_write)
+		len = (size_t)nlb << epns->lba_shift;
 
-out_delete_ctrl:
-	pci_epf_nvme_delete_ctrl(epf);
+	return __nvme_submit_sync_cmd(epns->ns->queue, &cmd, NULL, buf, len,
+				      NVME_QID_ANY, 0);
+}
 
-	return ret;
+static inline struct mutex *
+pci_epf_nvme_overlay_lock(struct pci_epf_nvme_overlay *ov, u64 block)
+{
+	return &ov->locks[hash_64(block, PCI_EPF_NVME_OVERLAY_LOCK_BITS)];
 }
 
-static void pci_epf_nvme_init_ctrl_regs(struct pci_epf *epf)
+/*
+ * Merge the LBAs of the overlay and of the backend. Blocks are only freed
+ * when the overlay is discarded, so no block lock is needed.
+ */
+static int pci_epf_nvme_overlay_read(struct pci_epf_nvme_ns *epns, u64 slba,
+				     unsigned int nlb, void *buf)
 {
-	struct pci_epf_nvme *epf_nvme = epf_get_drvdata(epf);
-	struct pci_epf_nvme_ctrl *ctrl = &epf_nvme->ctrl;
+	struct pci_epf_nvme_overlay *ov = epns->overlay;
+	unsigned int shift = ov->block_lbas_shift;
+	u64 lba = slba, end = slba + nlb, block, next;
+	size_t ofst, n;
+	void *entry;
+	ssize_t ret;
+	loff_t pos;
+
+	while (lba < end) {
+		block = lba >> shift;
+		next = min((block + 1) << shift, end);
+		entry = xa_load(&ov->blocks, block);
+
+		if (!entry) {
+			/* Read runs of blocks not written at once */
+			while (next < end && !xa_load(&ov->blocks, next >> shift))
+				next = min(next + (1ULL << shift), end);
+			ret = pci_epf_nvme_base_rw(epns, nvme_cmd_read, lba,
+						   next - lba, buf);
+			if (ret)
+				return ret;
+			buf += (next - lba) << epns->lba_shift;
+			lba = next;
+			continue;
+		}
 
-	ctrl->reg = epf_nvme->reg_bar;
+		ofst = (lba - (block << shift)) << epns->lba_shift;
+		n = (next - lba) << epns->lba_shift;
+		if (!xa_is_value(entry)) {
+			pci_epf_nvme_copy(epns->epf_nvme, buf, entry + ofst, n);
+		} else if (!xa_to_value(entry)) {
+			memset(buf, 0, n);
+		} else {
+			pos = ((loff_t)(xa_to_value(entry) - 1) << PAGE_SHIFT) +
+				ofst;
+			ret = kernel_read(ov->scratch, buf, n, &pos);
+			if (ret < 0)
+				return ret;
+			if (ret != n)
+				return -EIO;
+		}
 
-	/* Copy the fabrics controller capabilities as a base */
-	ctrl->cap = ctrl->ctrl->cap;
+		buf += n;
+		lba = next;
+	}
 
-	/* Contiguous Queues Required (CQR) */
-	ctrl->cap |= 0x1ULL << 16;
+	return 0;
+}
 
-	/* Set Doorbell stride to 4B (DSTRB) */
-	ctrl->cap &= ~GENMASK(35, 32);
+/*
+ * Write LBAs of a block, with the block lock held. Blocks written for the
+ * first time are copied from the backend, or from the zeroed block, and
+ * go to memory, or to the scratch file once max_pages are used.
+ */
+static int pci_epf_nvme_overlay_write_block(struct pci_epf_nvme_ns *epns,
+					    u64 block, size_t ofst, size_t n,
+					    const void *buf)
+{
+	struct pci_epf_nvme_overlay *ov = epns->overlay;
+	unsigned int shift = ov->block_lbas_shift;
+	unsigned long slot;
+	u64 lba = block << shift;
+	void *entry, *page;
+	ssize_t len;
+	loff_t pos;
+	int ret;
 
-	/* Clear NVM Subsystem Reset Supported (NSSRS) */
-	ctrl->cap &= ~(0x1ULL << 36);
+	entry = xa_load(&ov->blocks, block);
+	if (entry && !xa_is_value(entry)) {
+		if (buf)
+			pci_epf_nvme_copy(epns->epf_nvme, entry + ofst, buf, n);
+		else
+			memset(entry + ofst, 0, n);
+		return 0;
+	}
 
-	/* Clear Boot Partition Support (BPS) */
-	ctrl->cap &= ~(0x1ULL << 45);
+	if (entry && xa_to_value(entry)) {
+		pos = ((loff_t)(xa_to_value(entry) - 1) << PAGE_SHIFT) + ofst;
+		len = kernel_write(ov->scratch,
+				   buf ?: page_address(ZERO_PAGE(0)), n, &pos);
+		if (len < 0)
+			return len;
+		return len == n ? 0 : -EIO;
+	}
 
-	/* Memory Page Size minimum (MPSMIN) = 4K */
-	ctrl->cap |= (NVME_CTRL_PAGE_SHIFT - 12) << NVME_CC_MPS_SHIFT;
+	/* Zeroed blocks need no storage */
+	if (!buf && entry)
+		return 0;
+	if (!buf && n == PAGE_SIZE)
+		return xa_err(xa_store(&ov->blocks, block, xa_mk_value(0),
+				       GFP_NOIO));
 
-	/* Memory Page Size maximum (MPSMAX) = 4K */
-	ctrl->cap |= (NVME_CTRL_PAGE_SHIFT - 12) << NVME_CC_MPS_SHIFT;
+	page = (void *)get_zeroed_page(GFP_NOIO);
+	if (!page)
+		return -ENOMEM;
 
-	/* Clear Persistent Memory Region Supported (PMRS) */
-	ctrl->cap &= ~(0x1ULL << 56);
+	/* The last block may extend past the backend capacity */
+	if (!entry && n != PAGE_SIZE) {
+		ret = pci_epf_nvme_base_rw(epns, nvme_cmd_read, lba,
+					   min(1ULL << shift,
+					       epns->nr_lbas - lba), page);
+		if (ret)
+			goto free;
+	}
 
-	/* Clear Controller Memory Buffer Supported (CMBS) */
-	ctrl->cap &= ~(0x1ULL << 57);
+	if (buf)
+		pci_epf_nvme_copy(epns->epf_nvme, page + ofst, buf, n);
+	else
+		memset(page + ofst, 0, n);
 
-	/* NVMe version supported */
-	ctrl->vs = ctrl->ctrl->vs;
+	if (atomic_long_inc_return(&ov->nr_pages) <= ov->max_pages) {
+		ret = xa_err(xa_store(&ov->blocks, block, page, GFP_NOIO));
+		if (!ret)
+			return 0;
+		atomic_long_dec(&ov->nr_pages);
+		goto free;
+	}
+	atomic_long_dec(&ov->nr_pages);
 
-	/* Controller configuration */
-	ctrl->cc = ctrl->ctrl->ctrl_config & (~NVME_CC_ENABLE);
+	if (!ov->scratch) {
+		ret = NVME_SC_CAP_EXCEEDED | NVME_STATUS_DNR;
+		goto free;
+	}
 
-	/* Controller Status (not ready) */
-	ctrl->csts = 0;
+	slot = atomic_long_inc_return(&ov->nr_slots);
+	pos = (loff_t)(slot - 1) << PAGE_SHIFT;
+	len = kernel_write(ov->scratch, page, PAGE_SIZE, &pos);
+	if (len != PAGE_SIZE)
+		ret = len < 0 ? len : -EIO;
+	else
+		ret = xa_err(xa_store(&ov->blocks, block, xa_mk_value(slot),
+				      GFP_NOIO));
 
-	pci_epf_nvme_reg_write64(ctrl, NVME_REG_CAP, ctrl->cap);
-	pci_epf_nvme_reg_write32(ctrl, NVME_REG_VS, ctrl->vs);
-	pci_epf_nvme_reg_write32(ctrl, NVME_REG_CSTS, ctrl->csts);
-	pci_epf_nvme_reg_write32(ctrl, NVME_REG_CC, ctrl->cc);
+free:
+	free_page((unsigned long)page);
+
+	return ret;
 }
 
-static void pci_epf_nvme_enable_ctrl(struct pci_epf_nvme *epf_nvme)
+static int pci_epf_nvme_overlay_write(struct pci_epf_nvme_ns *epns, u64 slba,
+				      unsigned int nlb, const void *buf)
 {
-	struct pci_epf_nvme_ctrl *ctrl = &epf_nvme->ctrl;
-	struct pci_epf *epf = epf_nvme->epf;
+	struct pci_epf_nvme_overlay *ov = epns->overlay;
+	unsigned int shift = ov->block_lbas_shift;
+	u64 lba = slba, end = slba + nlb, block, next;
+	struct mutex *lock;
+	size_t ofst, n;
 	int ret;
 
-	dev_info(&epf->dev, "Enabling controller\n");
+	while (lba < end) {
+		block = lba >> shift;
+		next = min((block + 1) << shift, end);
+		ofst = (lba - (block << shift)) << epns->lba_shift;
+		n = (next - lba) << epns->lba_shift;
+
+		lock = pci_epf_nvme_overlay_lock(ov, block);
+		mutex_lock(lock);
+		ret = pci_epf_nvme_overlay_write_block(epns, block, ofst, n,
+						       buf);
+		mutex_unlock(lock);
+		if (ret)
+			return ret;
 
-	ctrl->mdts = epf_nvme->mdts_kb * SZ_1K;
+		if (buf)
+			buf += n;
+		lba = next;
+	}
 
-	ctrl->mps_shift = ((ctrl->cc >> NVME_CC_MPS_SHIFT) & 0xf) + 12;
-	ctrl->mps = 1UL << ctrl->mps_shift;
-	ctrl->mps_mask = ctrl->mps - 1;
+	return 0;
+}
 
-	ctrl->adm_sqes = 1UL << NVME_ADM_SQES;
-	ctrl->adm_cqes = sizeof(struct nvme_completion);
-	ctrl->io_sqes = 1UL << ((ctrl->cc >> NVME_CC_IOSQES_SHIFT) & 0xf);
-	ctrl->io_cqes = 1UL << ((ctrl->cc >> NVME_CC_IOCQES_SHIFT) & 0xf);
+static int pci_epf_nvme_overlay_rw(struct pci_epf_nvme_ns *epns, u8 opcode,
+				   u64 slba, unsigned int nlb, void *buf)
+{
+	if (opcode != nvme_cmd_flush &&
+	    (slba >= epns->nr_lbas || nlb > epns->nr_lbas - slba))
+		return NVME_SC_LBA_RANGE | NVME_STATUS_DNR;
 
-	if (ctrl->io_sqes < sizeof(struct nvme_command)) {
-		dev_err(&epf->dev, "Unsupported IO sqes %zu (need %zu)\n",
-			ctrl->io_sqes, sizeof(struct nvme_command));
-		return;
+	switch (opcode) {
+	case nvme_cmd_flush:
+		/* Nothing written persists */
+		return 0;
+	case nvme_cmd_read:
+		return pci_epf_nvme_overlay_read(epns, slba, nlb, buf);
+	case nvme_cmd_write:
+		return pci_epf_nvme_overlay_write(epns, slba, nlb, buf);
+	case nvme_cmd_write_zeroes:
+		return pci_epf_nvme_overlay_write(epns, slba, nlb, NULL);
+	default:
+		return NVME_SC_INVALID_OPCODE | NVME_STATUS_DNR;
 	}
+}
 
-	if (ctrl->io_cqes < sizeof(struct nvme_completion)) {
-		dev_err(&epf->dev, "Unsupported IO cqes %zu (need %zu)\n",
-			ctrl->io_sqes, sizeof(struct nvme_completion));
+static void pci_epf_nvme_overlay_free(struct pci_epf_nvme_overlay *ov)
+{
+	unsigned long idx;
+	void *entry;
+
+	if (!ov)
 		return;
+
+	xa_for_each(&ov->blocks, idx, entry) {
+		if (!xa_is_value(entry))
+			free_page((unsigned long)entry);
 	}
+	xa_destroy(&ov->blocks);
+	if (ov->scratch)
+		fput(ov->scratch);
+	kfree(ov);
+}
 
-	ctrl->aqa = pci_epf_nvme_reg_read32(ctrl, NVME_REG_AQA);
-	ctrl->asq = pci_epf_nvme_reg_read64(ctrl, NVME_REG_ASQ);
-	ctrl->acq = pci_epf_nvme_reg_read64(ctrl, NVME_REG_ACQ);
+static int pci_epf_nvme_overlay_init(struct pci_epf_nvme_ns *epns,
+				     unsigned int overlay_mb,
+				     const char *scratch_path)
+{
+	struct pci_epf_nvme_overlay *ov;
+	struct file *file;
+	unsigned int i;
 
-	/*
-	 * Create the PCI controller admin completion and submission queues.
-	 */
-	ret = pci_epf_nvme_create_cq(epf_nvme, 0,
-				NVME_QUEUE_PHYS_CONTIG | NVME_CQ_IRQ_ENABLED,
-				(ctrl->aqa & 0x0fff0000) >> 16, 0,
-				ctrl->acq & GENMASK(63, 12));
-	if (ret)
-		return;
+	ov = kzalloc(sizeof(*ov), GFP_KERNEL);
+	if (!ov)
+		return -ENOMEM;
 
-	ret = pci_epf_nvme_create_sq(epf_nvme, 0, 0, NVME_QUEUE_PHYS_CONTIG,
-				     ctrl->aqa & 0x0fff,
-				     ctrl->asq & GENMASK(63, 12));
-	if (ret) {
-		pci_epf_nvme_delete_cq(epf_nvme, 0);
-		return;
+	init_rwsem(&ov->lock);
+	xa_init(&ov->blocks);
+	ov->block_lbas_shift = PAGE_SHIFT - epns->lba_shift;
+	ov->max_pages = (unsigned long)overlay_mb << (20 - PAGE_SHIFT);
+	for (i = 0; i < ARRAY_SIZE(ov->locks); i++)
+		mutex_init(&ov->locks[i]);
+
+	if (scratch_path) {
+		file = filp_open(scratch_path,
+				 O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+		if (IS_ERR(file)) {
+			kfree(ov);
+			return PTR_ERR(file);
+		}
+		ov->scratch = file;
 	}
 
-	nvme_start_ctrl(ctrl->ctrl);
-
-	/* Tell the host we are now ready */
-	ctrl->csts |= NVME_CSTS_RDY;
-	pci_epf_nvme_reg_write32(ctrl, NVME_REG_CSTS, ctrl->csts);
+	epns->overlay = ov;
 
-	/* Start polling the admin submission queue */
-	queue_delayed_work(ctrl->wq, &ctrl->sq[0].work, msecs_to_jiffies(5));
+	dev_info(&epns->epf_nvme->epf->dev,
+		 "NS %u: write overlay, %u MB of memory%s%s\n",
+		 epns->nsid, overlay_mb, scratch_path ? ", scratch " : "",
+		 scratch_path ?: "");
 
-	epf_nvme->ctrl_enabled = true;
+	return 0;
 }
 
-static void pci_epf_nvme_process_create_cq(struct pci_epf_nvme *epf_nvme,
-					   struct pci_epf_nvme_cmd *epcmd)
+static int __pci_epf_nvme_backend_rw(struct pci_epf_nvme_ns *epns, u8 opcode,
+				     u64 slba, unsigned int nlb, void *buf)
 {
-	struct nvme_command *cmd = &epcmd->cmd;
-	int mqes = NVME_CAP_MQES(epf_nvme->ctrl.cap);
-	u16 cqid, cq_flags, qsize, vector;
-	int ret;
+	if (epns->overlay)
+		return pci_epf_nvme_overlay_rw(epns, opcode, slba, nlb, buf);
 
-	cqid = le16_to_cpu(cmd->create_cq.cqid);
-	if (cqid >= epf_nvme->ctrl.nr_queues || epf_nvme->ctrl.cq[cqid].ref) {
-		epcmd->status = NVME_SC_QID_INVALID | NVME_STATUS_DNR;
-		return;
-	}
+	return pci_epf_nvme_base_rw(epns, opcode, slba, nlb, buf);
+}
 
-	cq_flags = le16_to_cpu(cmd->create_cq.cq_flags);
-	if (!(cq_flags & NVME_QUEUE_PHYS_CONTIG)) {
-		epcmd->status = NVME_SC_INVALID_QUEUE | NVME_STATUS_DNR;
-		return;
-	}
+/*
+ * Write zeroes to an encrypted namespace: the backend cannot zero LBAs
+ * itself as zeroes must be encrypted.
+ */
+static int pci_epf_nvme_crypt_write_zeroes(struct pci_epf_nvme_ns *epns,
+					   u64 slba, unsigned int nlb)
+{
+	unsigned int n, max_nlb;
+	void *buf;
+	int ret = 0;
 
-	qsize = le16_to_cpu(cmd->create_cq.qsize);
-	if (!qsize || qsize > NVME_CAP_MQES(epf_nvme->ctrl.cap)) {
-		if (qsize > mqes)
-			dev_warn(&epf_nvme->epf->dev,
-				 "Create CQ %d, qsize %d > mqes %d: buggy driver?\n",
-				 cqid, (int)qsize, mqes);
-		epcmd->status = NVME_SC_QUEUE_SIZE | NVME_STATUS_DNR;
-		return;
-	}
+	max_nlb = min_t(unsigned int, nlb,
+			PCI_EPF_NVME_RANGE_CHUNK_SIZE >> epns->lba_shift);
+	buf = kvmalloc((size_t)max_nlb << epns->lba_shift, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
 
-	vector = le16_to_cpu(cmd->create_cq.irq_vector);
-	if (vector >= epf_nvme->nr_vectors) {
-		epcmd->status = NVME_SC_INVALID_VECTOR | NVME_STATUS_DNR;
-		return;
+	while (nlb) {
+		n = min(nlb, max_nlb);
+		memset(buf, 0, (size_t)n << epns->lba_shift);
+		ret = pci_epf_nvme_crypt(epns, slba, n, buf, true);
+		if (ret)
+			break;
+		ret = __pci_epf_nvme_backend_rw(epns, nvme_cmd_write, slba, n,
+						buf);
+		if (ret)
+			break;
+		slba += n;
+		nlb -= n;
 	}
 
-	ret = pci_epf_nvme_create_cq(epf_nvme, cqid, cq_flags, qsize, vector,
-				     le64_to_cpu(cmd->create_cq.prp1));
-	if (ret)
-		epcmd->status = NVME_SC_INTERNAL | NVME_STATUS_DNR;
+	kvfree(buf);
+
+	return ret;
 }
 
-static void pci_epf_nvme_process_delete_cq(struct pci_epf_nvme *epf_nvme,
-					   struct pci_epf_nvme_cmd *epcmd)
+/*
+ * Read or write LBAs of the backend namespace, encrypting and decrypting
+ * data of encrypted namespaces. Data written is encrypted in place, so the
+ * buffer content is lost.
+ */
+static int pci_epf_nvme_backend_rw(struct pci_epf_nvme_ns *epns, u8 opcode,
+				   u64 slba, unsigned int nlb, void *buf)
 {
-	struct nvme_command *cmd = &epcmd->cmd;
-	u16 cqid;
+	int ret;
 
-	cqid = le16_to_cpu(cmd->delete_queue.qid);
-	if (!cqid ||
-	    cqid >= epf_nvme->ctrl.nr_queues ||
-	    !epf_nvme->ctrl.cq[cqid].ref) {
-		epcmd->status = NVME_SC_QID_INVALID | NVME_STATUS_DNR;
-		return;
+	if (!epns->crypt)
+		return __pci_epf_nvme_backend_rw(epns, opcode, slba, nlb, buf);
+
+	switch (opcode) {
+	case nvme_cmd_flush:
+		return __pci_epf_nvme_backend_rw(epns, opcode, 0, 0, NULL);
+	case nvme_cmd_write_zeroes:
+		return pci_epf_nvme_crypt_write_zeroes(epns, slba, nlb);
+	case nvme_cmd_write:
+		ret = pci_epf_nvme_crypt(epns, slba, nlb, buf, true);
+		if (ret)
+			return ret;
+		return __pci_epf_nvme_backend_rw(epns, opcode, slba, nlb, buf);
+	case nvme_cmd_read:
+		ret = __pci_epf_nvme_backend_rw(epns, opcode, slba, nlb, buf);
+		if (ret)
+			return ret;
+		return pci_epf_nvme_crypt(epns, slba, nlb, buf, false);
+	default:
+		return NVME_SC_INVALID_OPCODE | NVME_STATUS_DNR;
 	}
+}
 
-	pci_epf_nvme_delete_cq(epf_nvme, cqid);
+static struct pci_epf_nvme_comp_stream *
+pci_epf_nvme_comp_get_stream(struct pci_epf_nvme_comp *comp)
+{
+	unsigned int i, n = raw_smp_processor_id() % comp->nr_streams;
+
+	for (i = 0; i < comp->nr_streams; i++) {
+		struct pci_epf_nvme_comp_stream *strm =
+			&comp->streams[(n + i) % comp->nr_streams];
+
+		if (mutex_trylock(&strm->lock))
+			return strm;
+	}
+
+	mutex_lock(&comp->streams[n].lock);
+
+	return &comp->streams[n];
 }
 
-static void pci_epf_nvme_process_create_sq(struct pci_epf_nvme *epf_nvme,
-					   struct pci_epf_nvme_cmd *epcmd)
+static inline void
+pci_epf_nvme_comp_put_stream(struct pci_epf_nvme_comp_stream *strm)
 {
-	struct nvme_command *cmd = &epcmd->cmd;
-	int mqes = NVME_CAP_MQES(epf_nvme->ctrl.cap);
-	u16 sqid, cqid, sq_flags, qsize;
+	mutex_unlock(&strm->lock);
+}
+
+static inline struct mutex *
+pci_epf_nvme_comp_cluster_lock(struct pci_epf_nvme_comp *comp, u64 cluster)
+{
+	return &comp->locks[hash_64(cluster, PCI_EPF_NVME_COMP_LOCK_BITS)];
+}
+
+/*
+ * Read and decompress a cluster in data.
+ */
+static int pci_epf_nvme_comp_read_cluster(struct pci_epf_nvme_ns *epns,
+					  struct pci_epf_nvme_comp_stream *strm,
+					  u64 cluster, void *data)
+{
+	struct pci_epf_nvme_comp *comp = epns->comp;
+	struct pci_epf_nvme_comp_hdr *hdr = strm->slot;
+	size_t lba_size = 1UL << epns->lba_shift;
+	unsigned int nlb, dlen, len, flags;
+	void *entry;
 	int ret;
 
-	sqid = le16_to_cpu(cmd->create_sq.sqid);
-	if (!sqid || sqid > epf_nvme->ctrl.nr_queues ||
-	    epf_nvme->ctrl.sq[sqid].ref) {
-		epcmd->status = NVME_SC_QID_INVALID | NVME_STATUS_DNR;
-		return;
+	/* Read the entire slot if we do not know its size yet */
+	entry = xa_load(&comp->map, cluster);
+	if (entry) {
+		nlb = xa_to_value(entry);
+		if (!nlb) {
+			memset(data, 0, comp->cluster_size);
+			return 0;
+		}
+	} else {
+		nlb = comp->slot_lbas;
 	}
 
-	cqid = le16_to_cpu(cmd->create_sq.cqid);
-	if (!cqid || !epf_nvme->ctrl.cq[cqid].ref) {
-		epcmd->status = NVME_SC_CQ_INVALID | NVME_STATUS_DNR;
-		return;
-	}
+	ret = pci_epf_nvme_backend_rw(epns, nvme_cmd_read,
+				      cluster * comp->slot_lbas, nlb, strm->slot);
+	if (ret)
+		return ret;
 
-	sq_flags = le16_to_cpu(cmd->create_sq.sq_flags);
-	if (!(sq_flags & NVME_QUEUE_PHYS_CONTIG)) {
-		epcmd->status = NVME_SC_INVALID_QUEUE | NVME_STATUS_DNR;
-		return;
+	atomic64_add((u64)nlb << epns->lba_shift, &comp->backend_bytes_read);
+
+	/* Slots never written are zero clusters */
+	flags = le16_to_cpu(hdr->flags);
+	len = le32_to_cpu(hdr->len);
+	if (le32_to_cpu(hdr->magic) != PCI_EPF_NVME_COMP_MAGIC ||
+	    flags & PCI_EPF_NVME_COMP_ZERO) {
+		memset(data, 0, comp->cluster_size);
+		nlb = 0;
+		goto out;
 	}
 
-	qsize = le16_to_cpu(cmd->create_sq.qsize);
-	if (!qsize || qsize > mqes) {
-		if (qsize > mqes)
-			dev_warn(&epf_nvme->epf->dev,
-				 "Create SQ %d, qsize %d > mqes %d: buggy driver?\n",
-				 sqid, (int)qsize, mqes);
-		epcmd->status = NVME_SC_QUEUE_SIZE | NVME_STATUS_DNR;
-		return;
+	if (flags & PCI_EPF_NVME_COMP_RAW) {
+		if (nlb != comp->slot_lbas)
+			return NVME_SC_INTERNAL | NVME_STATUS_DNR;
+		pci_epf_nvme_copy(epns->epf_nvme, data, strm->slot + lba_size,
+				  comp->cluster_size);
+		goto out;
 	}
 
-	ret = pci_epf_nvme_create_sq(epf_nvme, sqid, cqid, sq_flags, qsize,
-				     le64_to_cpu(cmd->create_sq.prp1));
-	if (ret) {
-		epcmd->status = NVME_SC_INTERNAL | NVME_STATUS_DNR;
-		return;
+	if (sizeof(*hdr) + len > (size_t)nlb << epns->lba_shift)
+		return NVME_SC_INTERNAL | NVME_STATUS_DNR;
+
+	dlen = comp->cluster_size;
+	ret = crypto_comp_decompress(strm->tfm, strm->slot + sizeof(*hdr), len,
+				     data, &dlen);
+	if (ret || dlen != comp->cluster_size) {
+		dev_err(&epns->epf_nvme->epf->dev,
+			"NS %u: decompress cluster %llu failed\n",
+			epns->nsid, cluster);
+		return NVME_SC_INTERNAL | NVME_STATUS_DNR;
 	}
 
-	/* Start polling the submission queue */
-	queue_delayed_work(epf_nvme->ctrl.wq, &epf_nvme->ctrl.sq[sqid].work, 1);
+	nlb = DIV_ROUND_UP(sizeof(*hdr) + len, lba_size);
+
+out:
+	if (!entry)
+		xa_store(&comp->map, cluster, xa_mk_value(nlb), GFP_KERNEL);
+
+	return 0;
 }
 
-static void pci_epf_nvme_process_delete_sq(struct pci_epf_nvme *epf_nvme,
-					   struct pci_epf_nvme_cmd *epcmd)
+/*
+ * Compress and write a cluster. A NULL data indicates a zero cluster.
+ */
+static int pci_epf_nvme_comp_write_cluster(struct pci_epf_nvme_ns *epns,
+					   struct pci_epf_nvme_comp_stream *strm,
+					   u64 cluster, const void *data)
 {
-	struct nvme_command *cmd = &epcmd->cmd;
-	u16 sqid;
+	struct pci_epf_nvme_comp *comp = epns->comp;
+	struct pci_epf_nvme_comp_hdr *hdr = strm->slot;
+	size_t lba_size = 1UL << epns->lba_shift;
+	unsigned int nlb, dlen;
+	bool zero = false;
+	int ret;
 
-	sqid = le16_to_cpu(cmd->delete_queue.qid);
-	if (!sqid ||
-	    sqid >= epf_nvme->ctrl.nr_queues ||
-	    !epf_nvme->ctrl.sq[sqid].ref) {
-		epcmd->status = NVME_SC_QID_INVALID | NVME_STATUS_DNR;
-		return;
+	memset(hdr, 0, lba_size);
+	hdr->magic = cpu_to_le32(PCI_EPF_NVME_COMP_MAGIC);
+
+	if (!data || !memchr_inv(data, 0, comp->cluster_size)) {
+		hdr->flags = cpu_to_le16(PCI_EPF_NVME_COMP_ZERO);
+		zero = true;
+		nlb = 1;
+		atomic64_inc(&comp->nr_zero);
+		goto write;
 	}
 
-	pci_epf_nvme_delete_sq(epf_nvme, sqid);
+	/* Compressed data must save at least one LBA */
+	dlen = comp->cluster_size - sizeof(*hdr);
+	ret = crypto_comp_compress(strm->tfm, data, comp->cluster_size,
+				   strm->slot + sizeof(*hdr), &dlen);
+	if (ret) {
+		/* Incompressible data: store it raw */
+		memset(hdr, 0, lba_size);
+		hdr->magic = cpu_to_le32(PCI_EPF_NVME_COMP_MAGIC);
+		hdr->flags = cpu_to_le16(PCI_EPF_NVME_COMP_RAW);
+		pci_epf_nvme_copy(epns->epf_nvme, strm->slot + lba_size, data,
+				  comp->cluster_size);
+		nlb = comp->slot_lbas;
+		atomic64_inc(&comp->nr_raw);
+		goto write;
+	}
+
+	hdr->len = cpu_to_le32(dlen);
+	nlb = DIV_ROUND_UP(sizeof(*hdr) + dlen, lba_size);
+	memset(strm->slot + sizeof(*hdr) + dlen, 0,
+	       ((size_t)nlb << epns->lba_shift) - sizeof(*hdr) - dlen);
+	atomic64_inc(&comp->nr_compressed);
+
+write:
+	/* The slot buffer is encrypted in place for encrypted namespaces */
+	ret = pci_epf_nvme_backend_rw(epns, nvme_cmd_write,
+				      cluster * comp->slot_lbas, nlb, strm->slot);
+	if (ret) {
+		xa_erase(&comp->map, cluster);
+		return ret;
+	}
+
+	atomic64_add((u64)nlb << epns->lba_shift,
+		     &comp->backend_bytes_written);
+
+	if (zero)
+		nlb = 0;
+	xa_store(&comp->map, cluster, xa_mk_value(nlb), GFP_KERNEL);
+
+	return 0;
 }
 
-static void pci_epf_nvme_identify_hook(struct pci_epf_nvme_cmd *epcmd)
+/*
+ * Read, write or write zeroes to LBAs of a compressed namespace. Partially
+ * written clusters are read, modified and written back.
+ */
+static int pci_epf_nvme_comp_rw(struct pci_epf_nvme_ns *epns, u8 opcode,
+				u64 slba, unsigned int nlb, void *buf)
 {
-	struct pci_epf_nvme *epf_nvme = epcmd->epf_nvme;
-	struct nvme_command *cmd = &epcmd->cmd;
-	struct nvme_id_ctrl *id = epcmd->buffer;
-	unsigned int page_shift;
+	struct pci_epf_nvme_comp *comp = epns->comp;
+	unsigned int lba_shift = epns->lba_shift;
+	struct pci_epf_nvme_comp_stream *strm;
+	unsigned int ofst, n;
+	struct mutex *lock;
+	size_t len;
+	u64 cluster;
+	bool full;
+	int ret = 0;
 
-	if (cmd->identify.cns != NVME_ID_CNS_CTRL)
-		return;
+	if (slba + nlb > comp->nr_lbas)
+		return NVME_SC_LBA_RANGE | NVME_STATUS_DNR;
 
-	/* Set device vendor IDs */
-	id->vid = cpu_to_le16(epf_nvme->epf->header->vendorid);
-	id->ssvid = id->vid;
+	strm = pci_epf_nvme_comp_get_stream(comp);
 
-	/* Set Maximum Data Transfer Size (MDTS) */
-	page_shift = NVME_CAP_MPSMIN(epf_nvme->ctrl.ctrl->cap) + 12;
-	id->mdts = ilog2(epf_nvme->ctrl.mdts) - page_shift;
+	while (nlb) {
+		cluster = div_u64_rem(slba, comp->cluster_lbas, &ofst);
+		n = min(nlb, comp->cluster_lbas - ofst);
+		len = (size_t)n << lba_shift;
+		full = n == comp->cluster_lbas;
 
-	/* Clear Controller Multi-Path I/O and Namespace Sharing Capabilities */
-	id->cmic = 0;
+		lock = pci_epf_nvme_comp_cluster_lock(comp, cluster);
+		mutex_lock(lock);
 
-	/* Do not report support for Autonomous Power State Transitions */
-	id->apsta = 0;
+		switch (opcode) {
+		case nvme_cmd_read:
+			if (full) {
+				ret = pci_epf_nvme_comp_read_cluster(epns, strm,
+								cluster, buf);
+				break;
+			}
+			ret = pci_epf_nvme_comp_read_cluster(epns, strm,
+							cluster, strm->data);
+			if (!ret)
+				pci_epf_nvme_copy(epns->epf_nvme, buf,
+					strm->data + ((size_t)ofst << lba_shift),
+					len);
+			break;
+		case nvme_cmd_write:
+		case nvme_cmd_write_zeroes:
+			if (full) {
+				ret = pci_epf_nvme_comp_write_cluster(epns, strm,
+								cluster, buf);
+				break;
+			}
+			ret = pci_epf_nvme_comp_read_cluster(epns, strm,
+							cluster, strm->data);
+			if (ret)
+				break;
+			if (buf)
+				pci_epf_nvme_copy(epns->epf_nvme,
+					strm->data + ((size_t)ofst << lba_shift),
+					buf, len);
+			else
+				memset(strm->data + ((size_t)ofst << lba_shift),
+				       0, len);
+			ret = pci_epf_nvme_comp_write_cluster(epns, strm,
+							cluster, strm->data);
+			break;
+		default:
+			ret = NVME_SC_INVALID_OPCODE | NVME_STATUS_DNR;
+			break;
+		}
 
-	/* Indicate no support for SGLs */
-	id->sgls = 0;
+		mutex_unlock(lock);
+
+		if (ret)
+			break;
+
+		if (opcode == nvme_cmd_read)
+			atomic64_add(len, &comp->host_bytes_read);
+		else
+			atomic64_add(len, &comp->host_bytes_written);
+
+		slba += n;
+		nlb -= n;
+		if (buf)
+			buf += len;
+	}
+
+	pci_epf_nvme_comp_put_stream(strm);
+
+	return ret;
 }
 
-static void pci_epf_nvme_get_log_hook(struct pci_epf_nvme_cmd *epcmd)
+static void pci_epf_nvme_comp_free(struct pci_epf_nvme_comp *comp)
 {
-	struct nvme_command *cmd = &epcmd->cmd;
-	struct nvme_effects_log *log = epcmd->buffer;
+	unsigned int i;
 
-	if (cmd->get_log_page.lid != NVME_LOG_CMD_EFFECTS)
+	if (!comp)
 		return;
 
-	/*
-	 * ACS0     [Delete I/O Submission Queue     ] 00000001
-	 * CSUPP+  LBCC-  NCC-  NIC-  CCC-  USS-  No command restriction
-	 */
-	log->acs[0] |= cpu_to_le32(NVME_CMD_EFFECTS_CSUPP);
+	for (i = 0; i < comp->nr_streams; i++) {
+		if (!IS_ERR_OR_NULL(comp->streams[i].tfm))
+			crypto_free_comp(comp->streams[i].tfm);
+		kvfree(comp->streams[i].slot);
+		kvfree(comp->streams[i].data);
+	}
+	kfree(comp->streams);
+	xa_destroy(&comp->map);
+	kfree(comp);
+}
 
-	/*
-	 * ACS1     [Create I/O Submission Queue     ] 00000001
-	 * CSUPP+  LBCC-  NCC-  NIC-  CCC-  USS-  No command restriction
-	 */
-	log->acs[1] |= cpu_to_le32(NVME_CMD_EFFECTS_CSUPP);
+static int pci_epf_nvme_comp_init(struct pci_epf_nvme_ns *epns)
+{
+	struct pci_epf_nvme *epf_nvme = epns->epf_nvme;
+	size_t lba_size = 1UL << epns->lba_shift;
+	struct pci_epf_nvme_comp_stream *strm;
+	struct pci_epf_nvme_comp *comp;
+	unsigned int i;
+
+	comp = kzalloc(sizeof(*comp), GFP_KERNEL);
+	if (!comp)
+		return -ENOMEM;
 
-	/*
-	 * ACS4     [Delete I/O Completion Queue     ] 00000001
-	 * CSUPP+  LBCC-  NCC-  NIC-  CCC-  USS-  No command restriction
-	 */
-	log->acs[4] |= cpu_to_le32(NVME_CMD_EFFECTS_CSUPP);
+	strscpy(comp->algo, epf_nvme->comp_algo, sizeof(comp->algo));
+	comp->cluster_size = epf_nvme->comp_cluster_kb * SZ_1K;
+	if (comp->cluster_size <= lba_size) {
+		kfree(comp);
+		return -EINVAL;
+	}
+	comp->cluster_lbas = comp->cluster_size >> epns->lba_shift;
+	comp->slot_lbas = comp->cluster_lbas + 1;
+	comp->nr_clusters = div_u64(epns->nr_lbas, comp->slot_lbas);
+	comp->nr_lbas = comp->nr_clusters * comp->cluster_lbas;
+	xa_init(&comp->map);
+	for (i = 0; i < ARRAY_SIZE(comp->locks); i++)
+		mutex_init(&comp->locks[i]);
+
+	comp->nr_streams = num_online_cpus();
+	comp->streams = kcalloc(comp->nr_streams, sizeof(*strm), GFP_KERNEL);
+	if (!comp->streams)
+		goto err;
+
+	for (i = 0; i < comp->nr_streams; i++) {
+		strm = &comp->streams[i];
+		mutex_init(&strm->lock);
+		strm->tfm = crypto_alloc_comp(comp->algo, 0, 0);
+		if (IS_ERR(strm->tfm))
+			goto err;
+		strm->slot = pci_epf_nvme_copy_alloc((size_t)comp->slot_lbas <<
+						     epns->lba_shift);
+		strm->data = pci_epf_nvme_copy_alloc(comp->cluster_size);
+		if (!strm->slot || !strm->data)
+			goto err;
+	}
 
-	/*
-	 * ACS5     [Create I/O Completion Queue     ] 00000001
-	 * CSUPP+  LBCC-  NCC-  NIC-  CCC-  USS-  No command restriction
-	 */
-	log->acs[5] |= cpu_to_le32(NVME_CMD_EFFECTS_CSUPP);
+	epns->comp = comp;
+
+	dev_info(&epf_nvme->epf->dev,
+		 "NS %u: %s compression, %zu KB clusters, %llu LBAs exposed\n",
+		 epns->nsid, comp->algo, comp->cluster_size / SZ_1K,
+		 comp->nr_lbas);
+
+	return 0;
+
+err:
+	pci_epf_nvme_comp_free(comp);
+
+	return -ENOMEM;
+}
+
+static int __pci_epf_nvme_ns_rw(struct pci_epf_nvme_ns *epns, u8 opcode,
+				u64 slba, unsigned int nlb, void *buf)
+{
+	if (epns->comp)
+		return pci_epf_nvme_comp_rw(epns, opcode, slba, nlb, buf);
+
+	return pci_epf_nvme_backend_rw(epns, opcode, slba, nlb, buf);
+}
+
+static inline spinlock_t *
+pci_epf_nvme_cache_lock(struct pci_epf_nvme_cache *cache, unsigned long idx)
+{
+	return &cache->locks[hash_long(idx, PCI_EPF_NVME_CACHE_LOCK_BITS)];
 }
 
 /*
- * Returns true if the command has been handled
+ * Copy cached LBAs. Returns false if some of the LBAs are not cached.
  */
-static bool pci_epf_nvme_process_set_features(struct pci_epf_nvme_cmd *epcmd)
+static bool pci_epf_nvme_cache_read(struct pci_epf_nvme_ns *epns, u64 slba,
+				    unsigned int nlb, void *buf)
 {
-	struct pci_epf_nvme *epf_nvme = epcmd->epf_nvme;
-	struct pci_epf_nvme_ctrl *ctrl = &epf_nvme->ctrl;
-	u32 cdw10 = le32_to_cpu(epcmd->cmd.common.cdw10);
-	u32 cdw11 = le32_to_cpu(epcmd->cmd.common.cdw11);
-	u8 feat = cdw10 & 0xff;
-	u16 nr_ioq, nsqr, ncqr;
-	int qid;
-
-	switch (feat) {
-	case NVME_FEAT_NUM_QUEUES:
-		ncqr = (cdw11 >> 16) & 0xffff;
-		nsqr = cdw11 & 0xffff;
-		if (ncqr == 0xffff || nsqr == 0xffff) {
-			epcmd->status = NVME_SC_INVALID_FIELD | NVME_STATUS_DNR;
-			return true;
+	struct pci_epf_nvme_cache *cache = epns->cache;
+	unsigned int shift = cache->line_lbas_shift;
+	u64 lba = slba, end = slba + nlb, line, next;
+	unsigned long idx;
+	spinlock_t *lock;
+	size_t ofst, n;
+
+	while (lba < end) {
+		line = lba >> shift;
+		idx = line & (cache->nr_lines - 1);
+		next = min((line + 1) << shift, end);
+		ofst = (lba - (line << shift)) << epns->lba_shift;
+		n = (next - lba) << epns->lba_shift;
+
+		lock = pci_epf_nvme_cache_lock(cache, idx);
+		spin_lock(lock);
+		if (cache->tags[idx] != line + 1) {
+			spin_unlock(lock);
+			return false;
 		}
-
-		/* We cannot accept this command if we already have IO queues */
-		for (qid = 1; qid < ctrl->nr_queues; qid++) {
-			if (epf_nvme->ctrl.sq[qid].ref ||
-			    epf_nvme->ctrl.cq[qid].ref) {
-				epcmd->status =
-					NVME_SC_CMD_SEQ_ERROR | NVME_STATUS_DNR;
-				return true;
-			}
+		memcpy(buf, cache->data + (idx << cache->line_shift) + ofst, n);
+		if (epns->prefetch &&
+		    test_and_clear_bit(idx, epns->prefetch->lines)) {
+			atomic64_inc(&epns->prefetch->nr_useful);
+			atomic_inc(&epns->prefetch->window_useful);
 		}
+		spin_unlock(lock);
 
-		/*
-		 * Number of I/O queues to report must not include the admin
-		 * queue and is a 0-based value, so it is the total number of
-		 * queues minus two.
-		 */
-		nr_ioq = ctrl->nr_queues - 2;
-		epcmd->cqe.result.u32 = cpu_to_le32(nr_ioq | (nr_ioq << 16));
-		return true;
-	case NVME_FEAT_IRQ_COALESCE:
-	case NVME_FEAT_ARBITRATION:
-		/* We do not need to do anything special here. */
-		epcmd->status = NVME_SC_SUCCESS;
-		return true;
-	default:
-		return false;
+		buf += n;
+		lba = next;
 	}
+
+	return true;
 }
 
 /*
- * Returns true if the command has been handled
+ * Cache the lines entirely covered by LBAs read from the backend, unless
+ * LBAs were written since seq was sampled, before the backend read.
+ * Returns the number of lines cached.
  */
-static bool pci_epf_nvme_process_get_features(struct pci_epf_nvme_cmd *epcmd)
+static unsigned int pci_epf_nvme_cache_fill(struct pci_epf_nvme_ns *epns,
+					    u64 slba, unsigned int nlb,
+					    const void *buf, u64 seq,
+					    bool prefetch)
 {
-	struct pci_epf_nvme *epf_nvme = epcmd->epf_nvme;
-	struct pci_epf_nvme_ctrl *ctrl = &epf_nvme->ctrl;
-	u32 cdw10 = le32_to_cpu(epcmd->cmd.common.cdw10);
-	u8 feat = cdw10 & 0xff;
-	u16 nr_ioq;
+	struct pci_epf_nvme_cache *cache = epns->cache;
+	unsigned int shift = cache->line_lbas_shift;
+	u64 line = round_up(slba, 1ULL << shift) >> shift;
+	u64 end = (slba + nlb) >> shift;
+	unsigned int nr_filled = 0;
+	unsigned long idx;
+	spinlock_t *lock;
+
+	for (; line < end; line++) {
+		idx = line & (cache->nr_lines - 1);
+		lock = pci_epf_nvme_cache_lock(cache, idx);
+
+		spin_lock(lock);
+		if (atomic64_read(&cache->seq) != seq) {
+			spin_unlock(lock);
+			break;
+		}
+		memcpy(cache->data + (idx << cache->line_shift),
+		       buf + (((line << shift) - slba) << epns->lba_shift),
+		       1UL << cache->line_shift);
+		cache->tags[idx] = line + 1;
+		if (epns->prefetch)
+			assign_bit(idx, epns->prefetch->lines, prefetch);
+		spin_unlock(lock);
+
+		atomic64_inc(&cache->nr_fills);
+		nr_filled++;
+	}
 
-	switch (feat) {
-	case NVME_FEAT_NUM_QUEUES:
-		/*
-		 * Number of I/O queues to report must not include the admin
-		 * queue and is a 0-based value, so it is the total number of
-		 * queues minus two.
-		 */
-		nr_ioq = ctrl->nr_queues - 2;
-		epcmd->cqe.result.u32 = cpu_to_le32(nr_ioq | (nr_ioq << 16));
-		return true;
-	case NVME_FEAT_IRQ_COALESCE:
-	case NVME_FEAT_ARBITRATION:
-		/* We do not need to do anything special here. */
-		epcmd->status = NVME_SC_SUCCESS;
-		return true;
-	default:
-		return false;
+	return nr_filled;
+}
+
+static void pci_epf_nvme_cache_clear(struct pci_epf_nvme_cache *cache)
+{
+	unsigned long idx;
+	spinlock_t *lock;
+
+	atomic64_inc(&cache->seq);
+
+	for (idx = 0; idx < cache->nr_lines; idx++) {
+		lock = pci_epf_nvme_cache_lock(cache, idx);
+		spin_lock(lock);
+		cache->tags[idx] = 0;
+		spin_unlock(lock);
 	}
 }
 
-static void pci_epf_nvme_process_admin_cmd(struct pci_epf_nvme_cmd *epcmd)
+static void pci_epf_nvme_cache_invalidate(struct pci_epf_nvme_ns *epns,
+					  u64 slba, unsigned int nlb)
 {
-	struct pci_epf_nvme *epf_nvme = epcmd->epf_nvme;
-	void (*post_exec_hook)(struct pci_epf_nvme_cmd *) = NULL;
-	struct nvme_command *cmd = &epcmd->cmd;
+	struct pci_epf_nvme_cache *cache = epns->cache;
+	unsigned int shift = cache->line_lbas_shift;
+	u64 line = slba >> shift, end = ((slba + nlb - 1) >> shift) + 1;
+	unsigned long idx;
+	spinlock_t *lock;
+
+	/* Large ranges invalidate all lines */
+	if (end - line > cache->nr_lines) {
+		pci_epf_nvme_cache_clear(cache);
+		return;
+	}
 
-	switch (cmd->common.opcode) {
-	case nvme_admin_identify:
-		post_exec_hook = pci_epf_nvme_identify_hook;
-		epcmd->buffer_size = NVME_IDENTIFY_DATA_SIZE;
-		epcmd->dma_dir = DMA_TO_DEVICE;
-		break;
+	atomic64_inc(&cache->seq);
 
-	case nvme_admin_get_log_page:
-		post_exec_hook = pci_epf_nvme_get_log_hook;
-		epcmd->buffer_size = nvme_get_log_page_len(cmd);
-		epcmd->dma_dir = DMA_TO_DEVICE;
-		break;
+	for (; line < end; line++) {
+		idx = line & (cache->nr_lines - 1);
+		lock = pci_epf_nvme_cache_lock(cache, idx);
+		spin_lock(lock);
+		if (cache->tags[idx] == line + 1)
+			cache->tags[idx] = 0;
+		spin_unlock(lock);
+	}
+}
 
-	case nvme_admin_async_event:
-		/*
-		 * Async events are a pain to deal with as they get canceled
-		 * only once we delete the fabrics controller, which happens
-		 * after the epf function is deleted, thus causing access to
-		 * freed memory or leaking of epcmd. So ignore these commands
-		 * for now, which is fine. The host will simply never see any
-		 * event.
-		 */
-		pci_epf_nvme_free_cmd(epcmd);
+/*
+ * Adapt the prefetch threshold to the share of the prefetched lines which
+ * the host read, with the prefetcher lock held.
+ */
+static void pci_epf_nvme_prefetch_adapt(struct pci_epf_nvme_prefetch *pf,
+					unsigned int nr_lines)
+{
+	unsigned int useful;
+
+	pf->window += nr_lines;
+	if (pf->window < PCI_EPF_NVME_PREFETCH_WINDOW)
 		return;
 
-	case nvme_admin_set_features:
-		/*
-		 * Several NVMe features do not apply to the NVMe fabrics
-		 * host controller, so handle them directly here.
-		 */
-		if (pci_epf_nvme_process_set_features(epcmd))
-			goto complete;
-		break;
+	useful = atomic_xchg(&pf->window_useful, 0);
+	if (useful * 4 < pf->window)
+		pf->threshold++;
+	else if (useful * 2 > pf->window && pf->threshold > 2)
+		pf->threshold--;
+	pf->window = 0;
+}
 
-	case nvme_admin_get_features:
-		/*
-		 * Several NVMe features do not apply to the NVMe fabrics
-		 * host controller, so handle them directly here.
-		 */
-		if (pci_epf_nvme_process_get_features(epcmd))
-			goto complete;
+static void pci_epf_nvme_prefetch_work(struct work_struct *work)
+{
+	struct pci_epf_nvme_prefetch *pf =
+		container_of(work, struct pci_epf_nvme_prefetch, work);
+	struct pci_epf_nvme_ns *epns = pf->epns;
+	struct pci_epf_nvme_cache *cache = epns->cache;
+	unsigned int shift = cache->line_lbas_shift;
+	/* Capacity below the cache */
+	u64 nr_lbas = epns->comp ? epns->comp->nr_lbas : epns->nr_lbas;
+	u64 slba = pf->line << shift, seq;
+	unsigned int nlb = pf->nr_lines << shift;
+	unsigned long idx = pf->line & (cache->nr_lines - 1);
+	unsigned int nr_filled = 0;
+	int ret;
 
-	case nvme_admin_abort_cmd:
-		break;
+	/* Skip reads past the end and reads already cached */
+	if (slba >= nr_lbas || READ_ONCE(cache->tags[idx]) == pf->line + 1)
+		goto out;
+	nlb = min_t(u64, nlb, nr_lbas - slba);
+
+	if (epns->overlay)
+		down_read(&epns->overlay->lock);
+	seq = atomic64_read(&cache->seq);
+	ret = __pci_epf_nvme_ns_rw(epns, nvme_cmd_read, slba, nlb, pf->buf);
+	if (!ret)
+		nr_filled = pci_epf_nvme_cache_fill(epns, slba, nlb, pf->buf,
+						    seq, true);
+	if (epns->overlay)
+		up_read(&epns->overlay->lock);
+
+	/* Only account the lines which were actually prefetched */
+	if (!nr_filled)
+		goto out;
+
+	atomic64_add(nr_filled, &pf->nr_prefetched);
+
+	spin_lock(&pf->lock);
+	pci_epf_nvme_prefetch_adapt(pf, nr_filled);
+	spin_unlock(&pf->lock);
+
+out:
+	WRITE_ONCE(pf->busy, false);
+}
 
-	case nvme_admin_create_cq:
-		pci_epf_nvme_process_create_cq(epf_nvme, epcmd);
-		goto complete;
+/*
+ * Learn that the cache lines of a host read follow the previous read, and
+ * prefetch the read which followed the read of the same line before, if
+ * confident enough.
+ */
+static void pci_epf_nvme_prefetch(struct pci_epf_nvme_ns *epns, u64 slba,
+				  unsigned int nlb)
+{
+	struct pci_epf_nvme_prefetch *pf = epns->prefetch;
+	struct pci_epf_nvme_prefetch_entry *e;
+	unsigned int shift = epns->cache->line_lbas_shift;
+	u64 line = slba >> shift;
+	unsigned int nr_lines = ((slba + nlb - 1) >> shift) - line + 1;
+
+	nr_lines = min_t(unsigned int, nr_lines,
+			 PCI_EPF_NVME_PREFETCH_MAX_LINES);
+
+	spin_lock(&pf->lock);
+
+	if (pf->last) {
+		e = &pf->table[hash_64(pf->last, pf->table_bits)];
+		if (e->tag != pf->last) {
+			e->tag = pf->last;
+			e->next = line;
+			e->nr_lines = nr_lines;
+			e->conf = 1;
+		} else if (e->next == line) {
+			e->nr_lines = max_t(u16, e->nr_lines, nr_lines);
+			if (e->conf < PCI_EPF_NVME_PREFETCH_CONF_MAX)
+				e->conf++;
+		} else if (!--e->conf) {
+			e->next = line;
+			e->nr_lines = nr_lines;
+			e->conf = 1;
+		}
+	}
+	pf->last = line + 1;
+
+	/* Try again some time after stopping */
+	if (pf->threshold > PCI_EPF_NVME_PREFETCH_CONF_MAX) {
+		if (++pf->idle_reads >= PCI_EPF_NVME_PREFETCH_RETRY_READS) {
+			pf->threshold = PCI_EPF_NVME_PREFETCH_CONF_MAX;
+			pf->idle_reads = 0;
+			pf->window = 0;
+			atomic_set(&pf->window_useful, 0);
+		}
+		goto unlock;
+	}
 
-	case nvme_admin_create_sq:
-		pci_epf_nvme_process_create_sq(epf_nvme, epcmd);
-		goto complete;
+	e = &pf->table[hash_64(line + 1, pf->table_bits)];
+	if (e->tag == line + 1 && e->conf >= pf->threshold &&
+	    !READ_ONCE(pf->busy)) {
+		WRITE_ONCE(pf->busy, true);
+		pf->line = e->next;
+		pf->nr_lines = e->nr_lines;
+		queue_work(pci_epf_nvme_prefetch_wq, &pf->work);
+	}
 
-	case nvme_admin_delete_cq:
-		pci_epf_nvme_process_delete_cq(epf_nvme, epcmd);
-		goto complete;
+unlock:
+	spin_unlock(&pf->lock);
+}
 
-	case nvme_admin_delete_sq:
-		pci_epf_nvme_process_delete_sq(epf_nvme, epcmd);
-		goto complete;
+static int pci_epf_nvme_cache_rw(struct pci_epf_nvme_ns *epns, u8 opcode,
+				 u64 slba, unsigned int nlb, void *buf)
+{
+	struct pci_epf_nvme_cache *cache = epns->cache;
+	u64 seq;
+	int ret;
 
+	switch (opcode) {
+	case nvme_cmd_read:
+		if (epns->prefetch)
+			pci_epf_nvme_prefetch(epns, slba, nlb);
+		if (pci_epf_nvme_cache_read(epns, slba, nlb, buf)) {
+			atomic64_inc(&cache->nr_hits);
+			return 0;
+		}
+		atomic64_inc(&cache->nr_misses);
+		seq = atomic64_read(&cache->seq);
+		ret = __pci_epf_nvme_ns_rw(epns, opcode, slba, nlb, buf);
+		if (!ret)
+			pci_epf_nvme_cache_fill(epns, slba, nlb, buf, seq,
+						false);
+		return ret;
+	case nvme_cmd_write:
+	case nvme_cmd_write_zeroes:
+		ret = __pci_epf_nvme_ns_rw(epns, opcode, slba, nlb, buf);
+		pci_epf_nvme_cache_invalidate(epns, slba, nlb);
+		return ret;
 	default:
-		dev_err(&epf_nvme->epf->dev,
-			"Unhandled admin command %s (0x%02x)\n",
-			pci_epf_nvme_cmd_name(epcmd), cmd->common.opcode);
-		epcmd->status = NVME_SC_INVALID_OPCODE | NVME_STATUS_DNR;
-		goto complete;
+		return __pci_epf_nvme_ns_rw(epns, opcode, slba, nlb, buf);
 	}
+}
 
-	/* Synchronously execute the command */
-	pci_epf_nvme_exec_cmd(epcmd, post_exec_hook);
+static void pci_epf_nvme_cache_free(struct pci_epf_nvme_cache *cache)
+{
+	if (!cache)
+		return;
 
-complete:
-	pci_epf_nvme_complete_cmd(epcmd);
+	vfree(cache->data);
+	kvfree(cache->tags);
+	kfree(cache);
 }
 
-static inline size_t pci_epf_nvme_rw_data_len(struct pci_epf_nvme_cmd *epcmd)
+static void pci_epf_nvme_prefetch_free(struct pci_epf_nvme_prefetch *pf)
 {
-	return ((u32)le16_to_cpu(epcmd->cmd.rw.length) + 1) <<
-		epcmd->ns->head->lba_shift;
+	if (!pf)
+		return;
+
+	cancel_work_sync(&pf->work);
+	vfree(pf->buf);
+	bitmap_free(pf->lines);
+	kvfree(pf->table);
+	kfree(pf);
 }
 
-static void pci_epf_nvme_process_io_cmd(struct pci_epf_nvme_cmd *epcmd,
-					struct pci_epf_nvme_queue *sq)
+static int pci_epf_nvme_prefetch_init(struct pci_epf_nvme_ns *epns,
+				      unsigned int nr_entries)
 {
-	struct pci_epf_nvme *epf_nvme = epcmd->epf_nvme;
+	struct pci_epf_nvme_cache *cache = epns->cache;
+	struct pci_epf_nvme_prefetch *pf;
 
-	/* Get the command target namespace */
-	epcmd->ns = nvme_find_get_ns(epf_nvme->ctrl.ctrl,
-				     le32_to_cpu(epcmd->cmd.common.nsid));
-	if (!epcmd->ns) {
-		epcmd->status = NVME_SC_INVALID_NS | NVME_STATUS_DNR;
-		goto complete;
+	pf = kzalloc(sizeof(*pf), GFP_KERNEL);
+	if (!pf)
+		return -ENOMEM;
+
+	pf->epns = epns;
+	spin_lock_init(&pf->lock);
+	INIT_WORK(&pf->work, pci_epf_nvme_prefetch_work);
+	pf->threshold = 2;
+	pf->table_bits = ilog2(clamp(nr_entries, 16U,
+				     PCI_EPF_NVME_PREFETCH_MAX_ENTRIES));
+	pf->table = kvcalloc(1UL << pf->table_bits, sizeof(*pf->table),
+			     GFP_KERNEL);
+	pf->lines = bitmap_zalloc(cache->nr_lines, GFP_KERNEL);
+	pf->buf = vmalloc(PCI_EPF_NVME_PREFETCH_MAX_LINES << cache->line_shift);
+	if (!pf->table || !pf->lines || !pf->buf) {
+		pci_epf_nvme_prefetch_free(pf);
+		return -ENOMEM;
 	}
 
-	switch (epcmd->cmd.common.opcode) {
-	case nvme_cmd_read:
-		epcmd->buffer_size = pci_epf_nvme_rw_data_len(epcmd);
-		epcmd->dma_dir = DMA_TO_DEVICE;
-		break;
+	epns->prefetch = pf;
 
-	case nvme_cmd_write:
-		epcmd->buffer_size = pci_epf_nvme_rw_data_len(epcmd);
-		epcmd->dma_dir = DMA_FROM_DEVICE;
-		break;
+	return 0;
+}
 
-	case nvme_cmd_dsm:
-		epcmd->buffer_size = (le32_to_cpu(epcmd->cmd.dsm.nr) + 1) *
-			sizeof(struct nvme_dsm_range);
-		epcmd->dma_dir = DMA_FROM_DEVICE;
-		goto complete;
+static int pci_epf_nvme_cache_init(struct pci_epf_nvme_ns *epns,
+				   unsigned int cache_mb)
+{
+	struct pci_epf_nvme_cache *cache;
+	unsigned int i;
 
-	case nvme_cmd_flush:
-	case nvme_cmd_write_zeroes:
-		break;
+	cache = kzalloc(sizeof(*cache), GFP_KERNEL);
+	if (!cache)
+		return -ENOMEM;
 
-	default:
-		dev_err(&epf_nvme->epf->dev,
-			"Unhandled IO command %s (0x%02x)\n",
-			pci_epf_nvme_cmd_name(epcmd),
-			epcmd->cmd.common.opcode);
-		epcmd->status = NVME_SC_INVALID_OPCODE | NVME_STATUS_DNR;
-		goto complete;
+	cache->line_shift = max_t(unsigned int, epns->lba_shift,
+				  PCI_EPF_NVME_CACHE_LINE_SHIFT);
+	cache->line_lbas_shift = cache->line_shift - epns->lba_shift;
+	cache->nr_lines = rounddown_pow_of_two(((size_t)cache_mb << 20) >>
+					       cache->line_shift);
+	cache->tags = kvcalloc(cache->nr_lines, sizeof(u64), GFP_KERNEL);
+	cache->data = vmalloc(cache->nr_lines << cache->line_shift);
+	if (!cache->tags || !cache->data) {
+		pci_epf_nvme_cache_free(cache);
+		return -ENOMEM;
 	}
+	for (i = 0; i < ARRAY_SIZE(cache->locks); i++)
+		spin_lock_init(&cache->locks[i]);
 
-	queue_work(sq->cmd_wq, &epcmd->work);
+	epns->cache = cache;
 
-	return;
+	dev_info(&epns->epf_nvme->epf->dev,
+		 "NS %u: %lu cache lines of %u B\n",
+		 epns->nsid, cache->nr_lines, 1U << cache->line_shift);
 
-complete:
-	pci_epf_nvme_complete_cmd(epcmd);
+	return 0;
 }
 
-static bool pci_epf_nvme_fetch_cmd(struct pci_epf_nvme *epf_nvme,
-				   struct pci_epf_nvme_queue *sq)
+/*
+ * Read or write LBAs of a namespace, as seen by the host.
+ */
+static int pci_epf_nvme_ns_rw(struct pci_epf_nvme_ns *epns, u8 opcode,
+			      u64 slba, unsigned int nlb, void *buf)
 {
-	struct pci_epf_nvme_ctrl *ctrl = &epf_nvme->ctrl;
-	struct pci_epf_nvme_cmd *epcmd;
 	int ret;
 
-	if (!(sq->qflags & PCI_EPF_NVME_QUEUE_LIVE))
-		return false;
+	if (!epns->overlay) {
+		if (epns->cache)
+			return pci_epf_nvme_cache_rw(epns, opcode, slba, nlb,
+						     buf);
+		return __pci_epf_nvme_ns_rw(epns, opcode, slba, nlb, buf);
+	}
 
-	sq->tail = pci_epf_nvme_reg_read32(ctrl, sq->db);
-	if (sq->head == sq->tail)
-		return false;
+	/* Keep the cache and compression map in sync with the overlay */
+	down_read(&epns->overlay->lock);
+	if (epns->cache)
+		ret = pci_epf_nvme_cache_rw(epns, opcode, slba, nlb, buf);
+	else
+		ret = __pci_epf_nvme_ns_rw(epns, opcode, slba, nlb, buf);
+	up_read(&epns->overlay->lock);
 
-	ret = pci_epf_nvme_map_queue(epf_nvme, sq);
-	if (ret)
-		return false;
+	return ret;
+}
 
-	while (sq->head != sq->tail) {
-		epcmd = pci_epf_nvme_alloc_cmd(epf_nvme);
-		if (!epcmd)
-			break;
+/*
+ * Drop all LBAs written to the overlay of a namespace, which then reads as
+ * its backend again.
+ */
+static void pci_epf_nvme_overlay_discard(struct pci_epf_nvme_ns *epns)
+{
+	struct pci_epf_nvme_overlay *ov = epns->overlay;
+	unsigned long idx;
+	void *entry;
 
-		/* Get the NVMe command submitted by the host */
-		pci_epf_nvme_init_cmd(epf_nvme, epcmd, sq->qid, sq->cqid);
-		memcpy_fromio(&epcmd->cmd,
-			      sq->pci_map.virt_addr + sq->head * sq->qes,
-			      sizeof(struct nvme_command));
+	down_write(&ov->lock);
 
-		dev_dbg(&epf_nvme->epf->dev,
-			"sq[%d]: head %d/%d, tail %d, command %s\n",
-			sq->qid, (int)sq->head, (int)sq->depth,
-			(int)sq->tail, pci_epf_nvme_cmd_name(epcmd));
+	xa_for_each(&ov->blocks, idx, entry) {
+		if (!xa_is_value(entry))
+			free_page((unsigned long)entry);
+	}
+	xa_destroy(&ov->blocks);
+	atomic_long_set(&ov->nr_pages, 0);
+	atomic_long_set(&ov->nr_slots, 0);
 
-		sq->head++;
-		if (sq->head == sq->depth)
-			sq->head = 0;
+	/* Cluster sizes are read again from the backend */
+	if (epns->comp)
+		xa_destroy(&epns->comp->map);
+	if (epns->cache)
+		pci_epf_nvme_cache_clear(epns->cache);
 
-		list_add_tail(&epcmd->link, &sq->list);
-	}
+	up_write(&ov->lock);
 
-	pci_epf_nvme_unmap_queue(epf_nvme, sq);
+	dev_info(&epns->epf_nvme->epf->dev, "NS %u: overlay discarded\n",
+		 epns->nsid);
+}
 
-	return !list_empty(&sq->list);
+/*
+ * Capacity of a namespace, as seen by the host.
+ */
+static u64 pci_epf_nvme_ns_nr_lbas(struct pci_epf_nvme_ns *epns)
+{
+	if (epns->pi)
+		return epns->pi->nr_lbas;
+	if (epns->comp)
+		return epns->comp->nr_lbas;
+	return epns->nr_lbas;
 }
 
-static void pci_epf_nvme_sq_work(struct work_struct *work)
+static void pci_epf_nvme_pi_get(struct pci_epf_nvme_pi *pi, const void *p,
+				struct pci_epf_nvme_pi_tuple *t)
 {
-	struct pci_epf_nvme_queue *sq =
-		container_of(work, struct pci_epf_nvme_queue, work.work);
-	struct pci_epf_nvme *epf_nvme = sq->epf_nvme;
-	struct pci_epf_nvme_cmd *epcmd;
-	unsigned long poll_interval = 1;
-	unsigned long j = jiffies;
+	if (pi->guard == NVME_NVM_NS_64B_GUARD) {
+		const struct crc64_pi_tuple *pt = p;
 
-	while (pci_epf_nvme_ctrl_ready(epf_nvme) &&
-	       (sq->qflags & PCI_EPF_NVME_QUEUE_LIVE)) {
-		/*
-		 * Try to get commands from the host. If We do not yet have any
-		 * command, aggressively keep polling the SQ of IO queues for at
-		 * most one tick and fall back to rescheduling the SQ work if we
-		 * have not received any command after that. This hybrid
-		 * spin-polling method significantly increases the IOPS for
-		 * shallow queue depth operation (e.g. QD=1).
-		 */
-		if (!pci_epf_nvme_fetch_cmd(epf_nvme, sq)) {
-			if (!sq->qid || jiffies > j + 1)
-				break;
-			usleep_range(1, 2);
-			continue;
-		}
+		t->guard = be64_to_cpu(pt->guard_tag);
+		t->app_tag = be16_to_cpu(pt->app_tag);
+		t->ref_tag = get_unaligned_be48(pt->ref_tag);
+	} else {
+		const struct t10_pi_tuple *pt = p;
 
-		while (!list_empty(&sq->list)) {
-			epcmd = list_first_entry(&sq->list,
-						 struct pci_epf_nvme_cmd, link);
-			list_del_init(&epcmd->link);
-			if (sq->qid)
-				pci_epf_nvme_process_io_cmd(epcmd, sq);
-			else
-				pci_epf_nvme_process_admin_cmd(epcmd);
-		}
+		t->guard = be16_to_cpu(pt->guard_tag);
+		t->app_tag = be16_to_cpu(pt->app_tag);
+		t->ref_tag = be32_to_cpu(pt->ref_tag);
 	}
-
-	if (!pci_epf_nvme_ctrl_ready(epf_nvme))
-		return;
-
-	/* No need to aggressively poll the admin queue. */
-	if (!sq->qid)
-		poll_interval = msecs_to_jiffies(5);
-	queue_delayed_work(epf_nvme->ctrl.wq, &sq->work, poll_interval);
 }
 
-static void pci_epf_nvme_cq_work(struct work_struct *work)
+static void pci_epf_nvme_pi_set(struct pci_epf_nvme_pi *pi, void *p,
+				const struct pci_epf_nvme_pi_tuple *t)
 {
-	struct pci_epf_nvme_queue *cq =
-		container_of(work, struct pci_epf_nvme_queue, work.work);
-	struct pci_epf_nvme *epf_nvme = cq->epf_nvme;
-	struct pci_epf_nvme_cmd *epcmd;
-	unsigned long flags;
-	LIST_HEAD(list);
-	int ret;
+	if (pi->guard == NVME_NVM_NS_64B_GUARD) {
+		struct crc64_pi_tuple *pt = p;
 
-	spin_lock_irqsave(&cq->lock, flags);
+		pt->guard_tag = cpu_to_be64(t->guard);
+		pt->app_tag = cpu_to_be16(t->app_tag);
+		put_unaligned_be48(t->ref_tag, pt->ref_tag);
+	} else {
+		struct t10_pi_tuple *pt = p;
 
-	while (!list_empty(&cq->list)) {
+		pt->guard_tag = cpu_to_be16(t->guard);
+		pt->app_tag = cpu_to_be16(t->app_tag);
+		pt->ref_tag = cpu_to_be32(t->ref_tag);
+	}
+}
 
-		list_splice_tail_init(&cq->list, &list);
-		spin_unlock_irqrestore(&cq->lock, flags);
+/*
+ * Compute the guard of an LBA data. Both CRCs use the accelerated (PMULL)
+ * implementations of the kernel crc libraries when available.
+ */
+static inline u64 pci_epf_nvme_pi_guard(struct pci_epf_nvme_pi *pi,
+					const void *data, size_t len)
+{
+	if (pi->guard == NVME_NVM_NS_64B_GUARD)
+		return crc64_rocksoft(data, len);
+	return crc_t10dif(data, len);
+}
 
-		ret = pci_epf_nvme_map_queue(epf_nvme, cq);
-		if (ret) {
-			queue_delayed_work(epf_nvme->ctrl.wq, &cq->work, 1);
-			return;
-		}
+static inline u64 pci_epf_nvme_pi_ref_mask(struct pci_epf_nvme_pi *pi)
+{
+	if (pi->guard == NVME_NVM_NS_64B_GUARD)
+		return GENMASK_ULL(47, 0);
+	return U32_MAX;
+}
 
-		while (!list_empty(&list)) {
-			epcmd = list_first_entry(&list,
-						 struct pci_epf_nvme_cmd, link);
-			list_del_init(&epcmd->link);
-			if (!pci_epf_nvme_queue_response(epcmd))
-				break;
-		}
+/*
+ * Check the PI of an LBA. Returns 0 or an NVMe status.
+ */
+static int pci_epf_nvme_pi_check(struct pci_epf_nvme_pi *pi,
+				 struct nvme_rw_command *rw,
+				 const void *data, size_t len, const void *p,
+				 u64 ref_tag)
+{
+	u16 control = le16_to_cpu(rw->control);
+	u16 lbatm = le16_to_cpu(rw->lbatm);
+	u16 lbat = le16_to_cpu(rw->lbat);
+	u64 ref_mask = pci_epf_nvme_pi_ref_mask(pi);
+	struct pci_epf_nvme_pi_tuple t;
+
+	/* Unwritten LBAs have no PI */
+	if (!memchr_inv(p, 0, pi->ms))
+		return 0;
 
-		pci_epf_nvme_unmap_queue(epf_nvme, cq);
+	pci_epf_nvme_pi_get(pi, p, &t);
 
-		if (pci_epf_nvme_ctrl_ready(cq->epf_nvme))
-			pci_epf_nvme_raise_irq(cq->epf_nvme, cq);
+	/* Escape values disabling checks */
+	if (t.app_tag == 0xffff &&
+	    (pi->type != NVME_NS_DPS_PI_TYPE3 || t.ref_tag == ref_mask))
+		return 0;
 
-		spin_lock_irqsave(&cq->lock, flags);
-	}
+	if ((control & NVME_RW_PRINFO_PRCHK_GUARD) &&
+	    t.guard != pci_epf_nvme_pi_guard(pi, data, len))
+		return NVME_SC_GUARD_CHECK | NVME_STATUS_DNR;
 
-	/*
-	 * Completions on the host may trigger issuing of new commands. Try to
-	 * get these early to improve IOPS and reduce latency.
-	 */
-	if (cq->qid)
-		queue_delayed_work(epf_nvme->ctrl.wq, &cq->sq->work, 0);
+	if ((control & NVME_RW_PRINFO_PRCHK_APP) &&
+	    (t.app_tag & lbatm) != (lbat & lbatm))
+		return NVME_SC_APPTAG_CHECK | NVME_STATUS_DNR;
 
-	spin_unlock_irqrestore(&cq->lock, flags);
+	if ((control & NVME_RW_PRINFO_PRCHK_REF) &&
+	    pi->type != NVME_NS_DPS_PI_TYPE3 &&
+	    t.ref_tag != (ref_tag & ref_mask))
+		return NVME_SC_REFTAG_CHECK | NVME_STATUS_DNR;
+
+	return 0;
 }
 
-static void pci_epf_nvme_reg_poll(struct work_struct *work)
+static void pci_epf_nvme_pi_generate(struct pci_epf_nvme_pi *pi,
+				     struct nvme_rw_command *rw,
+				     const void *data, size_t len, void *p,
+				     u64 ref_tag)
 {
-	struct pci_epf_nvme *epf_nvme =
-		container_of(work, struct pci_epf_nvme, reg_poll.work);
-	struct pci_epf_nvme_ctrl *ctrl = &epf_nvme->ctrl;
-	u32 old_cc;
+	struct pci_epf_nvme_pi_tuple t = {
+		.app_tag = le16_to_cpu(rw->lbat),
+		.ref_tag = ref_tag & pci_epf_nvme_pi_ref_mask(pi),
+	};
 
-	/* Set the controller register bar */
-	ctrl->reg = epf_nvme->reg_bar;
-	if (!ctrl->reg) {
-		dev_err(&epf_nvme->epf->dev, "No register BAR set\n");
-		goto again;
+	t.guard = pci_epf_nvme_pi_guard(pi, data, len);
+	pci_epf_nvme_pi_set(pi, p, &t);
+}
+
+/*
+ * Read or write the metadata of LBAs from the metadata region.
+ */
+static int pci_epf_nvme_pi_meta_rw(struct pci_epf_nvme_ns *epns, u8 opcode,
+				   u64 slba, unsigned int nlb, void *meta)
+{
+	struct pci_epf_nvme_pi *pi = epns->pi;
+	unsigned int lba_shift = epns->lba_shift;
+	u64 start = slba * pi->ms;
+	u64 end = (slba + nlb) * pi->ms;
+	u64 mlba = start >> lba_shift;
+	unsigned int mnlb = ((end - 1) >> lba_shift) - mlba + 1;
+	size_t ofst = start & ((1ULL << lba_shift) - 1);
+	size_t len = end - start;
+	bool partial;
+	void *buf;
+	int ret;
+
+	buf = kvmalloc((size_t)mnlb << lba_shift, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	if (opcode == nvme_cmd_read) {
+		ret = pci_epf_nvme_ns_rw(epns, nvme_cmd_read,
+					 pi->meta_slba + mlba, mnlb, buf);
+		if (!ret)
+			memcpy(meta, buf + ofst, len);
+		goto out;
 	}
 
-	/* Check CC.EN to determine what we need to do */
-	old_cc = ctrl->cc;
-	ctrl->cc = pci_epf_nvme_reg_read32(ctrl, NVME_REG_CC);
+	partial = ofst || (end & ((1ULL << lba_shift) - 1));
 
-	/* If not enabled yet, wait */
-	if (!(old_cc & NVME_CC_ENABLE) && !(ctrl->cc & NVME_CC_ENABLE))
-		goto again;
+	mutex_lock(&pi->meta_lock);
 
-	/* If CC.EN was set by the host, enable the controller */
-	if (!(old_cc & NVME_CC_ENABLE) && (ctrl->cc & NVME_CC_ENABLE)) {
-		pci_epf_nvme_enable_ctrl(epf_nvme);
-		goto again;
+	if (partial) {
+		ret = pci_epf_nvme_ns_rw(epns, nvme_cmd_read,
+					 pi->meta_slba + mlba, mnlb, buf);
+		if (ret)
+			goto unlock;
 	}
 
-	/* If CC.EN was cleared by the host, disable the controller */
-	if (((old_cc & NVME_CC_ENABLE) && !(ctrl->cc & NVME_CC_ENABLE)) ||
-	    ctrl->cc & NVME_CC_SHN_NORMAL)
-		pci_epf_nvme_disable_ctrl(epf_nvme);
+	if (meta)
+		memcpy(buf + ofst, meta, len);
+	else
+		memset(buf + ofst, 0, len);
 
-again:
-	schedule_delayed_work(&epf_nvme->reg_poll, msecs_to_jiffies(5));
+	ret = pci_epf_nvme_ns_rw(epns, nvme_cmd_write, pi->meta_slba + mlba,
+				 mnlb, buf);
+
+unlock:
+	mutex_unlock(&pi->meta_lock);
+out:
+	kvfree(buf);
+
+	return ret;
 }
 
-static int pci_epf_nvme_configure_bar(struct pci_epf *epf)
+/*
+ * Execute a read, write or write zeroes command on a namespace with PI.
+ * With PRACT set and the metadata holding only PI, the PI is generated on
+ * writes and stripped on reads, so it is never transferred with the host.
+ */
+static int pci_epf_nvme_pi_rw(struct pci_epf_nvme_cmd *epcmd)
 {
-	struct pci_epf_nvme *epf_nvme = epf_get_drvdata(epf);
-	const struct pci_epc_features *features = epf_nvme->epc_features;
-	size_t reg_size, reg_bar_size;
-	size_t msix_table_size = 0;
+	struct pci_epf_nvme_ns *epns = epcmd->epns;
+	struct pci_epf_nvme_pi *pi = epns->pi;
+	struct nvme_rw_command *rw = &epcmd->cmd.rw;
+	bool pract = le16_to_cpu(rw->control) & NVME_RW_PRINFO_PRACT;
+	size_t lba_size = 1UL << epns->lba_shift;
+	size_t ext_size = lba_size + pi->ms;
+	u64 slba = le64_to_cpu(rw->slba);
+	unsigned int nlb = (u32)le16_to_cpu(rw->length) + 1;
+	void *buf = epcmd->buffer;
+	void *meta = epcmd->meta;
+	u64 ref_tag;
+	unsigned int i;
+	int ret = 0;
 
-	/*
-	 * The first free BAR will be our register BAR and per NVMe
-	 * specifications, it must be BAR 0.
-	 */
-	if (pci_epc_get_first_free_bar(features) != BAR_0) {
-		dev_err(&epf->dev, "BAR 0 is not free\n");
-		return -EINVAL;
+	if (slba + nlb > pi->nr_lbas)
+		return NVME_SC_LBA_RANGE | NVME_STATUS_DNR;
+
+	/* Initial logical block reference tag, 48 bits for 64b guards */
+	ref_tag = le32_to_cpu(rw->reftag);
+	if (pi->guard == NVME_NVM_NS_64B_GUARD)
+		ref_tag |= (u64)(le32_to_cpu(rw->cdw3) & 0xffff) << 32;
+
+	if (!meta) {
+		meta = kvmalloc((size_t)nlb * pi->ms, GFP_KERNEL);
+		if (!meta)
+			return -ENOMEM;
 	}
 
-	/* Initialize BAR flags */
-	if (features->bar[BAR_0].only_64bit)
-		epf->bar[BAR_0].flags |= PCI_BASE_ADDRESS_MEM_TYPE_64;
+	switch (rw->opcode) {
+	case nvme_cmd_write_zeroes:
+		ret = pci_epf_nvme_ns_rw(epns, nvme_cmd_write_zeroes, slba, nlb,
+					 NULL);
+		if (ret)
+			break;
+		if (!pract) {
+			ret = pci_epf_nvme_pi_meta_rw(epns, nvme_cmd_write,
+						      slba, nlb, NULL);
+			break;
+		}
+		buf = kzalloc(lba_size, GFP_KERNEL);
+		if (!buf) {
+			ret = -ENOMEM;
+			break;
+		}
+		for (i = 0; i < nlb; i++)
+			pci_epf_nvme_pi_generate(pi, rw, buf, lba_size,
+						 meta + i * pi->ms, ref_tag + i);
+		kfree(buf);
+		ret = pci_epf_nvme_pi_meta_rw(epns, nvme_cmd_write, slba, nlb,
+					      meta);
+		break;
 
-	/*
-	 * Calculate the size of the register bar: NVMe registers first with
-	 * enough space for the doorbells, followed by the MSI-X table
-	 * if supported.
-	 */
-	reg_size = NVME_REG_DBS + (PCI_EPF_NVME_MAX_NR_QUEUES * 2 * sizeof(u32));
-	reg_size = ALIGN(reg_size, 8);
+	case nvme_cmd_write:
+		for (i = 0; i < nlb; i++) {
+			if (pract) {
+				pci_epf_nvme_pi_generate(pi, rw,
+						buf + i * lba_size, lba_size,
+						meta + i * pi->ms, ref_tag + i);
+				continue;
+			}
 
-	if (features->msix_capable) {
-		size_t pba_size;
+			/* Move the PI of extended LBAs out of the data */
+			if (pi->extended) {
+				memcpy(meta + i * pi->ms,
+				       buf + i * ext_size + lba_size, pi->ms);
+				memmove(buf + i * lba_size, buf + i * ext_size,
+					lba_size);
+			}
 
-		msix_table_size = PCI_MSIX_ENTRY_SIZE * epf->msix_interrupts;
-		epf_nvme->msix_table_offset = reg_size;
-		pba_size = ALIGN(DIV_ROUND_UP(epf->msix_interrupts, 8), 8);
+			ret = pci_epf_nvme_pi_check(pi, rw, buf + i * lba_size,
+						    lba_size, meta + i * pi->ms,
+						    ref_tag + i);
+			if (ret)
+				goto out;
+		}
 
-		reg_size += msix_table_size + pba_size;
+		ret = pci_epf_nvme_ns_rw(epns, nvme_cmd_write, slba, nlb, buf);
+		if (ret)
+			break;
+		ret = pci_epf_nvme_pi_meta_rw(epns, nvme_cmd_write, slba, nlb,
+					      meta);
+		break;
+
+	case nvme_cmd_read:
+		ret = pci_epf_nvme_ns_rw(epns, nvme_cmd_read, slba, nlb, buf);
+		if (ret)
+			break;
+		ret = pci_epf_nvme_pi_meta_rw(epns, nvme_cmd_read, slba, nlb,
+					      meta);
+		if (ret)
+			break;
+
+		for (i = 0; i < nlb; i++) {
+			ret = pci_epf_nvme_pi_check(pi, rw, buf + i * lba_size,
+						    lba_size, meta + i * pi->ms,
+						    ref_tag + i);
+			if (ret)
+				goto out;
+		}
+
+		/* Interleave the PI with the data of extended LBAs */
+		if (pi->extended && !pract) {
+			for (i = nlb; i > 0; i--) {
+				memmove(buf + (i - 1) * ext_size,
+					buf + (i - 1) * lba_size, lba_size);
+				memcpy(buf + (i - 1) * ext_size + lba_size,
+				       meta + (i - 1) * pi->ms, pi->ms);
+			}
+		}
+		break;
+
+	default:
+		ret = NVME_SC_INVALID_OPCODE | NVME_STATUS_DNR;
+		break;
 	}
 
-	reg_bar_size = ALIGN(reg_size, 4096);
+out:
+	if (meta != epcmd->meta)
+		kvfree(meta);
 
-	if (features->bar[BAR_0].type == BAR_FIXED) {
-		if (reg_bar_size > features->bar[BAR_0].fixed_size) {
-			dev_err(&epf->dev,
-				"Reg BAR 0 size %llu B too small, need %zu B\n",
-				features->bar[BAR_0].fixed_size,
-				reg_bar_size);
-			return -ENOMEM;
+	return ret;
+}
+
+static int pci_epf_nvme_pi_init(struct pci_epf_nvme_ns *epns)
+{
+	struct pci_epf_nvme *epf_nvme = epns->epf_nvme;
+	struct pci_epf_nvme_pi *pi;
+	u64 nr_lbas = epns->comp ? epns->comp->nr_lbas : epns->nr_lbas;
+	unsigned int pi_per_lba;
+
+	pi = kzalloc(sizeof(*pi), GFP_KERNEL);
+	if (!pi)
+		return -ENOMEM;
+
+	pi->type = epf_nvme->pi_type;
+	pi->guard = epf_nvme->pi_guard;
+	pi->extended = epf_nvme->pi_extended;
+	if (pi->guard == NVME_NVM_NS_64B_GUARD)
+		pi->ms = sizeof(struct crc64_pi_tuple);
+	else
+		pi->ms = sizeof(struct t10_pi_tuple);
+	mutex_init(&pi->meta_lock);
+
+	/* Split the LBAs between host LBAs and their metadata */
+	pi_per_lba = (1U << epns->lba_shift) / pi->ms;
+	pi->nr_lbas = div_u64(nr_lbas * pi_per_lba, pi_per_lba + 1);
+	pi->meta_slba = pi->nr_lbas;
+
+	epns->pi = pi;
+
+	dev_info(&epf_nvme->epf->dev,
+		 "NS %u: PI type %u, %s guard, %s metadata, %llu LBAs exposed\n",
+		 epns->nsid, pi->type,
+		 pi->guard == NVME_NVM_NS_64B_GUARD ? "64b" : "16b",
+		 pi->extended ? "extended" : "separate", pi->nr_lbas);
+
+	return 0;
+}
+
+/*
+ * Flush a namespace. Host flushes received while a backend flush is
+ * running are grouped into the next backend flush, which is issued by the
+ * first of them after an optional window to gather more flushes. Writes
+ * are completed to the host only once executed by the backend, so a
+ * backend flush started after a host flush is received covers all writes
+ * completed before the host flush.
+ */
+static int pci_epf_nvme_flush_ns(struct pci_epf_nvme_ns *epns)
+{
+	struct pci_epf_nvme_flush *fl = &epns->flush;
+	unsigned int window_us;
+	u64 target, gen;
+	int ret;
+
+	atomic64_inc(&fl->nr_host_flushes);
+
+	spin_lock_irq(&fl->lock);
+
+	target = fl->started + 1;
+	while (fl->completed < target) {
+		if (fl->running) {
+			wait_event_lock_irq(fl->wait,
+					    fl->completed >= target ||
+					    !fl->running, fl->lock);
+			continue;
 		}
-		reg_bar_size = features->bar[BAR_0].fixed_size;
+
+		fl->running = true;
+		gen = ++fl->started;
+		spin_unlock_irq(&fl->lock);
+
+		window_us = READ_ONCE(epns->epf_nvme->flush_window_us);
+		if (window_us)
+			usleep_range(window_us, window_us + 10);
+
+		ret = pci_epf_nvme_backend_rw(epns, nvme_cmd_flush, 0, 0, NULL);
+		atomic64_inc(&fl->nr_backend_flushes);
+
+		spin_lock_irq(&fl->lock);
+		fl->completed = gen;
+		fl->ret = ret;
+		fl->running = false;
+		wake_up_all(&fl->wait);
 	}
 
-	epf_nvme->reg_bar = pci_epf_alloc_space(epf, reg_bar_size, BAR_0,
-						features, PRIMARY_INTERFACE);
-	if (!epf_nvme->reg_bar) {
-		dev_err(&epf->dev, "Allocate register BAR failed\n");
+	ret = fl->ret;
+
+	spin_unlock_irq(&fl->lock);
+
+	return ret;
+}
+
+static int pci_epf_nvme_identify_ns(struct nvme_ctrl *ctrl, u32 nsid,
+				    struct nvme_id_ns *id)
+{
+	struct nvme_command cmd = { };
+
+	cmd.identify.opcode = nvme_admin_identify;
+	cmd.identify.nsid = cpu_to_le32(nsid);
+	cmd.identify.cns = NVME_ID_CNS_NS;
+
+	return __nvme_submit_sync_cmd(ctrl->admin_q, &cmd, NULL,
+				      id, sizeof(*id), NVME_QID_ANY, 0);
+}
+
+static void pci_epf_nvme_mirror_free(struct pci_epf_nvme_mirror *mirror)
+{
+	if (!mirror)
+		return;
+
+	if (mirror->ns)
+		nvme_put_ns(mirror->ns);
+	kfree(mirror);
+}
+
+static int pci_epf_nvme_mirror_init(struct pci_epf_nvme_ns *epns)
+{
+	struct pci_epf_nvme *epf_nvme = epns->epf_nvme;
+	struct pci_epf_nvme_mirror *mirror;
+	struct nvme_id_ns *id;
+	int ret = -ENODEV;
+
+	mirror = kzalloc(sizeof(*mirror), GFP_KERNEL);
+	if (!mirror)
 		return -ENOMEM;
+
+	mirror->ns = nvme_find_get_ns(epf_nvme->mirror_ctrl,
+				      epns->ns->head->ns_id);
+	if (!mirror->ns)
+		goto err;
+
+	/* The mirror must be able to hold all the LBAs */
+	ret = -EINVAL;
+	if (mirror->ns->head->lba_shift != epns->lba_shift)
+		goto err;
+
+	id = kzalloc(sizeof(*id), GFP_KERNEL);
+	if (!id) {
+		ret = -ENOMEM;
+		goto err;
 	}
-	memset(epf_nvme->reg_bar, 0, reg_bar_size);
+	ret = pci_epf_nvme_identify_ns(epf_nvme->mirror_ctrl,
+				       epns->ns->head->ns_id, id);
+	if (!ret && le64_to_cpu(id->nsze) < epns->nr_lbas)
+		ret = -ENOSPC;
+	kfree(id);
+	if (ret)
+		goto err;
+
+	epns->mirror = mirror;
+
+	dev_info(&epf_nvme->epf->dev, "NS %u: mirrored\n", epns->nsid);
 
 	return 0;
+
+err:
+	pci_epf_nvme_mirror_free(mirror);
+
+	return ret;
 }
 
-static void pci_epf_nvme_clear_bar(struct pci_epf *epf)
+static int pci_epf_nvme_crypt_init(struct pci_epf_nvme_ns *epns)
 {
-	struct pci_epf_nvme *epf_nvme = epf_get_drvdata(epf);
+	struct pci_epf_nvme *epf_nvme = epns->epf_nvme;
+	struct crypto_sync_skcipher *tfm;
+	int ret;
 
-	pci_epc_clear_bar(epf->epc, epf->func_no, epf->vfunc_no,
-			  &epf->bar[BAR_0]);
-	pci_epf_free_space(epf, epf_nvme->reg_bar, BAR_0, PRIMARY_INTERFACE);
-	epf_nvme->reg_bar = NULL;
+	tfm = crypto_alloc_sync_skcipher(PCI_EPF_NVME_CRYPT_ALGO, 0, 0);
+	if (IS_ERR(tfm))
+		return PTR_ERR(tfm);
+
+	ret = crypto_sync_skcipher_setkey(tfm, epf_nvme->crypt_key,
+					  epf_nvme->crypt_key_size);
+	if (ret) {
+		crypto_free_sync_skcipher(tfm);
+		return ret;
+	}
+
+	epns->crypt = tfm;
+
+	dev_info(&epf_nvme->epf->dev, "NS %u: %s encryption, %u-bit key\n",
+		 epns->nsid, PCI_EPF_NVME_CRYPT_ALGO,
+		 epf_nvme->crypt_key_size * 8);
+
+	return 0;
 }
 
-static int pci_epf_nvme_init_irq(struct pci_epf *epf)
+static void pci_epf_nvme_free_ns(struct pci_epf_nvme_ns *epns)
 {
-	struct pci_epf_nvme *epf_nvme = epf_get_drvdata(epf);
+	pci_epf_nvme_prefetch_free(epns->prefetch);
+	kfree(epns->pi);
+	pci_epf_nvme_comp_free(epns->comp);
+	pci_epf_nvme_mirror_free(epns->mirror);
+	pci_epf_nvme_cache_free(epns->cache);
+	pci_epf_nvme_overlay_free(epns->overlay);
+	if (epns->crypt)
+		crypto_free_sync_skcipher(epns->crypt);
+	if (epns->ns)
+		nvme_put_ns(epns->ns);
+	if (epns->file && epns->backend == PCI_EPF_NVME_BACKEND_BDEV)
+		bdev_fput(epns->file);
+	else if (epns->file)
+		fput(epns->file);
+	pci_epf_nvme_ram_free(epns);
+	kfree(epns);
+}
+
+static struct pci_epf_nvme_ns *pci_epf_nvme_new_ns(struct pci_epf_nvme *epf_nvme,
+						   u32 nsid)
+{
+	struct pci_epf_nvme_ns *epns;
+
+	epns = kzalloc(sizeof(*epns), GFP_KERNEL);
+	if (!epns)
+		return NULL;
+
+	epns->epf_nvme = epf_nvme;
+	epns->nsid = nsid;
+	spin_lock_init(&epns->flush.lock);
+	init_waitqueue_head(&epns->flush.wait);
+	spin_lock_init(&epns->perf.lock);
+	spin_lock_init(&epns->qos.lock);
+	xa_init(&epns->ram);
+
+	return epns;
+}
+
+/*
+ * Use the namespace with NSID nsid of the fabrics controller as backend.
+ */
+static int pci_epf_nvme_open_fabrics_ns(struct pci_epf_nvme_ns *epns, u32 nsid)
+{
+	struct pci_epf_nvme *epf_nvme = epns->epf_nvme;
+	struct nvme_id_ns *id;
 	int ret;
 
-	/* Enable MSI-X if supported, otherwise, use MSI */
-	if (epf_nvme->epc_features->msix_capable && epf->msix_interrupts) {
-		ret = pci_epc_set_msix(epf->epc, epf->func_no, epf->vfunc_no,
-				       epf->msix_interrupts, BAR_0,
-				       epf_nvme->msix_table_offset);
-		if (ret) {
-			dev_err(&epf->dev, "MSI-X configuration failed\n");
-			return ret;
-		}
+	epns->ns = nvme_find_get_ns(epf_nvme->ctrl.ctrl, nsid);
+	if (!epns->ns)
+		return -ENODEV;
+	epns->lba_shift = epns->ns->head->lba_shift;
 
-		epf_nvme->nr_vectors = epf->msix_interrupts;
-		epf_nvme->irq_type = PCI_IRQ_MSIX;
+	id = kzalloc(sizeof(*id), GFP_KERNEL);
+	if (!id)
+		return -ENOMEM;
+	ret = pci_epf_nvme_identify_ns(epf_nvme->ctrl.ctrl, nsid, id);
+	epns->nr_lbas = le64_to_cpu(id->nsze);
+	kfree(id);
 
-		return 0;
-	}
+	return ret ? -EIO : 0;
+}
 
-	if (epf_nvme->epc_features->msi_capable && epf->msi_interrupts) {
-		ret = pci_epc_set_msi(epf->epc, epf->func_no, epf->vfunc_no,
-				      epf->msi_interrupts);
-		if (ret) {
-			dev_err(&epf->dev, "MSI configuration failed\n");
-			return ret;
-		}
+static int pci_epf_nvme_open_bdev(struct pci_epf_nvme_ns *epns,
+				  const char *path, bool ro)
+{
+	struct block_device *bdev;
+	struct file *file;
 
-		epf_nvme->nr_vectors = epf->msi_interrupts;
-		epf_nvme->irq_type = PCI_IRQ_MSI;
+	file = bdev_file_open_by_path(path, ro ? BLK_OPEN_READ :
+				      BLK_OPEN_READ | BLK_OPEN_WRITE,
+				      epns, NULL);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
 
+	bdev = file_bdev(file);
+	epns->file = file;
+	epns->lba_shift = ilog2(bdev_logical_block_size(bdev));
+	epns->nr_lbas = bdev_nr_bytes(bdev) >> epns->lba_shift;
+
+	return 0;
+}
+
+/*
+ * Open or create a backend file, extending it to size bytes if it is
+ * smaller. A size of 0 uses the file size, as do read-only files.
+ */
+static int pci_epf_nvme_open_file(struct pci_epf_nvme_ns *epns,
+				  const char *path, u64 size, bool ro)
+{
+	struct file *file;
+	int ret;
+
+	file = filp_open(path, ro ? O_RDONLY | O_LARGEFILE :
+			 O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	epns->file = file;
+
+	if (!size || ro) {
+		size = i_size_read(file_inode(file));
+	} else if (i_size_read(file_inode(file)) < size) {
+		ret = vfs_truncate(&file->f_path, size);
+		if (ret)
+			return ret;
+	}
+
+	epns->nr_lbas = size >> epns->lba_shift;
+
+	return epns->nr_lbas ? 0 : -EINVAL;
+}
+
+/*
+ * Setup the data path of a namespace: mirror, encryption, compression and
+ * protection information.
+ */
+static int pci_epf_nvme_init_ns(struct pci_epf_nvme_ns *epns)
+{
+	struct pci_epf_nvme *epf_nvme = epns->epf_nvme;
+	u32 nsid = epns->nsid;
+	int ret;
+
+	if (epf_nvme->mirror_ctrl && epns->ns) {
+		ret = pci_epf_nvme_mirror_init(epns);
+		if (ret) {
+			dev_err(&epf_nvme->epf->dev,
+				"NS %u: initialize mirror failed %d\n",
+				nsid, ret);
+			return ret;
+		}
+	}
+
+	if (epf_nvme->crypt_key_size) {
+		ret = pci_epf_nvme_crypt_init(epns);
+		if (ret) {
+			dev_err(&epf_nvme->epf->dev,
+				"NS %u: initialize encryption failed %d\n",
+				nsid, ret);
+			return ret;
+		}
+	}
+
+	if (epf_nvme->comp_algo[0]) {
+		ret = pci_epf_nvme_comp_init(epns);
+		if (ret) {
+			dev_err(&epf_nvme->epf->dev,
+				"NS %u: initialize compression failed %d\n",
+				nsid, ret);
+			return ret;
+		}
+	}
+
+	if (epf_nvme->pi_type)
+		return pci_epf_nvme_pi_init(epns);
+
+	return 0;
+}
+
+static struct pci_epf_nvme_ns *pci_epf_nvme_alloc_ns(struct pci_epf_nvme *epf_nvme,
+						     u32 nsid)
+{
+	struct pci_epf_nvme_ns *epns;
+
+	epns = pci_epf_nvme_new_ns(epf_nvme, nsid);
+	if (!epns)
+		return NULL;
+
+	if (pci_epf_nvme_open_fabrics_ns(epns, nsid) ||
+	    pci_epf_nvme_init_ns(epns)) {
+		pci_epf_nvme_free_ns(epns);
+		return NULL;
+	}
+
+	return epns;
+}
+
+/*
+ * Create a namespace defined through configfs.
+ */
+static struct pci_epf_nvme_ns *
+pci_epf_nvme_alloc_local_ns(struct pci_epf_nvme *epf_nvme,
+			    struct pci_epf_nvme_ns_cfg *cfg)
+{
+	/* Backends are only read below an overlay */
+	bool ro = cfg->overlay_mb;
+	struct pci_epf_nvme_ns *epns;
+	int ret;
+
+	epns = pci_epf_nvme_new_ns(epf_nvme, cfg->nsid);
+	if (!epns)
+		return ERR_PTR(-ENOMEM);
+
+	epns->local = true;
+	epns->uuid = cfg->uuid;
+	epns->backend = cfg->backend;
+	epns->lba_shift = cfg->lba_shift;
+	epns->nr_lbas = (cfg->size_mb << 20) >> cfg->lba_shift;
+
+	switch (cfg->backend) {
+	case PCI_EPF_NVME_BACKEND_FABRICS:
+		ret = pci_epf_nvme_open_fabrics_ns(epns,
+					cfg->backend_nsid ?: cfg->nsid);
+		break;
+	case PCI_EPF_NVME_BACKEND_BDEV:
+		ret = cfg->path ? pci_epf_nvme_open_bdev(epns, cfg->path, ro) :
+			-EINVAL;
+		break;
+	case PCI_EPF_NVME_BACKEND_FILE:
+		ret = cfg->path ? pci_epf_nvme_open_file(epns, cfg->path,
+						cfg->size_mb << 20, ro) :
+			-EINVAL;
+		break;
+	case PCI_EPF_NVME_BACKEND_RAM:
+		ret = epns->nr_lbas ?
+			pci_epf_nvme_ram_store_init(&epf_nvme->ram_store) :
+			-EINVAL;
+		break;
+	default:
+		ret = epns->nr_lbas ? 0 : -EINVAL;
+		break;
+	}
+	if (ret)
+		goto free;
+
+	if (cfg->overlay_mb) {
+		ret = epns->lba_shift <= PAGE_SHIFT ?
+			pci_epf_nvme_overlay_init(epns, cfg->overlay_mb,
+						  cfg->overlay_path) : -EINVAL;
+		if (ret)
+			goto free;
+	}
+
+	if (cfg->cache_mb) {
+		ret = pci_epf_nvme_cache_init(epns, cfg->cache_mb);
+		if (ret)
+			goto free;
+	}
+
+	/* Prefetched LBAs go to the cache */
+	if (cfg->prefetch_entries) {
+		ret = epns->cache ?
+			pci_epf_nvme_prefetch_init(epns, cfg->prefetch_entries) :
+			-EINVAL;
+		if (ret)
+			goto free;
+	}
+
+	epns->qos.iops = cfg->qos_iops;
+	epns->qos.mbps = cfg->qos_mbps;
+
+	ret = pci_epf_nvme_init_ns(epns);
+	if (ret)
+		goto free;
+
+	dev_info(&epf_nvme->epf->dev, "NS %u: %s backend, %llu LBAs of %u B\n",
+		 epns->nsid, pci_epf_nvme_backend_name[epns->backend],
+		 epns->nr_lbas, 1U << epns->lba_shift);
+
+	return epns;
+
+free:
+	pci_epf_nvme_free_ns(epns);
+
+	return ERR_PTR(ret);
+}
+
+static int pci_epf_nvme_store_ns(struct pci_epf_nvme *epf_nvme,
+				 struct pci_epf_nvme_ns *epns)
+{
+	int ret;
+
+	ret = xa_err(xa_store(&epf_nvme->ns_xa, epns->nsid, epns, GFP_KERNEL));
+	if (ret)
+		return ret;
+
+	if (epns->nsid < PCI_EPF_NVME_NS_TABLE_SIZE)
+		WRITE_ONCE(epf_nvme->ns_table[epns->nsid], epns);
+
+	return 0;
+}
+
+/*
+ * Get a namespace, creating it on first use.
+ */
+static struct pci_epf_nvme_ns *pci_epf_nvme_get_ns(struct pci_epf_nvme *epf_nvme,
+						   u32 nsid)
+{
+	struct pci_epf_nvme_ns *epns;
+
+	if (nsid < PCI_EPF_NVME_NS_TABLE_SIZE) {
+		epns = READ_ONCE(epf_nvme->ns_table[nsid]);
+		if (epns)
+			return epns;
+	}
+
+	epns = xa_load(&epf_nvme->ns_xa, nsid);
+	if (epns)
+		return epns;
+
+	mutex_lock(&epf_nvme->ns_lock);
+
+	epns = xa_load(&epf_nvme->ns_xa, nsid);
+	if (!epns) {
+		epns = pci_epf_nvme_alloc_ns(epf_nvme, nsid);
+		if (epns && pci_epf_nvme_store_ns(epf_nvme, epns)) {
+			pci_epf_nvme_free_ns(epns);
+			epns = NULL;
+		}
+	}
+
+	mutex_unlock(&epf_nvme->ns_lock);
+
+	return epns;
+}
+
+/*
+ * Get a namespace defined through configfs, NULL for other NSIDs.
+ */
+static struct pci_epf_nvme_ns *
+pci_epf_nvme_get_local_ns(struct pci_epf_nvme *epf_nvme, u32 nsid)
+{
+	struct pci_epf_nvme_ns *epns;
+
+	if (!nsid || nsid > epf_nvme->max_local_nsid)
+		return NULL;
+
+	epns = xa_load(&epf_nvme->ns_xa, nsid);
+	if (!epns || !epns->local)
+		return NULL;
+
+	return epns;
+}
+
+/*
+ * Create the namespaces defined through configfs. Namespaces that cannot be
+ * created are not exposed to the host.
+ */
+static void pci_epf_nvme_create_namespaces(struct pci_epf_nvme *epf_nvme)
+{
+	struct pci_epf_nvme_ns_cfg *cfg;
+	struct pci_epf_nvme_ns *epns;
+	int ret;
+
+	mutex_lock(&epf_nvme->ns_lock);
+
+	list_for_each_entry(cfg, &epf_nvme->ns_cfgs, link) {
+		epns = pci_epf_nvme_alloc_local_ns(epf_nvme, cfg);
+		ret = PTR_ERR_OR_ZERO(epns);
+		if (!ret) {
+			ret = pci_epf_nvme_store_ns(epf_nvme, epns);
+			if (ret)
+				pci_epf_nvme_free_ns(epns);
+		}
+		if (ret) {
+			dev_err(&epf_nvme->epf->dev,
+				"NS %u: create %s namespace failed %d\n",
+				cfg->nsid, pci_epf_nvme_backend_name[cfg->backend],
+				ret);
+			continue;
+		}
+
+		epf_nvme->max_local_nsid = max(epf_nvme->max_local_nsid,
+					       cfg->nsid);
+	}
+
+	mutex_unlock(&epf_nvme->ns_lock);
+}
+
+static void pci_epf_nvme_free_namespaces(struct pci_epf_nvme *epf_nvme)
+{
+	struct pci_epf_nvme_ns *epns;
+	unsigned long nsid;
+
+	mutex_lock(&epf_nvme->ns_lock);
+	memset(epf_nvme->ns_table, 0, sizeof(epf_nvme->ns_table));
+	epf_nvme->max_local_nsid = 0;
+	xa_for_each(&epf_nvme->ns_xa, nsid, epns) {
+		xa_erase(&epf_nvme->ns_xa, nsid);
+		pci_epf_nvme_free_ns(epns);
+	}
+	pci_epf_nvme_ram_store_free(&epf_nvme->ram_store);
+	mutex_unlock(&epf_nvme->ns_lock);
+}
+
+static void pci_epf_nvme_range_chunk_work(struct work_struct *work)
+{
+	struct pci_epf_nvme_range_chunk *chunk =
+		container_of(work, struct pci_epf_nvme_range_chunk, work);
+	struct pci_epf_nvme_range_op *op = chunk->op;
+
+	chunk->ret = pci_epf_nvme_ns_rw(op->epcmd->epns, nvme_cmd_read,
+					chunk->slba,
+					chunk->nlb + chunk->nlb_extra,
+					chunk->buf);
+	if (!chunk->ret)
+		op->process(op, chunk);
+}
+
+/*
+ * Maximum number of LBAs of a range operation chunk.
+ */
+static inline size_t pci_epf_nvme_range_chunk_lbas(struct pci_epf_nvme_ns *epns)
+{
+	if (!epns->ns)
+		return PCI_EPF_NVME_RANGE_CHUNK_SIZE >> epns->lba_shift;
+
+	return min_t(size_t, PCI_EPF_NVME_RANGE_CHUNK_SIZE,
+		     (size_t)queue_max_hw_sectors(epns->ns->queue) << SECTOR_SHIFT)
+		>> epns->lba_shift;
+}
+
+/*
+ * Execute a range operation: read the range from the backend in large chunks,
+ * with one chunk being read and processed per CPU at a time, without going
+ * through the host data path.
+ */
+static int pci_epf_nvme_range_exec(struct pci_epf_nvme_range_op *op)
+{
+	struct pci_epf_nvme_ns *epns = op->epcmd->epns;
+	unsigned int lba_shift = epns->lba_shift;
+	struct pci_epf_nvme_range_chunk *chunks, *chunk;
+	u64 slba = op->slba, end = op->slba + op->nlb;
+	unsigned int i, nr, nr_chunks;
+	size_t chunk_lbas;
+	int ret = 0;
+
+	/* Chunks, including the lookahead LBAs, are read with one command */
+	chunk_lbas = pci_epf_nvme_range_chunk_lbas(epns);
+	if (chunk_lbas <= op->lookahead)
+		return NVME_SC_INVALID_FIELD | NVME_STATUS_DNR;
+	chunk_lbas -= op->lookahead;
+	if (op->align) {
+		chunk_lbas = rounddown(chunk_lbas, op->align);
+		if (!chunk_lbas)
+			return NVME_SC_INVALID_FIELD | NVME_STATUS_DNR;
+	}
+
+	nr_chunks = min_t(u64, num_online_cpus(),
+			  DIV_ROUND_UP_ULL(op->nlb, chunk_lbas));
+	chunks = kcalloc(nr_chunks, sizeof(*chunks), GFP_KERNEL);
+	if (!chunks)
+		return -ENOMEM;
+
+	down(&pci_epf_nvme_range_sem);
+
+	for (i = 0; i < nr_chunks; i++) {
+		chunk = &chunks[i];
+		INIT_WORK(&chunk->work, pci_epf_nvme_range_chunk_work);
+		chunk->op = op;
+		chunk->buf = kvmalloc((chunk_lbas + op->lookahead) << lba_shift,
+				      GFP_KERNEL);
+		if (!chunk->buf) {
+			ret = -ENOMEM;
+			goto free;
+		}
+		if (op->chunk_priv_size) {
+			chunk->priv = kvzalloc(op->chunk_priv_size, GFP_KERNEL);
+			if (!chunk->priv) {
+				ret = -ENOMEM;
+				goto free;
+			}
+		}
+	}
+
+	while (slba < end && !ret) {
+		for (nr = 0; nr < nr_chunks && slba < end; nr++) {
+			chunk = &chunks[nr];
+			chunk->slba = slba;
+			chunk->nlb = min_t(u64, chunk_lbas, end - slba);
+			chunk->nlb_extra = min_t(u64, op->lookahead,
+						 end - slba - chunk->nlb);
+			chunk->ret = 0;
+			queue_work(pci_epf_nvme_range_wq, &chunk->work);
+			slba += chunk->nlb;
+		}
+
+		for (i = 0; i < nr; i++)
+			flush_work(&chunks[i].work);
+
+		for (i = 0; i < nr && !ret; i++) {
+			ret = chunks[i].ret;
+			if (!ret && op->merge)
+				ret = op->merge(op, &chunks[i]);
+		}
+	}
+
+free:
+	up(&pci_epf_nvme_range_sem);
+
+	for (i = 0; i < nr_chunks; i++) {
+		kvfree(chunks[i].buf);
+		kvfree(chunks[i].priv);
+	}
+	kfree(chunks);
+
+	return ret;
+}
+
+struct pci_epf_nvme_scan {
+	const u8		*pattern;
+	unsigned int		plen;
+	unsigned int		max_ofsts;
+	unsigned int		nr_ofsts;
+	u64			nr_matches;
+	struct pci_epf_nvme_scan_result *res;
+};
+
+struct pci_epf_nvme_scan_chunk {
+	u64			nr_matches;
+	unsigned int		nr_ofsts;
+	__le64			ofst[];
+};
+
+static void pci_epf_nvme_scan_process(struct pci_epf_nvme_range_op *op,
+				      struct pci_epf_nvme_range_chunk *chunk)
+{
+	struct pci_epf_nvme_scan *scan = op->priv;
+	struct pci_epf_nvme_scan_chunk *schunk = chunk->priv;
+	unsigned int lba_shift = op->epcmd->epns->lba_shift;
+	size_t len = (size_t)chunk->nlb << lba_shift;
+	size_t end = (size_t)(chunk->nlb + chunk->nlb_extra) << lba_shift;
+	u64 base = (chunk->slba - op->slba) << lba_shift;
+	const u8 *buf = chunk->buf, *p;
+	size_t pos = 0;
+
+	schunk->nr_matches = 0;
+	schunk->nr_ofsts = 0;
+
+	/*
+	 * Matches must start within the chunk but may end in the lookahead
+	 * LBAs. Candidates are found with the architecture optimized memchr().
+	 */
+	while (pos < len) {
+		p = memchr(buf + pos, scan->pattern[0], len - pos);
+		if (!p)
+			break;
+
+		pos = p - buf;
+		if (pos + scan->plen <= end &&
+		    !memcmp(p, scan->pattern, scan->plen)) {
+			if (schunk->nr_ofsts < scan->max_ofsts)
+				schunk->ofst[schunk->nr_ofsts++] =
+					cpu_to_le64(base + pos);
+			schunk->nr_matches++;
+		}
+		pos++;
+	}
+}
+
+static int pci_epf_nvme_scan_merge(struct pci_epf_nvme_range_op *op,
+				   struct pci_epf_nvme_range_chunk *chunk)
+{
+	struct pci_epf_nvme_scan *scan = op->priv;
+	struct pci_epf_nvme_scan_chunk *schunk = chunk->priv;
+	unsigned int nr;
+
+	nr = min(schunk->nr_ofsts, scan->max_ofsts - scan->nr_ofsts);
+	memcpy(&scan->res->ofst[scan->nr_ofsts], schunk->ofst,
+	       nr * sizeof(__le64));
+	scan->nr_ofsts += nr;
+	scan->nr_matches += schunk->nr_matches;
+
+	return 0;
+}
+
+static int pci_epf_nvme_exec_scan(struct pci_epf_nvme_cmd *epcmd)
+{
+	struct pci_epf_nvme_scan_cmd *cmd =
+		(struct pci_epf_nvme_scan_cmd *)&epcmd->cmd;
+	struct pci_epf_nvme_scan_result *res = epcmd->buffer;
+	unsigned int lba_size = 1U << epcmd->epns->lba_shift;
+	struct pci_epf_nvme_range_op op = { };
+	struct pci_epf_nvme_scan scan = { };
+	int ret;
+
+	if (!cmd->plen || cmd->plen > sizeof(cmd->pattern) ||
+	    epcmd->buffer_size < sizeof(*res))
+		return NVME_SC_INVALID_FIELD | NVME_STATUS_DNR;
+
+	memset(res, 0, epcmd->buffer_size);
+
+	scan.pattern = cmd->pattern;
+	scan.plen = cmd->plen;
+	scan.max_ofsts = (epcmd->buffer_size - sizeof(*res)) / sizeof(__le64);
+	scan.res = res;
+
+	op.epcmd = epcmd;
+	op.slba = le64_to_cpu(cmd->slba);
+	op.nlb = (u64)le32_to_cpu(cmd->nlb) + 1;
+	op.lookahead = DIV_ROUND_UP(scan.plen - 1, lba_size);
+	op.process = pci_epf_nvme_scan_process;
+	op.merge = pci_epf_nvme_scan_merge;
+	op.chunk_priv_size = struct_size_t(struct pci_epf_nvme_scan_chunk,
+					   ofst, scan.max_ofsts);
+	op.priv = &scan;
+
+	ret = pci_epf_nvme_range_exec(&op);
+	if (ret)
+		return ret;
+
+	res->nr_matches = cpu_to_le32(scan.nr_ofsts);
+	epcmd->cqe.result.u32 =
+		cpu_to_le32(min_t(u64, scan.nr_matches, U32_MAX));
+
+	return 0;
+}
+
+struct pci_epf_nvme_hash {
+	struct crypto_shash	*tfm;
+	u64			block_lbas;
+	unsigned int		dsize;
+	u8			*digests;
+	unsigned int		nr_digests;
+
+	/* Blocks larger than a chunk are hashed in order, when merging */
+	struct shash_desc	*desc;
+	u64			block_left;
+};
+
+static void pci_epf_nvme_hash_process(struct pci_epf_nvme_range_op *op,
+				      struct pci_epf_nvme_range_chunk *chunk)
+{
+	struct pci_epf_nvme_hash *hash = op->priv;
+	unsigned int lba_shift = op->epcmd->epns->lba_shift;
+	SHASH_DESC_ON_STACK(desc, hash->tfm);
+	u64 idx = (chunk->slba - op->slba) / hash->block_lbas;
+	unsigned int i, nr_blocks;
+	u64 nlb;
+
+	if (hash->desc)
+		return;
+
+	/* Chunks are aligned to blocks: hash all blocks of the chunk */
+	desc->tfm = hash->tfm;
+	nr_blocks = DIV_ROUND_UP_ULL(chunk->nlb, hash->block_lbas);
+	for (i = 0; i < nr_blocks && !chunk->ret; i++) {
+		nlb = min_t(u64, hash->block_lbas,
+			    chunk->nlb - i * hash->block_lbas);
+		chunk->ret = crypto_shash_digest(desc,
+				chunk->buf + ((i * hash->block_lbas) << lba_shift),
+				nlb << lba_shift,
+				hash->digests + (idx + i) * hash->dsize);
+	}
+
+	shash_desc_zero(desc);
+}
+
+static int pci_epf_nvme_hash_merge(struct pci_epf_nvme_range_op *op,
+				   struct pci_epf_nvme_range_chunk *chunk)
+{
+	struct pci_epf_nvme_hash *hash = op->priv;
+	unsigned int lba_shift = op->epcmd->epns->lba_shift;
+	u64 nlb, ofst = 0;
+	int ret;
+
+	if (!hash->desc)
 		return 0;
+
+	while (ofst < chunk->nlb) {
+		if (!hash->block_left) {
+			ret = crypto_shash_init(hash->desc);
+			if (ret)
+				return ret;
+			hash->block_left = hash->block_lbas;
+		}
+
+		nlb = min_t(u64, hash->block_left, chunk->nlb - ofst);
+		ret = crypto_shash_update(hash->desc,
+					  chunk->buf + (ofst << lba_shift),
+					  nlb << lba_shift);
+		if (ret)
+			return ret;
+
+		ofst += nlb;
+		hash->block_left -= nlb;
+
+		/* Finish the block at its end or at the end of the range */
+		if (!hash->block_left ||
+		    chunk->slba + ofst == op->slba + op->nlb) {
+			ret = crypto_shash_final(hash->desc,
+				hash->digests + hash->nr_digests * hash->dsize);
+			if (ret)
+				return ret;
+			hash->nr_digests++;
+			hash->block_left = 0;
+		}
+	}
+
+	return 0;
+}
+
+static int pci_epf_nvme_exec_hash(struct pci_epf_nvme_cmd *epcmd)
+{
+	struct pci_epf_nvme_hash_cmd *cmd =
+		(struct pci_epf_nvme_hash_cmd *)&epcmd->cmd;
+	size_t chunk_lbas = pci_epf_nvme_range_chunk_lbas(epcmd->epns);
+	struct pci_epf_nvme_range_op op = { };
+	struct pci_epf_nvme_hash hash = { };
+	u64 nr_blocks;
+	int ret;
+
+	if (cmd->algo >= PCI_EPF_NVME_HASH_NR_ALGOS ||
+	    !pci_epf_nvme_hash_tfm[cmd->algo])
+		return NVME_SC_INVALID_FIELD | NVME_STATUS_DNR;
+
+	op.epcmd = epcmd;
+	op.slba = le64_to_cpu(cmd->slba);
+	op.nlb = (u64)le32_to_cpu(cmd->nlb) + 1;
+
+	if (cmd->bshift == PCI_EPF_NVME_HASH_RANGE)
+		hash.block_lbas = op.nlb;
+	else if (cmd->bshift < 32)
+		hash.block_lbas = 1ULL << cmd->bshift;
+	else
+		return NVME_SC_INVALID_FIELD | NVME_STATUS_DNR;
+
+	hash.tfm = pci_epf_nvme_hash_tfm[cmd->algo];
+	hash.dsize = crypto_shash_digestsize(hash.tfm);
+	hash.digests = epcmd->buffer;
+
+	nr_blocks = DIV_ROUND_UP_ULL(op.nlb, hash.block_lbas);
+	if (nr_blocks * hash.dsize > epcmd->buffer_size)
+		return NVME_SC_INVALID_FIELD | NVME_STATUS_DNR;
+
+	memset(epcmd->buffer, 0, epcmd->buffer_size);
+
+	/*
+	 * Blocks that fit in a chunk are hashed in parallel with the chunks
+	 * aligned to blocks. Larger blocks are hashed in order, as the chunks
+	 * are merged.
+	 */
+	if (hash.block_lbas <= chunk_lbas) {
+		op.align = hash.block_lbas;
+	} else {
+		hash.desc = kmalloc(sizeof(struct shash_desc) +
+				    crypto_shash_descsize(hash.tfm),
+				    GFP_KERNEL);
+		if (!hash.desc)
+			return -ENOMEM;
+		hash.desc->tfm = hash.tfm;
+	}
+
+	op.process = pci_epf_nvme_hash_process;
+	op.merge = pci_epf_nvme_hash_merge;
+	op.priv = &hash;
+
+	ret = pci_epf_nvme_range_exec(&op);
+
+	if (hash.desc) {
+		shash_desc_zero(hash.desc);
+		kfree(hash.desc);
 	}
 
-	/* MSI and MSI-X are not supported: fall back to INTX */
-	epf_nvme->nr_vectors = 1;
-	epf_nvme->irq_type = PCI_IRQ_INTX;
+	if (ret)
+		return ret;
+
+	epcmd->cqe.result.u32 = cpu_to_le32(nr_blocks);
+
+	return 0;
+}
+
+/*
+ * The NVM command set Identify Namespace data gives the guard type of the
+ * LBA formats. Backends may not support it, so it is always built locally
+ * when PI is enabled.
+ */
+static int pci_epf_nvme_identify_cs_ns(struct pci_epf_nvme_cmd *epcmd)
+{
+	struct nvme_id_ns_nvm *id = epcmd->buffer;
+	struct pci_epf_nvme_ns *epns;
+
+	epns = pci_epf_nvme_get_ns(epcmd->epf_nvme,
+				   le32_to_cpu(epcmd->cmd.identify.nsid));
+	if (!epns)
+		return NVME_SC_INVALID_NS | NVME_STATUS_DNR;
+
+	if (epcmd->buffer_size < sizeof(*id))
+		return NVME_SC_INVALID_FIELD | NVME_STATUS_DNR;
+
+	memset(id, 0, sizeof(*id));
+	if (epns->pi)
+		id->elbaf[0] = cpu_to_le32(epns->pi->guard <<
+					   NVME_ELBAF_GUARD_SHIFT);
+
+	return 0;
+}
+
+/*
+ * The Identify data of namespaces defined through configfs is built locally,
+ * whatever their backend. It is then adjusted for compression and PI as for
+ * other namespaces, by pci_epf_nvme_identify_ns_hook().
+ */
+static int pci_epf_nvme_identify_local_ns(struct pci_epf_nvme_cmd *epcmd,
+					  struct pci_epf_nvme_ns *epns)
+{
+	struct nvme_command *cmd = &epcmd->cmd;
+	struct nvme_id_ns_cs_indep *id_indep;
+	struct nvme_ns_id_desc *desc;
+	struct nvme_id_ns *id;
+	void *buf = epcmd->buffer;
+
+	if (epcmd->buffer_size < NVME_IDENTIFY_DATA_SIZE)
+		return NVME_SC_INVALID_FIELD | NVME_STATUS_DNR;
+
+	memset(buf, 0, NVME_IDENTIFY_DATA_SIZE);
+
+	switch (cmd->identify.cns) {
+	case NVME_ID_CNS_NS:
+		id = buf;
+		id->nsze = cpu_to_le64(epns->nr_lbas);
+		id->ncap = id->nsze;
+		id->nuse = id->nsze;
+		id->lbaf[0].ds = epns->lba_shift;
+		return 0;
+	case NVME_ID_CNS_NS_DESC_LIST:
+		desc = buf;
+		desc->nidt = NVME_NIDT_UUID;
+		desc->nidl = NVME_NIDT_UUID_LEN;
+		memcpy(desc + 1, &epns->uuid, NVME_NIDT_UUID_LEN);
+		desc = buf + sizeof(*desc) + NVME_NIDT_UUID_LEN;
+		desc->nidt = NVME_NIDT_CSI;
+		desc->nidl = NVME_NIDT_CSI_LEN;
+		*(u8 *)(desc + 1) = NVME_CSI_NVM;
+		return 0;
+	case NVME_ID_CNS_CS_NS:
+		if (cmd->identify.csi != NVME_CSI_NVM)
+			return NVME_SC_INVALID_FIELD | NVME_STATUS_DNR;
+		return pci_epf_nvme_identify_cs_ns(epcmd);
+	case NVME_ID_CNS_NS_CS_INDEP:
+		id_indep = buf;
+		id_indep->nstat = NVME_NSTAT_NRDY;
+		return 0;
+	default:
+		return NVME_SC_INVALID_FIELD | NVME_STATUS_DNR;
+	}
+}
+
+/*
+ * Commands can be passed through to the fabrics namespace if the data is
+ * not transformed or duplicated locally.
+ */
+static inline bool pci_epf_nvme_ns_passthru(struct pci_epf_nvme_ns *epns)
+{
+	return epns->ns && !epns->comp && !epns->crypt && !epns->mirror &&
+		!epns->cache && !epns->overlay;
+}
+
+/*
+ * Execute a command: vendor specific I/O commands are executed locally, all
+ * other commands are passed through to the fabrics controller. Returns 0, a
+ * negative error code or an NVMe status, as __nvme_submit_sync_cmd().
+ */
+static int pci_epf_nvme_submit_cmd(struct pci_epf_nvme_cmd *epcmd,
+				   struct request_queue *q)
+{
+	struct nvme_command *cmd = &epcmd->cmd;
+	struct pci_epf_nvme_ns *epns;
+
+	if (epcmd->sqid) {
+		switch (cmd->common.opcode) {
+		case PCI_EPF_NVME_CMD_SCAN:
+			return pci_epf_nvme_exec_scan(epcmd);
+		case PCI_EPF_NVME_CMD_HASH:
+			return pci_epf_nvme_exec_hash(epcmd);
+		case nvme_cmd_read:
+		case nvme_cmd_write:
+			if (epcmd->epns->pi)
+				return pci_epf_nvme_pi_rw(epcmd);
+			/* Host reads own their buffer and can be hedged */
+			if (epcmd->epns->mirror && !epcmd->epns->comp &&
+			    !epcmd->epns->crypt && !epcmd->epns->cache &&
+			    !epcmd->epns->overlay)
+				return pci_epf_nvme_mirror_rw(epcmd->epns,
+					cmd->rw.opcode,
+					le64_to_cpu(cmd->rw.slba),
+					(u32)le16_to_cpu(cmd->rw.length) + 1,
+					&epcmd->buffer, true);
+			if (pci_epf_nvme_ns_passthru(epcmd->epns))
+				break;
+			return pci_epf_nvme_ns_rw(epcmd->epns,
+					cmd->rw.opcode,
+					le64_to_cpu(cmd->rw.slba),
+					(u32)le16_to_cpu(cmd->rw.length) + 1,
+					epcmd->buffer);
+		case nvme_cmd_flush:
+			return pci_epf_nvme_flush_ns(epcmd->epns);
+		case nvme_cmd_write_zeroes:
+			if (epcmd->epns->pi)
+				return pci_epf_nvme_pi_rw(epcmd);
+			if (pci_epf_nvme_ns_passthru(epcmd->epns))
+				break;
+			return pci_epf_nvme_ns_rw(epcmd->epns,
+					cmd->write_zeroes.opcode,
+					le64_to_cpu(cmd->write_zeroes.slba),
+					(u32)le16_to_cpu(cmd->write_zeroes.length) + 1,
+					NULL);
+		default:
+			break;
+		}
+
+		/*
+		 * The fabrics namespace may have another NSID, and is not
+		 * written below an overlay.
+		 */
+		if (!epcmd->ns || (epcmd->epns && epcmd->epns->overlay))
+			return NVME_SC_INVALID_OPCODE | NVME_STATUS_DNR;
+		cmd->common.nsid = cpu_to_le32(epcmd->ns->head->ns_id);
+	} else if (cmd->common.opcode == nvme_admin_identify) {
+		switch (cmd->identify.cns) {
+		case NVME_ID_CNS_NS:
+		case NVME_ID_CNS_NS_DESC_LIST:
+		case NVME_ID_CNS_CS_NS:
+		case NVME_ID_CNS_NS_CS_INDEP:
+			epns = pci_epf_nvme_get_local_ns(epcmd->epf_nvme,
+					le32_to_cpu(cmd->identify.nsid));
+			if (epns)
+				return pci_epf_nvme_identify_local_ns(epcmd,
+								      epns);
+			break;
+		default:
+			break;
+		}
+
+		if (cmd->identify.cns == NVME_ID_CNS_CS_NS &&
+		    cmd->identify.csi == NVME_CSI_NVM &&
+		    epcmd->epf_nvme->pi_type)
+			return pci_epf_nvme_identify_cs_ns(epcmd);
+	}
+
+	return __nvme_submit_sync_cmd(q, &epcmd->cmd, &epcmd->cqe.result,
+				      epcmd->buffer, epcmd->buffer_size,
+				      NVME_QID_ANY, 0);
+}
+
+/*
+ * Commands marked as aborted by an Abort command while being executed are
+ * completed with the Command Abort Requested status at the next stage of
+ * their execution.
+ */
+static inline bool pci_epf_nvme_cmd_aborted(struct pci_epf_nvme_cmd *epcmd)
+{
+	if (!READ_ONCE(epcmd->aborted))
+		return false;
+
+	epcmd->status = NVME_SC_ABORT_REQ;
+
+	return true;
+}
+
+static struct pci_epf_nvme_perf_profile *
+pci_epf_nvme_perf_get_profile(struct pci_epf_nvme_perf *perf, u32 nsid)
+{
+	struct pci_epf_nvme_perf_profile *prof = NULL;
+	unsigned int i;
+
+	for (i = 0; i < perf->nr_profiles; i++) {
+		if (perf->profiles[i].nsid == nsid)
+			return &perf->profiles[i];
+		if (!perf->profiles[i].nsid)
+			prof = &perf->profiles[i];
+	}
+
+	return prof;
+}
+
+/*
+ * Sample a latency of the distribution of an operation, in nanoseconds.
+ */
+static u64 pci_epf_nvme_perf_latency(struct pci_epf_nvme_perf_profile *prof,
+				     enum pci_epf_nvme_perf_op op)
+{
+	/* Percentiles of the distribution points, in thousandths */
+	static const u32 pct[PCI_EPF_NVME_PERF_LAT_POINTS] = {
+		0, 50000, 99000, 100000
+	};
+	u32 *lat_us = prof->lat_us[op];
+	u32 r = get_random_u32_below(100000);
+	int i;
+
+	for (i = 1; i < PCI_EPF_NVME_PERF_LAT_POINTS - 1; i++) {
+		if (r < pct[i])
+			break;
+	}
+
+	return ((u64)lat_us[i - 1] * NSEC_PER_USEC) +
+		div_u64((u64)(lat_us[i] - lat_us[i - 1]) * NSEC_PER_USEC *
+			(r - pct[i - 1]), pct[i] - pct[i - 1]);
+}
+
+/*
+ * Latency scaling in percent for a queue depth, interpolated between the
+ * points of the queue depth curve. The curve may decrease, so interpolate
+ * with signed values.
+ */
+static u32 pci_epf_nvme_perf_qd_pct(struct pci_epf_nvme_perf_profile *prof,
+				    unsigned int qd)
+{
+	unsigned int i;
+	s64 delta;
+
+	if (!prof->nr_qd_points)
+		return 100;
+
+	if (qd <= prof->qd[0])
+		return prof->qd_pct[0];
+
+	for (i = 1; i < prof->nr_qd_points; i++) {
+		if (qd <= prof->qd[i]) {
+			delta = (s64)prof->qd_pct[i] - prof->qd_pct[i - 1];
+			return prof->qd_pct[i - 1] +
+				div64_s64(delta * (qd - prof->qd[i - 1]),
+					  prof->qd[i] - prof->qd[i - 1]);
+		}
+	}
+
+	return prof->qd_pct[prof->nr_qd_points - 1];
+}
+
+/*
+ * Delay the completion of an I/O command started at start (ns) to follow
+ * the performance profile of its namespace. The command worker sleeps with
+ * an hrtimer until the modeled completion time.
+ */
+static void pci_epf_nvme_perf_delay(struct pci_epf_nvme_cmd *epcmd, u64 start)
+{
+	struct pci_epf_nvme_ns *epns = epcmd->epns;
+	struct pci_epf_nvme_perf_state *st = &epns->perf;
+	struct pci_epf_nvme_perf_profile prof, *p;
+	struct pci_epf_nvme_perf *perf;
+	enum pci_epf_nvme_perf_op op;
+	u64 len = 0, done, now, xfer_ns, gc_bytes;
+	unsigned int gen, qd;
+	u32 mbps;
+	ktime_t expires;
+
+	switch (epcmd->cmd.common.opcode) {
+	case nvme_cmd_read:
+		op = PCI_EPF_NVME_PERF_READ;
+		break;
+	case nvme_cmd_write:
+	case nvme_cmd_write_zeroes:
+		op = PCI_EPF_NVME_PERF_WRITE;
+		break;
+	case nvme_cmd_flush:
+		op = PCI_EPF_NVME_PERF_FLUSH;
+		break;
+	default:
+		return;
+	}
+
+	if (op != PCI_EPF_NVME_PERF_FLUSH)
+		len = ((u64)le16_to_cpu(epcmd->cmd.rw.length) + 1) <<
+			epns->lba_shift;
+
+	rcu_read_lock();
+	perf = rcu_dereference(epcmd->epf_nvme->perf);
+	p = perf ? pci_epf_nvme_perf_get_profile(perf, epns->nsid) : NULL;
+	if (!p) {
+		rcu_read_unlock();
+		return;
+	}
+	prof = *p;
+	gen = perf->gen;
+	rcu_read_unlock();
+
+	qd = atomic_read(&st->inflight);
+	done = start + div_u64(pci_epf_nvme_perf_latency(&prof, op) *
+			       pci_epf_nvme_perf_qd_pct(&prof, qd), 100);
+
+	now = ktime_get_ns();
+
+	spin_lock(&st->lock);
+
+	if (st->gen != gen) {
+		st->gen = gen;
+		st->bw_next[0] = 0;
+		st->bw_next[1] = 0;
+		st->written = 0;
+		st->gc_until = 0;
+	}
+
+	if (op == PCI_EPF_NVME_PERF_WRITE) {
+		gc_bytes = prof.gc_bytes;
+		if (gc_bytes &&
+		    div64_u64(st->written + len, gc_bytes) >
+		    div64_u64(st->written, gc_bytes))
+			st->gc_until = max(now, st->gc_until) +
+				(u64)prof.gc_pause_us * NSEC_PER_USEC;
+		st->written += len;
+	}
+
+	/* Bandwidth caps: at N MB/s, a byte takes 1000 / N ns */
+	if (op != PCI_EPF_NVME_PERF_FLUSH) {
+		mbps = prof.mbps[op];
+		if (op == PCI_EPF_NVME_PERF_WRITE && prof.cliff_bytes &&
+		    st->written > prof.cliff_bytes)
+			mbps = prof.cliff_mbps;
+		if (mbps) {
+			xfer_ns = div_u64(len * 1000, mbps);
+			st->bw_next[op] = max(now, st->bw_next[op]) + xfer_ns;
+			done = max(done, st->bw_next[op]);
+		}
+	}
+
+	done = max(done, st->gc_until);
+
+	spin_unlock(&st->lock);
+
+	if (done <= now)
+		return;
+
+	expires = ns_to_ktime(done);
+	set_current_state(TASK_UNINTERRUPTIBLE);
+	schedule_hrtimeout(&expires, HRTIMER_MODE_ABS);
+}
+
+/*
+ * Delay the commands of namespaces with QoS limits: at N IOPS, a command
+ * takes 1 / N s and at N MB/s, a byte takes 1000 / N ns of a virtual clock,
+ * which can lag behind the current time by a short burst.
+ */
+static void pci_epf_nvme_qos_wait(struct pci_epf_nvme_cmd *epcmd)
+{
+	struct pci_epf_nvme_qos *qos = &epcmd->epns->qos;
+	u64 now, start, cost = 0, len = 0;
+	ktime_t expires;
+
+	if (epcmd->cmd.common.opcode == nvme_cmd_read ||
+	    epcmd->cmd.common.opcode == nvme_cmd_write)
+		len = ((u64)le16_to_cpu(epcmd->cmd.rw.length) + 1) <<
+			epcmd->epns->lba_shift;
+
+	if (qos->iops)
+		cost = div_u64(NSEC_PER_SEC, qos->iops);
+	if (qos->mbps)
+		cost = max(cost, div_u64(len * 1000, qos->mbps));
+
+	now = ktime_get_ns();
+
+	spin_lock(&qos->lock);
+	start = max(qos->next, now - min_t(u64, now, PCI_EPF_NVME_QOS_BURST_NS));
+	qos->next = start + cost;
+	spin_unlock(&qos->lock);
+
+	if (start <= now)
+		return;
+
+	atomic64_inc(&qos->nr_delayed);
+
+	expires = ns_to_ktime(start);
+	set_current_state(TASK_UNINTERRUPTIBLE);
+	schedule_hrtimeout(&expires, HRTIMER_MODE_ABS);
+}
+
+#if defined(CONFIG_BPF_JIT) && defined(CONFIG_BPF_SYSCALL)
+static struct pci_epf_nvme_bpf_ops __rcu *pci_epf_nvme_bpf_policy;
+
+__bpf_kfunc_start_defs();
+
+/*
+ * Copy dst__sz bytes of the data written by the host, from offset off.
+ */
+__bpf_kfunc int bpf_epf_nvme_read_data(struct pci_epf_nvme_bpf_ctx *ctx,
+				       u32 off, void *dst, u32 dst__sz)
+{
+	if (off > ctx->data_len || dst__sz > ctx->data_len - off)
+		return -EINVAL;
+
+	memcpy(dst, ctx->data + off, dst__sz);
+
+	return 0;
+}
+
+/*
+ * Status of failed commands: status code type and status code, as
+ * (sct << 8) | sc. Commands are failed with Access Denied by default.
+ */
+__bpf_kfunc void bpf_epf_nvme_set_status(struct pci_epf_nvme_bpf_ctx *ctx,
+					 u16 status)
+{
+	ctx->status = status & 0x7ff;
+}
+
+__bpf_kfunc void bpf_epf_nvme_redirect(struct pci_epf_nvme_bpf_ctx *ctx,
+				       u32 nsid)
+{
+	ctx->redirect_nsid = nsid;
+}
+
+__bpf_kfunc void bpf_epf_nvme_delay(struct pci_epf_nvme_bpf_ctx *ctx,
+				    u32 delay_us)
+{
+	ctx->delay_us = min_t(u32, delay_us, PCI_EPF_NVME_BPF_MAX_DELAY_US);
+}
+
+__bpf_kfunc_end_defs();
+
+BTF_KFUNCS_START(pci_epf_nvme_bpf_kfunc_ids)
+BTF_ID_FLAGS(func, bpf_epf_nvme_read_data, KF_TRUSTED_ARGS)
+BTF_ID_FLAGS(func, bpf_epf_nvme_set_status, KF_TRUSTED_ARGS)
+BTF_ID_FLAGS(func, bpf_epf_nvme_redirect, KF_TRUSTED_ARGS)
+BTF_ID_FLAGS(func, bpf_epf_nvme_delay, KF_TRUSTED_ARGS)
+BTF_KFUNCS_END(pci_epf_nvme_bpf_kfunc_ids)
+
+static const struct btf_kfunc_id_set pci_epf_nvme_bpf_kfunc_set = {
+	.owner	= THIS_MODULE,
+	.set	= &pci_epf_nvme_bpf_kfunc_ids,
+};
+
+static const struct bpf_func_proto *
+pci_epf_nvme_bpf_get_func_proto(enum bpf_func_id func_id,
+				const struct bpf_prog *prog)
+{
+	return bpf_base_func_proto(func_id, prog);
+}
+
+static bool pci_epf_nvme_bpf_is_valid_access(int off, int size,
+					     enum bpf_access_type type,
+					     const struct bpf_prog *prog,
+					     struct bpf_insn_access_aux *info)
+{
+	return bpf_tracing_btf_ctx_access(off, size, type, prog, info);
+}
+
+/*
+ * No btf_struct_access operation: the context and the command are
+ * read-only, verdict parameters are set with kfuncs.
+ */
+static const struct bpf_verifier_ops pci_epf_nvme_bpf_verifier_ops = {
+	.get_func_proto		= pci_epf_nvme_bpf_get_func_proto,
+	.is_valid_access	= pci_epf_nvme_bpf_is_valid_access,
+};
+
+static int pci_epf_nvme_bpf_init(struct btf *btf)
+{
+	return 0;
+}
+
+static int pci_epf_nvme_bpf_init_member(const struct btf_type *t,
+					const struct btf_member *member,
+					void *kdata, const void *udata)
+{
+	const struct pci_epf_nvme_bpf_ops *uops = udata;
+	struct pci_epf_nvme_bpf_ops *ops = kdata;
+
+	if (__btf_member_bit_offset(t, member) / 8 !=
+	    offsetof(struct pci_epf_nvme_bpf_ops, name))
+		return 0;
+
+	if (strscpy(ops->name, uops->name, sizeof(ops->name)) <= 0)
+		return -EINVAL;
+
+	return 1;
+}
+
+static int pci_epf_nvme_bpf_reg(void *kdata, struct bpf_link *link)
+{
+	struct pci_epf_nvme_bpf_ops *ops = kdata;
+
+	mutex_lock(&pci_epf_nvme_hooks_lock);
+
+	if (rcu_access_pointer(pci_epf_nvme_bpf_policy)) {
+		mutex_unlock(&pci_epf_nvme_hooks_lock);
+		return -EBUSY;
+	}
+
+	rcu_assign_pointer(pci_epf_nvme_bpf_policy, ops);
+	static_branch_enable(&pci_epf_nvme_bpf_enabled);
+
+	mutex_unlock(&pci_epf_nvme_hooks_lock);
+
+	pr_info("Registered %s BPF dispatch policy\n", ops->name);
+
+	return 0;
+}
+
+static void pci_epf_nvme_bpf_unreg(void *kdata, struct bpf_link *link)
+{
+	struct pci_epf_nvme_bpf_ops *ops = kdata;
+
+	mutex_lock(&pci_epf_nvme_hooks_lock);
+
+	if (rcu_access_pointer(pci_epf_nvme_bpf_policy) != ops) {
+		mutex_unlock(&pci_epf_nvme_hooks_lock);
+		return;
+	}
+
+	static_branch_disable(&pci_epf_nvme_bpf_enabled);
+	RCU_INIT_POINTER(pci_epf_nvme_bpf_policy, NULL);
+
+	/* Wait for the commands running the policy */
+	synchronize_rcu();
+
+	mutex_unlock(&pci_epf_nvme_hooks_lock);
+
+	pr_info("Unregistered %s BPF dispatch policy\n", ops->name);
+}
+
+static int pci_epf_nvme_bpf_dispatch_stub(struct pci_epf_nvme_bpf_ctx *ctx)
+{
+	return PCI_EPF_NVME_BPF_PASS;
+}
+
+static struct pci_epf_nvme_bpf_ops pci_epf_nvme_bpf_cfi_stubs = {
+	.dispatch	= pci_epf_nvme_bpf_dispatch_stub,
+};
+
+static struct bpf_struct_ops pci_epf_nvme_bpf_struct_ops = {
+	.verifier_ops	= &pci_epf_nvme_bpf_verifier_ops,
+	.init		= pci_epf_nvme_bpf_init,
+	.init_member	= pci_epf_nvme_bpf_init_member,
+	.reg		= pci_epf_nvme_bpf_reg,
+	.unreg		= pci_epf_nvme_bpf_unreg,
+	.cfi_stubs	= &pci_epf_nvme_bpf_cfi_stubs,
+	.name		= "pci_epf_nvme_bpf_ops",
+	.owner		= THIS_MODULE,
+};
+
+/*
+ * Register the BPF dispatch policy type. This needs the module BTF, and
+ * failing only makes policies unavailable.
+ */
+static void pci_epf_nvme_register_bpf(void)
+{
+	int ret;
+
+	ret = register_btf_kfunc_id_set(BPF_PROG_TYPE_STRUCT_OPS,
+					&pci_epf_nvme_bpf_kfunc_set);
+	if (!ret)
+		ret = register_bpf_struct_ops(&pci_epf_nvme_bpf_struct_ops,
+					      pci_epf_nvme_bpf_ops);
+	if (ret)
+		pr_warn("BPF dispatch policies unavailable (%d)\n", ret);
+}
+
+/*
+ * Apply the verdict of the BPF dispatch policy to an I/O command. Returns
+ * false if the command was failed.
+ */
+static bool pci_epf_nvme_run_bpf(struct pci_epf_nvme_cmd *epcmd)
+{
+	struct pci_epf_nvme_bpf_ctx ctx = {
+		.cmd = &epcmd->cmd,
+		.qid = epcmd->sqid,
+		.nsid = epcmd->epns->nsid,
+	};
+	struct pci_epf_nvme_bpf_ops *ops;
+	struct pci_epf_nvme_ns *epns;
+	int verdict = PCI_EPF_NVME_BPF_PASS;
+
+	if (epcmd->dma_dir == DMA_FROM_DEVICE) {
+		ctx.data = epcmd->buffer;
+		ctx.data_len = epcmd->buffer_size;
+	}
+
+	rcu_read_lock();
+	ops = rcu_dereference(pci_epf_nvme_bpf_policy);
+	if (ops)
+		verdict = ops->dispatch(&ctx);
+	rcu_read_unlock();
+
+	switch (verdict) {
+	case PCI_EPF_NVME_BPF_PASS:
+		return true;
+	case PCI_EPF_NVME_BPF_DELAY:
+		if (ctx.delay_us)
+			fsleep(ctx.delay_us);
+		return true;
+	case PCI_EPF_NVME_BPF_REDIRECT:
+		/* The data size was computed with the original LBA size */
+		epns = pci_epf_nvme_get_ns(epcmd->epf_nvme, ctx.redirect_nsid);
+		if (!epns || epns->lba_shift != epcmd->epns->lba_shift) {
+			epcmd->status = NVME_SC_INVALID_NS | NVME_STATUS_DNR;
+			return false;
+		}
+		epcmd->epns = epns;
+		epcmd->ns = epns->ns;
+		return true;
+	default:
+		epcmd->status = (ctx.status ?: NVME_SC_ACCESS_DENIED) |
+			NVME_STATUS_DNR;
+		return false;
+	}
+}
+#else
+static inline void pci_epf_nvme_register_bpf(void)
+{
+}
+
+static inline bool pci_epf_nvme_run_bpf(struct pci_epf_nvme_cmd *epcmd)
+{
+	return true;
+}
+#endif
+
+static void pci_epf_nvme_exec_cmd(struct pci_epf_nvme_cmd *epcmd,
+			void (*post_exec_hook)(struct pci_epf_nvme_cmd *))
+{
+	struct pci_epf_nvme *epf_nvme = epcmd->epf_nvme;
+	struct nvme_command *cmd = &epcmd->cmd;
+	struct request_queue *q;
+	bool perf = false;
+	u64 start = 0;
+	int ret;
+
+	if (epcmd->ns)
+		q = epcmd->ns->queue;
+	else
+		q = epf_nvme->ctrl.ctrl->admin_q;
+
+	if (epcmd->buffer_size) {
+		/* Setup the command buffer */
+		ret = pci_epf_nvme_cmd_parse_dptr(epcmd);
+		if (ret)
+			return;
+
+		/* Get data from the host if needed */
+		if (epcmd->dma_dir == DMA_FROM_DEVICE) {
+			ret = pci_epf_nvme_transfer_cmd_data(epcmd);
+			if (ret)
+				return;
+
+			/* Inspect the data written by the host */
+			if (static_branch_unlikely(&pci_epf_nvme_hooks_enabled) &&
+			    epcmd->sqid && cmd->common.opcode == nvme_cmd_write)
+				pci_epf_nvme_run_hooks(epcmd);
+		}
+	}
+
+	/*
+	 * Allocate the separate metadata buffer, and get the metadata from
+	 * the host for writes.
+	 */
+	if (epcmd->meta_size) {
+		ret = pci_epf_nvme_transfer_cmd_meta(epcmd);
+		if (ret)
+			return;
+	}
+
+	if (pci_epf_nvme_cmd_aborted(epcmd))
+		return;
+
+	if (static_branch_unlikely(&pci_epf_nvme_bpf_enabled) &&
+	    epcmd->sqid && epcmd->epns) {
+		if (!pci_epf_nvme_run_bpf(epcmd))
+			return;
+		if (epcmd->ns)
+			q = epcmd->ns->queue;
+	}
+
+	if (epcmd->sqid && epcmd->epns &&
+	    (epcmd->epns->qos.iops || epcmd->epns->qos.mbps))
+		pci_epf_nvme_qos_wait(epcmd);
+
+	if (static_branch_unlikely(&pci_epf_nvme_perf_enabled) &&
+	    epcmd->sqid && epcmd->epns) {
+		perf = true;
+		start = ktime_get_ns();
+		atomic_inc(&epcmd->epns->perf.inflight);
+	}
+
+	/* Synchronously execute the command */
+	ret = pci_epf_nvme_submit_cmd(epcmd, q);
+	if (ret < 0)
+		epcmd->status = NVME_SC_INTERNAL | NVME_STATUS_DNR;
+	else if (ret > 0)
+		epcmd->status = ret;
+
+	/* Emulate the performance profile of the namespace */
+	if (perf) {
+		if (epcmd->status == NVME_SC_SUCCESS)
+			pci_epf_nvme_perf_delay(epcmd, start);
+		atomic_dec(&epcmd->epns->perf.inflight);
+	}
+
+	if (epcmd->status != NVME_SC_SUCCESS) {
+		dev_err(&epf_nvme->epf->dev,
+			"QID %d: submit command %s (0x%x) failed, status 0x%0x\n",
+			epcmd->sqid, pci_epf_nvme_cmd_name(epcmd),
+			epcmd->cmd.common.opcode, epcmd->status);
+		return;
+	}
+
+	if (post_exec_hook)
+		post_exec_hook(epcmd);
+
+	if (epcmd->dma_dir != DMA_TO_DEVICE || pci_epf_nvme_cmd_aborted(epcmd))
+		return;
+
+	if (epcmd->buffer_size) {
+		ret = pci_epf_nvme_transfer_cmd_data(epcmd);
+		if (ret)
+			return;
+	}
+
+	if (epcmd->meta_size)
+		pci_epf_nvme_transfer_cmd_meta(epcmd);
+}
+
+static void pci_epf_nvme_exec_cmd_work(struct work_struct *work)
+{
+	struct pci_epf_nvme_cmd *epcmd =
+		container_of(work, struct pci_epf_nvme_cmd, work);
+
+	pci_epf_nvme_exec_cmd(epcmd, NULL);
+
+	pci_epf_nvme_complete_cmd(epcmd);
+}
+
+static bool pci_epf_nvme_queue_response(struct pci_epf_nvme_cmd *epcmd)
+{
+	struct pci_epf_nvme *epf_nvme = epcmd->epf_nvme;
+	struct pci_epf *epf = epf_nvme->epf;
+	struct pci_epf_nvme_ctrl *ctrl = &epf_nvme->ctrl;
+	struct pci_epf_nvme_queue *sq = &ctrl->sq[epcmd->sqid];
+	struct pci_epf_nvme_queue *cq = &ctrl->cq[epcmd->cqid];
+	struct nvme_completion *cqe = &epcmd->cqe;
+
+	/*
+	 * Do not try to complete commands if the controller is not ready
+	 * anymore, e.g. after the host cleared CC.EN.
+	 */
+	if (!pci_epf_nvme_ctrl_ready(epf_nvme) ||
+	    !(cq->qflags & PCI_EPF_NVME_QUEUE_LIVE))
+		goto free_cmd;
+
+	/* Check completion queue full state */
+	cq->head = pci_epf_nvme_reg_read32(ctrl, cq->db);
+	if (cq->head == cq->tail + 1)
+		return false;
+
+	/* Setup the completion entry */
+	cqe->sq_id = cpu_to_le16(epcmd->sqid);
+	cqe->sq_head = cpu_to_le16(sq->head);
+	cqe->command_id = epcmd->cmd.common.command_id;
+	cqe->status = cpu_to_le16((epcmd->status << 1) | cq->phase);
+
+	/* Post the completion entry */
+	dev_dbg(&epf->dev,
+		"cq[%d]: %s status 0x%x, head %d, tail %d, phase %d\n",
+		epcmd->cqid, pci_epf_nvme_cmd_name(epcmd),
+		epcmd->status, cq->head, cq->tail, cq->phase);
+
+	/*
+	 * The two halves of an STP to device memory are not ordered, so the
+	 * phase bit could be seen before the command result: post the entry
+	 * with memcpy_toio(), which writes it in address order.
+	 */
+	memcpy_toio(cq->pci_map.virt_addr + cq->tail * cq->qes, cqe,
+		    sizeof(struct nvme_completion));
+
+	if (pci_epf_nvme_verify_sample(epf_nvme)) {
+		struct nvme_completion rcqe;
+
+		pci_epf_nvme_memcpy_fromio(&rcqe, cq->pci_map.virt_addr +
+					   cq->tail * cq->qes,
+					   sizeof(struct nvme_completion));
+		pci_epf_nvme_verify_account(epf_nvme, sizeof(rcqe), cqe, &rcqe);
+	}
+
+	/* Advance the tail */
+	cq->tail++;
+	if (cq->tail >= cq->depth) {
+		cq->tail = 0;
+		cq->phase ^= 1;
+	}
+
+free_cmd:
+	pci_epf_nvme_free_cmd(epcmd);
+
+	return true;
+}
+
+static int __pci_epf_nvme_map_queue(struct pci_epf_nvme *epf_nvme,
+				    struct pci_epf_nvme_queue *q)
+{
+	struct pci_epf *epf = epf_nvme->epf;
+	int ret;
+
+	ret = pci_epc_mem_map(epf->epc, epf->func_no, epf->vfunc_no,
+			      q->pci_addr, q->pci_size, &q->pci_map);
+	if (ret) {
+		dev_err(&epf->dev, "Map %cQ %d failed %d\n",
+			q->qflags & PCI_EPF_NVME_QUEUE_IS_SQ ? 'S' : 'C',
+			q->qid, ret);
+		return ret;
+	}
+
+	if (q->pci_map.pci_size < q->pci_size) {
+		dev_err(&epf->dev, "Partial %cQ %d mapping\n",
+			q->qflags & PCI_EPF_NVME_QUEUE_IS_SQ ? 'S' : 'C',
+			q->qid);
+		pci_epc_mem_unmap(epf->epc, epf->func_no, epf->vfunc_no,
+				  &q->pci_map);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static inline void __pci_epf_nvme_unmap_queue(struct pci_epf_nvme *epf_nvme,
+					      struct pci_epf_nvme_queue *q)
+{
+	struct pci_epf *epf = epf_nvme->epf;
+
+	pci_epc_mem_unmap(epf->epc, epf->func_no, epf->vfunc_no,
+			  &q->pci_map);
+}
+
+/*
+ * SQ fetches and CQE posts are small accesses to the same ring addresses,
+ * so mapping and unmapping the ring window for each batch costs more than
+ * the accesses themselves. Keep the rings of the first ring_maps queues
+ * mapped until the queue is deleted. Outbound windows are a limited
+ * resource shared with data transfers, so the other queues, and any queue
+ * for which the persistent mapping fails, map their ring on each use.
+ */
+static void pci_epf_nvme_map_ring(struct pci_epf_nvme *epf_nvme,
+				  struct pci_epf_nvme_queue *q)
+{
+	if (atomic_inc_return(&epf_nvme->nr_ring_maps) >
+	    READ_ONCE(epf_nvme->ring_maps))
+		goto out;
+
+	if (__pci_epf_nvme_map_queue(epf_nvme, q))
+		goto out;
+
+	q->qflags |= PCI_EPF_NVME_QUEUE_MAPPED;
+
+	return;
+
+out:
+	atomic_dec(&epf_nvme->nr_ring_maps);
+}
+
+static void pci_epf_nvme_unmap_ring(struct pci_epf_nvme *epf_nvme,
+				    struct pci_epf_nvme_queue *q)
+{
+	if (!(q->qflags & PCI_EPF_NVME_QUEUE_MAPPED))
+		return;
+
+	__pci_epf_nvme_unmap_queue(epf_nvme, q);
+	q->qflags &= ~PCI_EPF_NVME_QUEUE_MAPPED;
+	atomic_dec(&epf_nvme->nr_ring_maps);
+}
+
+static inline int pci_epf_nvme_map_queue(struct pci_epf_nvme *epf_nvme,
+					 struct pci_epf_nvme_queue *q)
+{
+	if (q->qflags & PCI_EPF_NVME_QUEUE_MAPPED)
+		return 0;
+
+	return __pci_epf_nvme_map_queue(epf_nvme, q);
+}
+
+static inline void pci_epf_nvme_unmap_queue(struct pci_epf_nvme *epf_nvme,
+					    struct pci_epf_nvme_queue *q)
+{
+	if (q->qflags & PCI_EPF_NVME_QUEUE_MAPPED)
+		return;
+
+	__pci_epf_nvme_unmap_queue(epf_nvme, q);
+}
+
+static void pci_epf_nvme_delete_queue(struct pci_epf_nvme *epf_nvme,
+				      struct pci_epf_nvme_queue *q)
+{
+	struct pci_epf_nvme_cmd *epcmd;
+
+	q->qflags &= ~PCI_EPF_NVME_QUEUE_LIVE;
+
+	if (q->cmd_wq) {
+		flush_workqueue(q->cmd_wq);
+		destroy_workqueue(q->cmd_wq);
+		q->cmd_wq = NULL;
+	}
+
+	flush_delayed_work(&q->work);
+	cancel_delayed_work_sync(&q->work);
+
+	pci_epf_nvme_unmap_ring(epf_nvme, q);
+
+	while (!list_empty(&q->list)) {
+		epcmd = list_first_entry(&q->list,
+					 struct pci_epf_nvme_cmd, link);
+		list_del_init(&epcmd->link);
+		pci_epf_nvme_free_cmd(epcmd);
+	}
+}
+
+static void pci_epf_nvme_cq_work(struct work_struct *work);
+
+static int pci_epf_nvme_create_cq(struct pci_epf_nvme *epf_nvme, int qid,
+				  int flags, int size, int vector,
+				  phys_addr_t pci_addr)
+{
+	struct pci_epf_nvme_ctrl *ctrl = &epf_nvme->ctrl;
+	struct pci_epf_nvme_queue *cq = &ctrl->cq[qid];
+	struct pci_epf *epf = epf_nvme->epf;
+
+	/*
+	 * Increment the queue reference count: if the queue is already being
+	 * used, we have nothing to do.
+	 */
+	cq->ref++;
+	if (cq->ref > 1)
+		return 0;
+
+	/* Setup the completion queue */
+	cq->pci_addr = pci_addr;
+	cq->qid = qid;
+	cq->cqid = qid;
+	cq->size = size;
+	cq->flags = flags;
+	cq->depth = size + 1;
+	cq->vector = vector;
+	cq->head = 0;
+	cq->tail = 0;
+	cq->phase = 1;
+	cq->db = NVME_REG_DBS + (((qid * 2) + 1) * sizeof(u32));
+	pci_epf_nvme_reg_write32(ctrl, cq->db, 0);
+	INIT_DELAYED_WORK(&cq->work, pci_epf_nvme_cq_work);
+	if (!qid)
+		cq->qes = ctrl->adm_cqes;
+	else
+		cq->qes = ctrl->io_cqes;
+	cq->pci_size = cq->qes * cq->depth;
+
+	dev_dbg(&epf->dev,
+		"CQ %d: %d entries of %zu B, vector IRQ %d\n",
+		qid, cq->size, cq->qes, (int)cq->vector + 1);
+
+	cq->qflags = 0;
+	pci_epf_nvme_map_ring(epf_nvme, cq);
+	cq->qflags |= PCI_EPF_NVME_QUEUE_LIVE;
+
+	return 0;
+}
+
+static void pci_epf_nvme_delete_cq(struct pci_epf_nvme *epf_nvme, int qid)
+{
+	struct pci_epf_nvme_queue *cq = &epf_nvme->ctrl.cq[qid];
+
+	if (cq->ref < 1)
+		return;
+
+	cq->ref--;
+	if (cq->ref)
+		return;
+
+	pci_epf_nvme_delete_queue(epf_nvme, cq);
+}
+
+static void pci_epf_nvme_sq_work(struct work_struct *work);
+
+static int pci_epf_nvme_create_sq(struct pci_epf_nvme *epf_nvme, int qid,
+				  int cqid, int flags, int size,
+				  phys_addr_t pci_addr)
+{
+	struct pci_epf_nvme_ctrl *ctrl = &epf_nvme->ctrl;
+	struct pci_epf_nvme_queue *sq = &ctrl->sq[qid];
+	struct pci_epf_nvme_queue *cq = &ctrl->cq[cqid];
+	struct pci_epf *epf = epf_nvme->epf;
+
+	/* Setup the submission queue */
+	sq->qflags = PCI_EPF_NVME_QUEUE_IS_SQ;
+	sq->pci_addr = pci_addr;
+	sq->ref = 1;
+	sq->qid = qid;
+	sq->cqid = cqid;
+	sq->size = size;
+	sq->flags = flags;
+	sq->depth = size + 1;
+	sq->head = 0;
+	sq->tail = 0;
+	sq->phase = 0;
+	sq->last_fetch = jiffies;
+	sq->db = NVME_REG_DBS + (qid * 2 * sizeof(u32));
+	pci_epf_nvme_reg_write32(ctrl, sq->db, 0);
+	INIT_DELAYED_WORK(&sq->work, pci_epf_nvme_sq_work);
+	if (!qid)
+		sq->qes = ctrl->adm_sqes;
+	else
+		sq->qes = ctrl->io_sqes;
+	sq->pci_size = sq->qes * sq->depth;
+
+	sq->cmd_wq = alloc_workqueue("sq%d_wq", WQ_HIGHPRI | WQ_UNBOUND,
+				     min_t(int, sq->depth, WQ_MAX_ACTIVE), qid);
+	if (!sq->cmd_wq) {
+		dev_err(&epf->dev, "Create SQ %d cmd wq failed\n", qid);
+		memset(sq, 0, sizeof(*sq));
+		return -ENOMEM;
+	}
+
+	/* Get a reference on the completion queue */
+	cq->ref++;
+	cq->sq = sq;
+
+	dev_dbg(&epf->dev,
+		"SQ %d: %d queue entries of %zu B, CQ %d\n",
+		qid, size, sq->qes, cqid);
+
+	pci_epf_nvme_map_ring(epf_nvme, sq);
+	sq->qflags |= PCI_EPF_NVME_QUEUE_LIVE;
+
+	return 0;
+}
+
+static void pci_epf_nvme_delete_sq(struct pci_epf_nvme *epf_nvme, int qid)
+{
+	struct pci_epf_nvme_queue *sq = &epf_nvme->ctrl.sq[qid];
+
+	if (!sq->ref)
+		return;
+
+	sq->ref--;
+	if (WARN_ON_ONCE(sq->ref != 0))
+		return;
+
+	pci_epf_nvme_delete_queue(epf_nvme, sq);
+
+	if (epf_nvme->ctrl.cq[sq->cqid].ref)
+		epf_nvme->ctrl.cq[sq->cqid].ref--;
+}
+
+static void pci_epf_nvme_disable_ctrl(struct pci_epf_nvme *epf_nvme)
+{
+	struct pci_epf_nvme_ctrl *ctrl = &epf_nvme->ctrl;
+	struct pci_epf *epf = epf_nvme->epf;
+	int qid;
+
+	if (!epf_nvme->ctrl_enabled)
+		return;
+
+	dev_info(&epf->dev, "Disabling controller\n");
+
+	/*
+	 * Delete the submission queues first to release all references
+	 * to the completion queues. This also stops polling for submissions
+	 * and drains any pending command from the queue.
+	 */
+	for (qid = 1; qid < ctrl->nr_queues; qid++)
+		pci_epf_nvme_delete_sq(epf_nvme, qid);
+
+	for (qid = 1; qid < ctrl->nr_queues; qid++)
+		pci_epf_nvme_delete_cq(epf_nvme, qid);
+
+	/* Unmap the admin queue last */
+	pci_epf_nvme_delete_sq(epf_nvme, 0);
+	pci_epf_nvme_delete_cq(epf_nvme, 0);
+
+	pci_epf_nvme_post_event(epf_nvme,
+				ctrl->cc & NVME_CC_SHN_NORMAL ?
+				PCI_EPF_NVME_EVENT_CTRL_SHUTDOWN :
+				PCI_EPF_NVME_EVENT_CTRL_DISABLE, ctrl->cc, 0);
+
+	/* Tell the host we are done */
+	ctrl->csts &= ~NVME_CSTS_RDY;
+	if (ctrl->cc & NVME_CC_SHN_NORMAL) {
+		ctrl->csts |= NVME_CSTS_SHST_CMPLT;
+		ctrl->cc &= ~NVME_CC_SHN_NORMAL;
+	}
+	ctrl->cc &= ~NVME_CC_ENABLE;
+	pci_epf_nvme_reg_write32(ctrl, NVME_REG_CSTS, ctrl->csts);
+	pci_epf_nvme_reg_write32(ctrl, NVME_REG_CC, ctrl->cc);
+
+	epf_nvme->ctrl_enabled = false;
+}
+
+static void pci_epf_nvme_delete_ctrl(struct pci_epf *epf)
+{
+	struct pci_epf_nvme *epf_nvme = epf_get_drvdata(epf);
+	struct pci_epf_nvme_ctrl *ctrl = &epf_nvme->ctrl;
+
+	dev_info(&epf->dev, "Deleting controller\n");
+
+	if (epf_nvme->mirror_ctrl) {
+		nvme_put_ctrl(epf_nvme->mirror_ctrl);
+		epf_nvme->mirror_ctrl = NULL;
+	}
+
+	if (ctrl->ctrl) {
+		nvme_put_ctrl(ctrl->ctrl);
+		ctrl->ctrl = NULL;
+
+		ctrl->cc &= ~NVME_CC_SHN_NORMAL;
+		ctrl->csts |= NVME_CSTS_SHST_CMPLT;
+	}
+
+	pci_epf_nvme_disable_ctrl(epf_nvme);
+
+	/* Deferred inspection hooks may still reference the function */
+	flush_workqueue(pci_epf_nvme_hook_wq);
+
+	if (ctrl->wq) {
+		flush_workqueue(ctrl->wq);
+		destroy_workqueue(ctrl->wq);
+		ctrl->wq = NULL;
+	}
+
+	pci_epf_nvme_free_namespaces(epf_nvme);
+
+	ctrl->nr_queues = 0;
+	kfree(ctrl->cq);
+	ctrl->cq = NULL;
+	kfree(ctrl->sq);
+	ctrl->sq = NULL;
+}
+
+static struct pci_epf_nvme_queue *
+pci_epf_nvme_alloc_queues(struct pci_epf_nvme *epf_nvme, int nr_queues)
+{
+	struct pci_epf_nvme_queue *q;
+	int i;
+
+	q = kcalloc(nr_queues, sizeof(struct pci_epf_nvme_queue), GFP_KERNEL);
+	if (!q)
+		return NULL;
+
+	for (i = 0; i < nr_queues; i++) {
+		q[i].epf_nvme = epf_nvme;
+		spin_lock_init(&q[i].lock);
+		INIT_LIST_HEAD(&q[i].list);
+		spin_lock_init(&q[i].inflight_lock);
+		INIT_LIST_HEAD(&q[i].inflight);
+	}
+
+	return q;
+}
+
+static int pci_epf_nvme_create_ctrl(struct pci_epf *epf)
+{
+	struct pci_epf_nvme *epf_nvme = epf_get_drvdata(epf);
+	const struct pci_epc_features *features = epf_nvme->epc_features;
+	struct pci_epf_nvme_ctrl *ctrl = &epf_nvme->ctrl;
+	char *ctrl_opts, *mirror_opts = NULL;
+	struct nvme_ctrl *fctrl;
+	int ret;
+
+	/* We must have nvme fabrics options. */
+	mutex_lock(&epf_nvme->config_lock);
+	if (!epf_nvme->ctrl_opts_buf) {
+		mutex_unlock(&epf_nvme->config_lock);
+		dev_err(&epf->dev, "No nvme fabrics options specified\n");
+		return -EINVAL;
+	}
+	ctrl_opts = kstrdup(epf_nvme->ctrl_opts_buf, GFP_KERNEL);
+	if (epf_nvme->mirror_opts_buf)
+		mirror_opts = kstrdup(epf_nvme->mirror_opts_buf, GFP_KERNEL);
+	mutex_unlock(&epf_nvme->config_lock);
+
+	if (!ctrl_opts || (epf_nvme->mirror_opts_buf && !mirror_opts)) {
+		ret = -ENOMEM;
+		goto out_free_opts;
+	}
+
+	/* Create the fabrics controller */
+	fctrl = nvmf_create_ctrl(&epf->dev, ctrl_opts);
+	if (IS_ERR(fctrl)) {
+		dev_err(&epf->dev, "Create nvme fabrics controller failed\n");
+		ret = PTR_ERR(fctrl);
+		goto out_free_opts;
+	}
+
+	/* We only support IO controllers */
+	if (fctrl->cntrltype != NVME_CTRL_IO) {
+		dev_err(&epf->dev, "Unsupported controller type\n");
+		ret = -EINVAL;
+		goto out_delete_ctrl;
+	}
+
+	dev_info(&epf->dev, "NVMe fabrics controller created, %u I/O queues\n",
+		 fctrl->queue_count - 1);
+
+	epf_nvme->queue_count =
+		min(fctrl->queue_count, PCI_EPF_NVME_MAX_NR_QUEUES);
+	if (features->msix_capable && epf->msix_interrupts) {
+		dev_info(&epf->dev,
+			 "NVMe PCI controller supports MSI-X, %u vectors\n",
+			 epf->msix_interrupts);
+		epf_nvme->queue_count =
+			min(epf_nvme->queue_count, epf->msix_interrupts);
+	} else if (features->msi_capable && epf->msi_interrupts) {
+		dev_info(&epf->dev,
+			 "NVMe PCI controller supports MSI, %u vectors\n",
+			 epf->msi_interrupts);
+		epf_nvme->queue_count =
+			min(epf_nvme->queue_count, epf->msi_interrupts);
+	}
+
+	if (epf_nvme->queue_count < 2) {
+		dev_info(&epf->dev, "Invalid number of queues %u\n",
+			 epf_nvme->queue_count);
+		ret = -EINVAL;
+		goto out_delete_ctrl;
+	}
+
+	if (epf_nvme->queue_count != fctrl->queue_count)
+		dev_info(&epf->dev, "Limiting number of queues to %u\n",
+			 epf_nvme->queue_count);
+
+	dev_info(&epf->dev, "NVMe PCI controller: %u I/O queues\n",
+		 epf_nvme->queue_count - 1);
+
+	ret = -ENOMEM;
+
+	/* Create the workqueue for processing our SQs and CQs */
+	ctrl->wq = alloc_workqueue("ctrl_wq", WQ_HIGHPRI | WQ_UNBOUND,
+				min_t(int, ctrl->nr_queues * 2, WQ_MAX_ACTIVE));
+	if (!ctrl->wq) {
+		dev_err(&epf->dev, "Create controller wq failed\n");
+		goto out_delete_ctrl;
+	}
+
+	/* Allocate queues */
+	ctrl->nr_queues = epf_nvme->queue_count;
+	ctrl->sq = pci_epf_nvme_alloc_queues(epf_nvme, ctrl->nr_queues);
+	if (!ctrl->sq)
+		goto out_delete_ctrl;
+
+	ctrl->cq = pci_epf_nvme_alloc_queues(epf_nvme, ctrl->nr_queues);
+	if (!ctrl->cq)
+		goto out_delete_ctrl;
+
+	epf_nvme->ctrl.ctrl = fctrl;
+
+	/* Create the fabrics controller of mirrored namespaces */
+	if (mirror_opts) {
+		fctrl = nvmf_create_ctrl(&epf->dev, mirror_opts);
+		if (IS_ERR(fctrl)) {
+			dev_err(&epf->dev,
+				"Create mirror nvme fabrics controller failed\n");
+			ret = PTR_ERR(fctrl);
+			goto out_delete_ctrl;
+		}
+		epf_nvme->mirror_ctrl = fctrl;
+
+		dev_info(&epf->dev, "NVMe fabrics mirror controller created\n");
+	}
+
+	pci_epf_nvme_create_namespaces(epf_nvme);
+
+	/* Remember the options in use, to detect changes */
+	mutex_lock(&epf_nvme->config_lock);
+	kfree(epf_nvme->ctrl_opts_active);
+	epf_nvme->ctrl_opts_active = ctrl_opts;
+	kfree(epf_nvme->mirror_opts_active);
+	epf_nvme->mirror_opts_active = mirror_opts;
+	mutex_unlock(&epf_nvme->config_lock);
+
+	return 0;
+
+out_delete_ctrl:
+	pci_epf_nvme_delete_ctrl(epf);
+out_free_opts:
+	kfree(ctrl_opts);
+	kfree(mirror_opts);
+
+	return ret;
+}
+
+/*
+ * Check if the fabrics controllers options were changed since the
+ * controllers were created.
+ */
+static bool pci_epf_nvme_opts_changed(struct pci_epf_nvme *epf_nvme)
+{
+	bool changed;
+
+	mutex_lock(&epf_nvme->config_lock);
+	changed = strcmp(epf_nvme->ctrl_opts_buf ?: "",
+			 epf_nvme->ctrl_opts_active ?: "") ||
+		strcmp(epf_nvme->mirror_opts_buf ?: "",
+		       epf_nvme->mirror_opts_active ?: "");
+	mutex_unlock(&epf_nvme->config_lock);
+
+	return changed;
+}
+
+static void pci_epf_nvme_init_ctrl_regs(struct pci_epf *epf)
+{
+	struct pci_epf_nvme *epf_nvme = epf_get_drvdata(epf);
+	struct pci_epf_nvme_ctrl *ctrl = &epf_nvme->ctrl;
+
+	ctrl->reg = epf_nvme->reg_bar;
+
+	/* Copy the fabrics controller capabilities as a base */
+	ctrl->cap = ctrl->ctrl->cap;
+
+	/* Contiguous Queues Required (CQR) */
+	ctrl->cap |= 0x1ULL << 16;
+
+	/* Set Doorbell stride to 4B (DSTRB) */
+	ctrl->cap &= ~GENMASK(35, 32);
+
+	/* Clear NVM Subsystem Reset Supported (NSSRS) */
+	ctrl->cap &= ~(0x1ULL << 36);
+
+	/* Clear Boot Partition Support (BPS) */
+	ctrl->cap &= ~(0x1ULL << 45);
+
+	/* Memory Page Size minimum (MPSMIN) = 4K */
+	ctrl->cap |= (NVME_CTRL_PAGE_SHIFT - 12) << NVME_CC_MPS_SHIFT;
+
+	/* Memory Page Size maximum (MPSMAX) = 4K */
+	ctrl->cap |= (NVME_CTRL_PAGE_SHIFT - 12) << NVME_CC_MPS_SHIFT;
+
+	/* Clear Persistent Memory Region Supported (PMRS) */
+	ctrl->cap &= ~(0x1ULL << 56);
+
+	/* Clear Controller Memory Buffer Supported (CMBS) */
+	ctrl->cap &= ~(0x1ULL << 57);
+
+	/* NVMe version supported */
+	ctrl->vs = ctrl->ctrl->vs;
+
+	/* Controller configuration */
+	ctrl->cc = ctrl->ctrl->ctrl_config & (~NVME_CC_ENABLE);
+
+	/* Controller Status (not ready) */
+	ctrl->csts = 0;
+
+	pci_epf_nvme_reg_write64(ctrl, NVME_REG_CAP, ctrl->cap);
+	pci_epf_nvme_reg_write32(ctrl, NVME_REG_VS, ctrl->vs);
+	pci_epf_nvme_reg_write32(ctrl, NVME_REG_CSTS, ctrl->csts);
+	pci_epf_nvme_reg_write32(ctrl, NVME_REG_CC, ctrl->cc);
+}
+
+static void pci_epf_nvme_enable_ctrl(struct pci_epf_nvme *epf_nvme)
+{
+	struct pci_epf_nvme_ctrl *ctrl = &epf_nvme->ctrl;
+	struct pci_epf *epf = epf_nvme->epf;
+	int ret;
+
+	dev_info(&epf->dev, "Enabling controller\n");
+
+	ctrl->mdts = epf_nvme->mdts_kb * SZ_1K;
+
+	ctrl->nr_io_queues = ctrl->nr_queues - 1;
+	if (epf_nvme->max_io_queues)
+		ctrl->nr_io_queues = min(ctrl->nr_io_queues,
+					 epf_nvme->max_io_queues);
+
+	ctrl->mps_shift = ((ctrl->cc >> NVME_CC_MPS_SHIFT) & 0xf) + 12;
+	ctrl->mps = 1UL << ctrl->mps_shift;
+	ctrl->mps_mask = ctrl->mps - 1;
+
+	ctrl->adm_sqes = 1UL << NVME_ADM_SQES;
+	ctrl->adm_cqes = sizeof(struct nvme_completion);
+	ctrl->io_sqes = 1UL << ((ctrl->cc >> NVME_CC_IOSQES_SHIFT) & 0xf);
+	ctrl->io_cqes = 1UL << ((ctrl->cc >> NVME_CC_IOCQES_SHIFT) & 0xf);
+
+	if (ctrl->io_sqes < sizeof(struct nvme_command)) {
+		dev_err(&epf->dev, "Unsupported IO sqes %zu (need %zu)\n",
+			ctrl->io_sqes, sizeof(struct nvme_command));
+		return;
+	}
+
+	if (ctrl->io_cqes < sizeof(struct nvme_completion)) {
+		dev_err(&epf->dev, "Unsupported IO cqes %zu (need %zu)\n",
+			ctrl->io_sqes, sizeof(struct nvme_completion));
+		return;
+	}
+
+	ctrl->aqa = pci_epf_nvme_reg_read32(ctrl, NVME_REG_AQA);
+	ctrl->asq = pci_epf_nvme_reg_read64(ctrl, NVME_REG_ASQ);
+	ctrl->acq = pci_epf_nvme_reg_read64(ctrl, NVME_REG_ACQ);
+
+	/*
+	 * Create the PCI controller admin completion and submission queues.
+	 */
+	ret = pci_epf_nvme_create_cq(epf_nvme, 0,
+				NVME_QUEUE_PHYS_CONTIG | NVME_CQ_IRQ_ENABLED,
+				(ctrl->aqa & 0x0fff0000) >> 16, 0,
+				ctrl->acq & GENMASK(63, 12));
+	if (ret)
+		return;
+
+	ret = pci_epf_nvme_create_sq(epf_nvme, 0, 0, NVME_QUEUE_PHYS_CONTIG,
+				     ctrl->aqa & 0x0fff,
+				     ctrl->asq & GENMASK(63, 12));
+	if (ret) {
+		pci_epf_nvme_delete_cq(epf_nvme, 0);
+		return;
+	}
+
+	nvme_start_ctrl(ctrl->ctrl);
+
+	/* Tell the host we are now ready */
+	ctrl->csts |= NVME_CSTS_RDY;
+	pci_epf_nvme_reg_write32(ctrl, NVME_REG_CSTS, ctrl->csts);
+
+	/* Start polling the admin submission queue */
+	queue_delayed_work(ctrl->wq, &ctrl->sq[0].work, msecs_to_jiffies(5));
+
+	epf_nvme->ctrl_enabled = true;
+
+	pci_epf_nvme_post_event(epf_nvme, PCI_EPF_NVME_EVENT_CTRL_ENABLE,
+				ctrl->cc, 0);
+}
+
+static void pci_epf_nvme_process_create_cq(struct pci_epf_nvme *epf_nvme,
+					   struct pci_epf_nvme_cmd *epcmd)
+{
+	struct nvme_command *cmd = &epcmd->cmd;
+	int mqes = NVME_CAP_MQES(epf_nvme->ctrl.cap);
+	u16 cqid, cq_flags, qsize, vector;
+	int ret;
+
+	cqid = le16_to_cpu(cmd->create_cq.cqid);
+	if (!cqid || cqid > epf_nvme->ctrl.nr_io_queues ||
+	    epf_nvme->ctrl.cq[cqid].ref) {
+		epcmd->status = NVME_SC_QID_INVALID | NVME_STATUS_DNR;
+		return;
+	}
+
+	cq_flags = le16_to_cpu(cmd->create_cq.cq_flags);
+	if (!(cq_flags & NVME_QUEUE_PHYS_CONTIG)) {
+		epcmd->status = NVME_SC_INVALID_QUEUE | NVME_STATUS_DNR;
+		return;
+	}
+
+	qsize = le16_to_cpu(cmd->create_cq.qsize);
+	if (!qsize || qsize > NVME_CAP_MQES(epf_nvme->ctrl.cap)) {
+		if (qsize > mqes)
+			dev_warn(&epf_nvme->epf->dev,
+				 "Create CQ %d, qsize %d > mqes %d: buggy driver?\n",
+				 cqid, (int)qsize, mqes);
+		epcmd->status = NVME_SC_QUEUE_SIZE | NVME_STATUS_DNR;
+		return;
+	}
+
+	vector = le16_to_cpu(cmd->create_cq.irq_vector);
+	if (vector >= epf_nvme->nr_vectors) {
+		epcmd->status = NVME_SC_INVALID_VECTOR | NVME_STATUS_DNR;
+		return;
+	}
+
+	ret = pci_epf_nvme_create_cq(epf_nvme, cqid, cq_flags, qsize, vector,
+				     le64_to_cpu(cmd->create_cq.prp1));
+	if (ret)
+		epcmd->status = NVME_SC_INTERNAL | NVME_STATUS_DNR;
+}
+
+static void pci_epf_nvme_process_delete_cq(struct pci_epf_nvme *epf_nvme,
+					   struct pci_epf_nvme_cmd *epcmd)
+{
+	struct nvme_command *cmd = &epcmd->cmd;
+	u16 cqid;
+
+	cqid = le16_to_cpu(cmd->delete_queue.qid);
+	if (!cqid ||
+	    cqid >= epf_nvme->ctrl.nr_queues ||
+	    !epf_nvme->ctrl.cq[cqid].ref) {
+		epcmd->status = NVME_SC_QID_INVALID | NVME_STATUS_DNR;
+		return;
+	}
+
+	pci_epf_nvme_delete_cq(epf_nvme, cqid);
+}
+
+static void pci_epf_nvme_process_create_sq(struct pci_epf_nvme *epf_nvme,
+					   struct pci_epf_nvme_cmd *epcmd)
+{
+	struct nvme_command *cmd = &epcmd->cmd;
+	int mqes = NVME_CAP_MQES(epf_nvme->ctrl.cap);
+	u16 sqid, cqid, sq_flags, qsize;
+	int ret;
+
+	sqid = le16_to_cpu(cmd->create_sq.sqid);
+	if (!sqid || sqid > epf_nvme->ctrl.nr_io_queues ||
+	    epf_nvme->ctrl.sq[sqid].ref) {
+		epcmd->status = NVME_SC_QID_INVALID | NVME_STATUS_DNR;
+		return;
+	}
+
+	cqid = le16_to_cpu(cmd->create_sq.cqid);
+	if (!cqid || !epf_nvme->ctrl.cq[cqid].ref) {
+		epcmd->status = NVME_SC_CQ_INVALID | NVME_STATUS_DNR;
+		return;
+	}
+
+	sq_flags = le16_to_cpu(cmd->create_sq.sq_flags);
+	if (!(sq_flags & NVME_QUEUE_PHYS_CONTIG)) {
+		epcmd->status = NVME_SC_INVALID_QUEUE | NVME_STATUS_DNR;
+		return;
+	}
+
+	qsize = le16_to_cpu(cmd->create_sq.qsize);
+	if (!qsize || qsize > mqes) {
+		if (qsize > mqes)
+			dev_warn(&epf_nvme->epf->dev,
+				 "Create SQ %d, qsize %d > mqes %d: buggy driver?\n",
+				 sqid, (int)qsize, mqes);
+		epcmd->status = NVME_SC_QUEUE_SIZE | NVME_STATUS_DNR;
+		return;
+	}
+
+	ret = pci_epf_nvme_create_sq(epf_nvme, sqid, cqid, sq_flags, qsize,
+				     le64_to_cpu(cmd->create_sq.prp1));
+	if (ret) {
+		epcmd->status = NVME_SC_INTERNAL | NVME_STATUS_DNR;
+		return;
+	}
+
+	/* Start polling the submission queue */
+	queue_delayed_work(epf_nvme->ctrl.wq, &epf_nvme->ctrl.sq[sqid].work, 1);
+}
+
+static void pci_epf_nvme_process_delete_sq(struct pci_epf_nvme *epf_nvme,
+					   struct pci_epf_nvme_cmd *epcmd)
+{
+	struct nvme_command *cmd = &epcmd->cmd;
+	u16 sqid;
+
+	sqid = le16_to_cpu(cmd->delete_queue.qid);
+	if (!sqid ||
+	    sqid >= epf_nvme->ctrl.nr_queues ||
+	    !epf_nvme->ctrl.sq[sqid].ref) {
+		epcmd->status = NVME_SC_QID_INVALID | NVME_STATUS_DNR;
+		return;
+	}
+
+	pci_epf_nvme_delete_sq(epf_nvme, sqid);
+}
+
+/*
+ * Abort an I/O command: commands not started yet are canceled and
+ * completed right away, commands being executed are marked to complete
+ * with an aborted status at the next stage of their execution. Admin
+ * commands are executed synchronously and cannot be aborted.
+ */
+static void pci_epf_nvme_process_abort(struct pci_epf_nvme *epf_nvme,
+				       struct pci_epf_nvme_cmd *epcmd)
+{
+	u32 cdw10 = le32_to_cpu(epcmd->cmd.common.cdw10);
+	u16 sqid = cdw10 & 0xffff;
+	u16 cid = cdw10 >> 16;
+	struct pci_epf_nvme_cmd *acmd, *found = NULL;
+	struct pci_epf_nvme_queue *sq;
+	bool canceled = false;
+
+	/* Command not aborted */
+	epcmd->cqe.result.u32 = cpu_to_le32(1);
+
+	if (sqid >= epf_nvme->ctrl.nr_queues)
+		return;
+	sq = &epf_nvme->ctrl.sq[sqid];
+	if (!sqid || !sq->ref)
+		return;
+
+	spin_lock(&sq->inflight_lock);
+	list_for_each_entry(acmd, &sq->inflight, inflight_link) {
+		if (acmd->cmd.common.command_id != cid)
+			continue;
+		found = acmd;
+		canceled = cancel_work(&acmd->work);
+		if (canceled)
+			list_del_init(&acmd->inflight_link);
+		else
+			WRITE_ONCE(acmd->aborted, true);
+		break;
+	}
+	spin_unlock(&sq->inflight_lock);
+
+	if (!found)
+		return;
+
+	dev_dbg(&epf_nvme->epf->dev, "SQ %u: abort command %u%s\n",
+		sqid, cid, canceled ? "" : " in flight");
+
+	if (canceled) {
+		/* Not accounted by the completion, as it is off the list */
+		atomic_dec(&epf_nvme->nr_io_cmds);
+		epcmd->cqe.result.u32 = 0;
+		found->status = NVME_SC_ABORT_REQ;
+		pci_epf_nvme_complete_cmd(found);
+	}
+}
+
+static void pci_epf_nvme_identify_ns_hook(struct pci_epf_nvme_cmd *epcmd)
+{
+	struct pci_epf_nvme *epf_nvme = epcmd->epf_nvme;
+	struct nvme_command *cmd = &epcmd->cmd;
+	struct nvme_id_ns *id = epcmd->buffer;
+	struct pci_epf_nvme_ns *epns;
+
+	epns = pci_epf_nvme_get_ns(epf_nvme, le32_to_cpu(cmd->identify.nsid));
+	if (!epns)
+		return;
+
+	/* Compressed and PI namespaces expose less LBAs than their backend */
+	if (epns->comp || epns->pi) {
+		id->nsze = cpu_to_le64(pci_epf_nvme_ns_nr_lbas(epns));
+		id->ncap = id->nsze;
+		id->nuse = id->nsze;
+	}
+
+	if (!epns->pi)
+		return;
+
+	/* Report a single LBA format, with metadata holding the PI */
+	id->nlbaf = 0;
+	id->flbas = epns->pi->extended ? NVME_NS_FLBAS_META_EXT : 0;
+	memset(id->lbaf, 0, sizeof(id->lbaf));
+	id->lbaf[0].ms = cpu_to_le16(epns->pi->ms);
+	id->lbaf[0].ds = epns->lba_shift;
+	id->mc = NVME_MC_EXTENDED_LBA | NVME_MC_METADATA_PTR;
+	id->dpc = NVME_NS_DPC_PI_LAST | (1 << (epns->pi->type - 1));
+	id->dps = epns->pi->type;
+}
+
+static u32 pci_epf_nvme_next_local_nsid(struct pci_epf_nvme *epf_nvme,
+					u32 nsid)
+{
+	while (++nsid <= epf_nvme->max_local_nsid) {
+		if (pci_epf_nvme_get_local_ns(epf_nvme, nsid))
+			return nsid;
+	}
+
+	return 0;
+}
+
+/*
+ * Merge the namespaces defined through configfs in the active namespace list
+ * of the fabrics controller.
+ */
+static void pci_epf_nvme_identify_list_hook(struct pci_epf_nvme_cmd *epcmd)
+{
+	struct pci_epf_nvme *epf_nvme = epcmd->epf_nvme;
+	unsigned int i = 0, n, nr = NVME_IDENTIFY_DATA_SIZE / sizeof(__le32);
+	__le32 *list = epcmd->buffer, *fabrics_list;
+	u32 nsid, fnsid, lnsid;
+
+	lnsid = pci_epf_nvme_next_local_nsid(epf_nvme,
+				le32_to_cpu(epcmd->cmd.identify.nsid));
+	if (!lnsid)
+		return;
+
+	fabrics_list = kmemdup(list, NVME_IDENTIFY_DATA_SIZE, GFP_KERNEL);
+	if (!fabrics_list)
+		return;
+
+	for (n = 0; n < nr; n++) {
+		fnsid = i < nr ? le32_to_cpu(fabrics_list[i]) : 0;
+		if (!fnsid && !lnsid)
+			break;
+
+		if (lnsid && (!fnsid || lnsid <= fnsid)) {
+			if (lnsid == fnsid)
+				i++;
+			nsid = lnsid;
+			lnsid = pci_epf_nvme_next_local_nsid(epf_nvme, lnsid);
+		} else {
+			nsid = fnsid;
+			i++;
+		}
+
+		list[n] = cpu_to_le32(nsid);
+	}
+
+	memset(&list[n], 0, (nr - n) * sizeof(__le32));
+
+	kfree(fabrics_list);
+}
+
+static void pci_epf_nvme_identify_hook(struct pci_epf_nvme_cmd *epcmd)
+{
+	struct pci_epf_nvme *epf_nvme = epcmd->epf_nvme;
+	struct nvme_command *cmd = &epcmd->cmd;
+	struct nvme_id_ctrl *id = epcmd->buffer;
+	unsigned int page_shift;
+
+	if (cmd->identify.cns == NVME_ID_CNS_NS) {
+		pci_epf_nvme_identify_ns_hook(epcmd);
+		return;
+	}
+
+	if (cmd->identify.cns == NVME_ID_CNS_NS_ACTIVE_LIST) {
+		pci_epf_nvme_identify_list_hook(epcmd);
+		return;
+	}
+
+	if (cmd->identify.cns != NVME_ID_CNS_CTRL)
+		return;
+
+	/* Include the namespaces defined through configfs */
+	if (epf_nvme->max_local_nsid > le32_to_cpu(id->nn))
+		id->nn = cpu_to_le32(epf_nvme->max_local_nsid);
+
+	/* Set device vendor IDs */
+	id->vid = cpu_to_le16(epf_nvme->epf->header->vendorid);
+	id->ssvid = id->vid;
+
+	/* Set Maximum Data Transfer Size (MDTS) */
+	page_shift = NVME_CAP_MPSMIN(epf_nvme->ctrl.ctrl->cap) + 12;
+	id->mdts = ilog2(epf_nvme->ctrl.mdts) - page_shift;
+
+	/* Clear Controller Multi-Path I/O and Namespace Sharing Capabilities */
+	id->cmic = 0;
+
+	/* Abort commands are executed locally */
+	id->acl = PCI_EPF_NVME_ABORT_LIMIT - 1;
+
+	/* Do not report support for Autonomous Power State Transitions */
+	id->apsta = 0;
+
+	/* Indicate no support for SGLs */
+	id->sgls = 0;
+
+	/* 64b guards are reported with the NVM command set identify data */
+	if (epf_nvme->pi_type && epf_nvme->pi_guard == NVME_NVM_NS_64B_GUARD)
+		id->ctratt |= cpu_to_le32(NVME_CTRL_ATTR_ELBAS);
+}
+
+static void pci_epf_nvme_get_log_hook(struct pci_epf_nvme_cmd *epcmd)
+{
+	struct nvme_command *cmd = &epcmd->cmd;
+	struct nvme_effects_log *log = epcmd->buffer;
+
+	if (cmd->get_log_page.lid != NVME_LOG_CMD_EFFECTS)
+		return;
+
+	/*
+	 * ACS0     [Delete I/O Submission Queue     ] 00000001
+	 * CSUPP+  LBCC-  NCC-  NIC-  CCC-  USS-  No command restriction
+	 */
+	log->acs[0] |= cpu_to_le32(NVME_CMD_EFFECTS_CSUPP);
+
+	/*
+	 * ACS1     [Create I/O Submission Queue     ] 00000001
+	 * CSUPP+  LBCC-  NCC-  NIC-  CCC-  USS-  No command restriction
+	 */
+	log->acs[1] |= cpu_to_le32(NVME_CMD_EFFECTS_CSUPP);
+
+	/*
+	 * ACS4     [Delete I/O Completion Queue     ] 00000001
+	 * CSUPP+  LBCC-  NCC-  NIC-  CCC-  USS-  No command restriction
+	 */
+	log->acs[4] |= cpu_to_le32(NVME_CMD_EFFECTS_CSUPP);
+
+	/*
+	 * ACS5     [Create I/O Completion Queue     ] 00000001
+	 * CSUPP+  LBCC-  NCC-  NIC-  CCC-  USS-  No command restriction
+	 */
+	log->acs[5] |= cpu_to_le32(NVME_CMD_EFFECTS_CSUPP);
+
+	/*
+	 * Vendor specific I/O commands executed locally.
+	 */
+	log->iocs[PCI_EPF_NVME_CMD_SCAN] |= cpu_to_le32(NVME_CMD_EFFECTS_CSUPP);
+	log->iocs[PCI_EPF_NVME_CMD_HASH] |= cpu_to_le32(NVME_CMD_EFFECTS_CSUPP);
+}
+
+/*
+ * Returns true if the command has been handled
+ */
+static bool pci_epf_nvme_process_set_features(struct pci_epf_nvme_cmd *epcmd)
+{
+	struct pci_epf_nvme *epf_nvme = epcmd->epf_nvme;
+	struct pci_epf_nvme_ctrl *ctrl = &epf_nvme->ctrl;
+	u32 cdw10 = le32_to_cpu(epcmd->cmd.common.cdw10);
+	u32 cdw11 = le32_to_cpu(epcmd->cmd.common.cdw11);
+	u8 feat = cdw10 & 0xff;
+	u16 nr_ioq, nsqr, ncqr;
+	int qid;
+
+	switch (feat) {
+	case NVME_FEAT_NUM_QUEUES:
+		ncqr = (cdw11 >> 16) & 0xffff;
+		nsqr = cdw11 & 0xffff;
+		if (ncqr == 0xffff || nsqr == 0xffff) {
+			epcmd->status = NVME_SC_INVALID_FIELD | NVME_STATUS_DNR;
+			return true;
+		}
+
+		/* We cannot accept this command if we already have IO queues */
+		for (qid = 1; qid < ctrl->nr_queues; qid++) {
+			if (epf_nvme->ctrl.sq[qid].ref ||
+			    epf_nvme->ctrl.cq[qid].ref) {
+				epcmd->status =
+					NVME_SC_CMD_SEQ_ERROR | NVME_STATUS_DNR;
+				return true;
+			}
+		}
+
+		/*
+		 * Number of I/O queues to report must not include the admin
+		 * queue and is a 0-based value, so it is the number of I/O
+		 * queues allowed minus one.
+		 */
+		nr_ioq = ctrl->nr_io_queues - 1;
+		epcmd->cqe.result.u32 = cpu_to_le32(nr_ioq | (nr_ioq << 16));
+		return true;
+	case NVME_FEAT_IRQ_COALESCE:
+	case NVME_FEAT_ARBITRATION:
+		/* We do not need to do anything special here. */
+		epcmd->status = NVME_SC_SUCCESS;
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Returns true if the command has been handled
+ */
+static bool pci_epf_nvme_process_get_features(struct pci_epf_nvme_cmd *epcmd)
+{
+	struct pci_epf_nvme *epf_nvme = epcmd->epf_nvme;
+	struct pci_epf_nvme_ctrl *ctrl = &epf_nvme->ctrl;
+	u32 cdw10 = le32_to_cpu(epcmd->cmd.common.cdw10);
+	u8 feat = cdw10 & 0xff;
+	u16 nr_ioq;
+
+	switch (feat) {
+	case NVME_FEAT_NUM_QUEUES:
+		/*
+		 * Number of I/O queues to report must not include the admin
+		 * queue and is a 0-based value, so it is the number of I/O
+		 * queues allowed minus one.
+		 */
+		nr_ioq = ctrl->nr_io_queues - 1;
+		epcmd->cqe.result.u32 = cpu_to_le32(nr_ioq | (nr_ioq << 16));
+		return true;
+	case NVME_FEAT_IRQ_COALESCE:
+	case NVME_FEAT_ARBITRATION:
+		/* We do not need to do anything special here. */
+		epcmd->status = NVME_SC_SUCCESS;
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void pci_epf_nvme_process_admin_cmd(struct pci_epf_nvme_cmd *epcmd)
+{
+	struct pci_epf_nvme *epf_nvme = epcmd->epf_nvme;
+	void (*post_exec_hook)(struct pci_epf_nvme_cmd *) = NULL;
+	struct nvme_command *cmd = &epcmd->cmd;
+
+	switch (cmd->common.opcode) {
+	case nvme_admin_identify:
+		post_exec_hook = pci_epf_nvme_identify_hook;
+		epcmd->buffer_size = NVME_IDENTIFY_DATA_SIZE;
+		epcmd->dma_dir = DMA_TO_DEVICE;
+		break;
+
+	case nvme_admin_get_log_page:
+		post_exec_hook = pci_epf_nvme_get_log_hook;
+		epcmd->buffer_size = nvme_get_log_page_len(cmd);
+		epcmd->dma_dir = DMA_TO_DEVICE;
+		break;
+
+	case nvme_admin_async_event:
+		/*
+		 * Async events are a pain to deal with as they get canceled
+		 * only once we delete the fabrics controller, which happens
+		 * after the epf function is deleted, thus causing access to
+		 * freed memory or leaking of epcmd. So ignore these commands
+		 * for now, which is fine. The host will simply never see any
+		 * event.
+		 */
+		pci_epf_nvme_free_cmd(epcmd);
+		return;
+
+	case nvme_admin_set_features:
+		/*
+		 * Several NVMe features do not apply to the NVMe fabrics
+		 * host controller, so handle them directly here.
+		 */
+		if (pci_epf_nvme_process_set_features(epcmd))
+			goto complete;
+		break;
+
+	case nvme_admin_get_features:
+		/*
+		 * Several NVMe features do not apply to the NVMe fabrics
+		 * host controller, so handle them directly here.
+		 */
+		if (pci_epf_nvme_process_get_features(epcmd))
+			goto complete;
+		break;
+
+	case nvme_admin_abort_cmd:
+		pci_epf_nvme_process_abort(epf_nvme, epcmd);
+		goto complete;
+
+	case nvme_admin_create_cq:
+		pci_epf_nvme_process_create_cq(epf_nvme, epcmd);
+		goto complete;
+
+	case nvme_admin_create_sq:
+		pci_epf_nvme_process_create_sq(epf_nvme, epcmd);
+		goto complete;
+
+	case nvme_admin_delete_cq:
+		pci_epf_nvme_process_delete_cq(epf_nvme, epcmd);
+		goto complete;
+
+	case nvme_admin_delete_sq:
+		pci_epf_nvme_process_delete_sq(epf_nvme, epcmd);
+		goto complete;
+
+	default:
+		dev_err(&epf_nvme->epf->dev,
+			"Unhandled admin command %s (0x%02x)\n",
+			pci_epf_nvme_cmd_name(epcmd), cmd->common.opcode);
+		epcmd->status = NVME_SC_INVALID_OPCODE | NVME_STATUS_DNR;
+		goto complete;
+	}
+
+	/* Synchronously execute the command */
+	pci_epf_nvme_exec_cmd(epcmd, post_exec_hook);
+
+complete:
+	pci_epf_nvme_complete_cmd(epcmd);
+}
+
+static inline size_t pci_epf_nvme_rw_data_len(struct pci_epf_nvme_cmd *epcmd)
+{
+	struct pci_epf_nvme_pi *pi = epcmd->epns->pi;
+	size_t nlb = (u32)le16_to_cpu(epcmd->cmd.rw.length) + 1;
+	size_t len = nlb << epcmd->epns->lba_shift;
+
+	/*
+	 * Transfer the metadata with the data of extended LBAs, or set the
+	 * size of the separate metadata. No metadata is transferred when the
+	 * PI is inserted and stripped by the controller (PRACT).
+	 */
+	if (!pi || le16_to_cpu(epcmd->cmd.rw.control) & NVME_RW_PRINFO_PRACT)
+		return len;
+
+	if (pi->extended)
+		return len + nlb * pi->ms;
+
+	epcmd->meta_size = nlb * pi->ms;
+
+	return len;
+}
+
+static void pci_epf_nvme_process_io_cmd(struct pci_epf_nvme_cmd *epcmd,
+					struct pci_epf_nvme_queue *sq)
+{
+	struct pci_epf_nvme *epf_nvme = epcmd->epf_nvme;
+
+	/* Get the command target namespace */
+	epcmd->epns = pci_epf_nvme_get_ns(epf_nvme,
+					  le32_to_cpu(epcmd->cmd.common.nsid));
+	if (!epcmd->epns) {
+		epcmd->status = NVME_SC_INVALID_NS | NVME_STATUS_DNR;
+		goto complete;
+	}
+	epcmd->ns = epcmd->epns->ns;
+
+	switch (epcmd->cmd.common.opcode) {
+	case nvme_cmd_read:
+		epcmd->buffer_size = pci_epf_nvme_rw_data_len(epcmd);
+		epcmd->dma_dir = DMA_TO_DEVICE;
+		break;
+
+	case nvme_cmd_write:
+		epcmd->buffer_size = pci_epf_nvme_rw_data_len(epcmd);
+		epcmd->dma_dir = DMA_FROM_DEVICE;
+		break;
+
+	case nvme_cmd_dsm:
+		epcmd->buffer_size = (le32_to_cpu(epcmd->cmd.dsm.nr) + 1) *
+			sizeof(struct nvme_dsm_range);
+		epcmd->dma_dir = DMA_FROM_DEVICE;
+		goto complete;
+
+	case nvme_cmd_flush:
+	case nvme_cmd_write_zeroes:
+		break;
+
+	case PCI_EPF_NVME_CMD_SCAN:
+	case PCI_EPF_NVME_CMD_HASH:
+		epcmd->buffer_size =
+			(size_t)le32_to_cpu(epcmd->cmd.common.cdw10) << 2;
+		if (!epcmd->buffer_size) {
+			epcmd->status = NVME_SC_INVALID_FIELD | NVME_STATUS_DNR;
+			goto complete;
+		}
+		epcmd->dma_dir = DMA_TO_DEVICE;
+		break;
+
+	default:
+		dev_err(&epf_nvme->epf->dev,
+			"Unhandled IO command %s (0x%02x)\n",
+			pci_epf_nvme_cmd_name(epcmd),
+			epcmd->cmd.common.opcode);
+		epcmd->status = NVME_SC_INVALID_OPCODE | NVME_STATUS_DNR;
+		goto complete;
+	}
+
+	atomic_inc(&epf_nvme->nr_io_cmds);
+	spin_lock(&sq->inflight_lock);
+	list_add_tail(&epcmd->inflight_link, &sq->inflight);
+	spin_unlock(&sq->inflight_lock);
+
+	queue_work(sq->cmd_wq, &epcmd->work);
+
+	return;
+
+complete:
+	pci_epf_nvme_complete_cmd(epcmd);
+}
+
+static bool pci_epf_nvme_fetch_cmd(struct pci_epf_nvme *epf_nvme,
+				   struct pci_epf_nvme_queue *sq)
+{
+	struct pci_epf_nvme_ctrl *ctrl = &epf_nvme->ctrl;
+	struct pci_epf_nvme_cmd *epcmd;
+	int ret;
+
+	if (!(sq->qflags & PCI_EPF_NVME_QUEUE_LIVE))
+		return false;
+
+	sq->tail = pci_epf_nvme_reg_read32(ctrl, sq->db);
+	if (sq->head == sq->tail)
+		return false;
+
+	ret = pci_epf_nvme_map_queue(epf_nvme, sq);
+	if (ret)
+		return false;
+
+	while (sq->head != sq->tail) {
+		epcmd = pci_epf_nvme_alloc_cmd(epf_nvme);
+		if (!epcmd)
+			break;
+
+		/* Get the NVMe command submitted by the host */
+		pci_epf_nvme_init_cmd(epf_nvme, epcmd, sq->qid, sq->cqid);
+		pci_epf_nvme_memcpy_fromio(&epcmd->cmd,
+				sq->pci_map.virt_addr + sq->head * sq->qes,
+				sizeof(struct nvme_command));
+
+		dev_dbg(&epf_nvme->epf->dev,
+			"sq[%d]: head %d/%d, tail %d, command %s\n",
+			sq->qid, (int)sq->head, (int)sq->depth,
+			(int)sq->tail, pci_epf_nvme_cmd_name(epcmd));
+
+		sq->head++;
+		if (sq->head == sq->depth)
+			sq->head = 0;
+
+		list_add_tail(&epcmd->link, &sq->list);
+	}
+
+	pci_epf_nvme_unmap_queue(epf_nvme, sq);
+
+	return !list_empty(&sq->list);
+}
+
+/*
+ * Set the minimum utilization clamp of the current task, so that the
+ * scheduler and cpufreq see the I/O load of the SQ poller.
+ */
+static void pci_epf_nvme_set_uclamp_min(unsigned int util_min)
+{
+#ifdef CONFIG_UCLAMP_TASK
+	struct sched_attr attr = {
+		/* Keep the current policy and parameters */
+		.sched_policy = -1,
+		.sched_flags = SCHED_FLAG_KEEP_ALL |
+			       SCHED_FLAG_UTIL_CLAMP_MIN,
+		.sched_util_min = util_min,
+	};
+
+	sched_setattr_nocheck(current, &attr);
+#endif
+}
+
+/*
+ * Utilization clamp of the SQ poller for the current load: the full boost
+ * at the onset of a burst, then scaled with the number of I/O commands
+ * being executed. The clamp is quantized in a few steps, so that the
+ * scheduler attributes are only changed when the load changes notably.
+ */
+static unsigned int pci_epf_nvme_poll_uclamp(struct pci_epf_nvme *epf_nvme,
+					     unsigned int boost, bool onset)
+{
+	unsigned int nr_cmds, step;
+
+	if (onset)
+		return boost;
+
+	nr_cmds = min_t(unsigned int, atomic_read(&epf_nvme->nr_io_cmds),
+			PCI_EPF_NVME_UCLAMP_QD);
+	step = DIV_ROUND_UP(nr_cmds * PCI_EPF_NVME_UCLAMP_STEPS,
+			    PCI_EPF_NVME_UCLAMP_QD);
+
+	return boost * step / PCI_EPF_NVME_UCLAMP_STEPS;
+}
+
+static void pci_epf_nvme_sq_work(struct work_struct *work)
+{
+	struct pci_epf_nvme_queue *sq =
+		container_of(work, struct pci_epf_nvme_queue, work.work);
+	struct pci_epf_nvme *epf_nvme = sq->epf_nvme;
+	unsigned int boost = READ_ONCE(epf_nvme->uclamp_boost);
+	unsigned int idle_ms = READ_ONCE(epf_nvme->poll_idle_ms);
+	unsigned int uclamp = 0, util_min;
+	struct pci_epf_nvme_cmd *epcmd;
+	unsigned long poll_interval = 1;
+	unsigned long j = jiffies;
+	bool idle;
+
+	/* Do not spin on I/O queues idle for more than poll_idle_ms */
+	idle = sq->qid && idle_ms &&
+		time_after(j, sq->last_fetch + msecs_to_jiffies(idle_ms));
+
+	while (pci_epf_nvme_ctrl_ready(epf_nvme) &&
+	       (sq->qflags & PCI_EPF_NVME_QUEUE_LIVE)) {
+		/*
+		 * Try to get commands from the host. If We do not yet have any
+		 * command, aggressively keep polling the SQ of IO queues for at
+		 * most one tick and fall back to rescheduling the SQ work if we
+		 * have not received any command after that. This hybrid
+		 * spin-polling method significantly increases the IOPS for
+		 * shallow queue depth operation (e.g. QD=1). After sustained
+		 * idle, only check the SQ once per tick to save power.
+		 */
+		if (!pci_epf_nvme_fetch_cmd(epf_nvme, sq)) {
+			if (!sq->qid || idle || jiffies > j + 1)
+				break;
+			usleep_range(1, 2);
+			continue;
+		}
+
+		sq->last_fetch = jiffies;
+
+		if (boost && sq->qid) {
+			util_min = pci_epf_nvme_poll_uclamp(epf_nvme, boost,
+							    idle);
+			/* Only update the clamp when its step changes */
+			if (util_min != uclamp) {
+				pci_epf_nvme_set_uclamp_min(util_min);
+				uclamp = util_min;
+			}
+		}
+		idle = false;
+
+		while (!list_empty(&sq->list)) {
+			epcmd = list_first_entry(&sq->list,
+						 struct pci_epf_nvme_cmd, link);
+			list_del_init(&epcmd->link);
+			if (sq->qid)
+				pci_epf_nvme_process_io_cmd(epcmd, sq);
+			else
+				pci_epf_nvme_process_admin_cmd(epcmd);
+		}
+	}
+
+	/* Workers are shared: do not leave the boost on this one */
+	if (uclamp)
+		pci_epf_nvme_set_uclamp_min(0);
+
+	if (!pci_epf_nvme_ctrl_ready(epf_nvme))
+		return;
+
+	/* No need to aggressively poll the admin queue. */
+	if (!sq->qid)
+		poll_interval = msecs_to_jiffies(5);
+	queue_delayed_work(epf_nvme->ctrl.wq, &sq->work, poll_interval);
+}
+
+static void pci_epf_nvme_cq_work(struct work_struct *work)
+{
+	struct pci_epf_nvme_queue *cq =
+		container_of(work, struct pci_epf_nvme_queue, work.work);
+	struct pci_epf_nvme *epf_nvme = cq->epf_nvme;
+	struct pci_epf_nvme_cmd *epcmd;
+	unsigned long flags;
+	LIST_HEAD(list);
+	int ret;
+
+	spin_lock_irqsave(&cq->lock, flags);
+
+	while (!list_empty(&cq->list)) {
+
+		list_splice_tail_init(&cq->list, &list);
+		spin_unlock_irqrestore(&cq->lock, flags);
+
+		ret = pci_epf_nvme_map_queue(epf_nvme, cq);
+		if (ret) {
+			queue_delayed_work(epf_nvme->ctrl.wq, &cq->work, 1);
+			return;
+		}
+
+		while (!list_empty(&list)) {
+			epcmd = list_first_entry(&list,
+						 struct pci_epf_nvme_cmd, link);
+			list_del_init(&epcmd->link);
+			if (!pci_epf_nvme_queue_response(epcmd))
+				break;
+		}
+
+		pci_epf_nvme_unmap_queue(epf_nvme, cq);
+
+		if (pci_epf_nvme_ctrl_ready(cq->epf_nvme))
+			pci_epf_nvme_raise_irq(cq->epf_nvme, cq);
+
+		spin_lock_irqsave(&cq->lock, flags);
+	}
+
+	/*
+	 * Completions on the host may trigger issuing of new commands. Try to
+	 * get these early to improve IOPS and reduce latency.
+	 */
+	if (cq->qid)
+		queue_delayed_work(epf_nvme->ctrl.wq, &cq->sq->work, 0);
+
+	spin_unlock_irqrestore(&cq->lock, flags);
+}
+
+/*
+ * Recreate the fabrics controllers with the options set after the function
+ * was started. This is done while the host keeps the controller disabled,
+ * so that it sees the new controller on its next enable.
+ */
+static void pci_epf_nvme_reconfigure(struct pci_epf_nvme *epf_nvme)
+{
+	struct pci_epf_nvme_ctrl *ctrl = &epf_nvme->ctrl;
+	struct pci_epf *epf = epf_nvme->epf;
+	u32 cc = ctrl->cc;
+	int ret;
+
+	dev_info(&epf->dev, "Applying new fabrics controller options\n");
+
+	pci_epf_nvme_delete_ctrl(epf);
+
+	ret = pci_epf_nvme_create_ctrl(epf);
+	if (ret) {
+		dev_err(&epf->dev,
+			"New options failed (err=%d), restoring options\n",
+			ret);
+
+		mutex_lock(&epf_nvme->config_lock);
+		kfree(epf_nvme->ctrl_opts_buf);
+		epf_nvme->ctrl_opts_buf =
+			kstrdup(epf_nvme->ctrl_opts_active, GFP_KERNEL);
+		kfree(epf_nvme->mirror_opts_buf);
+		epf_nvme->mirror_opts_buf =
+			kstrdup(epf_nvme->mirror_opts_active, GFP_KERNEL);
+		mutex_unlock(&epf_nvme->config_lock);
+
+		ret = pci_epf_nvme_create_ctrl(epf);
+		if (ret) {
+			dev_err(&epf->dev,
+				"Restore controller failed (err=%d), retrying\n",
+				ret);
+			pci_epf_nvme_post_event(epf_nvme,
+						PCI_EPF_NVME_EVENT_CTRL_FAILURE,
+						-ret, 0);
+			epf_nvme->ctrl_retry = jiffies +
+				msecs_to_jiffies(PCI_EPF_NVME_CTRL_RETRY_MS);
+			return;
+		}
+	}
+
+	pci_epf_nvme_init_ctrl_regs(epf);
+
+	/* Keep the configuration the host wrote */
+	ctrl->cc = cc & ~NVME_CC_ENABLE;
+	pci_epf_nvme_reg_write32(ctrl, NVME_REG_CC, ctrl->cc);
+}
+
+static void pci_epf_nvme_reg_poll(struct work_struct *work)
+{
+	struct pci_epf_nvme *epf_nvme =
+		container_of(work, struct pci_epf_nvme, reg_poll.work);
+	struct pci_epf_nvme_ctrl *ctrl = &epf_nvme->ctrl;
+	u32 old_cc;
+
+	/* Set the controller register bar */
+	ctrl->reg = epf_nvme->reg_bar;
+	if (!ctrl->reg) {
+		dev_err(&epf_nvme->epf->dev, "No register BAR set\n");
+		goto again;
+	}
+
+	/* Check CC.EN to determine what we need to do */
+	old_cc = ctrl->cc;
+	ctrl->cc = pci_epf_nvme_reg_read32(ctrl, NVME_REG_CC);
+
+	/*
+	 * If not enabled yet, apply new options if any and wait. If the
+	 * fabrics controllers were lost by a failed reconfiguration, keep
+	 * trying to recreate them.
+	 */
+	if (!(old_cc & NVME_CC_ENABLE) && !(ctrl->cc & NVME_CC_ENABLE)) {
+		if (pci_epf_nvme_opts_changed(epf_nvme) ||
+		    (!ctrl->ctrl &&
+		     time_after_eq(jiffies, epf_nvme->ctrl_retry)))
+			pci_epf_nvme_reconfigure(epf_nvme);
+		goto again;
+	}
+
+	/*
+	 * If CC.EN was set by the host, enable the controller. Without a
+	 * fabrics controller, report a fatal status so that the host does not
+	 * wait for CSTS.RDY forever.
+	 */
+	if (!(old_cc & NVME_CC_ENABLE) && (ctrl->cc & NVME_CC_ENABLE)) {
+		if (ctrl->ctrl) {
+			pci_epf_nvme_enable_ctrl(epf_nvme);
+		} else {
+			ctrl->csts |= NVME_CSTS_CFS;
+			pci_epf_nvme_reg_write32(ctrl, NVME_REG_CSTS,
+						 ctrl->csts);
+		}
+		goto again;
+	}
+
+	/* If CC.EN was cleared by the host, disable the controller */
+	if (((old_cc & NVME_CC_ENABLE) && !(ctrl->cc & NVME_CC_ENABLE)) ||
+	    ctrl->cc & NVME_CC_SHN_NORMAL)
+		pci_epf_nvme_disable_ctrl(epf_nvme);
+
+again:
+	schedule_delayed_work(&epf_nvme->reg_poll, msecs_to_jiffies(5));
+}
+
+static int pci_epf_nvme_configure_bar(struct pci_epf *epf)
+{
+	struct pci_epf_nvme *epf_nvme = epf_get_drvdata(epf);
+	const struct pci_epc_features *features = epf_nvme->epc_features;
+	size_t reg_size, reg_bar_size;
+	size_t msix_table_size = 0;
+
+	/*
+	 * The first free BAR will be our register BAR and per NVMe
+	 * specifications, it must be BAR 0.
+	 */
+	if (pci_epc_get_first_free_bar(features) != BAR_0) {
+		dev_err(&epf->dev, "BAR 0 is not free\n");
+		return -EINVAL;
+	}
+
+	/* Initialize BAR flags */
+	if (features->bar[BAR_0].only_64bit)
+		epf->bar[BAR_0].flags |= PCI_BASE_ADDRESS_MEM_TYPE_64;
+
+	/*
+	 * Calculate the size of the register bar: NVMe registers first with
+	 * enough space for the doorbells, followed by the MSI-X table
+	 * if supported.
+	 */
+	reg_size = NVME_REG_DBS + (PCI_EPF_NVME_MAX_NR_QUEUES * 2 * sizeof(u32));
+	reg_size = ALIGN(reg_size, 8);
+
+	if (features->msix_capable) {
+		size_t pba_size;
+
+		msix_table_size = PCI_MSIX_ENTRY_SIZE * epf->msix_interrupts;
+		epf_nvme->msix_table_offset = reg_size;
+		pba_size = ALIGN(DIV_ROUND_UP(epf->msix_interrupts, 8), 8);
+
+		reg_size += msix_table_size + pba_size;
+	}
+
+	reg_bar_size = ALIGN(reg_size, 4096);
+
+	if (features->bar[BAR_0].type == BAR_FIXED) {
+		if (reg_bar_size > features->bar[BAR_0].fixed_size) {
+			dev_err(&epf->dev,
+				"Reg BAR 0 size %llu B too small, need %zu B\n",
+				features->bar[BAR_0].fixed_size,
+				reg_bar_size);
+			return -ENOMEM;
+		}
+		reg_bar_size = features->bar[BAR_0].fixed_size;
+	}
+
+	epf_nvme->reg_bar = pci_epf_alloc_space(epf, reg_bar_size, BAR_0,
+						features, PRIMARY_INTERFACE);
+	if (!epf_nvme->reg_bar) {
+		dev_err(&epf->dev, "Allocate register BAR failed\n");
+		return -ENOMEM;
+	}
+	memset(epf_nvme->reg_bar, 0, reg_bar_size);
+
+	return 0;
+}
+
+static void pci_epf_nvme_clear_bar(struct pci_epf *epf)
+{
+	struct pci_epf_nvme *epf_nvme = epf_get_drvdata(epf);
+
+	pci_epc_clear_bar(epf->epc, epf->func_no, epf->vfunc_no,
+			  &epf->bar[BAR_0]);
+	pci_epf_free_space(epf, epf_nvme->reg_bar, BAR_0, PRIMARY_INTERFACE);
+	epf_nvme->reg_bar = NULL;
+}
+
+static int pci_epf_nvme_init_irq(struct pci_epf *epf)
+{
+	struct pci_epf_nvme *epf_nvme = epf_get_drvdata(epf);
+	int ret;
+
+	/* Enable MSI-X if supported, otherwise, use MSI */
+	if (epf_nvme->epc_features->msix_capable && epf->msix_interrupts) {
+		ret = pci_epc_set_msix(epf->epc, epf->func_no, epf->vfunc_no,
+				       epf->msix_interrupts, BAR_0,
+				       epf_nvme->msix_table_offset);
+		if (ret) {
+			dev_err(&epf->dev, "MSI-X configuration failed\n");
+			return ret;
+		}
+
+		epf_nvme->nr_vectors = epf->msix_interrupts;
+		epf_nvme->irq_type = PCI_IRQ_MSIX;
+
+		return 0;
+	}
+
+	if (epf_nvme->epc_features->msi_capable && epf->msi_interrupts) {
+		ret = pci_epc_set_msi(epf->epc, epf->func_no, epf->vfunc_no,
+				      epf->msi_interrupts);
+		if (ret) {
+			dev_err(&epf->dev, "MSI configuration failed\n");
+			return ret;
+		}
+
+		epf_nvme->nr_vectors = epf->msi_interrupts;
+		epf_nvme->irq_type = PCI_IRQ_MSI;
+
+		return 0;
+	}
+
+	/* MSI and MSI-X are not supported: fall back to INTX */
+	epf_nvme->nr_vectors = 1;
+	epf_nvme->irq_type = PCI_IRQ_INTX;
+
+	return 0;
+}
+
+static int pci_epf_nvme_epc_init(struct pci_epf *epf)
+{
+	struct pci_epf_nvme *epf_nvme = epf_get_drvdata(epf);
+	int ret;
+
+	if (epf->vfunc_no <= 1) {
+		/* Set device ID, class, etc */
+		ret = pci_epc_write_header(epf->epc, epf->func_no, epf->vfunc_no,
+					   epf->header);
+		if (ret) {
+			dev_err(&epf->dev,
+				"Write configuration header failed %d\n", ret);
+			return ret;
+		}
+	}
+
+	/* Setup the PCIe BAR and enable interrupts */
+	ret = pci_epc_set_bar(epf->epc, epf->func_no, epf->vfunc_no,
+			      &epf->bar[BAR_0]);
+	if (ret) {
+		dev_err(&epf->dev, "Set BAR 0 failed\n");
+		pci_epf_free_space(epf, epf_nvme->reg_bar, BAR_0,
+				   PRIMARY_INTERFACE);
+		return ret;
+	}
+
+	ret = pci_epf_nvme_init_irq(epf);
+	if (ret)
+		return ret;
+
+	pci_epf_nvme_init_ctrl_regs(epf);
+
+	if (!epf_nvme->epc_features->linkup_notifier) {
+		schedule_delayed_work(&epf_nvme->reg_poll, msecs_to_jiffies(5));
+		/* If there is no notifier at all, assume link is up */
+		epf_nvme->link_up = true;
+	}
+
+	return 0;
+}
+
+static void pci_epf_nvme_epc_deinit(struct pci_epf *epf)
+{
+	struct pci_epf_nvme *epf_nvme = epf_get_drvdata(epf);
+
+	/* Stop polling BAR registers and disable the controller */
+	cancel_delayed_work_sync(&epf_nvme->reg_poll);
+
+	pci_epf_nvme_delete_ctrl(epf);
+	pci_epf_nvme_clean_dma(epf);
+	pci_epf_nvme_clear_bar(epf);
+}
+
+static int pci_epf_nvme_link_up(struct pci_epf *epf)
+{
+	struct pci_epf_nvme *epf_nvme = epf_get_drvdata(epf);
+	int i;
+
+	dev_info(&epf->dev, "Link UP\n");
+	epf_nvme->link_up = true;
+
+	/* Start a new link epoch for transfer verification */
+	epf_nvme->link_epoch++;
+	for (i = 0; i < PCI_EPF_NVME_VERIFY_NR_SIZES; i++) {
+		atomic64_set(&epf_nvme->verify_link.nr_verified[i], 0);
+		atomic64_set(&epf_nvme->verify_link.nr_mismatch[i], 0);
+	}
+
+	pci_epf_nvme_post_event(epf_nvme, PCI_EPF_NVME_EVENT_LINK_UP,
+				epf_nvme->link_epoch, 0);
+
+	pci_epf_nvme_init_ctrl_regs(epf);
+
+	/* Start polling the BAR registers to detect controller enable */
+	schedule_delayed_work(&epf_nvme->reg_poll, 0);
+
+	return 0;
+}
+
+static int pci_epf_nvme_link_down(struct pci_epf *epf)
+{
+	struct pci_epf_nvme *epf_nvme = epf_get_drvdata(epf);
+
+	dev_info(&epf->dev, "Link DOWN\n");
+	epf_nvme->link_up = false;
+
+	/* Stop polling BAR registers and disable the controller */
+	cancel_delayed_work_sync(&epf_nvme->reg_poll);
+	pci_epf_nvme_disable_ctrl(epf_nvme);
+
+	pci_epf_nvme_post_event(epf_nvme, PCI_EPF_NVME_EVENT_LINK_DOWN,
+				epf_nvme->link_epoch, 0);
+
+	return 0;
+}
+
+static const struct pci_epc_event_ops pci_epf_nvme_event_ops = {
+	.epc_init = pci_epf_nvme_epc_init,
+	.epc_deinit = pci_epf_nvme_epc_deinit,
+	.link_up = pci_epf_nvme_link_up,
+	.link_down = pci_epf_nvme_link_down,
+};
+
+static int pci_epf_nvme_bind(struct pci_epf *epf)
+{
+	struct pci_epf_nvme *epf_nvme = epf_get_drvdata(epf);
+	const struct pci_epc_features *epc_features;
+	struct pci_epc *epc = epf->epc;
+	bool dma_supported;
+	int ret;
+
+	if (!epc) {
+		dev_err(&epf->dev, "No endpoint controller\n");
+		return -EINVAL;
+	}
+
+	epc_features = pci_epc_get_features(epc, epf->func_no, epf->vfunc_no);
+	if (!epc_features) {
+		dev_err(&epf->dev, "epc_features not implemented\n");
+		return -EOPNOTSUPP;
+	}
+	epf_nvme->epc_features = epc_features;
+
+	ret = pci_epf_nvme_configure_bar(epf);
+	if (ret)
+		return ret;
+
+	if (epf_nvme->dma_enable) {
+		dma_supported = pci_epf_nvme_init_dma(epf_nvme);
+		if (dma_supported) {
+			dev_info(&epf->dev, "DMA supported\n");
+			pci_epf_nvme_init_copy(epf_nvme);
+		} else {
+			dev_info(&epf->dev,
+				 "DMA not supported, falling back to mmio\n");
+			epf_nvme->dma_enable = false;
+		}
+	} else {
+		dev_info(&epf->dev, "DMA disabled\n");
+	}
+
+	/* Create the fabrics host controller */
+	ret = pci_epf_nvme_create_ctrl(epf);
+	if (ret)
+		goto clean_dma;
+
+	mutex_lock(&epf_nvme->config_lock);
+	epf_nvme->bound = true;
+	pci_epf_nvme_verify_update_key(epf_nvme);
+	mutex_unlock(&epf_nvme->config_lock);
+
+	mutex_lock(&epf_nvme->perf_lock);
+	pci_epf_nvme_perf_update_key(epf_nvme);
+	mutex_unlock(&epf_nvme->perf_lock);
+
+	return 0;
+
+clean_dma:
+	pci_epf_nvme_clean_dma(epf);
+	pci_epf_nvme_clear_bar(epf);
+
+	return ret;
+}
+
+static void pci_epf_nvme_unbind(struct pci_epf *epf)
+{
+	struct pci_epf_nvme *epf_nvme = epf_get_drvdata(epf);
+	struct pci_epc *epc = epf->epc;
+
+	mutex_lock(&epf_nvme->config_lock);
+	epf_nvme->bound = false;
+	pci_epf_nvme_verify_update_key(epf_nvme);
+	mutex_unlock(&epf_nvme->config_lock);
+
+	mutex_lock(&epf_nvme->perf_lock);
+	pci_epf_nvme_perf_update_key(epf_nvme);
+	mutex_unlock(&epf_nvme->perf_lock);
+
+	cancel_delayed_work_sync(&epf_nvme->reg_poll);
+
+	pci_epf_nvme_delete_ctrl(epf);
+
+	if (epc->init_complete) {
+		pci_epf_nvme_clean_dma(epf);
+		pci_epf_nvme_clear_bar(epf);
+	}
+}
+
+static int pci_epf_nvme_pci_dev_open(struct inode* inode, struct file* file) {
+	struct pci_epf_nvme_cdev_data *pencdd = container_of(inode->i_cdev,
+		struct pci_epf_nvme_cdev_data, cdev);
+	file->private_data = pencdd;
+	return 0;
+}
+
+static ssize_t pci_epf_nvme_pci_dev_read(struct file* file, char* buffer, size_t len, loff_t* offset) {
+	struct pci_epf_nvme_cdev_data *pencdd = file->private_data;
+	struct pci_epf_nvme *epf_nvme = pencdd->epf_nvme;
+	struct pci_epf *epf = epf_nvme->epf;
+	struct device *dev = &epf->dev;
+	struct pci_epf_nvme_segment seg;
+	void* local_buffer = NULL;
+	int error_count = 0;
+	int ret = 0;
+	size_t bytes_transfered = 0, btt = 0;
+	const size_t LOCAL_BUFFER_SIZE = SZ_64K;
+	if (!offset)
+		return -EINVAL;
+
+	if (!epf_nvme->link_up) {
+		dev_warn(dev, "Link is down cannot read\n");
+		return -EFAULT;
+	}
+
+	local_buffer = kzalloc(LOCAL_BUFFER_SIZE, GFP_KERNEL);
+	if (!local_buffer)
+		return -ENOMEM;
+
+	dev_dbg(dev, "Request to read %zu bytes from offset 0x%llx\n", len, *offset);
+
+	while (bytes_transfered < len) {
+		btt = min(len - bytes_transfered, LOCAL_BUFFER_SIZE);
+		//dev_dbg(dev, "btt: %zu, bytes_transfered: %zu\n", btt, bytes_transfered);
+		seg.pci_addr = *offset + bytes_transfered;
+		seg.size = btt;
+		ret = pci_epf_nvme_transfer(epf_nvme, &seg, DMA_FROM_DEVICE, local_buffer);
+		if (ret < 0) {
+			dev_err(dev, "Failed to read over PCI\n");
+			return ret;
+		}
+		/* Maybe this is possible in zero-copy */
+		error_count += copy_to_user(buffer + bytes_transfered, local_buffer, btt);
+		bytes_transfered += btt;
+	}
+	kfree(local_buffer);
+
+	if (error_count != 0) {
+		dev_err(dev, "Failed to send %d characters to the user\n", error_count);
+		return -EFAULT;
+	}
+
+	*offset += len;
+	return len;
+}
+
+static ssize_t pci_epf_nvme_pci_dev_write(struct file* file, const char* buffer, size_t len, loff_t* offset) {
+	struct pci_epf_nvme_cdev_data *pencdd = file->private_data;
+	struct pci_epf_nvme *epf_nvme = pencdd->epf_nvme;
+	struct pci_epf *epf = epf_nvme->epf;
+	struct device *dev = &epf->dev;
+	struct pci_epf_nvme_segment seg;
+	size_t bytes_transfered = 0, btt = 0;
+	const size_t LOCAL_BUFFER_SIZE = SZ_64K;
+	void* local_buffer = NULL;
+	int ret = 0;
+	if (!offset)
+		return -EINVAL;
+
+	dev_dbg(dev, "Request to write %zu bytes at offset 0x%llx\n", len, *offset);
+
+	if (!epf_nvme->link_up) {
+		dev_warn(dev, "Link is down cannot write\n");
+		return -EFAULT;
+	}
+
+	local_buffer = kzalloc(LOCAL_BUFFER_SIZE, GFP_KERNEL);
+	if (!local_buffer)
+		return -ENOMEM;
+
+	while (bytes_transfered < len) {
+		btt = min(len - bytes_transfered, LOCAL_BUFFER_SIZE);
+		//dev_dbg(dev, "btt: %zu, bytes_transfered: %zu\n", btt, bytes_transfered);
+		/* Maybe this is possible in zero-copy */
+		if (copy_from_user(local_buffer, buffer + bytes_transfered, btt)) {
+			dev_err(dev, "Failed to copy data from user\n");
+			return -EFAULT;
+		}
+		seg.pci_addr = *offset + bytes_transfered;
+		seg.size = btt;
+		ret = pci_epf_nvme_transfer(epf_nvme, &seg, DMA_TO_DEVICE, local_buffer);
+		if (ret < 0) {
+			dev_err(dev, "Failed to write over PCI\n");
+			return ret;
+		}
+		bytes_transfered += btt;
+	}
+	kfree(local_buffer);
+
+	*offset += len;
+	return len;
+}
+
+static int pci_epf_nvme_pci_dev_release(struct inode* inode, struct file* file) {
+	return 0;
+}
+
+static struct file_operations fops = {
+	.open		= pci_epf_nvme_pci_dev_open,
+	.read		= pci_epf_nvme_pci_dev_read,
+	.write		= pci_epf_nvme_pci_dev_write,
+	.release	= pci_epf_nvme_pci_dev_release,
+};
+
+static int pci_epf_nvme_events_open(struct inode *inode, struct file *file)
+{
+	struct pci_epf_nvme_cdev_data *pencdd =
+		container_of(inode->i_cdev, struct pci_epf_nvme_cdev_data, cdev);
+
+	file->private_data = pencdd->epf_nvme;
+
+	return nonseekable_open(inode, file);
+}
+
+/*
+ * Read whole events, waiting for at least one unless O_NONBLOCK is set.
+ */
+static ssize_t pci_epf_nvme_events_read(struct file *file, char __user *buf,
+					size_t len, loff_t *offset)
+{
+	struct pci_epf_nvme *epf_nvme = file->private_data;
+	struct pci_epf_nvme_events *events = &epf_nvme->events;
+	unsigned int copied;
+	int ret;
+
+	if (len < sizeof(struct pci_epf_nvme_event))
+		return -EINVAL;
+
+	for (;;) {
+		ret = mutex_lock_interruptible(&events->read_lock);
+		if (ret)
+			return ret;
+
+		if (!kfifo_is_empty(&events->fifo))
+			break;
+
+		mutex_unlock(&events->read_lock);
+
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		ret = wait_event_interruptible(events->wait,
+					       !kfifo_is_empty(&events->fifo));
+		if (ret)
+			return ret;
+	}
+
+	ret = kfifo_to_user(&events->fifo, buf,
+			    rounddown(len, sizeof(struct pci_epf_nvme_event)),
+			    &copied);
+	mutex_unlock(&events->read_lock);
+
+	return ret ? ret : copied;
+}
+
+static __poll_t pci_epf_nvme_events_poll(struct file *file,
+					 struct poll_table_struct *wait)
+{
+	struct pci_epf_nvme *epf_nvme = file->private_data;
+
+	poll_wait(file, &epf_nvme->events.wait, wait);
+
+	if (!kfifo_is_empty(&epf_nvme->events.fifo))
+		return EPOLLIN | EPOLLRDNORM;
+
+	return 0;
+}
+
+static const struct file_operations pci_epf_nvme_events_fops = {
+	.owner		= THIS_MODULE,
+	.open		= pci_epf_nvme_events_open,
+	.read		= pci_epf_nvme_events_read,
+	.poll		= pci_epf_nvme_events_poll,
+};
+
+static struct pci_epf_header epf_nvme_pci_header = {
+	.vendorid	= PCI_ANY_ID,
+	.deviceid	= PCI_ANY_ID,
+	.progif_code	= 0x02, /* NVM Express */
+	.baseclass_code = PCI_BASE_CLASS_STORAGE,
+	.subclass_code	= 0x08, /* Non-Volatile Memory controller */
+	.interrupt_pin	= PCI_INTERRUPT_INTA,
+};
+
+static int dev_major = 0;
+
+static int pci_epf_nvme_probe(struct pci_epf *epf,
+			      const struct pci_epf_device_id *id)
+{
+	struct pci_epf_nvme *epf_nvme;
+	dev_t cdev;
+	int ret = 0;
+
+	epf_nvme = devm_kzalloc(&epf->dev, sizeof(*epf_nvme), GFP_KERNEL);
+	if (!epf_nvme)
+		return -ENOMEM;
+
+	epf_nvme->epf = epf;
+	INIT_DELAYED_WORK(&epf_nvme->reg_poll, pci_epf_nvme_reg_poll);
+
+	epf_nvme->prp_list_buf = devm_kzalloc(&epf->dev, NVME_CTRL_PAGE_SIZE,
+					      GFP_KERNEL);
+	if (!epf_nvme->prp_list_buf)
+		return -ENOMEM;
+
+	xa_init(&epf_nvme->ns_xa);
+	mutex_init(&epf_nvme->ns_lock);
+	INIT_LIST_HEAD(&epf_nvme->ns_cfgs);
+	mutex_init(&epf_nvme->perf_lock);
+	mutex_init(&epf_nvme->config_lock);
+	ret = devm_add_action(&epf->dev, pci_epf_nvme_perf_release, epf_nvme);
+	if (ret)
+		return ret;
+	spin_lock_init(&epf_nvme->xfer_lock);
+	INIT_LIST_HEAD(&epf_nvme->xfer_queue);
+	mutex_init(&epf_nvme->irq_lock);
+
+	spin_lock_init(&epf_nvme->events.lock);
+	mutex_init(&epf_nvme->events.read_lock);
+	init_waitqueue_head(&epf_nvme->events.wait);
+	INIT_KFIFO(epf_nvme->events.fifo);
+
+	/* Set default attribute values */
+	epf_nvme->dma_enable = true;
+	epf_nvme->mdts_kb = PCI_EPF_NVME_MDTS_KB;
+	epf_nvme->comp_cluster_kb = PCI_EPF_NVME_COMP_CLUSTER_KB;
+	epf_nvme->mirror_hedge_pct = PCI_EPF_NVME_MIRROR_HEDGE_PCT;
+	epf_nvme->ring_maps = PCI_EPF_NVME_RING_MAPS;
+	epf_nvme->poll_idle_ms = PCI_EPF_NVME_POLL_IDLE_MS;
+	epf_nvme->copy_offload_kb = PCI_EPF_NVME_COPY_OFFLOAD_KB;
+	epf_nvme->xfer_chunk_kb = PCI_EPF_NVME_XFER_CHUNK_KB;
+
+	epf->event_ops = &pci_epf_nvme_event_ops;
+	epf->header = &epf_nvme_pci_header;
+	epf_set_drvdata(epf, epf_nvme);
+
+	/* allocate chardev region and assign Major number */
+	ret = alloc_chrdev_region(&cdev, 0, 2, "nvme_pci_cdev");
+	if (ret) {
+		dev_err(&epf->dev, "Could not alloc chrdev region\n");
+		return ret;
+	}
+
+	dev_major = MAJOR(cdev);
+
+	/* Add char device that exposes PCI space */
+	epf_nvme->char_class = class_create("nvme_pci_cdev");
+	if (IS_ERR_OR_NULL(epf_nvme->char_class)) {
+		dev_err(&epf->dev, "Could not create class\n");
+		return PTR_ERR(epf_nvme->char_class);
+	}
+
+	cdev_init(&epf_nvme->chardev_data.cdev, &fops);
+	epf_nvme->chardev_data.cdev.owner = THIS_MODULE;
+
+	ret = cdev_add(&epf_nvme->chardev_data.cdev, MKDEV(dev_major, 0), 1);
+	if (ret < 0) {
+		dev_err(&epf->dev, "Could not add character device: %d\n", ret);
+		return ret;
+	}
+
+	device_create(epf_nvme->char_class, NULL, MKDEV(dev_major, 0), NULL,
+		      "pci-io");
+
+	epf_nvme->chardev_data.epf_nvme = epf_nvme;
+
+	/* Add char device that exposes the function events */
+	epf_nvme->events_cdev_data.epf_nvme = epf_nvme;
+	cdev_init(&epf_nvme->events_cdev_data.cdev, &pci_epf_nvme_events_fops);
+	epf_nvme->events_cdev_data.cdev.owner = THIS_MODULE;
+
+	ret = cdev_add(&epf_nvme->events_cdev_data.cdev, MKDEV(dev_major, 1), 1);
+	if (ret < 0) {
+		dev_err(&epf->dev, "Could not add events device: %d\n", ret);
+		return ret;
+	}
+
+	device_create(epf_nvme->char_class, NULL, MKDEV(dev_major, 1), NULL,
+		      "nvme-events");
+
+	return 0;
+}
+
+#define to_epf_nvme(epf_group)	\
+	container_of((epf_group), struct pci_epf_nvme, group)
+
+static ssize_t pci_epf_nvme_ctrl_opts_show(struct config_item *item,
+					   char *page)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	ssize_t ret = 0;
+
+	mutex_lock(&epf_nvme->config_lock);
+	if (epf_nvme->ctrl_opts_buf)
+		ret = sysfs_emit(page, "%s\n", epf_nvme->ctrl_opts_buf);
+	mutex_unlock(&epf_nvme->config_lock);
+
+	return ret;
+}
+
+#define PCI_EPF_NVME_OPT_HIDDEN_NS	"hidden_ns"
+
+static ssize_t pci_epf_nvme_ctrl_opts_store(struct config_item *item,
+					    const char *page, size_t len)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	size_t opt_buf_size;
+	char *buf;
+
+	if (!len)
+		return -EINVAL;
+
+	/*
+	 * Make sure we have enough room to add the hidden_ns option
+	 * if it is missing.
+	 */
+	opt_buf_size = len + strlen(PCI_EPF_NVME_OPT_HIDDEN_NS) + 2;
+	buf = kzalloc(opt_buf_size, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	strscpy(buf, page, opt_buf_size);
+	if (!strnstr(page, PCI_EPF_NVME_OPT_HIDDEN_NS, len))
+		strncat(buf, "," PCI_EPF_NVME_OPT_HIDDEN_NS, opt_buf_size);
+
+	dev_dbg(&epf_nvme->epf->dev,
+		"NVMe fabrics controller options: %s\n", buf);
+
+	/*
+	 * If the function is already started, the new options are applied
+	 * on the next controller reset (see pci_epf_nvme_reconfigure()).
+	 */
+	mutex_lock(&epf_nvme->config_lock);
+	kfree(epf_nvme->ctrl_opts_buf);
+	epf_nvme->ctrl_opts_buf = buf;
+	mutex_unlock(&epf_nvme->config_lock);
+
+	return len;
+}
+
+CONFIGFS_ATTR(pci_epf_nvme_, ctrl_opts);
+
+static ssize_t pci_epf_nvme_mirror_opts_show(struct config_item *item,
+					     char *page)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	ssize_t ret = 0;
+
+	mutex_lock(&epf_nvme->config_lock);
+	if (epf_nvme->mirror_opts_buf)
+		ret = sysfs_emit(page, "%s\n", epf_nvme->mirror_opts_buf);
+	mutex_unlock(&epf_nvme->config_lock);
+
+	return ret;
+}
+
+static ssize_t pci_epf_nvme_mirror_opts_store(struct config_item *item,
+					      const char *page, size_t len)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	size_t opt_buf_size;
+	char *buf = NULL;
+
+	/* An empty string disables mirroring */
+	if (len && !sysfs_streq(page, "")) {
+		opt_buf_size = len + strlen(PCI_EPF_NVME_OPT_HIDDEN_NS) + 2;
+		buf = kzalloc(opt_buf_size, GFP_KERNEL);
+		if (!buf)
+			return -ENOMEM;
+
+		strscpy(buf, page, opt_buf_size);
+		if (!strnstr(page, PCI_EPF_NVME_OPT_HIDDEN_NS, len))
+			strncat(buf, "," PCI_EPF_NVME_OPT_HIDDEN_NS,
+				opt_buf_size);
+	}
+
+	mutex_lock(&epf_nvme->config_lock);
+	kfree(epf_nvme->mirror_opts_buf);
+	epf_nvme->mirror_opts_buf = buf;
+	mutex_unlock(&epf_nvme->config_lock);
+
+	return len;
+}
+
+CONFIGFS_ATTR(pci_epf_nvme_, mirror_opts);
+
+static ssize_t pci_epf_nvme_mirror_hedge_pct_show(struct config_item *item,
+						  char *page)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+
+	return sysfs_emit(page, "%u\n", READ_ONCE(epf_nvme->mirror_hedge_pct));
+}
+
+static ssize_t pci_epf_nvme_mirror_hedge_pct_store(struct config_item *item,
+						   const char *page, size_t len)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	unsigned int pct;
+	int ret;
+
+	ret = kstrtouint(page, 0, &pct);
+	if (ret)
+		return ret;
+	if (pct >= 100)
+		return -EINVAL;
+
+	WRITE_ONCE(epf_nvme->mirror_hedge_pct, pct);
+
+	return len;
+}
+
+CONFIGFS_ATTR(pci_epf_nvme_, mirror_hedge_pct);
+
+static ssize_t pci_epf_nvme_mirror_stats_show(struct config_item *item,
+					      char *page)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	struct pci_epf_nvme_mirror *mirror;
+	struct pci_epf_nvme_ns *epns;
+	unsigned long nsid;
+	ssize_t count = 0;
+
+	mutex_lock(&epf_nvme->ns_lock);
+	xa_for_each(&epf_nvme->ns_xa, nsid, epns) {
+		mirror = epns->mirror;
+		if (!mirror)
+			continue;
+		count += sysfs_emit_at(page, count,
+			"ns %lu: reads %lld / %lld, hedged %lld, hedge wins %lld, failovers %lld, hedge threshold %llu us\n",
+			nsid,
+			atomic64_read(&mirror->nr_reads[0]),
+			atomic64_read(&mirror->nr_reads[1]),
+			atomic64_read(&mirror->nr_hedged),
+			atomic64_read(&mirror->nr_hedge_wins),
+			atomic64_read(&mirror->nr_failovers),
+			div_u64(READ_ONCE(mirror->hedge_ns), NSEC_PER_USEC));
+	}
+	mutex_unlock(&epf_nvme->ns_lock);
+
+	return count;
+}
+
+CONFIGFS_ATTR_RO(pci_epf_nvme_, mirror_stats);
+
+static ssize_t pci_epf_nvme_flush_window_us_show(struct config_item *item,
+						 char *page)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+
+	return sysfs_emit(page, "%u\n", READ_ONCE(epf_nvme->flush_window_us));
+}
+
+static ssize_t pci_epf_nvme_flush_window_us_store(struct config_item *item,
+						  const char *page, size_t len)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	unsigned int window_us;
+	int ret;
+
+	ret = kstrtouint(page, 0, &window_us);
+	if (ret)
+		return ret;
+	if (window_us > USEC_PER_SEC)
+		return -EINVAL;
+
+	WRITE_ONCE(epf_nvme->flush_window_us, window_us);
+
+	return len;
+}
+
+CONFIGFS_ATTR(pci_epf_nvme_, flush_window_us);
+
+static ssize_t pci_epf_nvme_ring_maps_show(struct config_item *item,
+					   char *page)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+
+	return sysfs_emit(page, "%u\n", READ_ONCE(epf_nvme->ring_maps));
+}
+
+static ssize_t pci_epf_nvme_ring_maps_store(struct config_item *item,
+					    const char *page, size_t len)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	unsigned int ring_maps;
+	int ret;
+
+	ret = kstrtouint(page, 0, &ring_maps);
+	if (ret)
+		return ret;
+	if (ring_maps > 2 * PCI_EPF_NVME_MAX_NR_QUEUES)
+		return -EINVAL;
+
+	/* Applies to queues created after the change */
+	WRITE_ONCE(epf_nvme->ring_maps, ring_maps);
+
+	return len;
+}
+
+CONFIGFS_ATTR(pci_epf_nvme_, ring_maps);
+
+static ssize_t pci_epf_nvme_ring_stats_show(struct config_item *item,
+					    char *page)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+
+	return sysfs_emit(page, "mapped %d\n",
+			  atomic_read(&epf_nvme->nr_ring_maps));
+}
+
+CONFIGFS_ATTR_RO(pci_epf_nvme_, ring_stats);
+
+static ssize_t pci_epf_nvme_poll_idle_ms_show(struct config_item *item,
+					      char *page)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+
+	return sysfs_emit(page, "%u\n", READ_ONCE(epf_nvme->poll_idle_ms));
+}
+
+static ssize_t pci_epf_nvme_poll_idle_ms_store(struct config_item *item,
+					       const char *page, size_t len)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	unsigned int idle_ms;
+	int ret;
+
+	ret = kstrtouint(page, 0, &idle_ms);
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(epf_nvme->poll_idle_ms, idle_ms);
+
+	return len;
+}
+
+CONFIGFS_ATTR(pci_epf_nvme_, poll_idle_ms);
+
+static ssize_t pci_epf_nvme_uclamp_boost_show(struct config_item *item,
+					      char *page)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+
+	return sysfs_emit(page, "%u\n", READ_ONCE(epf_nvme->uclamp_boost));
+}
+
+static ssize_t pci_epf_nvme_uclamp_boost_store(struct config_item *item,
+					       const char *page, size_t len)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	unsigned int boost;
+	int ret;
+
+	if (!IS_ENABLED(CONFIG_UCLAMP_TASK))
+		return -EOPNOTSUPP;
+
+	ret = kstrtouint(page, 0, &boost);
+	if (ret)
+		return ret;
+	if (boost > SCHED_CAPACITY_SCALE)
+		return -EINVAL;
+
+	WRITE_ONCE(epf_nvme->uclamp_boost, boost);
+
+	return len;
+}
+
+CONFIGFS_ATTR(pci_epf_nvme_, uclamp_boost);
+
+static ssize_t pci_epf_nvme_flush_stats_show(struct config_item *item,
+					     char *page)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	struct pci_epf_nvme_ns *epns;
+	unsigned long nsid;
+	ssize_t count = 0;
+
+	mutex_lock(&epf_nvme->ns_lock);
+	xa_for_each(&epf_nvme->ns_xa, nsid, epns)
+		count += sysfs_emit_at(page, count,
+			"ns %lu: host flushes %lld, backend flushes %lld\n",
+			nsid, atomic64_read(&epns->flush.nr_host_flushes),
+			atomic64_read(&epns->flush.nr_backend_flushes));
+	mutex_unlock(&epf_nvme->ns_lock);
+
+	return count;
+}
+
+CONFIGFS_ATTR_RO(pci_epf_nvme_, flush_stats);
+
+/*
+ * Parsers of the profile keys, storing the value in the profile field at
+ * offset off.
+ */
+static int pci_epf_nvme_perf_parse_lat(struct pci_epf_nvme_perf_profile *prof,
+				       char *val, size_t off)
+{
+	u32 *lat_us = (void *)prof + off;
+	char *p;
+	int i;
+
+	for (i = 0; i < PCI_EPF_NVME_PERF_LAT_POINTS; i++) {
+		p = strsep(&val, ",");
+		if (!p || kstrtou32(strim(p), 0, &lat_us[i]))
+			return -EINVAL;
+		if (lat_us[i] > PCI_EPF_NVME_PERF_MAX_LAT_US ||
+		    (i && lat_us[i] < lat_us[i - 1]))
+			return -EINVAL;
+	}
+
+	return val ? -EINVAL : 0;
+}
+
+static int pci_epf_nvme_perf_parse_u32(struct pci_epf_nvme_perf_profile *prof,
+				       char *val, size_t off)
+{
+	return kstrtou32(val, 0, (void *)prof + off);
+}
+
+static int pci_epf_nvme_perf_parse_gb(struct pci_epf_nvme_perf_profile *prof,
+				      char *val, size_t off)
+{
+	u64 *bytes = (void *)prof + off;
+	u64 val64;
+
+	if (kstrtou64(val, 0, &val64) || val64 > U32_MAX)
+		return -EINVAL;
+	*bytes = val64 * SZ_1G;
+
+	return 0;
+}
+
+static int pci_epf_nvme_perf_parse_ms(struct pci_epf_nvme_perf_profile *prof,
+				      char *val, size_t off)
+{
+	u32 *us = (void *)prof + off;
+	u64 val64;
+
+	if (kstrtou64(val, 0, &val64) || val64 > MSEC_PER_SEC)
+		return -EINVAL;
+	*us = val64 * USEC_PER_MSEC;
+
+	return 0;
+}
+
+static int pci_epf_nvme_perf_parse_qd(struct pci_epf_nvme_perf_profile *prof,
+				      char *val, size_t off)
+{
+	unsigned int n = 0;
+	char *p, *pct;
+
+	while ((p = strsep(&val, ",")) != NULL) {
+		if (n == PCI_EPF_NVME_PERF_QD_POINTS)
+			return -EINVAL;
+		pct = strchr(p, ':');
+		if (!pct)
+			return -EINVAL;
+		*pct++ = '\0';
+		if (kstrtou32(strim(p), 0, &prof->qd[n]) ||
+		    kstrtou32(strim(pct), 0, &prof->qd_pct[n]))
+			return -EINVAL;
+		if (prof->qd_pct[n] > PCI_EPF_NVME_PERF_MAX_QD_PCT ||
+		    (n && prof->qd[n] <= prof->qd[n - 1]))
+			return -EINVAL;
+		n++;
+	}
+
+	prof->nr_qd_points = n;
+
+	return 0;
+}
+
+#define PCI_EPF_NVME_PERF_KEY(_name, _parse, _field)			\
+	{ .name = _name, .parse = pci_epf_nvme_perf_parse_##_parse,	\
+	  .off = offsetof(struct pci_epf_nvme_perf_profile, _field) }
+
+static const struct pci_epf_nvme_perf_key {
+	const char	*name;
+	int		(*parse)(struct pci_epf_nvme_perf_profile *prof,
+				 char *val, size_t off);
+	size_t		off;
+} pci_epf_nvme_perf_keys[] = {
+	PCI_EPF_NVME_PERF_KEY("read_lat", lat,
+			      lat_us[PCI_EPF_NVME_PERF_READ]),
+	PCI_EPF_NVME_PERF_KEY("write_lat", lat,
+			      lat_us[PCI_EPF_NVME_PERF_WRITE]),
+	PCI_EPF_NVME_PERF_KEY("flush_lat", lat,
+			      lat_us[PCI_EPF_NVME_PERF_FLUSH]),
+	PCI_EPF_NVME_PERF_KEY("read_mbps", u32,
+			      mbps[PCI_EPF_NVME_PERF_READ]),
+	PCI_EPF_NVME_PERF_KEY("write_mbps", u32,
+			      mbps[PCI_EPF_NVME_PERF_WRITE]),
+	PCI_EPF_NVME_PERF_KEY("cliff_write_mbps", u32, cliff_mbps),
+	PCI_EPF_NVME_PERF_KEY("cliff_gb", gb, cliff_bytes),
+	PCI_EPF_NVME_PERF_KEY("gc_every_gb", gb, gc_bytes),
+	PCI_EPF_NVME_PERF_KEY("gc_pause_ms", ms, gc_pause_us),
+	PCI_EPF_NVME_PERF_KEY("qd_curve", qd, qd),
+};
+
+static int pci_epf_nvme_perf_parse_key(struct pci_epf_nvme_perf_profile *prof,
+				       const char *key, char *val)
+{
+	const struct pci_epf_nvme_perf_key *k;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(pci_epf_nvme_perf_keys); i++) {
+		k = &pci_epf_nvme_perf_keys[i];
+		if (!strcmp(key, k->name))
+			return k->parse(prof, val, k->off);
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Parse a profile: lines of key=value, with # comments. Keys given before
+ * any "ns=<nsid>" line define the default profile, used for all the
+ * namespaces without their own profile.
+ */
+static int pci_epf_nvme_perf_parse(struct pci_epf_nvme *epf_nvme,
+				   struct pci_epf_nvme_perf *perf, char *text)
+{
+	struct pci_epf_nvme_perf_profile *prof = NULL;
+	char *line, *val;
+	u32 nsid;
+	int ret;
+
+	while ((line = strsep(&text, "\n")) != NULL) {
+		line = strim(line);
+		if (!*line || *line == '#')
+			continue;
+
+		val = strchr(line, '=');
+		if (!val)
+			return -EINVAL;
+		*val++ = '\0';
+		line = strim(line);
+		val = strim(val);
+
+		if (!prof || !strcmp(line, "ns")) {
+			if (perf->nr_profiles == PCI_EPF_NVME_PERF_MAX_PROFILES)
+				return -E2BIG;
+			prof = &perf->profiles[perf->nr_profiles++];
+			if (!strcmp(line, "ns")) {
+				ret = kstrtou32(val, 0, &nsid);
+				if (ret || !nsid)
+					return -EINVAL;
+				prof->nsid = nsid;
+				continue;
+			}
+		}
+
+		ret = pci_epf_nvme_perf_parse_key(prof, line, val);
+		if (ret) {
+			dev_err(&epf_nvme->epf->dev,
+				"Invalid performance profile key %s\n", line);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static ssize_t pci_epf_nvme_perf_profile_show(struct config_item *item,
+					      char *page)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	struct pci_epf_nvme_perf *perf;
+	ssize_t count;
+
+	mutex_lock(&epf_nvme->perf_lock);
+	perf = rcu_dereference_protected(epf_nvme->perf,
+				lockdep_is_held(&epf_nvme->perf_lock));
+	count = sysfs_emit(page, "%s\n", perf ? perf->text : "none");
+	mutex_unlock(&epf_nvme->perf_lock);
+
+	return count;
+}
+
+static ssize_t pci_epf_nvme_perf_profile_store(struct config_item *item,
+					       const char *page, size_t len)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	struct pci_epf_nvme_perf *perf = NULL, *old;
+	char *buf = NULL;
+	int ret;
+
+	if (!sysfs_streq(page, "none") && !sysfs_streq(page, "")) {
+		perf = kzalloc(sizeof(*perf), GFP_KERNEL);
+		if (!perf)
+			return -ENOMEM;
+
+		perf->text = kstrndup(page, len, GFP_KERNEL);
+		buf = kstrndup(page, len, GFP_KERNEL);
+		if (!perf->text || !buf) {
+			ret = -ENOMEM;
+			goto free;
+		}
+
+		strim(perf->text);
+		ret = pci_epf_nvme_perf_parse(epf_nvme, perf, buf);
+		kfree(buf);
+		buf = NULL;
+		if (ret)
+			goto free;
+	}
+
+	mutex_lock(&epf_nvme->perf_lock);
+
+	if (perf)
+		perf->gen = ++epf_nvme->perf_gen;
+
+	old = rcu_replace_pointer(epf_nvme->perf, perf,
+				  lockdep_is_held(&epf_nvme->perf_lock));
+	pci_epf_nvme_perf_update_key(epf_nvme);
+
+	mutex_unlock(&epf_nvme->perf_lock);
+
+	if (old) {
+		synchronize_rcu();
+		kfree(old->text);
+		kfree(old);
+	}
+
+	return len;
+
+free:
+	kfree(buf);
+	kfree(perf->text);
+	kfree(perf);
+
+	return ret;
+}
+
+CONFIGFS_ATTR(pci_epf_nvme_, perf_profile);
+
+static ssize_t pci_epf_nvme_dma_enable_show(struct config_item *item,
+					    char *page)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+
+	return sysfs_emit(page, "%d\n", epf_nvme->dma_enable);
+}
+
+static ssize_t pci_epf_nvme_dma_enable_store(struct config_item *item,
+					     const char *page, size_t len)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	u64 arrival = 0;
+	bool enable;
+	int ret;
+
+	ret = kstrtobool(page, &enable);
+	if (ret)
+		return ret;
+
+	/*
+	 * Transfers check dma_enable with the data path held, so DMA can be
+	 * switched on and off while the controller is running. If the
+	 * function was started without DMA, get the DMA channels now.
+	 */
+	pci_epf_nvme_xfer_get(epf_nvme, 0, &arrival);
+	if (enable && epf_nvme->ctrl.ctrl && !epf_nvme->dma_xfer) {
+		if (!pci_epf_nvme_init_dma(epf_nvme)) {
+			pci_epf_nvme_xfer_put(epf_nvme);
+			return -EOPNOTSUPP;
+		}
+		pci_epf_nvme_init_copy(epf_nvme);
+	}
+	WRITE_ONCE(epf_nvme->dma_enable, enable);
+	pci_epf_nvme_xfer_put(epf_nvme);
+
+	return len;
+}
+
+CONFIGFS_ATTR(pci_epf_nvme_, dma_enable);
+
+static ssize_t pci_epf_nvme_copy_offload_kb_show(struct config_item *item,
+						 char *page)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+
+	return sysfs_emit(page, "%u\n", READ_ONCE(epf_nvme->copy_offload_kb));
+}
+
+static ssize_t pci_epf_nvme_copy_offload_kb_store(struct config_item *item,
+						  const char *page, size_t len)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	unsigned int offload_kb;
+	int ret;
+
+	ret = kstrtouint(page, 0, &offload_kb);
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(epf_nvme->copy_offload_kb, offload_kb);
+
+	return len;
+}
+
+CONFIGFS_ATTR(pci_epf_nvme_, copy_offload_kb);
+
+static ssize_t pci_epf_nvme_xfer_chunk_kb_show(struct config_item *item,
+					       char *page)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+
+	return sysfs_emit(page, "%u\n", READ_ONCE(epf_nvme->xfer_chunk_kb));
+}
+
+static ssize_t pci_epf_nvme_xfer_chunk_kb_store(struct config_item *item,
+						const char *page, size_t len)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	unsigned int chunk_kb;
+	int ret;
+
+	ret = kstrtouint(page, 0, &chunk_kb);
+	if (ret)
+		return ret;
+
+	/* DMA is only used for chunks larger than a page */
+	if (chunk_kb && chunk_kb <= SZ_4K / SZ_1K)
+		return -EINVAL;
+
+	WRITE_ONCE(epf_nvme->xfer_chunk_kb, chunk_kb);
+
+	return len;
+}
+
+CONFIGFS_ATTR(pci_epf_nvme_, xfer_chunk_kb);
+
+static ssize_t pci_epf_nvme_xfer_stats_show(struct config_item *item,
+					    char *page)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+
+	return sysfs_emit(page, "waits %lld\n",
+			  atomic64_read(&epf_nvme->nr_xfer_waits));
+}
+
+CONFIGFS_ATTR_RO(pci_epf_nvme_, xfer_stats);
+
+static ssize_t pci_epf_nvme_copy_stats_show(struct config_item *item,
+					    char *page)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+
+	return sysfs_emit(page, "channel %s, offloaded %lld, cpu %lld\n",
+			  epf_nvme->copy_chan ?
+			  dma_chan_name(epf_nvme->copy_chan) : "none",
+			  atomic64_read(&epf_nvme->nr_copies_offloaded),
+			  atomic64_read(&epf_nvme->nr_copies_cpu));
+}
+
+CONFIGFS_ATTR_RO(pci_epf_nvme_, copy_stats);
+
+static ssize_t pci_epf_nvme_mdts_kb_show(struct config_item *item, char *page)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+
+	return sysfs_emit(page, "%zu\n", epf_nvme->mdts_kb);
+}
+
+static ssize_t pci_epf_nvme_mdts_kb_store(struct config_item *item,
+					  const char *page, size_t len)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	unsigned long mdts_kb;
+	int ret;
+
+	ret = kstrtoul(page, 0, &mdts_kb);
+	if (ret)
+		return ret;
+	if (!mdts_kb)
+		mdts_kb = PCI_EPF_NVME_MDTS_KB;
+	else if (mdts_kb > PCI_EPF_NVME_MAX_MDTS_KB)
+		mdts_kb = PCI_EPF_NVME_MAX_MDTS_KB;
+
+	if (!is_power_of_2(mdts_kb))
+		return -EINVAL;
+
+	/* Used on the next controller enable */
+	WRITE_ONCE(epf_nvme->mdts_kb, mdts_kb);
+
+	return len;
+}
+
+CONFIGFS_ATTR(pci_epf_nvme_, mdts_kb);
+
+static ssize_t pci_epf_nvme_max_io_queues_show(struct config_item *item,
+					       char *page)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+
+	return sysfs_emit(page, "%u\n", READ_ONCE(epf_nvme->max_io_queues));
+}
+
+static ssize_t pci_epf_nvme_max_io_queues_store(struct config_item *item,
+						const char *page, size_t len)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	unsigned int max_io_queues;
+	int ret;
+
+	ret = kstrtouint(page, 0, &max_io_queues);
+	if (ret)
+		return ret;
+
+	if (max_io_queues >= PCI_EPF_NVME_MAX_NR_QUEUES)
+		return -EINVAL;
+
+	/* 0 means all queues, used on the next controller enable */
+	WRITE_ONCE(epf_nvme->max_io_queues, max_io_queues);
+
+	return len;
+}
+
+CONFIGFS_ATTR(pci_epf_nvme_, max_io_queues);
+
+static ssize_t pci_epf_nvme_active_config_show(struct config_item *item,
+					       char *page)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	struct pci_epf_nvme_ctrl *ctrl = &epf_nvme->ctrl;
+	bool enabled = epf_nvme->ctrl_enabled;
+	ssize_t count = 0;
+
+	mutex_lock(&epf_nvme->config_lock);
+	count += sysfs_emit_at(page, count, "ctrl_opts %s\n",
+			       epf_nvme->ctrl_opts_active ?: "none");
+	count += sysfs_emit_at(page, count, "mirror_opts %s\n",
+			       epf_nvme->mirror_opts_active ?: "none");
+	mutex_unlock(&epf_nvme->config_lock);
+
+	if (enabled) {
+		count += sysfs_emit_at(page, count, "mdts_kb %zu\n",
+				       ctrl->mdts / SZ_1K);
+		count += sysfs_emit_at(page, count, "io_queues %u\n",
+				       ctrl->nr_io_queues);
+	} else {
+		count += sysfs_emit_at(page, count, "mdts_kb none\n");
+		count += sysfs_emit_at(page, count, "io_queues none\n");
+	}
+	count += sysfs_emit_at(page, count, "dma %d\n",
+			       READ_ONCE(epf_nvme->dma_enable) &&
+			       epf_nvme->dma_xfer);
+	count += sysfs_emit_at(page, count, "reconfig_pending %d\n",
+			       pci_epf_nvme_opts_changed(epf_nvme));
+
+	return count;
+}
+
+CONFIGFS_ATTR_RO(pci_epf_nvme_, active_config);
+
+static ssize_t pci_epf_nvme_compression_show(struct config_item *item,
+					     char *page)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+
+	if (!epf_nvme->comp_algo[0])
+		return sysfs_emit(page, "none\n");
+
+	return sysfs_emit(page, "%s\n", epf_nvme->comp_algo);
+}
+
+static ssize_t pci_epf_nvme_compression_store(struct config_item *item,
+					      const char *page, size_t len)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	char algo[CRYPTO_MAX_ALG_NAME];
+
+	/* The backend data layout cannot change once namespaces are used */
+	if (epf_nvme->ctrl.ctrl)
+		return -EBUSY;
+
+	strscpy(algo, page, sizeof(algo));
+	strim(algo);
+
+	if (!algo[0] || !strcmp(algo, "none")) {
+		epf_nvme->comp_algo[0] = '\0';
+		return len;
+	}
+
+	if (!crypto_has_comp(algo, 0, 0))
+		return -ENOENT;
+
+	strscpy(epf_nvme->comp_algo, algo, sizeof(epf_nvme->comp_algo));
+
+	return len;
+}
+
+CONFIGFS_ATTR(pci_epf_nvme_, compression);
+
+static ssize_t pci_epf_nvme_compression_cluster_kb_show(struct config_item *item,
+							char *page)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+
+	return sysfs_emit(page, "%zu\n", epf_nvme->comp_cluster_kb);
+}
+
+static ssize_t pci_epf_nvme_compression_cluster_kb_store(struct config_item *item,
+						const char *page, size_t len)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	unsigned long cluster_kb;
+	int ret;
+
+	if (epf_nvme->ctrl.ctrl)
+		return -EBUSY;
+
+	ret = kstrtoul(page, 0, &cluster_kb);
+	if (ret)
+		return ret;
+	if (!cluster_kb)
+		cluster_kb = PCI_EPF_NVME_COMP_CLUSTER_KB;
+	else if (cluster_kb > PCI_EPF_NVME_COMP_MAX_CLUSTER_KB)
+		cluster_kb = PCI_EPF_NVME_COMP_MAX_CLUSTER_KB;
+
+	if (!is_power_of_2(cluster_kb))
+		return -EINVAL;
+
+	epf_nvme->comp_cluster_kb = cluster_kb;
+
+	return len;
+}
+
+CONFIGFS_ATTR(pci_epf_nvme_, compression_cluster_kb);
+
+static ssize_t pci_epf_nvme_compression_stats_show(struct config_item *item,
+						   char *page)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	struct pci_epf_nvme_comp *comp;
+	struct pci_epf_nvme_ns *epns;
+	unsigned long nsid;
+	ssize_t count = 0;
+
+	mutex_lock(&epf_nvme->ns_lock);
+	xa_for_each(&epf_nvme->ns_xa, nsid, epns) {
+		comp = epns->comp;
+		if (!comp)
+			continue;
+		count += sysfs_emit_at(page, count,
+			"ns %lu: %s, clusters %lld compressed, %lld raw, %lld zero, "
+			"written %lld B host / %lld B backend, "
+			"read %lld B host / %lld B backend\n",
+			nsid, comp->algo,
+			atomic64_read(&comp->nr_compressed),
+			atomic64_read(&comp->nr_raw),
+			atomic64_read(&comp->nr_zero),
+			atomic64_read(&comp->host_bytes_written),
+			atomic64_read(&comp->backend_bytes_written),
+			atomic64_read(&comp->host_bytes_read),
+			atomic64_read(&comp->backend_bytes_read));
+	}
+	mutex_unlock(&epf_nvme->ns_lock);
+
+	return count;
+}
+
+CONFIGFS_ATTR_RO(pci_epf_nvme_, compression_stats);
+
+static ssize_t pci_epf_nvme_encryption_key_show(struct config_item *item,
+						char *page)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+
+	/* Never show the key itself */
+	if (!epf_nvme->crypt_key_size)
+		return sysfs_emit(page, "none\n");
 
-	return 0;
+	return sysfs_emit(page, "%s %u-bit\n", PCI_EPF_NVME_CRYPT_ALGO,
+			  epf_nvme->crypt_key_size * 8);
 }
 
-static int pci_epf_nvme_epc_init(struct pci_epf *epf)
+static ssize_t pci_epf_nvme_encryption_key_store(struct config_item *item,
+						 const char *page, size_t len)
 {
-	struct pci_epf_nvme *epf_nvme = epf_get_drvdata(epf);
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	u8 key[PCI_EPF_NVME_CRYPT_MAX_KEY_SIZE];
+	struct crypto_sync_skcipher *tfm;
+	size_t key_len, key_size;
 	int ret;
 
-	if (epf->vfunc_no <= 1) {
-		/* Set device ID, class, etc */
-		ret = pci_epc_write_header(epf->epc, epf->func_no, epf->vfunc_no,
-					   epf->header);
-		if (ret) {
-			dev_err(&epf->dev,
-				"Write configuration header failed %d\n", ret);
-			return ret;
-		}
-	}
+	if (epf_nvme->ctrl.ctrl)
+		return -EBUSY;
 
-	/* Setup the PCIe BAR and enable interrupts */
-	ret = pci_epc_set_bar(epf->epc, epf->func_no, epf->vfunc_no,
-			      &epf->bar[BAR_0]);
-	if (ret) {
-		dev_err(&epf->dev, "Set BAR 0 failed\n");
-		pci_epf_free_space(epf, epf_nvme->reg_bar, BAR_0,
-				   PRIMARY_INTERFACE);
-		return ret;
+	if (sysfs_streq(page, "none")) {
+		memzero_explicit(epf_nvme->crypt_key,
+				 sizeof(epf_nvme->crypt_key));
+		epf_nvme->crypt_key_size = 0;
+		return len;
 	}
 
-	ret = pci_epf_nvme_init_irq(epf);
+	/*
+	 * XTS keys are 2 AES-128 or AES-256 keys, given in hex. Check the
+	 * exact number of digits, so that a mistyped key is not truncated.
+	 */
+	key_len = strcspn(page, "\n");
+	if (key_len != 64 && key_len != 128)
+		return -EINVAL;
+	key_size = key_len / 2;
+	if (hex2bin(key, page, key_size))
+		return -EINVAL;
+
+	/* Check the key now rather than when the namespaces are used */
+	tfm = crypto_alloc_sync_skcipher(PCI_EPF_NVME_CRYPT_ALGO, 0, 0);
+	if (IS_ERR(tfm)) {
+		ret = PTR_ERR(tfm);
+		goto out;
+	}
+	ret = crypto_sync_skcipher_setkey(tfm, key, key_size);
+	crypto_free_sync_skcipher(tfm);
 	if (ret)
-		return ret;
+		goto out;
 
-	pci_epf_nvme_init_ctrl_regs(epf);
+	memcpy(epf_nvme->crypt_key, key, key_size);
+	epf_nvme->crypt_key_size = key_size;
+	ret = len;
 
-	if (!epf_nvme->epc_features->linkup_notifier) {
-		schedule_delayed_work(&epf_nvme->reg_poll, msecs_to_jiffies(5));
-		/* If there is no notifier at all, assume link is up */
-		epf_nvme->link_up = true;
-	}
+out:
+	memzero_explicit(key, sizeof(key));
 
-	return 0;
+	return ret;
 }
 
-static void pci_epf_nvme_epc_deinit(struct pci_epf *epf)
-{
-	struct pci_epf_nvme *epf_nvme = epf_get_drvdata(epf);
+CONFIGFS_ATTR(pci_epf_nvme_, encryption_key);
 
-	/* Stop polling BAR registers and disable the controller */
-	cancel_delayed_work_sync(&epf_nvme->reg_poll);
+static ssize_t pci_epf_nvme_pi_type_show(struct config_item *item, char *page)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
 
-	pci_epf_nvme_delete_ctrl(epf);
-	pci_epf_nvme_clean_dma(epf);
-	pci_epf_nvme_clear_bar(epf);
+	return sysfs_emit(page, "%u\n", epf_nvme->pi_type);
 }
 
-static int pci_epf_nvme_link_up(struct pci_epf *epf)
+static ssize_t pci_epf_nvme_pi_type_store(struct config_item *item,
+					  const char *page, size_t len)
 {
-	struct pci_epf_nvme *epf_nvme = epf_get_drvdata(epf);
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	unsigned int type;
+	int ret;
 
-	dev_info(&epf->dev, "Link UP\n");
-	epf_nvme->link_up = true;
+	if (epf_nvme->ctrl.ctrl)
+		return -EBUSY;
 
-	pci_epf_nvme_init_ctrl_regs(epf);
+	ret = kstrtouint(page, 0, &type);
+	if (ret)
+		return ret;
+	if (type > NVME_NS_DPS_PI_TYPE3)
+		return -EINVAL;
 
-	/* Start polling the BAR registers to detect controller enable */
-	schedule_delayed_work(&epf_nvme->reg_poll, 0);
+	epf_nvme->pi_type = type;
 
-	return 0;
+	return len;
 }
 
-static int pci_epf_nvme_link_down(struct pci_epf *epf)
+CONFIGFS_ATTR(pci_epf_nvme_, pi_type);
+
+static ssize_t pci_epf_nvme_pi_guard_show(struct config_item *item, char *page)
 {
-	struct pci_epf_nvme *epf_nvme = epf_get_drvdata(epf);
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
 
-	dev_info(&epf->dev, "Link DOWN\n");
-	epf_nvme->link_up = false;
+	return sysfs_emit(page, "%s\n",
+		epf_nvme->pi_guard == NVME_NVM_NS_64B_GUARD ? "crc64" : "crc16");
+}
 
-	/* Stop polling BAR registers and disable the controller */
-	cancel_delayed_work_sync(&epf_nvme->reg_poll);
-	pci_epf_nvme_disable_ctrl(epf_nvme);
+static ssize_t pci_epf_nvme_pi_guard_store(struct config_item *item,
+					   const char *page, size_t len)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
 
-	return 0;
+	if (epf_nvme->ctrl.ctrl)
+		return -EBUSY;
+
+	if (sysfs_streq(page, "crc16"))
+		epf_nvme->pi_guard = NVME_NVM_NS_16B_GUARD;
+	else if (sysfs_streq(page, "crc64"))
+		epf_nvme->pi_guard = NVME_NVM_NS_64B_GUARD;
+	else
+		return -EINVAL;
+
+	return len;
 }
 
-static const struct pci_epc_event_ops pci_epf_nvme_event_ops = {
-	.epc_init = pci_epf_nvme_epc_init,
-	.epc_deinit = pci_epf_nvme_epc_deinit,
-	.link_up = pci_epf_nvme_link_up,
-	.link_down = pci_epf_nvme_link_down,
-};
+CONFIGFS_ATTR(pci_epf_nvme_, pi_guard);
 
-static int pci_epf_nvme_bind(struct pci_epf *epf)
+static ssize_t pci_epf_nvme_pi_extended_show(struct config_item *item,
+					     char *page)
 {
-	struct pci_epf_nvme *epf_nvme = epf_get_drvdata(epf);
-	const struct pci_epc_features *epc_features;
-	struct pci_epc *epc = epf->epc;
-	bool dma_supported;
-	int ret;
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
 
-	if (!epc) {
-		dev_err(&epf->dev, "No endpoint controller\n");
-		return -EINVAL;
-	}
+	return sysfs_emit(page, "%d\n", epf_nvme->pi_extended);
+}
 
-	epc_features = pci_epc_get_features(epc, epf->func_no, epf->vfunc_no);
-	if (!epc_features) {
-		dev_err(&epf->dev, "epc_features not implemented\n");
-		return -EOPNOTSUPP;
-	}
-	epf_nvme->epc_features = epc_features;
+static ssize_t pci_epf_nvme_pi_extended_store(struct config_item *item,
+					      const char *page, size_t len)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	bool extended;
+	int ret;
 
-	ret = pci_epf_nvme_configure_bar(epf);
+	if (epf_nvme->ctrl.ctrl)
+		return -EBUSY;
+
+	ret = kstrtobool(page, &extended);
 	if (ret)
 		return ret;
 
-	if (epf_nvme->dma_enable) {
-		dma_supported = pci_epf_nvme_init_dma(epf_nvme);
-		if (dma_supported) {
-			dev_info(&epf->dev, "DMA supported\n");
-		} else {
-			dev_info(&epf->dev,
-				 "DMA not supported, falling back to mmio\n");
-			epf_nvme->dma_enable = false;
-		}
-	} else {
-		dev_info(&epf->dev, "DMA disabled\n");
-	}
+	epf_nvme->pi_extended = extended;
 
-	/* Create the fabrics host controller */
-	ret = pci_epf_nvme_create_ctrl(epf);
-	if (ret)
-		goto clean_dma;
+	return len;
+}
 
-	return 0;
+CONFIGFS_ATTR(pci_epf_nvme_, pi_extended);
 
-clean_dma:
-	pci_epf_nvme_clean_dma(epf);
-	pci_epf_nvme_clear_bar(epf);
+static ssize_t pci_epf_nvme_xfer_verify_show(struct config_item *item,
+					     char *page)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
 
-	return ret;
+	return sysfs_emit(page, "%u\n", READ_ONCE(epf_nvme->verify_rate));
 }
 
-static void pci_epf_nvme_unbind(struct pci_epf *epf)
+static ssize_t pci_epf_nvme_xfer_verify_store(struct config_item *item,
+					      const char *page, size_t len)
 {
-	struct pci_epf_nvme *epf_nvme = epf_get_drvdata(epf);
-	struct pci_epc *epc = epf->epc;
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	unsigned int rate;
+	int ret;
 
-	cancel_delayed_work_sync(&epf_nvme->reg_poll);
+	ret = kstrtouint(page, 0, &rate);
+	if (ret)
+		return ret;
 
-	pci_epf_nvme_delete_ctrl(epf);
+	mutex_lock(&epf_nvme->config_lock);
+	WRITE_ONCE(epf_nvme->verify_rate, rate);
+	pci_epf_nvme_verify_update_key(epf_nvme);
+	mutex_unlock(&epf_nvme->config_lock);
 
-	if (epc->init_complete) {
-		pci_epf_nvme_clean_dma(epf);
-		pci_epf_nvme_clear_bar(epf);
-	}
+	return len;
 }
 
-static int pci_epf_nvme_pci_dev_open(struct inode* inode, struct file* file) {
-	struct pci_epf_nvme_cdev_data *pencdd = container_of(inode->i_cdev,
-		struct pci_epf_nvme_cdev_data, cdev);
-	file->private_data = pencdd;
-	return 0;
+CONFIGFS_ATTR(pci_epf_nvme_, xfer_verify);
+
+static ssize_t pci_epf_nvme_xfer_verify_stats_show(struct config_item *item,
+						   char *page)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	struct pci_epf_nvme_verify_stats *link = &epf_nvme->verify_link;
+	struct pci_epf_nvme_verify_stats *total = &epf_nvme->verify_total;
+	ssize_t count;
+	int i;
+
+	count = sysfs_emit(page, "link epoch %u\n", epf_nvme->link_epoch);
+	for (i = 0; i < PCI_EPF_NVME_VERIFY_NR_SIZES; i++)
+		count += sysfs_emit_at(page, count,
+			"%s: link %lld verified %lld mismatch, total %lld verified %lld mismatch\n",
+			pci_epf_nvme_verify_size_name[i],
+			atomic64_read(&link->nr_verified[i]),
+			atomic64_read(&link->nr_mismatch[i]),
+			atomic64_read(&total->nr_verified[i]),
+			atomic64_read(&total->nr_mismatch[i]));
+
+	return count;
 }
 
-static ssize_t pci_epf_nvme_pci_dev_read(struct file* file, char* buffer, size_t len, loff_t* offset) {
-	struct pci_epf_nvme_cdev_data *pencdd = file->private_data;
-	struct pci_epf_nvme *epf_nvme = pencdd->epf_nvme;
-	struct pci_epf *epf = epf_nvme->epf;
-	struct device *dev = &epf->dev;
-	struct pci_epf_nvme_segment seg;
-	void* local_buffer = NULL;
-	int error_count = 0;
-	int ret = 0;
-	size_t bytes_transfered = 0, btt = 0;
-	const size_t LOCAL_BUFFER_SIZE = SZ_64K;
-	if (!offset)
-		return -EINVAL;
+CONFIGFS_ATTR_RO(pci_epf_nvme_, xfer_verify_stats);
 
-	if (!epf_nvme->link_up) {
-		dev_warn(dev, "Link is down cannot read\n");
-		return -EFAULT;
-	}
+static ssize_t pci_epf_nvme_payload_attrs_show(struct config_item *item,
+					       char *page)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	unsigned int attrs = READ_ONCE(epf_nvme->payload_attrs);
 
-	local_buffer = kzalloc(LOCAL_BUFFER_SIZE, GFP_KERNEL);
-	if (!local_buffer)
-		return -ENOMEM;
+	if (!attrs)
+		return sysfs_emit(page, "none\n");
 
-	dev_dbg(dev, "Request to read %zu bytes from offset 0x%llx\n", len, *offset);
+	return sysfs_emit(page, "%s%s%s\n",
+			  attrs & PCI_EPF_NVME_PAYLOAD_RO ? "ro" : "",
+			  attrs == (PCI_EPF_NVME_PAYLOAD_RO |
+				    PCI_EPF_NVME_PAYLOAD_NS) ? "," : "",
+			  attrs & PCI_EPF_NVME_PAYLOAD_NS ? "ns" : "");
+}
 
-	while (bytes_transfered < len) {
-		btt = min(len - bytes_transfered, LOCAL_BUFFER_SIZE);
-		//dev_dbg(dev, "btt: %zu, bytes_transfered: %zu\n", btt, bytes_transfered);
-		seg.pci_addr = *offset + bytes_transfered;
-		seg.size = btt;
-		ret = pci_epf_nvme_transfer(epf_nvme, &seg, DMA_FROM_DEVICE, local_buffer);
-		if (ret < 0) {
-			dev_err(dev, "Failed to read over PCI\n");
-			return ret;
+static ssize_t pci_epf_nvme_payload_attrs_store(struct config_item *item,
+						const char *page, size_t len)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	char *buf, *opts, *p;
+	unsigned int attrs = 0;
+	int ret = len;
+
+	buf = kstrndup(page, len, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	opts = strim(buf);
+	while ((p = strsep(&opts, ",")) != NULL) {
+		if (!strcmp(p, "ro")) {
+			attrs |= PCI_EPF_NVME_PAYLOAD_RO;
+		} else if (!strcmp(p, "ns")) {
+			attrs |= PCI_EPF_NVME_PAYLOAD_NS;
+		} else if (strcmp(p, "none")) {
+			ret = -EINVAL;
+			break;
 		}
-		/* Maybe this is possible in zero-copy */
-		error_count += copy_to_user(buffer + bytes_transfered, local_buffer, btt);
-		bytes_transfered += btt;
 	}
-	kfree(local_buffer);
 
-	if (error_count != 0) {
-		dev_err(dev, "Failed to send %d characters to the user\n", error_count);
-		return -EFAULT;
-	}
+	if (ret > 0)
+		WRITE_ONCE(epf_nvme->payload_attrs, attrs);
 
-	*offset += len;
-	return len;
+	kfree(buf);
+
+	return ret;
 }
 
-static ssize_t pci_epf_nvme_pci_dev_write(struct file* file, const char* buffer, size_t len, loff_t* offset) {
-	struct pci_epf_nvme_cdev_data *pencdd = file->private_data;
-	struct pci_epf_nvme *epf_nvme = pencdd->epf_nvme;
-	struct pci_epf *epf = epf_nvme->epf;
-	struct device *dev = &epf->dev;
-	struct pci_epf_nvme_segment seg;
-	size_t bytes_transfered = 0, btt = 0;
-	const size_t LOCAL_BUFFER_SIZE = SZ_64K;
-	void* local_buffer = NULL;
-	int ret = 0;
-	if (!offset)
-		return -EINVAL;
+CONFIGFS_ATTR(pci_epf_nvme_, payload_attrs);
+
+static ssize_t pci_epf_nvme_payload_stats_show(struct config_item *item,
+					       char *page)
+{
+	struct config_group *group = to_config_group(item);
+	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+
+	return sysfs_emit(page, "fences %lld, errors %lld\n",
+			  atomic64_read(&epf_nvme->nr_fences),
+			  atomic64_read(&epf_nvme->nr_fence_errors));
+}
+
+CONFIGFS_ATTR_RO(pci_epf_nvme_, payload_stats);
+
+static ssize_t pci_epf_nvme_activation_hook_show(struct config_item *item,
+						 char *page)
+{
+	return sysfs_emit(page, "%d\n",
+			  READ_ONCE(pci_epf_nvme_activation_hook.registered));
+}
 
-	dev_dbg(dev, "Request to write %zu bytes at offset 0x%llx\n", len, *offset);
+static ssize_t pci_epf_nvme_activation_hook_store(struct config_item *item,
+						  const char *page, size_t len)
+{
+	bool enable;
+	int ret;
 
-	if (!epf_nvme->link_up) {
-		dev_warn(dev, "Link is down cannot write\n");
-		return -EFAULT;
-	}
+	ret = kstrtobool(page, &enable);
+	if (ret)
+		return ret;
 
-	local_buffer = kzalloc(LOCAL_BUFFER_SIZE, GFP_KERNEL);
-	if (!local_buffer)
-		return -ENOMEM;
+	if (enable == READ_ONCE(pci_epf_nvme_activation_hook.registered))
+		return len;
 
-	while (bytes_transfered < len) {
-		btt = min(len - bytes_transfered, LOCAL_BUFFER_SIZE);
-		//dev_dbg(dev, "btt: %zu, bytes_transfered: %zu\n", btt, bytes_transfered);
-		/* Maybe this is possible in zero-copy */
-		if (copy_from_user(local_buffer, buffer + bytes_transfered, btt)) {
-			dev_err(dev, "Failed to copy data from user\n");
-			return -EFAULT;
-		}
-		seg.pci_addr = *offset + bytes_transfered;
-		seg.size = btt;
-		ret = pci_epf_nvme_transfer(epf_nvme, &seg, DMA_TO_DEVICE, local_buffer);
-		if (ret < 0) {
-			dev_err(dev, "Failed to write over PCI\n");
+	if (enable) {
+		ret = pci_epf_nvme_register_hook(&pci_epf_nvme_activation_hook);
+		if (ret)
 			return ret;
-		}
-		bytes_transfered += btt;
+	} else {
+		pci_epf_nvme_unregister_hook(&pci_epf_nvme_activation_hook);
 	}
-	kfree(local_buffer);
 
-	*offset += len;
 	return len;
 }
 
-static int pci_epf_nvme_pci_dev_release(struct inode* inode, struct file* file) {
-	return 0;
+CONFIGFS_ATTR(pci_epf_nvme_, activation_hook);
+
+static ssize_t pci_epf_nvme_hooks_show(struct config_item *item, char *page)
+{
+	struct pci_epf_nvme_hook *hook;
+	ssize_t count = 0;
+
+	count += sysfs_emit_at(page, count, "deferred pending %d/%d\n",
+			       atomic_read(&pci_epf_nvme_hook_pending),
+			       PCI_EPF_NVME_HOOK_MAX_PENDING);
+
+	mutex_lock(&pci_epf_nvme_hooks_lock);
+	list_for_each_entry(hook, &pci_epf_nvme_hooks, link) {
+		count += sysfs_emit_at(page, count,
+				"%s: %s, max %zu B, calls %lld, dropped %lld\n",
+				hook->name,
+				hook->flags & PCI_EPF_NVME_HOOK_DEFERRED ?
+				"deferred" : "inline",
+				hook->max_bytes,
+				atomic64_read(&hook->nr_calls),
+				atomic64_read(&hook->nr_dropped));
+	}
+	mutex_unlock(&pci_epf_nvme_hooks_lock);
+
+	return count;
 }
 
-static struct file_operations fops = {
-	.open		= pci_epf_nvme_pci_dev_open,
-	.read		= pci_epf_nvme_pci_dev_read,
-	.write		= pci_epf_nvme_pci_dev_write,
-	.release	= pci_epf_nvme_pci_dev_release,
-};
+CONFIGFS_ATTR_RO(pci_epf_nvme_, hooks);
 
-static struct pci_epf_header epf_nvme_pci_header = {
-	.vendorid	= PCI_ANY_ID,
-	.deviceid	= PCI_ANY_ID,
-	.progif_code	= 0x02, /* NVM Express */
-	.baseclass_code = PCI_BASE_CLASS_STORAGE,
-	.subclass_code	= 0x08, /* Non-Volatile Memory controller */
-	.interrupt_pin	= PCI_INTERRUPT_INTA,
-};
+/*
+ * Namespaces defined through configfs: the attributes are used when the
+ * controller is created.
+ */
+#define to_ns_cfg(item)	\
+	container_of(to_config_group(item), struct pci_epf_nvme_ns_cfg, group)
 
-static int dev_major = 0;
+static ssize_t pci_epf_nvme_ns_backend_show(struct config_item *item,
+					    char *page)
+{
+	return sysfs_emit(page, "%s\n",
+			  pci_epf_nvme_backend_name[to_ns_cfg(item)->backend]);
+}
 
-static int pci_epf_nvme_probe(struct pci_epf *epf,
-			      const struct pci_epf_device_id *id)
+static ssize_t pci_epf_nvme_ns_backend_store(struct config_item *item,
+					     const char *page, size_t len)
 {
-	struct pci_epf_nvme *epf_nvme;
-	dev_t cdev;
-	int ret = 0;
+	struct pci_epf_nvme_ns_cfg *cfg = to_ns_cfg(item);
+	int i;
 
-	/* This is just an example on how to call userspace commands from here */
-	char *argv[] = { "/bin/sh", "-c", "echo Hello from kernel space! > /tmp/kernel_output.txt", NULL };
-	static char *envp[] = { "HOME=/", "PATH=/sbin:/bin:/usr/sbin:/usr/bin" , NULL};
-	ret = call_usermodehelper(argv[0], argv, envp, UMH_WAIT_PROC);
-	if (ret != 0) {
-		dev_err(&epf->dev,
-			"call_usermodehelper() failed with return code: %d\n",
-			ret);
-	} else {
-		dev_info(&epf->dev,
-			 "User space program executed successfully\n");
+	for (i = 0; i < PCI_EPF_NVME_NR_BACKENDS; i++) {
+		if (sysfs_streq(page, pci_epf_nvme_backend_name[i]))
+			break;
 	}
+	if (i == PCI_EPF_NVME_NR_BACKENDS)
+		return -EINVAL;
 
-	epf_nvme = devm_kzalloc(&epf->dev, sizeof(*epf_nvme), GFP_KERNEL);
-	if (!epf_nvme)
-		return -ENOMEM;
-
-	epf_nvme->epf = epf;
-	INIT_DELAYED_WORK(&epf_nvme->reg_poll, pci_epf_nvme_reg_poll);
+	mutex_lock(&cfg->epf_nvme->ns_lock);
+	cfg->backend = i;
+	mutex_unlock(&cfg->epf_nvme->ns_lock);
 
-	epf_nvme->evil_wq = create_singlethread_workqueue("evil wq");
-	if (!epf_nvme->evil_wq)
-		return -ENOMEM;
+	return len;
+}
 
-	epf_nvme->prp_list_buf = devm_kzalloc(&epf->dev, NVME_CTRL_PAGE_SIZE,
-					      GFP_KERNEL);
-	if (!epf_nvme->prp_list_buf)
-		return -ENOMEM;
+CONFIGFS_ATTR(pci_epf_nvme_ns_, backend);
 
-	/* Set default attribute values */
-	epf_nvme->dma_enable = true;
-	epf_nvme->mdts_kb = PCI_EPF_NVME_MDTS_KB;
+static ssize_t pci_epf_nvme_ns_str_show(struct pci_epf_nvme_ns_cfg *cfg,
+					char **str, char *page)
+{
+	ssize_t ret;
 
-	epf->event_ops = &pci_epf_nvme_event_ops;
-	epf->header = &epf_nvme_pci_header;
-	epf_set_drvdata(epf, epf_nvme);
+	mutex_lock(&cfg->epf_nvme->ns_lock);
+	ret = sysfs_emit(page, "%s\n", *str ?: "");
+	mutex_unlock(&cfg->epf_nvme->ns_lock);
 
-	/* allocate chardev region and assign Major number */
-	ret = alloc_chrdev_region(&cdev, 0, 1, "nvme_pci_cdev");
-	if (ret) {
-		dev_err(&epf->dev, "Could not alloc chrdev region\n");
-		return ret;
-	}
+	return ret;
+}
 
-	dev_major = MAJOR(cdev);
+static ssize_t pci_epf_nvme_ns_str_store(struct pci_epf_nvme_ns_cfg *cfg,
+					 char **str, const char *page,
+					 size_t len)
+{
+	char *val = NULL;
 
-	/* Add char device that exposes PCI space */
-	epf_nvme->char_class = class_create("nvme_pci_cdev");
-	if (IS_ERR_OR_NULL(epf_nvme->char_class)) {
-		dev_err(&epf->dev, "Could not create class\n");
-		return PTR_ERR(epf_nvme->char_class);
+	if (len && !sysfs_streq(page, "")) {
+		val = kstrndup(page, len, GFP_KERNEL);
+		if (!val)
+			return -ENOMEM;
+		val[strcspn(val, "\n")] = '\0';
 	}
 
-	cdev_init(&epf_nvme->chardev_data.cdev, &fops);
-	epf_nvme->chardev_data.cdev.owner = THIS_MODULE;
-
-	ret = cdev_add(&epf_nvme->chardev_data.cdev, MKDEV(dev_major, 0), 1);
-	if (ret < 0) {
-		dev_err(&epf->dev, "Could not add character device: %d\n", ret);
-		return ret;
-	}
+	mutex_lock(&cfg->epf_nvme->ns_lock);
+	kfree(*str);
+	*str = val;
+	mutex_unlock(&cfg->epf_nvme->ns_lock);
 
-	device_create(epf_nvme->char_class, NULL, MKDEV(dev_major, 0), NULL,
-		      "pci-io");
+	return len;
+}
 
-	epf_nvme->chardev_data.epf_nvme = epf_nvme;
+static ssize_t pci_epf_nvme_ns_path_show(struct config_item *item,
+					 char *page)
+{
+	struct pci_epf_nvme_ns_cfg *cfg = to_ns_cfg(item);
 
-	return 0;
+	return pci_epf_nvme_ns_str_show(cfg, &cfg->path, page);
 }
 
-#define to_epf_nvme(epf_group)	\
-	container_of((epf_group), struct pci_epf_nvme, group)
-
-static ssize_t pci_epf_nvme_ctrl_opts_show(struct config_item *item,
-					   char *page)
+static ssize_t pci_epf_nvme_ns_path_store(struct config_item *item,
+					  const char *page, size_t len)
 {
-	struct config_group *group = to_config_group(item);
-	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
-
-	if (!epf_nvme->ctrl_opts_buf)
-		return 0;
+	struct pci_epf_nvme_ns_cfg *cfg = to_ns_cfg(item);
 
-	return sysfs_emit(page, "%s\n", epf_nvme->ctrl_opts_buf);
+	return pci_epf_nvme_ns_str_store(cfg, &cfg->path, page, len);
 }
 
-#define PCI_EPF_NVME_OPT_HIDDEN_NS	"hidden_ns"
+CONFIGFS_ATTR(pci_epf_nvme_ns_, path);
 
-static ssize_t pci_epf_nvme_ctrl_opts_store(struct config_item *item,
-					    const char *page, size_t len)
+static ssize_t pci_epf_nvme_ns_overlay_path_show(struct config_item *item,
+						 char *page)
 {
-	struct config_group *group = to_config_group(item);
-	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
-	size_t opt_buf_size;
+	struct pci_epf_nvme_ns_cfg *cfg = to_ns_cfg(item);
 
-	/* Do not allow setting options when the function is already started */
-	if (epf_nvme->ctrl.ctrl)
-		return -EBUSY;
+	return pci_epf_nvme_ns_str_show(cfg, &cfg->overlay_path, page);
+}
 
-	if (!len)
-		return -EINVAL;
+static ssize_t pci_epf_nvme_ns_overlay_path_store(struct config_item *item,
+						  const char *page, size_t len)
+{
+	struct pci_epf_nvme_ns_cfg *cfg = to_ns_cfg(item);
 
-	kfree(epf_nvme->ctrl_opts_buf);
+	return pci_epf_nvme_ns_str_store(cfg, &cfg->overlay_path, page, len);
+}
 
-	/*
-	 * Make sure we have enough room to add the hidden_ns option
-	 * if it is missing.
-	 */
-	opt_buf_size = len + strlen(PCI_EPF_NVME_OPT_HIDDEN_NS) + 2;
-	epf_nvme->ctrl_opts_buf = kzalloc(opt_buf_size, GFP_KERNEL);
-	if (!epf_nvme->ctrl_opts_buf)
-		return -ENOMEM;
+CONFIGFS_ATTR(pci_epf_nvme_ns_, overlay_path);
 
-	strscpy(epf_nvme->ctrl_opts_buf, page, opt_buf_size);
-	if (!strnstr(page, PCI_EPF_NVME_OPT_HIDDEN_NS, len))
-		strncat(epf_nvme->ctrl_opts_buf,
-			"," PCI_EPF_NVME_OPT_HIDDEN_NS, opt_buf_size);
+static ssize_t pci_epf_nvme_ns_lba_size_show(struct config_item *item,
+					     char *page)
+{
+	return sysfs_emit(page, "%u\n", 1U << to_ns_cfg(item)->lba_shift);
+}
 
-	dev_dbg(&epf_nvme->epf->dev,
-		"NVMe fabrics controller options: %s\n",
-		epf_nvme->ctrl_opts_buf);
+static ssize_t pci_epf_nvme_ns_lba_size_store(struct config_item *item,
+					      const char *page, size_t len)
+{
+	struct pci_epf_nvme_ns_cfg *cfg = to_ns_cfg(item);
+	unsigned int lba_size;
+	int ret;
 
-	return len;
-}
+	ret = kstrtouint(page, 0, &lba_size);
+	if (ret)
+		return ret;
 
-CONFIGFS_ATTR(pci_epf_nvme_, ctrl_opts);
+	if (!is_power_of_2(lba_size) || lba_size < SECTOR_SIZE ||
+	    lba_size > PAGE_SIZE)
+		return -EINVAL;
 
-static ssize_t pci_epf_nvme_dma_enable_show(struct config_item *item,
-					    char *page)
-{
-	struct config_group *group = to_config_group(item);
-	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	mutex_lock(&cfg->epf_nvme->ns_lock);
+	cfg->lba_shift = ilog2(lba_size);
+	mutex_unlock(&cfg->epf_nvme->ns_lock);
 
-	return sysfs_emit(page, "%d\n", epf_nvme->dma_enable);
+	return len;
 }
 
-static ssize_t pci_epf_nvme_dma_enable_store(struct config_item *item,
-					     const char *page, size_t len)
+CONFIGFS_ATTR(pci_epf_nvme_ns_, lba_size);
+
+#define PCI_EPF_NVME_NS_CFG_ATTR(_name, _type, _fmt, _kstrto)		\
+static ssize_t pci_epf_nvme_ns_##_name##_show(struct config_item *item,	\
+					      char *page)		\
+{									\
+	return sysfs_emit(page, _fmt "\n", to_ns_cfg(item)->_name);	\
+}									\
+									\
+static ssize_t pci_epf_nvme_ns_##_name##_store(struct config_item *item, \
+					       const char *page,	\
+					       size_t len)		\
+{									\
+	struct pci_epf_nvme_ns_cfg *cfg = to_ns_cfg(item);		\
+	_type val;							\
+	int ret;							\
+									\
+	ret = _kstrto(page, 0, &val);					\
+	if (ret)							\
+		return ret;						\
+									\
+	mutex_lock(&cfg->epf_nvme->ns_lock);				\
+	cfg->_name = val;						\
+	mutex_unlock(&cfg->epf_nvme->ns_lock);				\
+									\
+	return len;							\
+}									\
+									\
+CONFIGFS_ATTR(pci_epf_nvme_ns_, _name)
+
+PCI_EPF_NVME_NS_CFG_ATTR(backend_nsid, u32, "%u", kstrtou32);
+PCI_EPF_NVME_NS_CFG_ATTR(size_mb, u64, "%llu", kstrtou64);
+PCI_EPF_NVME_NS_CFG_ATTR(cache_mb, unsigned int, "%u", kstrtouint);
+PCI_EPF_NVME_NS_CFG_ATTR(prefetch_entries, unsigned int, "%u", kstrtouint);
+PCI_EPF_NVME_NS_CFG_ATTR(qos_iops, unsigned int, "%u", kstrtouint);
+PCI_EPF_NVME_NS_CFG_ATTR(qos_mbps, unsigned int, "%u", kstrtouint);
+PCI_EPF_NVME_NS_CFG_ATTR(overlay_mb, unsigned int, "%u", kstrtouint);
+
+static ssize_t pci_epf_nvme_ns_overlay_discard_store(struct config_item *item,
+						     const char *page,
+						     size_t len)
 {
-	struct config_group *group = to_config_group(item);
-	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	struct pci_epf_nvme_ns_cfg *cfg = to_ns_cfg(item);
+	struct pci_epf_nvme *epf_nvme = cfg->epf_nvme;
+	struct pci_epf_nvme_ns *epns;
+	bool discard;
 	int ret;
 
-	if (epf_nvme->ctrl_enabled)
-		return -EBUSY;
-
-	ret = kstrtobool(page, &epf_nvme->dma_enable);
+	ret = kstrtobool(page, &discard);
 	if (ret)
 		return ret;
+	if (!discard)
+		return len;
 
-	return len;
+	mutex_lock(&epf_nvme->ns_lock);
+	epns = xa_load(&epf_nvme->ns_xa, cfg->nsid);
+	if (epns && epns->local && epns->overlay)
+		pci_epf_nvme_overlay_discard(epns);
+	else
+		ret = -ENODEV;
+	mutex_unlock(&epf_nvme->ns_lock);
+
+	return ret ? ret : len;
 }
 
-CONFIGFS_ATTR(pci_epf_nvme_, dma_enable);
+CONFIGFS_ATTR_WO(pci_epf_nvme_ns_, overlay_discard);
 
-static ssize_t pci_epf_nvme_mdts_kb_show(struct config_item *item, char *page)
+static ssize_t pci_epf_nvme_ns_stats_show(struct config_item *item,
+					  char *page)
 {
-	struct config_group *group = to_config_group(item);
-	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
+	struct pci_epf_nvme_ns_cfg *cfg = to_ns_cfg(item);
+	struct pci_epf_nvme *epf_nvme = cfg->epf_nvme;
+	struct pci_epf_nvme_ns *epns;
+	s64 prefetched, useful;
+	ssize_t count = 0;
+
+	mutex_lock(&epf_nvme->ns_lock);
+
+	epns = xa_load(&epf_nvme->ns_xa, cfg->nsid);
+	if (!epns || !epns->local) {
+		count = sysfs_emit(page, "not created\n");
+		goto unlock;
+	}
 
-	return sysfs_emit(page, "%zu\n", epf_nvme->mdts_kb);
+	count += sysfs_emit_at(page, count, "%s backend, %llu LBAs of %u B\n",
+			       pci_epf_nvme_backend_name[epns->backend],
+			       epns->nr_lbas, 1U << epns->lba_shift);
+	if (epns->cache)
+		count += sysfs_emit_at(page, count,
+				"cache hits %lld, misses %lld, fills %lld\n",
+				atomic64_read(&epns->cache->nr_hits),
+				atomic64_read(&epns->cache->nr_misses),
+				atomic64_read(&epns->cache->nr_fills));
+	if (epns->prefetch) {
+		prefetched = atomic64_read(&epns->prefetch->nr_prefetched);
+		useful = atomic64_read(&epns->prefetch->nr_useful);
+		count += sysfs_emit_at(page, count,
+				"prefetch lines %lld, useful %lld, wasted %lld B, threshold %u\n",
+				prefetched, useful,
+				max(prefetched - useful, 0LL) <<
+				epns->cache->line_shift,
+				READ_ONCE(epns->prefetch->threshold));
+	}
+	if (epns->qos.iops || epns->qos.mbps)
+		count += sysfs_emit_at(page, count, "qos delayed %lld\n",
+				atomic64_read(&epns->qos.nr_delayed));
+	if (epns->backend == PCI_EPF_NVME_BACKEND_RAM)
+		count += sysfs_emit_at(page, count,
+				"ram store blocks %lu, references %lu\n",
+				READ_ONCE(epf_nvme->ram_store.nr_blocks),
+				READ_ONCE(epf_nvme->ram_store.nr_refs));
+	if (epns->overlay)
+		count += sysfs_emit_at(page, count,
+				"overlay pages %ld, scratch blocks %ld\n",
+				atomic_long_read(&epns->overlay->nr_pages),
+				atomic_long_read(&epns->overlay->nr_slots));
+
+unlock:
+	mutex_unlock(&epf_nvme->ns_lock);
+
+	return count;
 }
 
-static ssize_t pci_epf_nvme_mdts_kb_store(struct config_item *item,
-					  const char *page, size_t len)
+CONFIGFS_ATTR_RO(pci_epf_nvme_ns_, stats);
+
+static struct configfs_attribute *pci_epf_nvme_ns_attrs[] = {
+	&pci_epf_nvme_ns_attr_backend,
+	&pci_epf_nvme_ns_attr_path,
+	&pci_epf_nvme_ns_attr_backend_nsid,
+	&pci_epf_nvme_ns_attr_size_mb,
+	&pci_epf_nvme_ns_attr_lba_size,
+	&pci_epf_nvme_ns_attr_cache_mb,
+	&pci_epf_nvme_ns_attr_prefetch_entries,
+	&pci_epf_nvme_ns_attr_qos_iops,
+	&pci_epf_nvme_ns_attr_qos_mbps,
+	&pci_epf_nvme_ns_attr_overlay_mb,
+	&pci_epf_nvme_ns_attr_overlay_path,
+	&pci_epf_nvme_ns_attr_overlay_discard,
+	&pci_epf_nvme_ns_attr_stats,
+	NULL,
+};
+
+static void pci_epf_nvme_ns_cfg_release(struct config_item *item)
 {
-	struct config_group *group = to_config_group(item);
-	struct pci_epf_nvme *epf_nvme = to_epf_nvme(group);
-	unsigned long mdts_kb;
-	int ret;
+	struct pci_epf_nvme_ns_cfg *cfg = to_ns_cfg(item);
 
-	if (epf_nvme->ctrl_enabled)
-		return -EBUSY;
+	kfree(cfg->path);
+	kfree(cfg->overlay_path);
+	kfree(cfg);
+}
 
-	ret = kstrtoul(page, 0, &mdts_kb);
+static struct configfs_item_operations pci_epf_nvme_ns_cfg_item_ops = {
+	.release	= pci_epf_nvme_ns_cfg_release,
+};
+
+static const struct config_item_type pci_epf_nvme_ns_cfg_type = {
+	.ct_item_ops	= &pci_epf_nvme_ns_cfg_item_ops,
+	.ct_attrs	= pci_epf_nvme_ns_attrs,
+	.ct_owner	= THIS_MODULE,
+};
+
+static struct config_group *pci_epf_nvme_ns_make_group(struct config_group *group,
+							const char *name)
+{
+	struct pci_epf_nvme *epf_nvme =
+		container_of(group, struct pci_epf_nvme, ns_group);
+	struct pci_epf_nvme_ns_cfg *cfg, *c;
+	u32 nsid;
+	int ret;
+
+	ret = kstrtou32(name, 0, &nsid);
 	if (ret)
-		return ret;
-	if (!mdts_kb)
-		mdts_kb = PCI_EPF_NVME_MDTS_KB;
-	else if (mdts_kb > PCI_EPF_NVME_MAX_MDTS_KB)
-		mdts_kb = PCI_EPF_NVME_MAX_MDTS_KB;
+		return ERR_PTR(ret);
+	if (!nsid || nsid > PCI_EPF_NVME_MAX_NSID)
+		return ERR_PTR(-EINVAL);
+
+	cfg = kzalloc(sizeof(*cfg), GFP_KERNEL);
+	if (!cfg)
+		return ERR_PTR(-ENOMEM);
+
+	cfg->epf_nvme = epf_nvme;
+	cfg->nsid = nsid;
+	uuid_gen(&cfg->uuid);
+	cfg->backend = PCI_EPF_NVME_BACKEND_FABRICS;
+	cfg->lba_shift = SECTOR_SHIFT;
+
+	mutex_lock(&epf_nvme->ns_lock);
+	list_for_each_entry(c, &epf_nvme->ns_cfgs, link) {
+		if (c->nsid == nsid) {
+			mutex_unlock(&epf_nvme->ns_lock);
+			kfree(cfg);
+			return ERR_PTR(-EEXIST);
+		}
+	}
+	list_add_tail(&cfg->link, &epf_nvme->ns_cfgs);
+	mutex_unlock(&epf_nvme->ns_lock);
 
-	if (!is_power_of_2(mdts_kb))
-		return -EINVAL;
+	config_group_init_type_name(&cfg->group, name,
+				    &pci_epf_nvme_ns_cfg_type);
 
-	epf_nvme->mdts_kb = mdts_kb;
+	return &cfg->group;
+}
 
-	return len;
+static void pci_epf_nvme_ns_drop_item(struct config_group *group,
+				      struct config_item *item)
+{
+	struct pci_epf_nvme *epf_nvme =
+		container_of(group, struct pci_epf_nvme, ns_group);
+	struct pci_epf_nvme_ns_cfg *cfg = to_ns_cfg(item);
+
+	mutex_lock(&epf_nvme->ns_lock);
+	list_del(&cfg->link);
+	mutex_unlock(&epf_nvme->ns_lock);
+
+	config_item_put(item);
 }
 
-CONFIGFS_ATTR(pci_epf_nvme_, mdts_kb);
+static struct configfs_group_operations pci_epf_nvme_ns_group_ops = {
+	.make_group	= pci_epf_nvme_ns_make_group,
+	.drop_item	= pci_epf_nvme_ns_drop_item,
+};
+
+static const struct config_item_type pci_epf_nvme_ns_group_type = {
+	.ct_group_ops	= &pci_epf_nvme_ns_group_ops,
+	.ct_owner	= THIS_MODULE,
+};
 
 static struct configfs_attribute *pci_epf_nvme_attrs[] = {
 	&pci_epf_nvme_attr_ctrl_opts,
+	&pci_epf_nvme_attr_mirror_opts,
+	&pci_epf_nvme_attr_mirror_hedge_pct,
+	&pci_epf_nvme_attr_mirror_stats,
+	&pci_epf_nvme_attr_flush_window_us,
+	&pci_epf_nvme_attr_flush_stats,
+	&pci_epf_nvme_attr_perf_profile,
+	&pci_epf_nvme_attr_ring_maps,
+	&pci_epf_nvme_attr_ring_stats,
+	&pci_epf_nvme_attr_poll_idle_ms,
+	&pci_epf_nvme_attr_uclamp_boost,
 	&pci_epf_nvme_attr_dma_enable,
+	&pci_epf_nvme_attr_copy_offload_kb,
+	&pci_epf_nvme_attr_xfer_chunk_kb,
+	&pci_epf_nvme_attr_xfer_stats,
+	&pci_epf_nvme_attr_copy_stats,
 	&pci_epf_nvme_attr_mdts_kb,
+	&pci_epf_nvme_attr_max_io_queues,
+	&pci_epf_nvme_attr_active_config,
+	&pci_epf_nvme_attr_compression,
+	&pci_epf_nvme_attr_compression_cluster_kb,
+	&pci_epf_nvme_attr_compression_stats,
+	&pci_epf_nvme_attr_encryption_key,
+	&pci_epf_nvme_attr_pi_type,
+	&pci_epf_nvme_attr_pi_guard,
+	&pci_epf_nvme_attr_pi_extended,
+	&pci_epf_nvme_attr_xfer_verify,
+	&pci_epf_nvme_attr_xfer_verify_stats,
+	&pci_epf_nvme_attr_payload_attrs,
+	&pci_epf_nvme_attr_payload_stats,
+	&pci_epf_nvme_attr_activation_hook,
+	&pci_epf_nvme_attr_hooks,
 	NULL,
 };
 
@@ -2870,6 +10458,11 @@ static struct config_group *pci_epf_nvme_add_cfs(struct pci_epf *epf,
 	config_group_init_type_name(&epf_nvme->group, "nvme",
 				    &pci_epf_nvme_group_type);
 
+	/* Add the group of namespaces defined through configfs */
+	config_group_init_type_name(&epf_nvme->ns_group, "namespaces",
+				    &pci_epf_nvme_ns_group_type);
+	configfs_add_default_group(&epf_nvme->ns_group, &epf_nvme->group);
+
 	return &epf_nvme->group;
 }
 
@@ -2892,6 +10485,38 @@ static struct pci_epf_driver epf_nvme_driver = {
 	.owner		= THIS_MODULE,
 };
 
+static void pci_epf_nvme_init_hash_algos(void)
+{
+	struct crypto_shash *tfm;
+	int i;
+
+	/* Hash algorithms are optional, use those the kernel provides */
+	for (i = 0; i < PCI_EPF_NVME_HASH_NR_ALGOS; i++) {
+		tfm = crypto_alloc_shash(pci_epf_nvme_hash_algo_name[i], 0, 0);
+		if (IS_ERR(tfm)) {
+			pr_info("Hash algorithm %s not supported\n",
+				pci_epf_nvme_hash_algo_name[i]);
+			continue;
+		}
+
+		pr_info("Hash algorithm %s, driver %s\n",
+			pci_epf_nvme_hash_algo_name[i],
+			crypto_shash_driver_name(tfm));
+		pci_epf_nvme_hash_tfm[i] = tfm;
+	}
+}
+
+static void pci_epf_nvme_free_hash_algos(void)
+{
+	int i;
+
+	for (i = 0; i < PCI_EPF_NVME_HASH_NR_ALGOS; i++) {
+		if (pci_epf_nvme_hash_tfm[i])
+			crypto_free_shash(pci_epf_nvme_hash_tfm[i]);
+		pci_epf_nvme_hash_tfm[i] = NULL;
+	}
+}
+
 static int __init pci_epf_nvme_init(void)
 {
 	int ret;
@@ -2905,14 +10530,60 @@ static int __init pci_epf_nvme_init(void)
 	if (!epf_nvme_cmd_cache)
 		return -ENOMEM;
 
+	pci_epf_nvme_hook_wq = alloc_workqueue("epf_nvme_hook_wq", WQ_UNBOUND,
+					       PCI_EPF_NVME_HOOK_MAX_WORKERS);
+	if (!pci_epf_nvme_hook_wq) {
+		ret = -ENOMEM;
+		goto out_cache;
+	}
+
+	pci_epf_nvme_range_wq = alloc_workqueue("epf_nvme_range_wq",
+						WQ_UNBOUND, 0);
+	if (!pci_epf_nvme_range_wq) {
+		ret = -ENOMEM;
+		goto out_hook_wq;
+	}
+
+	pci_epf_nvme_crypt_wq = alloc_workqueue("epf_nvme_crypt_wq",
+						WQ_HIGHPRI | WQ_UNBOUND, 0);
+	if (!pci_epf_nvme_crypt_wq) {
+		ret = -ENOMEM;
+		goto out_range_wq;
+	}
+
+	pci_epf_nvme_prefetch_wq = alloc_workqueue("epf_nvme_prefetch_wq",
+						   WQ_UNBOUND, 0);
+	if (!pci_epf_nvme_prefetch_wq) {
+		ret = -ENOMEM;
+		goto out_crypt_wq;
+	}
+
+	pci_epf_nvme_init_hash_algos();
+	pci_epf_nvme_register_bpf();
+
+	ret = pci_epf_nvme_register_hook(&pci_epf_nvme_activation_hook);
+	if (ret)
+		goto out_hash;
+
 	ret = pci_epf_register_driver(&epf_nvme_driver);
 	if (ret)
-		goto out_cache;
+		goto out_hook;
 
 	pr_info("Registered nvme EPF driver\n");
 
 	return 0;
 
+out_hook:
+	pci_epf_nvme_unregister_hook(&pci_epf_nvme_activation_hook);
+out_hash:
+	pci_epf_nvme_free_hash_algos();
+	destroy_workqueue(pci_epf_nvme_prefetch_wq);
+out_crypt_wq:
+	destroy_workqueue(pci_epf_nvme_crypt_wq);
+out_range_wq:
+	destroy_workqueue(pci_epf_nvme_range_wq);
+out_hook_wq:
+	destroy_workqueue(pci_epf_nvme_hook_wq);
 out_cache:
 	kmem_cache_destroy(epf_nvme_cmd_cache);
 
@@ -2925,6 +10596,15 @@ module_init(pci_epf_nvme_init);
 static void __exit pci_epf_nvme_exit(void)
 {
 	pci_epf_unregister_driver(&epf_nvme_driver);
+	/* Wait for RAM backend blocks to be freed */
+	rcu_barrier();
+
+	pci_epf_nvme_unregister_hook(&pci_epf_nvme_activation_hook);
+	pci_epf_nvme_free_hash_algos();
+	destroy_workqueue(pci_epf_nvme_prefetch_wq);
+	destroy_workqueue(pci_epf_nvme_crypt_wq);
+	destroy_workqueue(pci_epf_nvme_range_wq);
+	destroy_workqueue(pci_epf_nvme_hook_wq);
 
 	kmem_cache_destroy(epf_nvme_cmd_cache);
 